@@ -9,14 +9,31 @@
  * can be caught and dealt with appropriately.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "SDL.h"
 #include "SDL_main.h"
+#include "tw_alloc.h"
+#include "tw_animation.h"
 #include "tw_audio.h"
+#include "tw_batch.h"
+#include "tw_broadphase.h"
+#include "tw_capture.h"
+#include "tw_entity.h"
 #include "tw_error.h"
+#include "tw_jobs.h"
 #include "tw_graphics.h"
 #include "tw_keyboard.h"
 #include "tw_lua.h"
 #include "tw_mouse.h"
+#include "tw_path.h"
+#include "tw_pixels.h"
+#include "tw_replay.h"
+#include "tw_savestate.h"
+#include "tw_scene.h"
+#include "tw_trace.h"
+#include "tw_tween.h"
+#include "tw_watch.h"
 
 unsigned long frame_count;
 
@@ -39,18 +56,31 @@ int handle_events() {
 /*
  * The main game loop. This controls when the screen is redrawn, as well as
  * handling events. To ensure that events are handled in a consistent manner,
- * event handling is limited to once per frame.
+ * event handling is limited to once per frame. Time left over at the end of a
+ * frame is first given to the garbage collector, and then slept away, unless a
+ * replay is run as fast as possible.
+ *
+ * Game logic only ever sees the frame clock passed through replay_frame(), the
+ * input passed through replay_poll_event(), and job results delivered in the
+ * frames the recording delivered them in, which is what makes replays
+ * deterministic.
  */
 int main_loop() {
     int status;
+    unsigned int real_start, frame_start, frame_end, now;
     SDL_Event event;
     status = 0;
     while( status == 0 ) {
-        SDL_Delay(1000 / FPS);
+        real_start = SDL_GetTicks();
+        trace_begin("frame");
+        frame_start = replay_frame(real_start);
         frame_count++;
+        log_set_frame(frame_count);
+        frame_arena_reset();
         set_lua_global_n("frameCount", frame_count);
         eventlist_reset();
-        while( SDL_PollEvent(&event) ) {
+        trace_begin("events");
+        while( replay_poll_event(&event) ) {
             switch( event.type ) {
                 case SDL_KEYDOWN:
                     status = handle_keyboard(&event);
@@ -63,6 +93,8 @@ int main_loop() {
                     status = handle_mouse(&event);
                     break;
                 case SDL_QUIT:
+                    trace_end("events");
+                    trace_end("frame");
                     SDL_Quit();
                     return 0;
                 default:
@@ -72,12 +104,58 @@ int main_loop() {
         if( status == 0 ) {
             status = handle_events();
         }
+        trace_end("events");
+        if( status == 0 ) {
+            status = watch_poll();
+        }
+        if( status == 0 ) {
+            trace_begin("jobs");
+            status = jobs_step();
+            trace_end("jobs");
+        }
+        if( status == 0 ) {
+            trace_begin("paths");
+            status = path_step(lua_main_state());
+            trace_end("paths");
+        }
         if( status == 0 ) {
+            trace_begin("scheduler");
+            status = scheduler_step(lua_main_state(), frame_count, frame_start);
+            trace_end("scheduler");
+        }
+        if( status == 0 ) {
+            trace_begin("entities");
+            status = entity_step(lua_main_state(), frame_start);
+            trace_end("entities");
+        }
+        if( status == 0 ) {
+            trace_begin("tweens");
+            status = tween_step(lua_main_state(), frame_start);
+            trace_end("tweens");
+        }
+        if( status == 0 ) {
+            trace_begin("tw_main");
             status = run_lua_function("tw_main");
+            trace_end("tw_main");
         }
         if( status == 0 ) {
+            trace_begin("display");
             status = display();
+            trace_end("display");
+        }
+        if( status == 0 ) {
+            frame_end = real_start + 1000 / FPS;
+            trace_begin("gc");
+            status = gc_step(frame_end);
+            trace_end("gc");
+            now = SDL_GetTicks();
+            if( now < frame_end && !replay_fast() ) {
+                trace_begin("sleep");
+                SDL_Delay(frame_end - now);
+                trace_end("sleep");
+            }
         }
+        trace_end("frame");
     }
     push_error("Fatal error encountered in main loop!");
     dump_stack_trace();
@@ -85,17 +163,94 @@ int main_loop() {
 }
 
 /*
- * Initializes the main components of the ToyWrench framework.
+ * Initializes the main components of the ToyWrench framework. The game file is
+ * given on the command line, optionally preceded by "--record <file>" to record
+ * the input of the run, or by "--replay <file>" to replay a recording instead
+ * of reading real input. A replay can be run as fast as possible with "--fast",
+ * and without a window or audio device with "--headless". Every frame shown is
+ * captured to a video file with "--capture <file>", and a timeline of the run
+ * is written to a trace file with "--trace <file>", including every call into
+ * the engine from Lua with "--trace-bindings". With "--batch <count>", the
+ * given number of headless instances of the game are run side by side instead,
+ * for "--frames <count>" frames each (see tw_batch.c).
  */
 int main(int argc, char** argv) {
-    int status;
+    int status, i, replay_mode, fast, batch_count, trace_calls;
+    unsigned long batch_frames;
+    char *game_file, *replay_file, *capture_file, *trace_file;
     status = 0;
     frame_count = 0;
-    if( argc != 2 ) {
+    game_file = NULL;
+    replay_file = NULL;
+    capture_file = NULL;
+    trace_file = NULL;
+    replay_mode = TW_REPLAY_OFF;
+    fast = 0;
+    trace_calls = 0;
+    batch_count = 0;
+    batch_frames = TW_BATCH_FRAMES;
+    for( i = 1; i < argc && status == 0; i++ ) {
+        if( !strcmp(argv[i], "--record") && i + 1 < argc ) {
+            replay_mode = TW_REPLAY_RECORD;
+            replay_file = argv[++i];
+        }
+        else if( !strcmp(argv[i], "--replay") && i + 1 < argc ) {
+            replay_mode = TW_REPLAY_PLAY;
+            replay_file = argv[++i];
+        }
+        else if( !strcmp(argv[i], "--capture") && i + 1 < argc ) {
+            capture_file = argv[++i];
+        }
+        else if( !strcmp(argv[i], "--trace") && i + 1 < argc ) {
+            trace_file = argv[++i];
+        }
+        else if( !strcmp(argv[i], "--trace-bindings") ) {
+            trace_calls = 1;
+        }
+        else if( !strcmp(argv[i], "--batch") && i + 1 < argc ) {
+            batch_count = atoi(argv[++i]);
+        }
+        else if( !strcmp(argv[i], "--frames") && i + 1 < argc ) {
+            batch_frames = strtoul(argv[++i], NULL, 10);
+        }
+        else if( !strcmp(argv[i], "--fast") ) {
+            fast = 1;
+        }
+        else if( !strcmp(argv[i], "--headless") ) {
+            setenv("SDL_VIDEODRIVER", "dummy", 1);
+            setenv("SDL_AUDIODRIVER", "dummy", 1);
+        }
+        else if( game_file == NULL && argv[i][0] != '-' ) {
+            game_file = argv[i];
+        }
+        else {
+            push_error("Unrecognized command line argument!");
+            status = -1;
+        }
+    }
+    if( status == 0 && game_file == NULL ) {
         push_error("No game file selected!");
         status = -1;
     }
-    else {
+    if( status == 0 ) {
+        if( log_init(getenv("TW_LOG_FILE")) ) {
+            push_error("Logging failed to initialize!");
+            status = -1;
+        }
+        if( trace_init(trace_file, trace_calls) ) {
+            push_error("Tracing failed to initialize!");
+            status = -1;
+        }
+        if( status == 0 && batch_count > 0 ) {
+            status = batch_run(game_file, batch_count, batch_frames);
+            trace_shutdown();
+            log_shutdown();
+            return status;
+        }
+        if( replay_init(replay_mode, replay_file, fast) ) {
+            push_error("Replay interface failed to initialize!");
+            status = -1;
+        }
         if( sdlsetup_init() ) {
             push_error("SDL failed to initialize!");
             status = -1;
@@ -108,6 +263,10 @@ int main(int argc, char** argv) {
             push_error("Graphics interface failed to initialize!");
             status = -1;
         }
+        if( capture_init(capture_file) ) {
+            push_error("Capture failed to initialize!");
+            status = -1;
+        }
         if( audio_init() ) {
             push_error("Audio interface failed to initialize!");
             status = -1;
@@ -120,22 +279,72 @@ int main(int argc, char** argv) {
             push_error("Mouse interface failed to initialize!");
             status = -1;
         }
+        if( broadphase_init() ) {
+            push_error("Broadphase failed to initialize!");
+            status = -1;
+        }
+        if( scene_init() ) {
+            push_error("Scene failed to initialize!");
+            status = -1;
+        }
+        if( animation_init() ) {
+            push_error("Animation system failed to initialize!");
+            status = -1;
+        }
+        if( pixels_init() ) {
+            push_error("Pixel access failed to initialize!");
+            status = -1;
+        }
+        if( path_init() ) {
+            push_error("Pathfinding failed to initialize!");
+            status = -1;
+        }
+        if( entity_init() ) {
+            push_error("Entity store failed to initialize!");
+            status = -1;
+        }
+        if( tween_init() ) {
+            push_error("Tweening failed to initialize!");
+            status = -1;
+        }
+        if( savestate_init() ) {
+            push_error("Save states failed to initialize!");
+            status = -1;
+        }
+        if( jobs_init() ) {
+            push_error("Job system failed to initialize!");
+            status = -1;
+        }
         if( eventlist_init() ) {
             push_error("Event list failed to initialize!");
             status = -1;
         }
-        if( gamelogic_init(argv[1]) ) {
+        if( watch_init() ) {
+            push_error("Watch interface failed to initialize!");
+            status = -1;
+        }
+        if( gamelogic_init(game_file) ) {
             push_error("Game logic failed to initialize!");
             status = -1;
         }
     }
     if( status ) {
         push_error("Required component(s) failed to initialize!");
-        dump_stack_trace();
+        jobs_shutdown();
+        capture_shutdown();
+        replay_shutdown();
+        trace_shutdown();
+        log_shutdown();
         return -1;
     }
     else {
         add_lua_global_n("frameCount", frame_count, NULL);
-        return main_loop();
+        status = main_loop();
+        jobs_shutdown();
+        capture_shutdown();
+        replay_shutdown();
+        trace_shutdown();
+        log_shutdown();
+        return status;
     }
 }
@@ -0,0 +1,263 @@
+/*
+ * tw_alloc.c
+ *
+ * This file contains the source code pertaining to the memory allocators used
+ * in the ToyWrench application.
+ *
+ * The pool allocator backs the Lua state. Lua scripts churn through a large
+ * number of small tables, closures and strings, so blocks of up to
+ * TW_POOL_MAX_SIZE bytes are carved out of large chunks and recycled through a
+ * free list per size class instead of going through malloc every time. Larger
+ * blocks are passed on to malloc. Lua always tells the allocator the old size
+ * of a block, which is what allows the pool to do without block headers.
+ *
+ * The frame arena hands out engine-side scratch memory that only has to live
+ * until the end of the current frame, and releases it all at once. It must not
+ * be used for anything the Lua state holds on to. Every thread has its own
+ * arena, so batch threads can step their instances' subsystems side by side.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "tw_alloc.h"
+
+#define TW_POOL_CHUNK_SIZE 65536
+#define TW_ARENA_MIN_SIZE 65536
+#define TW_ALIGN(n) (((n) + TW_POOL_GRANULARITY - 1) & ~(size_t)(TW_POOL_GRANULARITY - 1))
+
+struct tw_pool_chunk_t {
+    tw_pool_chunk_t *next;
+    char pad[TW_POOL_GRANULARITY - sizeof(tw_pool_chunk_t*)];
+};
+
+typedef struct tw_arena_block_t {
+    struct tw_arena_block_t *next;
+    size_t size;
+    size_t used;
+} tw_arena_block_t;
+
+static __thread tw_arena_block_t *frame_arena = NULL;
+
+/*
+ * Returns the size class of a small block of the given size.
+ */
+static unsigned int pool_class( size_t size ) {
+    return (unsigned int)((size - 1) / TW_POOL_GRANULARITY);
+}
+
+/*
+ * Returns a block of the given size class, or NULL if out of memory.
+ */
+static void * pool_alloc( tw_pool_t *pool, unsigned int cls ) {
+    tw_pool_chunk_t *chunk;
+    size_t size;
+    void *block;
+    block = pool->free_list[cls];
+    if( block != NULL ) {
+        pool->free_list[cls] = *(void**)block;
+        return block;
+    }
+    size = (cls + 1) * TW_POOL_GRANULARITY;
+    if( pool->chunk_next + size > pool->chunk_end ) {
+        /* the rest of the current chunk is lost, at most one block's worth */
+        chunk = (tw_pool_chunk_t*)malloc(TW_POOL_CHUNK_SIZE);
+        if( chunk == NULL ) {
+            return NULL;
+        }
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
+        pool->chunk_next = (char*)(chunk + 1);
+        pool->chunk_end = (char*)chunk + TW_POOL_CHUNK_SIZE;
+        pool->bytes_reserved += TW_POOL_CHUNK_SIZE;
+    }
+    block = pool->chunk_next;
+    pool->chunk_next += size;
+    return block;
+}
+
+/*
+ * Returns the given block to the free list of the given size class.
+ */
+static void pool_free( tw_pool_t *pool, void *block, unsigned int cls ) {
+    *(void**)block = pool->free_list[cls];
+    pool->free_list[cls] = block;
+}
+
+/*
+ * lua_Alloc function serving blocks from the tw_pool_t given as ud. Follows the
+ * lua_Alloc contract: a new size of 0 frees the block, and shrinking a block
+ * never fails.
+ */
+void * pool_lua_alloc( void *ud, void *ptr, size_t osize, size_t nsize ) {
+    tw_pool_t *pool;
+    void *block;
+    pool = (tw_pool_t*)ud;
+    if( ptr == NULL ) {
+        osize = 0;
+    }
+    if( nsize == 0 ) {
+        if( ptr != NULL ) {
+            pool->frees++;
+            pool->bytes_in_use -= osize;
+            if( osize <= TW_POOL_MAX_SIZE ) {
+                pool_free(pool, ptr, pool_class(osize));
+            }
+            else {
+                pool->large_bytes -= osize;
+                free(ptr);
+            }
+        }
+        return NULL;
+    }
+    if( osize > TW_POOL_MAX_SIZE && nsize > TW_POOL_MAX_SIZE ) {
+        block = realloc(ptr, nsize);
+        if( block == NULL ) {
+            if( nsize > osize ) {
+                return NULL;
+            }
+            block = ptr; /* shrinking must not fail */
+        }
+        pool->large_bytes += nsize;
+        pool->large_bytes -= osize;
+    }
+    else if( nsize > TW_POOL_MAX_SIZE ) {
+        block = malloc(nsize);
+        if( block == NULL ) {
+            return NULL;
+        }
+        pool->large_allocs++;
+        pool->large_bytes += nsize;
+        if( ptr != NULL ) {
+            memcpy(block, ptr, osize);
+            pool_free(pool, ptr, pool_class(osize));
+        }
+    }
+    else if( ptr != NULL && osize <= TW_POOL_MAX_SIZE &&
+        pool_class(nsize) == pool_class(osize) ) {
+        block = ptr;
+    }
+    else {
+        block = pool_alloc(pool, pool_class(nsize));
+        if( block == NULL ) {
+            if( nsize > osize ) {
+                return NULL;
+            }
+            /*
+             * Shrinking must not fail. Keep the old block, it is big enough to
+             * be recycled as a block of the smaller size class later.
+             */
+            if( osize > TW_POOL_MAX_SIZE ) {
+                pool->large_bytes -= osize;
+            }
+            pool->bytes_in_use += nsize;
+            pool->bytes_in_use -= osize;
+            return ptr;
+        }
+        if( ptr != NULL ) {
+            memcpy(block, ptr, osize < nsize ? osize : nsize);
+            if( osize <= TW_POOL_MAX_SIZE ) {
+                pool_free(pool, ptr, pool_class(osize));
+            }
+            else {
+                pool->large_bytes -= osize;
+                free(ptr);
+            }
+        }
+    }
+    if( ptr == NULL ) {
+        pool->allocs++;
+    }
+    pool->bytes_in_use += nsize;
+    pool->bytes_in_use -= osize;
+    return block;
+}
+
+void pool_init( tw_pool_t *pool ) {
+    memset(pool, 0, sizeof(tw_pool_t));
+}
+
+/*
+ * Frees all memory owned by the given pool. Large blocks still in use are not
+ * tracked by the pool and are not freed.
+ */
+void pool_destroy( tw_pool_t *pool ) {
+    tw_pool_chunk_t *chunk;
+    while( pool->chunks != NULL ) {
+        chunk = pool->chunks;
+        pool->chunks = chunk->next;
+        free(chunk);
+    }
+    pool_init(pool);
+}
+
+/*
+ * Returns scratch memory that is valid until the next call to
+ * frame_arena_reset(), or NULL if out of memory.
+ */
+void * frame_alloc( size_t size ) {
+    tw_arena_block_t *block;
+    size_t block_size;
+    void *p;
+    size = TW_ALIGN(size);
+    block = frame_arena;
+    if( block == NULL || block->used + size > block->size ) {
+        block_size = size > TW_ARENA_MIN_SIZE ? size : TW_ARENA_MIN_SIZE;
+        if( block != NULL && block->size * 2 > block_size ) {
+            block_size = block->size * 2;
+        }
+        block = (tw_arena_block_t*)malloc(TW_ALIGN(sizeof(tw_arena_block_t)) + block_size);
+        if( block == NULL ) {
+            return NULL;
+        }
+        block->next = frame_arena;
+        block->size = block_size;
+        block->used = 0;
+        frame_arena = block;
+    }
+    p = (char*)block + TW_ALIGN(sizeof(tw_arena_block_t)) + block->used;
+    block->used += size;
+    return p;
+}
+
+/*
+ * Releases all frame_alloc() memory at once. If the last frame needed more than
+ * one block, they are replaced by a single block large enough for all of them,
+ * so that the arena settles on one block after a few frames.
+ */
+void frame_arena_reset() {
+    tw_arena_block_t *block;
+    size_t total;
+    if( frame_arena == NULL ) {
+        return;
+    }
+    if( frame_arena->next != NULL ) {
+        total = 0;
+        while( frame_arena != NULL ) {
+            block = frame_arena;
+            frame_arena = block->next;
+            total += block->size;
+            free(block);
+        }
+        block = (tw_arena_block_t*)malloc(TW_ALIGN(sizeof(tw_arena_block_t)) + total);
+        if( block != NULL ) {
+            block->next = NULL;
+            block->size = total;
+            frame_arena = block;
+        }
+    }
+    if( frame_arena != NULL ) {
+        frame_arena->used = 0;
+    }
+}
+
+/*
+ * Frees the frame arena of the calling thread, before the thread exits.
+ */
+void frame_arena_destroy() {
+    tw_arena_block_t *block;
+    while( frame_arena != NULL ) {
+        block = frame_arena;
+        frame_arena = block->next;
+        free(block);
+    }
+}
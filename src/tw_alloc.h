@@ -0,0 +1,58 @@
+/*
+ * tw_alloc.h
+ */
+
+#ifndef TWALLOC
+#define TWALLOC
+
+#include <stddef.h>
+
+#define TW_POOL_GRANULARITY 16
+#define TW_POOL_MAX_SIZE 512
+#define TW_POOL_CLASSES (TW_POOL_MAX_SIZE / TW_POOL_GRANULARITY)
+
+typedef struct tw_pool_chunk_t tw_pool_chunk_t;
+
+typedef struct {
+    void *free_list[TW_POOL_CLASSES];
+    tw_pool_chunk_t *chunks;
+    char *chunk_next;
+    char *chunk_end;
+    size_t bytes_in_use;
+    size_t bytes_reserved;
+    size_t large_bytes;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long large_allocs;
+} tw_pool_t;
+
+/*
+ * lua_Alloc function serving blocks from the tw_pool_t given as ud.
+ */
+void * pool_lua_alloc( void *ud, void *ptr, size_t osize, size_t nsize );
+
+void pool_init( tw_pool_t *pool );
+
+/*
+ * Frees all memory owned by the given pool.
+ */
+void pool_destroy( tw_pool_t *pool );
+
+/*
+ * Returns scratch memory that is valid until the next call to
+ * frame_arena_reset() on the calling thread.
+ */
+void * frame_alloc( size_t size );
+
+/*
+ * Releases all frame_alloc() memory of the calling thread at once. Called once
+ * per frame.
+ */
+void frame_arena_reset();
+
+/*
+ * Frees the frame arena of the calling thread, before the thread exits.
+ */
+void frame_arena_destroy();
+
+#endif
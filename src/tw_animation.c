@@ -0,0 +1,254 @@
+/*
+ * tw_animation.c
+ *
+ * This file contains the source code pertaining to sprite animation in the
+ * ToyWrench application. An animation clip is a list of frames cut from a
+ * sprite sheet texture, each shown for a given number of seconds, together with
+ * what happens at the end of the list: start over (loop), stay on the last
+ * frame (once), or play the list backwards and forwards again (pingpong).
+ *
+ * Clips are defined once from Lua with defineClip() and then attached to
+ * entities with setAnimation(). The entity store advances the animation time of
+ * every animated entity each frame, and drawEntities() draws the current frame
+ * of each, so scripts never pick animation frames themselves.
+ *
+ * Sheets are cut into equally sized frames in rows from the top left, and
+ * frames are numbered from 0 in that order.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "tw_animation.h"
+#include "tw_error.h"
+#include "tw_graphics.h"
+#include "tw_lua.h"
+
+#define TW_MAX_CLIPS 256
+
+#define TW_CLIP_LOOP 0
+#define TW_CLIP_ONCE 1
+#define TW_CLIP_PINGPONG 2
+
+typedef struct {
+    int texture;
+    int mode;
+    unsigned int frame_count;
+    SDL_Rect *frames;
+    float *frame_end; /* time each frame ends at */
+    float duration;
+} tw_clip_t;
+
+static int initialized = 0;
+static tw_clip_t clip_list[TW_MAX_CLIPS];
+static unsigned int clip_list_size = 0;
+
+/*
+ * Returns the frame of the given clip showing at the given time into the clip.
+ */
+static unsigned int find_frame( tw_clip_t *clip, float time ) {
+    unsigned int low, high, mid;
+    low = 0;
+    high = clip->frame_count - 1;
+    while( low < high ) {
+        mid = (low + high) / 2;
+        if( clip->frame_end[mid] <= time ) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/*
+ * Stores the texture and the rectangle of it to draw for the given clip after
+ * playing it for the given number of seconds. Returns 1 if a clip that plays
+ * once has ended, 0 if it is still playing, and -1 for invalid clips.
+ */
+int animation_frame( int clip_index, float time, int *texture, SDL_Rect *src ) {
+    tw_clip_t *clip;
+    int ended;
+    if( (unsigned int)clip_index >= clip_list_size ) {
+        return -1;
+    }
+    clip = &clip_list[clip_index];
+    ended = 0;
+    if( time < 0 ) {
+        time = 0;
+    }
+    switch( clip->mode ) {
+        case TW_CLIP_ONCE:
+            if( time >= clip->duration ) {
+                time = clip->duration;
+                ended = 1;
+            }
+            break;
+        case TW_CLIP_PINGPONG:
+            time = fmodf(time, clip->duration * 2);
+            if( time >= clip->duration ) {
+                time = clip->duration * 2 - time;
+            }
+            break;
+        default:
+            time = fmodf(time, clip->duration);
+            break;
+    }
+    *texture = clip->texture;
+    *src = clip->frames[find_frame(clip, time)];
+    return ended;
+}
+
+/*
+ * Defines a clip showing the given frames of the given texture cut into frames
+ * of the given size, each for the given number of seconds. Returns the new
+ * clip, or -1 on errors.
+ */
+static int define_clip( int texture, unsigned int frame_width, unsigned int frame_height,
+                        const int *frames, const float *durations, unsigned int frame_count,
+                        int mode ) {
+    tw_clip_t *clip;
+    unsigned int width, height, columns, i;
+    float time;
+    if( clip_list_size >= TW_MAX_CLIPS ) {
+        push_error("define_clip failed: Too many clips defined!");
+        return -1;
+    }
+    if( texture_size(texture, &width, &height) ) {
+        push_error("define_clip failed: Invalid texture!");
+        return -1;
+    }
+    if( frame_width == 0 || frame_height == 0 || frame_width > width || frame_height > height ||
+        frame_count == 0 ) {
+        push_error("define_clip failed: Invalid frame size!");
+        return -1;
+    }
+    clip = &clip_list[clip_list_size];
+    clip->frames = (SDL_Rect*)malloc(sizeof(SDL_Rect) * frame_count);
+    clip->frame_end = (float*)malloc(sizeof(float) * frame_count);
+    if( clip->frames == NULL || clip->frame_end == NULL ) {
+        free(clip->frames);
+        free(clip->frame_end);
+        push_error("define_clip failed: Out of memory!");
+        return -1;
+    }
+    columns = width / frame_width;
+    time = 0;
+    for( i = 0; i < frame_count; i++ ) {
+        if( frames[i] < 0 || (unsigned int)frames[i] >= columns * (height / frame_height) ) {
+            free(clip->frames);
+            free(clip->frame_end);
+            push_error("define_clip failed: Frame outside of the sheet!");
+            return -1;
+        }
+        clip->frames[i].x = (frames[i] % columns) * frame_width;
+        clip->frames[i].y = (frames[i] / columns) * frame_height;
+        clip->frames[i].w = frame_width;
+        clip->frames[i].h = frame_height;
+        time += durations[i] > 0 ? durations[i] : 0;
+        clip->frame_end[i] = time;
+    }
+    if( time <= 0 ) {
+        free(clip->frames);
+        free(clip->frame_end);
+        push_error("define_clip failed: Clip has no duration!");
+        return -1;
+    }
+    clip->texture = texture;
+    clip->mode = mode;
+    clip->frame_count = frame_count;
+    clip->duration = time;
+    return clip_list_size++;
+}
+
+/*
+ * Lua hook to the function
+ * define_clip( int texture, unsigned int frame_width, unsigned int frame_height,
+ *              const int *frames, const float *durations, unsigned int frame_count,
+ *              int mode )
+ * taking a table of frames, the duration of every frame as either a number or a
+ * table, and the mode as "loop" (the default), "once" or "pingpong".
+ */
+int lua_defineClip( lua_State *L ) {
+    int *frames;
+    float *durations;
+    const char *mode_name;
+    unsigned int frame_count, i;
+    int mode, clip;
+    if( lua_gettop(L) < 5 ) {
+        push_error("Lua: Error while calling defineClip: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    if( !lua_istable(L, 4) || !(lua_istable(L, 5) || lua_isnumber(L, 5)) ) {
+        push_error("Lua: Error while calling defineClip: Invalid frames or durations!");
+        lua_pushstring(L, "Given parameter not a table.");
+        lua_error(L);
+        return -1;
+    }
+    mode_name = lua_isnoneornil(L, 6) ? "loop" : lua_tostring(L, 6);
+    if( mode_name != NULL && !strcmp(mode_name, "once") ) {
+        mode = TW_CLIP_ONCE;
+    }
+    else if( mode_name != NULL && !strcmp(mode_name, "pingpong") ) {
+        mode = TW_CLIP_PINGPONG;
+    }
+    else {
+        mode = TW_CLIP_LOOP;
+    }
+    frame_count = lua_objlen(L, 4);
+    frames = (int*)malloc(sizeof(int) * (frame_count + 1));
+    durations = (float*)malloc(sizeof(float) * (frame_count + 1));
+    if( frames == NULL || durations == NULL ) {
+        free(frames);
+        free(durations);
+        push_error("Lua: Error while calling defineClip: Out of memory!");
+        lua_pushstring(L, "Out of memory.");
+        lua_error(L);
+        return -1;
+    }
+    for( i = 0; i < frame_count; i++ ) {
+        lua_rawgeti(L, 4, i + 1);
+        frames[i] = (int)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        if( lua_istable(L, 5) ) {
+            lua_rawgeti(L, 5, i + 1);
+            durations[i] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+        else {
+            durations[i] = lua_tonumber(L, 5);
+        }
+    }
+    clip = define_clip((int)lua_tonumber(L, 1), (unsigned int)lua_tonumber(L, 2),
+        (unsigned int)lua_tonumber(L, 3), frames, durations, frame_count, mode);
+    free(frames);
+    free(durations);
+    if( clip < 0 ) {
+        push_error("Lua: Error while calling defineClip!");
+        lua_pushstring(L, "Error while defining clip.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, clip);
+    return 1;
+}
+
+/*
+ * Initializes the animation system and registers its Lua functions.
+ */
+int animation_init() {
+    if( initialized ) {
+        push_warning("Animation system already initialized!");
+        return 0;
+    }
+    if( add_lua_function("defineClip", lua_defineClip) ) {
+        push_error("Failed to add animation functions!");
+        return -1;
+    }
+    initialized = 1;
+    return 0;
+}
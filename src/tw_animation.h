@@ -0,0 +1,19 @@
+/*
+ * tw_animation.h
+ */
+
+#ifndef TWANIMATION
+#define TWANIMATION
+
+#include "SDL.h"
+
+/*
+ * Stores the texture and the rectangle of it to draw for the given clip after
+ * playing it for the given number of seconds. Returns 1 if a clip that plays
+ * once has ended, 0 if it is still playing, and -1 for invalid clips.
+ */
+int animation_frame( int clip, float time, int *texture, SDL_Rect *src );
+
+int animation_init();
+
+#endif
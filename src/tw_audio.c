@@ -1,10 +1,487 @@
 /*
  * tw_audio.c
+ *
+ * This file contains the source code pertaining to the audio handling
+ * functions used in the ToyWrench application. The main purpose of this file is
+ * to mix the sounds played by the game into the audio output.
+ *
+ * Mixing happens in the SDL audio callback, which runs on its own thread. The
+ * voices being mixed belong to the callback alone: the main thread never
+ * touches them, and instead sends commands through a single-producer,
+ * single-consumer queue that the callback drains at the start of every buffer.
+ * Neither side ever takes a lock, so the callback can never be held up by the
+ * main thread. Sounds are converted to the output format when loaded and are
+ * never modified afterwards, so the callback may read them freely. Music is
+ * streamed rather than loaded, see tw_music.c.
+ *
+ * The audio subsystem can be run headless by setting the SDL_AUDIODRIVER
+ * environment variable to "dummy", or to "disk" to have SDL write the mixed
+ * output to a file. If no audio device can be opened at all, the game runs
+ * without sound.
  */
 
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "SDL.h"
 #include "tw_audio.h"
+#include "tw_error.h"
+#include "tw_lua.h"
+#include "tw_music.h"
 
+#define TW_AUDIO_FREQ 44100
+#define TW_AUDIO_SAMPLES 1024
+#define TW_MAX_SOUNDS 128
+#define TW_MAX_VOICES 32
+#define TW_AUDIO_QUEUE 256 /* must be a power of two */
+
+#define TW_CMD_PLAY 1
+#define TW_CMD_STOP 2
+#define TW_CMD_STOP_ALL 3
+#define TW_CMD_MASTER 4
+
+typedef struct {
+    Sint16 *samples; /* interleaved stereo */
+    Uint32 frames;
+} tw_sound_t;
+
+typedef struct {
+    int active;
+    unsigned int handle;
+    int sound;
+    Uint64 pos; /* 32.16 fixed point frame position */
+    Uint32 step; /* 16.16 fixed point frames per output frame */
+    Sint16 vol_l; /* 8.8 fixed point */
+    Sint16 vol_r;
+    int loop;
+} tw_voice_t;
+
+typedef struct {
+    int type;
+    unsigned int handle;
+    int sound;
+    Uint32 step;
+    Sint16 vol_l;
+    Sint16 vol_r;
+    int loop;
+} tw_audio_cmd_t;
+
+static int initialized = 0;
+static int device_open = 0;
+static SDL_AudioSpec spec;
+static tw_sound_t sound_list[TW_MAX_SOUNDS];
+static unsigned int sound_list_size = 0;
+static unsigned int next_handle = 1;
+
+/* owned by the audio callback */
+static tw_voice_t voices[TW_MAX_VOICES];
+static Sint32 *mix_buffer = NULL;
+static Sint16 master_volume = 256;
+
+/* command queue, head written by the main thread, tail by the callback */
+static tw_audio_cmd_t cmd_queue[TW_AUDIO_QUEUE];
+static volatile unsigned int cmd_head = 0;
+static volatile unsigned int cmd_tail = 0;
+
+/*
+ * Sends the given command to the audio callback. Returns -1 if the queue is
+ * full, which only happens if the callback has stopped running.
+ */
+static int send_command( tw_audio_cmd_t *cmd ) {
+    unsigned int head;
+    if( !device_open ) {
+        return 0;
+    }
+    head = cmd_head;
+    if( head - cmd_tail == TW_AUDIO_QUEUE ) {
+        push_warning("Audio command queue full, command dropped!");
+        return -1;
+    }
+    cmd_queue[head & (TW_AUDIO_QUEUE - 1)] = *cmd;
+    __sync_synchronize(); /* command must be visible before the new head */
+    cmd_head = head + 1;
+    return 0;
+}
+
+/*
+ * Applies all pending commands. Called from the audio callback.
+ */
+static void process_commands() {
+    tw_audio_cmd_t *cmd;
+    unsigned int tail;
+    int i;
+    tail = cmd_tail;
+    while( tail != cmd_head ) {
+        __sync_synchronize();
+        cmd = &cmd_queue[tail & (TW_AUDIO_QUEUE - 1)];
+        switch( cmd->type ) {
+            case TW_CMD_PLAY:
+                for( i = 0; i < TW_MAX_VOICES && voices[i].active; i++ );
+                if( i < TW_MAX_VOICES ) { /* all voices busy: drop the sound */
+                    voices[i].active = 1;
+                    voices[i].handle = cmd->handle;
+                    voices[i].sound = cmd->sound;
+                    voices[i].pos = 0;
+                    voices[i].step = cmd->step;
+                    voices[i].vol_l = cmd->vol_l;
+                    voices[i].vol_r = cmd->vol_r;
+                    voices[i].loop = cmd->loop;
+                }
+                break;
+            case TW_CMD_STOP:
+                for( i = 0; i < TW_MAX_VOICES; i++ ) {
+                    if( voices[i].active && voices[i].handle == cmd->handle ) {
+                        voices[i].active = 0;
+                    }
+                }
+                break;
+            case TW_CMD_STOP_ALL:
+                for( i = 0; i < TW_MAX_VOICES; i++ ) {
+                    voices[i].active = 0;
+                }
+                break;
+            case TW_CMD_MASTER:
+                master_volume = cmd->vol_l;
+                break;
+            default:
+                break;
+        }
+        tail++;
+        __sync_synchronize(); /* done reading before releasing the slot */
+        cmd_tail = tail;
+    }
+}
+
+/*
+ * Accumulates frames of the given voice into the mix buffer, playing the sound
+ * back at its original pitch. Returns the number of frames mixed.
+ */
+static int mix_voice_unpitched( tw_voice_t *voice, Sint16 vol_l, Sint16 vol_r,
+    Sint32 *out, int frames ) {
+    tw_sound_t *sound;
+    Sint16 *src;
+    Uint32 start;
+    int n, i;
+    sound = &sound_list[voice->sound];
+    start = (Uint32)(voice->pos >> 16);
+    n = sound->frames - start < (Uint32)frames ? (int)(sound->frames - start) : frames;
+    src = sound->samples + start * 2;
+    i = 0;
+#ifdef __SSE2__
+    {
+        __m128i vol, s, lo, hi;
+        vol = _mm_set_epi16(vol_r, vol_l, vol_r, vol_l, vol_r, vol_l, vol_r, vol_l);
+        for( ; i + 4 <= n; i += 4 ) { /* 4 stereo frames at a time */
+            s = _mm_loadu_si128((__m128i*)(src + i * 2));
+            lo = _mm_mullo_epi16(s, vol);
+            hi = _mm_mulhi_epi16(s, vol);
+            _mm_storeu_si128((__m128i*)(out + i * 2), _mm_add_epi32(
+                _mm_loadu_si128((__m128i*)(out + i * 2)),
+                _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 8)));
+            _mm_storeu_si128((__m128i*)(out + i * 2 + 4), _mm_add_epi32(
+                _mm_loadu_si128((__m128i*)(out + i * 2 + 4)),
+                _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 8)));
+        }
+    }
+#endif
+    for( ; i < n; i++ ) {
+        out[i * 2] += (src[i * 2] * vol_l) >> 8;
+        out[i * 2 + 1] += (src[i * 2 + 1] * vol_r) >> 8;
+    }
+    voice->pos += (Uint64)n << 16;
+    return n;
+}
+
+/*
+ * Accumulates frames of the given voice into the mix buffer, resampling it
+ * with linear interpolation. Returns the number of frames mixed.
+ */
+static int mix_voice_pitched( tw_voice_t *voice, Sint16 vol_l, Sint16 vol_r,
+    Sint32 *out, int frames ) {
+    tw_sound_t *sound;
+    Sint16 *a, *b;
+    Uint32 idx, frac;
+    Sint32 l, r;
+    int i;
+    sound = &sound_list[voice->sound];
+    for( i = 0; i < frames; i++ ) {
+        idx = (Uint32)(voice->pos >> 16);
+        if( idx >= sound->frames ) {
+            break;
+        }
+        frac = (Uint32)(voice->pos & 0xFFFF) >> 1; /* 15 bits avoids overflow */
+        a = sound->samples + idx * 2;
+        b = idx + 1 < sound->frames ? a + 2 : a;
+        l = a[0] + (((b[0] - a[0]) * (Sint32)frac) >> 15);
+        r = a[1] + (((b[1] - a[1]) * (Sint32)frac) >> 15);
+        out[i * 2] += (l * vol_l) >> 8;
+        out[i * 2 + 1] += (r * vol_r) >> 8;
+        voice->pos += voice->step;
+    }
+    return i;
+}
+
+/*
+ * Converts the mix buffer to clamped 16-bit samples in the output stream.
+ */
+static void mix_output( Sint16 *stream, int samples ) {
+    Sint32 s;
+    int i;
+    i = 0;
+#ifdef __SSE2__
+    for( ; i + 8 <= samples; i += 8 ) { /* packs saturates, doing the clamp */
+        _mm_storeu_si128((__m128i*)(stream + i), _mm_packs_epi32(
+            _mm_loadu_si128((__m128i*)(mix_buffer + i)),
+            _mm_loadu_si128((__m128i*)(mix_buffer + i + 4))));
+    }
+#endif
+    for( ; i < samples; i++ ) {
+        s = mix_buffer[i];
+        stream[i] = s > 32767 ? 32767 : s < -32768 ? -32768 : (Sint16)s;
+    }
+}
+
+/*
+ * SDL audio callback. Mixes all active voices into the given stream.
+ */
+static void audio_callback( void *userdata, Uint8 *stream, int len ) {
+    tw_voice_t *voice;
+    Sint16 vol_l, vol_r;
+    int samples, frames, done, i;
+    (void)userdata;
+    process_commands();
+    samples = len / sizeof(Sint16);
+    frames = samples / 2;
+    memset(mix_buffer, 0, samples * sizeof(Sint32));
+    for( i = 0; i < TW_MAX_VOICES; i++ ) {
+        voice = &voices[i];
+        vol_l = (voice->vol_l * master_volume) >> 8;
+        vol_r = (voice->vol_r * master_volume) >> 8;
+        done = 0;
+        while( voice->active && done < frames ) {
+            if( voice->step == 0x10000 ) {
+                done += mix_voice_unpitched(voice, vol_l, vol_r, mix_buffer + done * 2, frames - done);
+            }
+            else {
+                done += mix_voice_pitched(voice, vol_l, vol_r, mix_buffer + done * 2, frames - done);
+            }
+            if( (voice->pos >> 16) >= sound_list[voice->sound].frames ) {
+                if( voice->loop ) {
+                    voice->pos -= (Uint64)sound_list[voice->sound].frames << 16;
+                }
+                else {
+                    voice->active = 0;
+                }
+            }
+        }
+    }
+    music_mix(mix_buffer, frames, master_volume);
+    mix_output((Sint16*)stream, samples);
+}
+
+/*
+ * Loads the given WAV file and converts it to the output format, storing it
+ * into the sound list.
+ */
+static int load_sound( const char *file ) {
+    SDL_AudioSpec wav_spec;
+    SDL_AudioCVT cvt;
+    Uint8 *wav_buf;
+    Uint32 wav_len;
+    if( !initialized ) {
+        push_error("load_sound failed: Audio interface not initialized!");
+        return -1;
+    }
+    if( sound_list_size >= TW_MAX_SOUNDS ) {
+        push_error("load_sound failed: Too many sounds loaded!");
+        return -1;
+    }
+    if( SDL_LoadWAV(file, &wav_spec, &wav_buf, &wav_len) == NULL ) {
+        push_error(SDL_GetError());
+        push_error("load_sound failed: Failed to load given sound file!");
+        return -1;
+    }
+    if( SDL_BuildAudioCVT(&cvt, wav_spec.format, wav_spec.channels, wav_spec.freq,
+        AUDIO_S16SYS, 2, spec.freq) < 0 ) {
+        SDL_FreeWAV(wav_buf);
+        push_error("load_sound failed: Unsupported sound format!");
+        return -1;
+    }
+    cvt.len = wav_len;
+    cvt.buf = (Uint8*)malloc(wav_len * cvt.len_mult);
+    if( cvt.buf == NULL ) {
+        SDL_FreeWAV(wav_buf);
+        push_error("load_sound failed: Out of memory!");
+        return -1;
+    }
+    memcpy(cvt.buf, wav_buf, wav_len);
+    SDL_FreeWAV(wav_buf);
+    if( SDL_ConvertAudio(&cvt) ) {
+        free(cvt.buf);
+        push_error("load_sound failed: Failed to convert sound!");
+        return -1;
+    }
+    if( cvt.len_cvt < 4 ) {
+        free(cvt.buf);
+        push_error("load_sound failed: Sound is empty!");
+        return -1;
+    }
+    sound_list[sound_list_size].samples = (Sint16*)cvt.buf;
+    sound_list[sound_list_size].frames = cvt.len_cvt / 4;
+    sound_list_size++;
+    return 0;
+}
+
+/*
+ * Converts the given volume (1 being full volume) and pan (-1 for left to 1 for
+ * right) to fixed point channel volumes.
+ */
+static void channel_volumes( lua_Number volume, lua_Number pan, Sint16 *vol_l, Sint16 *vol_r ) {
+    lua_Number l, r;
+    volume = volume < 0 ? 0 : volume > 4 ? 4 : volume;
+    pan = pan < -1 ? -1 : pan > 1 ? 1 : pan;
+    l = pan > 0 ? 1 - pan : 1;
+    r = pan < 0 ? 1 + pan : 1;
+    *vol_l = (Sint16)(volume * l * 256);
+    *vol_r = (Sint16)(volume * r * 256);
+}
+
+/*
+ * Lua hook to the function
+ * load_sound( const char *file )
+ */
+int lua_loadSound( lua_State *L ) {
+    if( lua_gettop(L) == 0 ) {
+        push_error("Lua: Error while calling loadSound: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    if( load_sound(lua_tostring(L, 1)) ) {
+        push_error("Lua: Error while calling loadSound!");
+        lua_pushstring(L, "Error while loading sound.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, sound_list_size - 1);
+    return 1;
+}
+
+/*
+ * Lua hook to play a loaded sound. Takes the sound and optionally the volume,
+ * pan, pitch and whether to loop, and returns a handle for stopSound.
+ */
+int lua_playSound( lua_State *L ) {
+    tw_audio_cmd_t cmd;
+    lua_Number pitch;
+    int sound;
+    if( lua_gettop(L) == 0 ) {
+        push_error("Lua: Error while calling playSound: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    sound = lua_tonumber(L, 1);
+    if( (unsigned int)sound >= sound_list_size ) {
+        push_error("Lua: Error while calling playSound: Invalid sound!");
+        lua_pushstring(L, "Invalid sound.");
+        lua_error(L);
+        return -1;
+    }
+    pitch = lua_isnoneornil(L, 4) ? 1 : lua_tonumber(L, 4);
+    pitch = pitch < 1.0 / 64 ? 1.0 / 64 : pitch > 64 ? 64 : pitch;
+    cmd.type = TW_CMD_PLAY;
+    cmd.handle = next_handle++;
+    cmd.sound = sound;
+    cmd.step = (Uint32)(pitch * 0x10000);
+    channel_volumes(lua_isnoneornil(L, 2) ? 1 : lua_tonumber(L, 2),
+        lua_tonumber(L, 3), &cmd.vol_l, &cmd.vol_r);
+    cmd.loop = lua_toboolean(L, 5);
+    send_command(&cmd);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, cmd.handle);
+    return 1;
+}
+
+/*
+ * Lua hook to stop the sound with the given handle, or all sounds if no handle
+ * is given.
+ */
+int lua_stopSound( lua_State *L ) {
+    tw_audio_cmd_t cmd;
+    if( lua_gettop(L) == 0 ) {
+        cmd.type = TW_CMD_STOP_ALL;
+    }
+    else {
+        cmd.type = TW_CMD_STOP;
+        cmd.handle = lua_tonumber(L, 1);
+    }
+    send_command(&cmd);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua callback to set the master volume whenever GLOBALS.masterVolume is
+ * changed.
+ */
+int lua_setMasterVolume( lua_State *L ) {
+    tw_audio_cmd_t cmd;
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while setting masterVolume: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    cmd.type = TW_CMD_MASTER;
+    channel_volumes(lua_tonumber(L, -1), 0, &cmd.vol_l, &cmd.vol_r);
+    send_command(&cmd);
+    lua_pop(L, 1);
+    return 0;
+}
+
+/*
+ * Initializes the audio subsystem. Failing to open an audio device is not an
+ * error, the Lua functions still work but no sound is produced.
+ */
 int audio_init() {
-    /* stub */
+    if( initialized ) {
+        push_warning("Audio interface already initialized!");
+        return 0;
+    }
+    spec.freq = TW_AUDIO_FREQ;
+    spec.format = AUDIO_S16SYS;
+    spec.channels = 2;
+    spec.samples = TW_AUDIO_SAMPLES;
+    spec.callback = audio_callback;
+    spec.userdata = NULL;
+    if( SDL_InitSubSystem(SDL_INIT_AUDIO) || SDL_OpenAudio(&spec, NULL) ) {
+        push_warning(SDL_GetError());
+        push_warning("Failed to open audio device, running without sound!");
+    }
+    else {
+        mix_buffer = (Sint32*)malloc(spec.samples * spec.channels * sizeof(Sint32));
+        if( mix_buffer == NULL ) {
+            SDL_CloseAudio();
+            push_error("audio_init failed: Out of memory!");
+            return -1;
+        }
+        device_open = 1;
+    }
+    if( music_init(device_open ? spec.freq : 0) ) {
+        push_error("audio_init failed: Failed to initialize music!");
+        return -1;
+    }
+    if( device_open ) {
+        SDL_PauseAudio(0);
+    }
+    add_lua_function("loadSound", lua_loadSound);
+    add_lua_function("playSound", lua_playSound);
+    add_lua_function("stopSound", lua_stopSound);
+    add_lua_global_n("masterVolume", 1, lua_setMasterVolume);
+    initialized = 1;
     return 0;
 }
@@ -0,0 +1,519 @@
+/*
+ * tw_batch.c
+ *
+ * This file contains the source code pertaining to batch simulation in the
+ * ToyWrench application. Run with "--batch <count>", the engine does not open a
+ * window or audio device, and instead runs the given number of independent
+ * instances of the game on a pool of threads, one per core. Every instance
+ * steps its main function as fast as possible for "--frames <count>" frames,
+ * or until it calls quit(), without rendering or sleeping. This is meant for
+ * automated balance testing and AI training, where throughput should scale
+ * with cores rather than with processes.
+ *
+ * Each instance is a tw_instance_t context holding its own Lua state, frame
+ * counter, random number generator and result, and shares nothing with other
+ * instances. Its Lua state has the standard libraries, require() for the
+ * game's modules, setMain(), setDisplay(), quit(), saveState(), loadState(),
+ * traceBegin(), traceEnd(), an empty eventList, and its own GLOBALS with
+ * frameCount, screenWidth, screenHeight, fpsCap, gameName, batchInstance
+ * (counting from 1) and batchSize. The coroutine scheduler, the broadphase,
+ * entities, tweens and pathfinding are set up in the instance's Lua state by
+ * the same *_open() functions as in the main state, each with its own context,
+ * and are stepped before tw_main every frame in the order of the main loop.
+ * Time advances by 1000 / TW_DEFAULT_FPS milliseconds per frame, so that
+ * waitSeconds(), velocities, lifetimes and tweens behave as in a game running
+ * at full speed, and every run of a batch is reproducible.
+ *
+ * The functions of the device modules (graphics, audio, capture and the
+ * camera) are replaced by the stand-ins in device_functions: drawing and
+ * playback do nothing, loadTexture(), createCanvas(), loadSound(),
+ * defineClip() and playSound() return ids that refer to nothing, so entities
+ * never show a sprite and animations never end, setResolution() only updates
+ * GLOBALS, and getCamera() returns 0, 0. getPixels() needs real textures, and
+ * jobs and the allocator statistics belong to the main state, so those raise
+ * an error saying they are not available in batch mode. Only the functions of
+ * the device modules need to be listed there; everything else is registered by
+ * the modules themselves.
+ *
+ * math.random() draws from a generator of the instance, seeded with the
+ * instance number, so that every run of a batch is reproducible. A script
+ * reports the outcome of its instance with reportResult(...), and when all
+ * instances are done one line per instance is written to stdout:
+ *
+ *   <instance> <frames> <ok|error> <result values, tab separated>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include "SDL.h"
+#include "tw_alloc.h"
+#include "tw_batch.h"
+#include "tw_broadphase.h"
+#include "tw_entity.h"
+#include "tw_error.h"
+#include "tw_graphics.h"
+#include "tw_loader.h"
+#include "tw_lua.h"
+#include "tw_path.h"
+#include "tw_savestate.h"
+#include "tw_trace.h"
+#include "tw_tween.h"
+
+#define TW_MAX_BATCH_THREADS 64
+#define TW_BATCH_INSTANCE "TWInstance"
+
+typedef struct {
+    int index;
+    lua_State *L;
+    unsigned long frame_count;
+    unsigned long long random_state;
+    unsigned int next_handle;
+    int quit;
+    int failed;
+    char *result;
+} tw_instance_t;
+
+static int lua_batchNoop( lua_State *L );
+static int lua_batchHandle( lua_State *L );
+static int lua_batchGetCamera( lua_State *L );
+static int lua_batchSetResolution( lua_State *L );
+
+/* stand-ins for the device functions, NULL for those raising an error */
+static const luaL_Reg device_functions[] = {
+    { "loadTexture", lua_batchHandle },
+    { "drawTexture", lua_batchNoop },
+    { "drawLine", lua_batchNoop },
+    { "setResolution", lua_batchSetResolution },
+    { "createCanvas", lua_batchHandle },
+    { "setTarget", lua_batchNoop },
+    { "clearTarget", lua_batchNoop },
+    { "getPixels", NULL },
+    { "defineClip", lua_batchHandle },
+    { "drawEntities", lua_batchNoop },
+    { "loadSound", lua_batchHandle },
+    { "playSound", lua_batchHandle },
+    { "stopSound", lua_batchNoop },
+    { "playMusic", lua_batchNoop },
+    { "stopMusic", lua_batchNoop },
+    { "screenshot", lua_batchNoop },
+    { "startCapture", lua_batchNoop },
+    { "stopCapture", lua_batchNoop },
+    { "setCamera", lua_batchNoop },
+    { "getCamera", lua_batchGetCamera },
+    { "setLayerParallax", lua_batchNoop },
+    { "setLayerDepth", lua_batchNoop },
+    { "setLayerVisible", lua_batchNoop },
+    { "submitJob", NULL },
+    { "gcStats", NULL },
+    { "allocStats", NULL },
+    { NULL, NULL }
+};
+
+static const char *game_path;
+static tw_instance_t *instance_list;
+static int instance_count;
+static unsigned long frame_limit;
+static volatile int next_instance = 0;
+
+/*
+ * Returns the instance the given Lua state belongs to.
+ */
+static tw_instance_t * get_instance( lua_State *L ) {
+    tw_instance_t *instance;
+    lua_getfield(L, LUA_REGISTRYINDEX, TW_BATCH_INSTANCE);
+    instance = (tw_instance_t*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return instance;
+}
+
+/*
+ * Returns the next number of the xorshift generator of the given instance.
+ */
+static unsigned long long next_random( tw_instance_t *instance ) {
+    unsigned long long x;
+    x = instance->random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    instance->random_state = x;
+    return x;
+}
+
+/*
+ * Lua hook replacing math.random() with the generator of the instance, with
+ * the same arguments and results.
+ */
+static int lua_batchRandom( lua_State *L ) {
+    tw_instance_t *instance;
+    lua_Number r, low, high;
+    instance = get_instance(L);
+    r = (lua_Number)(next_random(instance) >> 11) / (lua_Number)(1ULL << 53);
+    switch( lua_gettop(L) ) {
+        case 0:
+            lua_pushnumber(L, r);
+            return 1;
+        case 1:
+            low = 1;
+            high = lua_tonumber(L, 1);
+            break;
+        default:
+            low = lua_tonumber(L, 1);
+            high = lua_tonumber(L, 2);
+            break;
+    }
+    if( low > high ) {
+        push_error("Lua: Error while calling math.random: Interval is empty!");
+        lua_pushstring(L, "Interval is empty.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, (lua_Number)(long long)(r * (high - low + 1)) + low);
+    return 1;
+}
+
+/*
+ * Lua hook replacing math.randomseed() to seed the generator of the instance.
+ */
+static int lua_batchRandomSeed( lua_State *L ) {
+    tw_instance_t *instance;
+    instance = get_instance(L);
+    instance->random_state = (unsigned long long)lua_tonumber(L, 1) * 2685821657736338717ULL;
+    if( instance->random_state == 0 ) { /* xorshift would stay at zero */
+        instance->random_state = 1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook ending the instance after the current frame.
+ */
+static int lua_batchQuit( lua_State *L ) {
+    get_instance(L)->quit = 1;
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook recording the given values as the result of the instance, replacing
+ * any result reported before.
+ */
+static int lua_reportResult( lua_State *L ) {
+    tw_instance_t *instance;
+    const char *s;
+    size_t length;
+    int i, n;
+    instance = get_instance(L);
+    n = lua_gettop(L);
+    lua_getglobal(L, "tostring");
+    for( i = 1; i <= n; i++ ) {
+        lua_pushvalue(L, n + 1);
+        lua_pushvalue(L, i);
+        lua_call(L, 1, 1);
+        if( i < n ) {
+            lua_pushstring(L, "\t");
+        }
+    }
+    lua_concat(L, n > 0 ? 2 * n - 1 : 0);
+    s = lua_tolstring(L, -1, &length);
+    free(instance->result);
+    instance->result = (char*)malloc(length + 1);
+    if( instance->result != NULL ) {
+        memcpy(instance->result, s, length + 1);
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook standing in for functions that do nothing in batches.
+ */
+static int lua_batchNoop( lua_State *L ) {
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook standing in for functions that return the id of a texture, sound,
+ * clip or channel, returning a new id that refers to nothing.
+ */
+static int lua_batchHandle( lua_State *L ) {
+    tw_instance_t *instance;
+    instance = get_instance(L);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, instance->next_handle++);
+    return 1;
+}
+
+/*
+ * Lua hook standing in for getCamera(), as the camera never moves in batches.
+ */
+static int lua_batchGetCamera( lua_State *L ) {
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, 0);
+    lua_pushnumber(L, 0);
+    return 2;
+}
+
+/*
+ * Lua hook standing in for setResolution(), only updating the screen size in
+ * GLOBALS.
+ */
+static int lua_batchSetResolution( lua_State *L ) {
+    if( lua_gettop(L) < 2 ) {
+        push_error("Lua: Error while calling setResolution: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    set_lua_global_n_in(L, "screenWidth", (int)lua_tonumber(L, 1));
+    set_lua_global_n_in(L, "screenHeight", (int)lua_tonumber(L, 2));
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook standing in for functions that can not run in batches, raising an
+ * error naming the function in upvalue 1.
+ */
+static int lua_batchUnavailable( lua_State *L ) {
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushstring(L, " is not available in batch mode.");
+    lua_concat(L, 2);
+    push_error(lua_tostring(L, -1));
+    lua_error(L);
+    return -1;
+}
+
+/*
+ * Sets up the Lua state of the given instance. Returns -1 with an error message
+ * on the stack if that fails.
+ */
+static int setup_instance( tw_instance_t *instance ) {
+    lua_State *L;
+    int i;
+    L = instance->L;
+    luaL_openlibs(L);
+    if( loader_install(L) ) {
+        lua_pushstring(L, "Failed to install module loader.");
+        return -1;
+    }
+    lua_pushlightuserdata(L, instance);
+    lua_setfield(L, LUA_REGISTRYINDEX, TW_BATCH_INSTANCE);
+    lua_getglobal(L, "math");
+    lua_pushcfunction(L, lua_batchRandom);
+    lua_setfield(L, -2, "random");
+    lua_pushcfunction(L, lua_batchRandomSeed);
+    lua_setfield(L, -2, "randomseed");
+    lua_pop(L, 1);
+    instance->random_state = (unsigned long long)(instance->index + 1) * 2685821657736338717ULL;
+    if( setup_lua_globals(L) ||
+        add_lua_global_n_in(L, "frameCount", 0, NULL) ||
+        add_lua_global_n_in(L, "screenWidth", TW_DEFAULT_WIDTH, NULL) ||
+        add_lua_global_n_in(L, "screenHeight", TW_DEFAULT_HEIGHT, NULL) ||
+        add_lua_global_n_in(L, "fpsCap", TW_DEFAULT_FPS, NULL) ||
+        add_lua_global_s_in(L, "gameName", "Untitled", NULL) ||
+        add_lua_global_n_in(L, "batchInstance", instance->index + 1, NULL) ||
+        add_lua_global_n_in(L, "batchSize", instance_count, NULL) ) {
+        lua_pushstring(L, "Failed to create GLOBALS.");
+        return -1;
+    }
+    if( scheduler_open(L) || broadphase_open(L) || entity_open(L) || tween_open(L) ||
+        path_open(L) ) {
+        lua_pushstring(L, "Failed to set up subsystems.");
+        return -1;
+    }
+    lua_newtable(L);
+    lua_setglobal(L, "eventList");
+    add_lua_function_in(L, "quit", lua_batchQuit);
+    add_lua_function_in(L, "reportResult", lua_reportResult);
+    add_lua_function_in(L, "saveState", lua_saveState);
+    add_lua_function_in(L, "loadState", lua_loadState);
+    add_lua_function_in(L, "traceBegin", lua_traceBegin);
+    add_lua_function_in(L, "traceEnd", lua_traceEnd);
+    for( i = 0; device_functions[i].name != NULL; i++ ) {
+        if( device_functions[i].func != NULL ) {
+            add_lua_function_in(L, device_functions[i].name, device_functions[i].func);
+        }
+        else {
+            lua_pushstring(L, device_functions[i].name);
+            lua_pushcclosure(L, lua_batchUnavailable, 1);
+            lua_setglobal(L, device_functions[i].name);
+        }
+    }
+    if( setup_lua_main(L) ) {
+        return -1;
+    }
+    return loader_load_file(L, game_path) || lua_pcall(L, 0, 0, 0) ? -1 : 0;
+}
+
+/*
+ * Steps the subsystems of the given instance and runs its main function for
+ * the next frame. Returns -1 with an error message on the stack if that fails.
+ */
+static int step_instance( tw_instance_t *instance ) {
+    lua_State *L;
+    unsigned int ticks;
+    L = instance->L;
+    frame_arena_reset();
+    instance->frame_count++;
+    ticks = (unsigned int)(instance->frame_count * 1000 / TW_DEFAULT_FPS);
+    set_lua_global_n_in(L, "frameCount", (int)instance->frame_count);
+    if( path_step(L) ) {
+        lua_pushstring(L, "Error while stepping path requests.");
+        return -1;
+    }
+    if( scheduler_step(L, instance->frame_count, ticks) ) {
+        lua_pushstring(L, "Error while resuming coroutines.");
+        return -1;
+    }
+    if( entity_step(L, ticks) ) {
+        lua_pushstring(L, "Error while stepping entities.");
+        return -1;
+    }
+    if( tween_step(L, ticks) ) {
+        lua_pushstring(L, "Error while stepping tweens.");
+        return -1;
+    }
+    lua_getglobal(L, "tw_main");
+    return lua_pcall(L, 0, 0, 0) ? -1 : 0;
+}
+
+/*
+ * Runs the given instance until it quits, fails, or reaches the frame limit.
+ */
+static void run_instance( tw_instance_t *instance ) {
+    lua_State *L;
+    const char *message;
+    instance->L = luaL_newstate();
+    if( instance->L == NULL ) {
+        instance->failed = 1;
+        return;
+    }
+    L = instance->L;
+    if( setup_instance(instance) ) {
+        instance->failed = 1;
+    }
+    while( !instance->failed && !instance->quit && instance->frame_count < frame_limit ) {
+        if( step_instance(instance) ) {
+            instance->failed = 1;
+        }
+    }
+    if( instance->failed ) {
+        message = lua_tostring(L, -1);
+        free(instance->result);
+        instance->result = NULL;
+        if( message != NULL ) {
+            instance->result = (char*)malloc(strlen(message) + 1);
+            if( instance->result != NULL ) {
+                strcpy(instance->result, message);
+            }
+        }
+    }
+    lua_close(L);
+    instance->L = NULL;
+}
+
+/*
+ * Batch thread running instances until there are none left.
+ */
+static int batch_thread( void *data ) {
+    int index;
+    (void)data;
+    trace_thread("batch");
+    for( ;; ) {
+        index = __sync_fetch_and_add(&next_instance, 1);
+        if( index >= instance_count ) {
+            break;
+        }
+        trace_begin("instance");
+        run_instance(&instance_list[index]);
+        trace_end("instance");
+    }
+    frame_arena_destroy();
+    return 0;
+}
+
+/*
+ * Runs the given number of instances of the given game for up to the given
+ * number of frames each, and writes their results to stdout.
+ */
+int batch_run( const char *game_file, int count, unsigned long frames ) {
+    SDL_Thread *thread_list[TW_MAX_BATCH_THREADS];
+    struct timespec start, end;
+    unsigned long long total_frames;
+    double seconds;
+    long cores;
+    int thread_count, i, failures;
+    char message[160];
+    if( count <= 0 ) {
+        push_error("batch_run failed: No instances to run!");
+        return -1;
+    }
+    if( loader_init(NULL, game_file) ) {
+        push_error("batch_run failed: Failed to initialize module loader!");
+        return -1;
+    }
+    instance_list = (tw_instance_t*)calloc(count, sizeof(tw_instance_t));
+    if( instance_list == NULL ) {
+        push_error("batch_run failed: Out of memory!");
+        return -1;
+    }
+    for( i = 0; i < count; i++ ) {
+        instance_list[i].index = i;
+    }
+    game_path = game_file;
+    instance_count = count;
+    frame_limit = frames;
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = cores > 0 ? (int)cores : 1;
+    if( thread_count > count ) {
+        thread_count = count;
+    }
+    if( thread_count > TW_MAX_BATCH_THREADS ) {
+        thread_count = TW_MAX_BATCH_THREADS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for( i = 0; i < thread_count; i++ ) {
+        thread_list[i] = SDL_CreateThread(batch_thread, NULL);
+        if( thread_list[i] == NULL ) {
+            push_warning("Failed to start batch thread!");
+            break;
+        }
+    }
+    thread_count = i;
+    if( thread_count == 0 ) {
+        batch_thread(NULL); /* run them all on this thread instead */
+    }
+    for( i = 0; i < thread_count; i++ ) {
+        SDL_WaitThread(thread_list[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    total_frames = 0;
+    failures = 0;
+    for( i = 0; i < count; i++ ) {
+        printf("%d\t%lu\t%s\t%s\n", i + 1, instance_list[i].frame_count,
+            instance_list[i].failed ? "error" : "ok",
+            instance_list[i].result != NULL ? instance_list[i].result : "");
+        total_frames += instance_list[i].frame_count;
+        failures += instance_list[i].failed;
+        free(instance_list[i].result);
+    }
+    fflush(stdout);
+    free(instance_list);
+    instance_list = NULL;
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    sprintf(message, "Batch: %d instances on %d threads, %llu frames in %.2f s (%.0f frames/s), %d failed.",
+        count, thread_count > 0 ? thread_count : 1, total_frames, seconds,
+        seconds > 0 ? total_frames / seconds : 0.0, failures);
+    log_message(TW_LOG_INFO, message);
+    return failures ? -1 : 0;
+}
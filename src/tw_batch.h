@@ -0,0 +1,16 @@
+/*
+ * tw_batch.h
+ */
+
+#ifndef TWBATCH
+#define TWBATCH
+
+#define TW_BATCH_FRAMES 3600 /* default frames per instance, a minute at 60 fps */
+
+/*
+ * Runs the given number of instances of the given game for up to the given
+ * number of frames each, and writes their results to stdout.
+ */
+int batch_run( const char *game_file, int count, unsigned long frames );
+
+#endif
@@ -0,0 +1,859 @@
+/*
+ * tw_broadphase.c
+ *
+ * This file contains the source code pertaining to the collision broadphase of
+ * the ToyWrench application. Games register their collidable objects here as
+ * axis aligned boxes ("bodies"), keep them up to date as they move, and ask
+ * which bodies overlap a region, another body, or a ray, instead of testing
+ * every pair of objects in Lua.
+ *
+ * Bodies are kept in a uniform grid stored as a spatial hash: every body is
+ * listed in each grid cell it touches, and the cells are hashed into a fixed
+ * number of buckets, so the grid needs no bounds and empty space costs nothing.
+ * Moving a body within the cells it already touches only updates its box. The
+ * cell size (GLOBALS.cellSize) should be around the size of a typical body.
+ * Bodies spanning more than TW_BROADPHASE_MAX_BODY_CELLS cells are not listed
+ * in the grid but kept in a separate list of large bodies, which every query
+ * checks one by one.
+ *
+ * To avoid creating garbage every frame, queries return the same result table
+ * each time they are called. The contents of a result table are only valid
+ * until the next query of the same kind.
+ *
+ * Each Lua state set up with broadphase_open() has its own broadphase context,
+ * so batch instances keep their bodies apart.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include "tw_broadphase.h"
+#include "tw_error.h"
+#include "tw_lua.h"
+
+#define TW_BROADPHASE "tw_broadphase"
+#define TW_BROADPHASE_BUCKETS 4096 /* must be a power of two */
+#define TW_BROADPHASE_CELL_SIZE 64
+#define TW_BROADPHASE_MAX_CELLS 4096
+#define TW_BROADPHASE_MAX_BODY_CELLS 64
+#define TW_BROADPHASE_MAX_CELL_INDEX (1 << 30) /* keeps cell ranges within int */
+
+typedef struct {
+    float x, y, w, h;
+    int cx0, cy0, cx1, cy1; /* range of grid cells the body is listed in */
+    int active;
+    int large; /* in the large body list instead of the grid */
+    unsigned int stamp; /* query the body was last visited by */
+} tw_body_t;
+
+typedef struct {
+    int body;
+    int cx, cy;
+    int next;
+} tw_cell_entry_t;
+
+/*
+ * The broadphase of one Lua state.
+ */
+typedef struct {
+    float cell_size;
+    tw_body_t *body_list;
+    unsigned int body_list_size;
+    unsigned int body_list_capacity;
+    int *free_bodies;
+    unsigned int free_bodies_size;
+    unsigned int active_bodies;
+    int buckets[TW_BROADPHASE_BUCKETS];
+    tw_cell_entry_t *entry_list;
+    unsigned int entry_list_size;
+    unsigned int entry_list_capacity;
+    int free_entries;
+    int *large_list;
+    unsigned int large_list_size;
+    unsigned int large_list_capacity;
+    unsigned int query_stamp;
+    int *hit_list;
+    unsigned int hit_list_size;
+    unsigned int hit_list_capacity;
+    /* result tables in the Lua registry, and how many entries they hold */
+    int rect_result_ref;
+    int body_result_ref;
+    int pair_result_ref;
+    int rect_result_size;
+    int body_result_size;
+    int pair_result_size;
+} tw_broadphase_t;
+
+static int initialized = 0;
+
+/*
+ * Returns the broadphase of the given Lua state.
+ */
+static tw_broadphase_t * get_broadphase( lua_State *L ) {
+    return (tw_broadphase_t*)lua_context(L, TW_BROADPHASE);
+}
+
+/*
+ * Frees the bodies and cell lists of a broadphase when its Lua state is
+ * closed.
+ */
+static void release_broadphase( void *context ) {
+    tw_broadphase_t *bp;
+    bp = (tw_broadphase_t*)context;
+    free(bp->body_list);
+    free(bp->free_bodies);
+    free(bp->entry_list);
+    free(bp->large_list);
+    free(bp->hit_list);
+}
+
+/*
+ * Returns the bucket of the given grid cell.
+ */
+static int cell_bucket( int cx, int cy ) {
+    return (int)(((unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u) &
+        (TW_BROADPHASE_BUCKETS - 1));
+}
+
+/*
+ * Returns the grid cell containing the given coordinate.
+ */
+static int to_cell( tw_broadphase_t *bp, float v ) {
+    float cell;
+    cell = floorf(v / bp->cell_size);
+    if( !(cell > -TW_BROADPHASE_MAX_CELL_INDEX) ) { /* also catches NaN */
+        return -TW_BROADPHASE_MAX_CELL_INDEX;
+    }
+    if( cell > TW_BROADPHASE_MAX_CELL_INDEX ) {
+        return TW_BROADPHASE_MAX_CELL_INDEX;
+    }
+    return (int)cell;
+}
+
+/*
+ * Lists the given body in the given grid cell.
+ */
+static int cell_insert( tw_broadphase_t *bp, int body, int cx, int cy ) {
+    tw_cell_entry_t *new_list;
+    int entry, bucket;
+    if( bp->free_entries >= 0 ) {
+        entry = bp->free_entries;
+        bp->free_entries = bp->entry_list[entry].next;
+    }
+    else {
+        if( bp->entry_list_size == bp->entry_list_capacity ) {
+            new_list = (tw_cell_entry_t*)realloc(bp->entry_list,
+                sizeof(tw_cell_entry_t) * (bp->entry_list_capacity ? bp->entry_list_capacity * 2 : 256));
+            if( new_list == NULL ) {
+                push_error("cell_insert failed: Out of memory!");
+                return -1;
+            }
+            bp->entry_list = new_list;
+            bp->entry_list_capacity = bp->entry_list_capacity ? bp->entry_list_capacity * 2 : 256;
+        }
+        entry = bp->entry_list_size++;
+    }
+    bucket = cell_bucket(cx, cy);
+    bp->entry_list[entry].body = body;
+    bp->entry_list[entry].cx = cx;
+    bp->entry_list[entry].cy = cy;
+    bp->entry_list[entry].next = bp->buckets[bucket];
+    bp->buckets[bucket] = entry;
+    return 0;
+}
+
+/*
+ * Removes the given body from the given grid cell.
+ */
+static void cell_remove( tw_broadphase_t *bp, int body, int cx, int cy ) {
+    int *link, entry;
+    link = &bp->buckets[cell_bucket(cx, cy)];
+    while( *link >= 0 ) {
+        entry = *link;
+        if( bp->entry_list[entry].body == body && bp->entry_list[entry].cx == cx &&
+            bp->entry_list[entry].cy == cy ) {
+            *link = bp->entry_list[entry].next;
+            bp->entry_list[entry].next = bp->free_entries;
+            bp->free_entries = entry;
+            return;
+        }
+        link = &bp->entry_list[entry].next;
+    }
+}
+
+/*
+ * Lists the given body in all grid cells its box touches, or in the large body
+ * list if it touches too many.
+ */
+static int body_link( tw_broadphase_t *bp, int id ) {
+    tw_body_t *body;
+    int *new_list, cx, cy;
+    body = &bp->body_list[id];
+    body->cx0 = to_cell(bp, body->x);
+    body->cy0 = to_cell(bp, body->y);
+    body->cx1 = to_cell(bp, body->x + body->w);
+    body->cy1 = to_cell(bp, body->y + body->h);
+    if( (double)(body->cx1 - body->cx0 + 1) * (body->cy1 - body->cy0 + 1) >
+        TW_BROADPHASE_MAX_BODY_CELLS ) {
+        body->large = 1;
+        if( bp->large_list_size == bp->large_list_capacity ) {
+            new_list = (int*)realloc(bp->large_list,
+                sizeof(int) * (bp->large_list_capacity ? bp->large_list_capacity * 2 : 16));
+            if( new_list == NULL ) {
+                push_error("body_link failed: Out of memory!");
+                return -1;
+            }
+            bp->large_list = new_list;
+            bp->large_list_capacity = bp->large_list_capacity ? bp->large_list_capacity * 2 : 16;
+        }
+        bp->large_list[bp->large_list_size++] = id;
+        return 0;
+    }
+    for( cy = body->cy0; cy <= body->cy1; cy++ ) {
+        for( cx = body->cx0; cx <= body->cx1; cx++ ) {
+            if( cell_insert(bp, id, cx, cy) ) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Removes the given body from all grid cells it is listed in.
+ */
+static void body_unlink( tw_broadphase_t *bp, int id ) {
+    tw_body_t *body;
+    unsigned int i;
+    int cx, cy;
+    body = &bp->body_list[id];
+    if( body->large ) {
+        body->large = 0;
+        for( i = 0; i < bp->large_list_size; i++ ) {
+            if( bp->large_list[i] == id ) {
+                bp->large_list[i] = bp->large_list[--bp->large_list_size];
+                break;
+            }
+        }
+        return;
+    }
+    for( cy = body->cy0; cy <= body->cy1; cy++ ) {
+        for( cx = body->cx0; cx <= body->cx1; cx++ ) {
+            cell_remove(bp, id, cx, cy);
+        }
+    }
+}
+
+/*
+ * Returns whether the given body is valid.
+ */
+static int body_valid( tw_broadphase_t *bp, int id ) {
+    return id >= 0 && (unsigned int)id < bp->body_list_size && bp->body_list[id].active;
+}
+
+/*
+ * Adds a body with the given box, returning its id or -1 on errors.
+ */
+static int add_body( tw_broadphase_t *bp, float x, float y, float w, float h ) {
+    tw_body_t *new_list;
+    int *new_free, id;
+    if( !isfinite(x) || !isfinite(y) || !isfinite(w) || !isfinite(h) ) {
+        push_error("add_body failed: Box is not finite!");
+        return -1;
+    }
+    if( bp->free_bodies_size > 0 ) {
+        id = bp->free_bodies[--bp->free_bodies_size];
+    }
+    else {
+        if( bp->body_list_size == bp->body_list_capacity ) {
+            new_list = (tw_body_t*)realloc(bp->body_list,
+                sizeof(tw_body_t) * (bp->body_list_capacity ? bp->body_list_capacity * 2 : 64));
+            new_free = new_list == NULL ? NULL : (int*)realloc(bp->free_bodies,
+                sizeof(int) * (bp->body_list_capacity ? bp->body_list_capacity * 2 : 64));
+            if( new_list != NULL ) {
+                bp->body_list = new_list;
+            }
+            if( new_free == NULL ) {
+                push_error("add_body failed: Out of memory!");
+                return -1;
+            }
+            bp->free_bodies = new_free;
+            bp->body_list_capacity = bp->body_list_capacity ? bp->body_list_capacity * 2 : 64;
+        }
+        id = bp->body_list_size++;
+    }
+    bp->body_list[id].x = x;
+    bp->body_list[id].y = y;
+    bp->body_list[id].w = w < 0 ? 0 : w;
+    bp->body_list[id].h = h < 0 ? 0 : h;
+    bp->body_list[id].active = 1;
+    bp->body_list[id].large = 0;
+    bp->body_list[id].stamp = 0;
+    bp->active_bodies++;
+    if( body_link(bp, id) ) {
+        body_unlink(bp, id);
+        bp->body_list[id].active = 0;
+        bp->free_bodies[bp->free_bodies_size++] = id;
+        bp->active_bodies--;
+        return -1;
+    }
+    return id;
+}
+
+/*
+ * Moves the given body to the given box. Only touches the grid when the body
+ * crosses into different cells.
+ */
+static int move_body( tw_broadphase_t *bp, int id, float x, float y, float w, float h ) {
+    tw_body_t *body;
+    if( !isfinite(x) || !isfinite(y) || !isfinite(w) || !isfinite(h) ) {
+        push_error("move_body failed: Box is not finite!");
+        return -1;
+    }
+    body = &bp->body_list[id];
+    body->x = x;
+    body->y = y;
+    body->w = w < 0 ? 0 : w;
+    body->h = h < 0 ? 0 : h;
+    if( to_cell(bp, x) == body->cx0 && to_cell(bp, y) == body->cy0 &&
+        to_cell(bp, x + body->w) == body->cx1 && to_cell(bp, y + body->h) == body->cy1 ) {
+        return 0;
+    }
+    body_unlink(bp, id);
+    return body_link(bp, id);
+}
+
+/*
+ * Removes the given body, freeing its id for reuse.
+ */
+static void remove_body( tw_broadphase_t *bp, int id ) {
+    body_unlink(bp, id);
+    bp->body_list[id].active = 0;
+    bp->free_bodies[bp->free_bodies_size++] = id;
+    bp->active_bodies--;
+}
+
+/*
+ * Returns whether the given body overlaps the given box. Touching edges count
+ * as overlapping.
+ */
+static int body_overlaps( tw_body_t *body, float x, float y, float w, float h ) {
+    return body->x <= x + w && x <= body->x + body->w &&
+        body->y <= y + h && y <= body->y + body->h;
+}
+
+/*
+ * Pushes the result table with the given registry reference, creating it if
+ * needed.
+ */
+static void push_result( lua_State *L, int *ref ) {
+    if( *ref == LUA_NOREF ) {
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        *ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, *ref);
+    }
+}
+
+/*
+ * Clears the entries of the result table on top of the stack past the given
+ * count, which were left over from a bigger previous result.
+ */
+static void trim_result( lua_State *L, int count, int *old_count ) {
+    int i;
+    for( i = count + 1; i <= *old_count; i++ ) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i);
+    }
+    *old_count = count;
+}
+
+/*
+ * Appends the given body to the hit list.
+ */
+static int add_hit( tw_broadphase_t *bp, int id ) {
+    int *new_list;
+    if( bp->hit_list_size == bp->hit_list_capacity ) {
+        new_list = (int*)realloc(bp->hit_list,
+            sizeof(int) * (bp->hit_list_capacity ? bp->hit_list_capacity * 2 : 64));
+        if( new_list == NULL ) {
+            push_error("add_hit failed: Out of memory!");
+            return -1;
+        }
+        bp->hit_list = new_list;
+        bp->hit_list_capacity = bp->hit_list_capacity ? bp->hit_list_capacity * 2 : 64;
+    }
+    bp->hit_list[bp->hit_list_size++] = id;
+    return 0;
+}
+
+/*
+ * Fills the hit list with all bodies overlapping the given box, except the
+ * given body.
+ */
+static int collect_overlaps( tw_broadphase_t *bp, int skip, float x, float y, float w, float h ) {
+    tw_body_t *body;
+    unsigned int i;
+    int cx0, cy0, cx1, cy1, cx, cy, entry;
+    bp->hit_list_size = 0;
+    bp->query_stamp++;
+    cx0 = to_cell(bp, x);
+    cy0 = to_cell(bp, y);
+    cx1 = to_cell(bp, x + w);
+    cy1 = to_cell(bp, y + h);
+    if( (double)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) > TW_BROADPHASE_MAX_CELLS ||
+        (double)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) > bp->active_bodies ) {
+        /* visiting all bodies is cheaper than visiting all cells */
+        for( i = 0; i < bp->body_list_size; i++ ) {
+            body = &bp->body_list[i];
+            if( body->active && (int)i != skip && body_overlaps(body, x, y, w, h) &&
+                add_hit(bp, i) ) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    for( i = 0; i < bp->large_list_size; i++ ) {
+        body = &bp->body_list[bp->large_list[i]];
+        if( bp->large_list[i] != skip && body_overlaps(body, x, y, w, h) &&
+            add_hit(bp, bp->large_list[i]) ) {
+            return -1;
+        }
+    }
+    for( cy = cy0; cy <= cy1; cy++ ) {
+        for( cx = cx0; cx <= cx1; cx++ ) {
+            for( entry = bp->buckets[cell_bucket(cx, cy)]; entry >= 0;
+                 entry = bp->entry_list[entry].next ) {
+                body = &bp->body_list[bp->entry_list[entry].body];
+                if( bp->entry_list[entry].cx != cx || bp->entry_list[entry].cy != cy ||
+                    bp->entry_list[entry].body == skip || body->stamp == bp->query_stamp ) {
+                    continue;
+                }
+                body->stamp = bp->query_stamp;
+                if( body_overlaps(body, x, y, w, h) && add_hit(bp, bp->entry_list[entry].body) ) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Stores the hit list in the result table with the given registry reference,
+ * and leaves the table on top of the stack.
+ */
+static void push_hits( lua_State *L, tw_broadphase_t *bp, int *ref, int *old_count ) {
+    unsigned int i;
+    push_result(L, ref);
+    for( i = 0; i < bp->hit_list_size; i++ ) {
+        lua_pushnumber(L, bp->hit_list[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    trim_result(L, bp->hit_list_size, old_count);
+}
+
+/*
+ * Returns the distance along the given ray at which it enters the given body,
+ * or a negative number if it misses the body within the given length.
+ */
+static float ray_hit( tw_body_t *body, float x, float y, float dx, float dy, float length ) {
+    float t0, t1, ta, tb, tmp;
+    t0 = 0;
+    t1 = length;
+    if( dx != 0 ) {
+        ta = (body->x - x) / dx;
+        tb = (body->x + body->w - x) / dx;
+        if( ta > tb ) {
+            tmp = ta; ta = tb; tb = tmp;
+        }
+        t0 = ta > t0 ? ta : t0;
+        t1 = tb < t1 ? tb : t1;
+    }
+    else if( x < body->x || x > body->x + body->w ) {
+        return -1;
+    }
+    if( dy != 0 ) {
+        ta = (body->y - y) / dy;
+        tb = (body->y + body->h - y) / dy;
+        if( ta > tb ) {
+            tmp = ta; ta = tb; tb = tmp;
+        }
+        t0 = ta > t0 ? ta : t0;
+        t1 = tb < t1 ? tb : t1;
+    }
+    else if( y < body->y || y > body->y + body->h ) {
+        return -1;
+    }
+    return t0 <= t1 ? t0 : -1;
+}
+
+/*
+ * Finds the first body hit by the ray from (x1, y1) to (x2, y2), walking the
+ * grid cells along the ray in order and stopping at the first cell containing
+ * a hit. Returns the body, or -1 if nothing is hit, and stores the distance
+ * along the ray of the hit in hit_t.
+ */
+static int ray_cast( tw_broadphase_t *bp, float x1, float y1, float x2, float y2, float *hit_t ) {
+    tw_body_t *body;
+    float dx, dy, length, t, next_x, next_y, step_tx, step_ty, best_t;
+    unsigned int i;
+    int cx, cy, end_cx, end_cy, step_x, step_y, entry, best, cells;
+    dx = x2 - x1;
+    dy = y2 - y1;
+    length = sqrtf(dx * dx + dy * dy);
+    if( length > 0 ) {
+        dx /= length;
+        dy /= length;
+    }
+    cx = to_cell(bp, x1);
+    cy = to_cell(bp, y1);
+    end_cx = to_cell(bp, x2);
+    end_cy = to_cell(bp, y2);
+    step_x = dx > 0 ? 1 : -1;
+    step_y = dy > 0 ? 1 : -1;
+    step_tx = dx != 0 ? bp->cell_size / fabsf(dx) : INFINITY;
+    step_ty = dy != 0 ? bp->cell_size / fabsf(dy) : INFINITY;
+    next_x = dx != 0 ? ((cx + (dx > 0)) * bp->cell_size - x1) / dx : INFINITY;
+    next_y = dy != 0 ? ((cy + (dy > 0)) * bp->cell_size - y1) / dy : INFINITY;
+    best = -1;
+    best_t = length;
+    bp->query_stamp++;
+    for( i = 0; i < bp->large_list_size; i++ ) { /* not in the grid, test them all */
+        t = ray_hit(&bp->body_list[bp->large_list[i]], x1, y1, dx, dy, best_t);
+        if( t >= 0 && (best < 0 || t < best_t) ) {
+            best = bp->large_list[i];
+            best_t = t;
+        }
+    }
+    for( cells = 0; ; cells++ ) {
+        for( entry = bp->buckets[cell_bucket(cx, cy)]; entry >= 0; entry = bp->entry_list[entry].next ) {
+            body = &bp->body_list[bp->entry_list[entry].body];
+            if( bp->entry_list[entry].cx != cx || bp->entry_list[entry].cy != cy ||
+                body->stamp == bp->query_stamp ) {
+                continue;
+            }
+            body->stamp = bp->query_stamp;
+            t = ray_hit(body, x1, y1, dx, dy, best_t);
+            if( t >= 0 && (best < 0 || t < best_t) ) {
+                best = bp->entry_list[entry].body;
+                best_t = t;
+            }
+        }
+        t = next_x < next_y ? next_x : next_y; /* where the ray leaves the cell */
+        if( (best >= 0 && best_t <= t) || (cx == end_cx && cy == end_cy) ||
+            t > length || cells > TW_BROADPHASE_MAX_CELLS ) {
+            break;
+        }
+        if( next_x < next_y ) {
+            cx += step_x;
+            next_x += step_tx;
+        }
+        else {
+            cy += step_y;
+            next_y += step_ty;
+        }
+    }
+    *hit_t = best_t;
+    return best;
+}
+
+/*
+ * Reads the body id argument at the given index, raising a Lua error for
+ * invalid bodies.
+ */
+static int check_body( lua_State *L, tw_broadphase_t *bp, int index, const char *fn_name ) {
+    int id;
+    id = (int)lua_tonumber(L, index);
+    if( !body_valid(bp, id) ) {
+        push_error(fn_name);
+        lua_pushstring(L, "Invalid body.");
+        lua_error(L);
+        return -1;
+    }
+    return id;
+}
+
+/*
+ * Lua hook to the function
+ * add_body( tw_broadphase_t *bp, float x, float y, float w, float h )
+ * returning the id of the new body.
+ */
+int lua_addBody( lua_State *L ) {
+    tw_broadphase_t *bp;
+    int id;
+    bp = get_broadphase(L);
+    if( lua_gettop(L) < 4 ) {
+        push_error("Lua: Error while calling addBody: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    id = add_body(bp, lua_tonumber(L, 1), lua_tonumber(L, 2), lua_tonumber(L, 3),
+        lua_tonumber(L, 4));
+    if( id < 0 ) {
+        push_error("Lua: Error while calling addBody!");
+        lua_pushstring(L, "Error while adding body.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, id);
+    return 1;
+}
+
+/*
+ * Lua hook to the function
+ * move_body( tw_broadphase_t *bp, int id, float x, float y, float w, float h )
+ * keeping the size of the body if no new size is given.
+ */
+int lua_moveBody( lua_State *L ) {
+    tw_broadphase_t *bp;
+    int id;
+    bp = get_broadphase(L);
+    if( lua_gettop(L) < 3 ) {
+        push_error("Lua: Error while calling moveBody: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    id = check_body(L, bp, 1, "Lua: Error while calling moveBody: Invalid body!");
+    if( move_body(bp, id, lua_tonumber(L, 2), lua_tonumber(L, 3),
+        lua_isnoneornil(L, 4) ? bp->body_list[id].w : lua_tonumber(L, 4),
+        lua_isnoneornil(L, 5) ? bp->body_list[id].h : lua_tonumber(L, 5)) ) {
+        push_error("Lua: Error while calling moveBody!");
+        lua_pushstring(L, "Error while moving body.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to the function
+ * remove_body( tw_broadphase_t *bp, int id )
+ */
+int lua_removeBody( lua_State *L ) {
+    tw_broadphase_t *bp;
+    bp = get_broadphase(L);
+    if( lua_gettop(L) == 0 ) {
+        push_error("Lua: Error while calling removeBody: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    remove_body(bp, check_body(L, bp, 1, "Lua: Error while calling removeBody: Invalid body!"));
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook returning a table with the ids of all bodies overlapping the given
+ * rectangle.
+ */
+int lua_queryRect( lua_State *L ) {
+    tw_broadphase_t *bp;
+    float x, y, w, h;
+    bp = get_broadphase(L);
+    if( lua_gettop(L) < 4 ) {
+        push_error("Lua: Error while calling queryRect: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    x = lua_tonumber(L, 1);
+    y = lua_tonumber(L, 2);
+    w = lua_tonumber(L, 3);
+    h = lua_tonumber(L, 4);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    if( collect_overlaps(bp, -1, x, y, w, h) ) {
+        push_error("Lua: Error while calling queryRect!");
+        lua_pushstring(L, "Error while querying bodies.");
+        lua_error(L);
+        return -1;
+    }
+    push_hits(L, bp, &bp->rect_result_ref, &bp->rect_result_size);
+    return 1;
+}
+
+/*
+ * Lua hook returning a table with the ids of all other bodies overlapping the
+ * given body.
+ */
+int lua_queryBody( lua_State *L ) {
+    tw_broadphase_t *bp;
+    tw_body_t *body;
+    int id;
+    bp = get_broadphase(L);
+    if( lua_gettop(L) == 0 ) {
+        push_error("Lua: Error while calling queryBody: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    id = check_body(L, bp, 1, "Lua: Error while calling queryBody: Invalid body!");
+    body = &bp->body_list[id];
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    if( collect_overlaps(bp, id, body->x, body->y, body->w, body->h) ) {
+        push_error("Lua: Error while calling queryBody!");
+        lua_pushstring(L, "Error while querying bodies.");
+        lua_error(L);
+        return -1;
+    }
+    push_hits(L, bp, &bp->body_result_ref, &bp->body_result_size);
+    return 1;
+}
+
+/*
+ * Lua hook returning a flat table {a1, b1, a2, b2, ...} of every pair of
+ * overlapping bodies, each pair listed once.
+ */
+int lua_queryPairs( lua_State *L ) {
+    tw_broadphase_t *bp;
+    tw_body_t *body;
+    unsigned int i, j;
+    int count;
+    bp = get_broadphase(L);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    push_result(L, &bp->pair_result_ref);
+    count = 0;
+    for( i = 0; i < bp->body_list_size; i++ ) {
+        body = &bp->body_list[i];
+        if( !body->active ) {
+            continue;
+        }
+        if( collect_overlaps(bp, i, body->x, body->y, body->w, body->h) ) {
+            push_error("Lua: Error while calling queryPairs!");
+            lua_pushstring(L, "Error while querying bodies.");
+            lua_error(L);
+            return -1;
+        }
+        for( j = 0; j < bp->hit_list_size; j++ ) {
+            if( (unsigned int)bp->hit_list[j] > i ) { /* list each pair once */
+                lua_pushnumber(L, i);
+                lua_rawseti(L, -2, ++count);
+                lua_pushnumber(L, bp->hit_list[j]);
+                lua_rawseti(L, -2, ++count);
+            }
+        }
+    }
+    trim_result(L, count, &bp->pair_result_size);
+    return 1;
+}
+
+/*
+ * Lua hook to cast a ray from (x1, y1) to (x2, y2). Returns the id of the first
+ * body hit and the point it was hit at, or nil if nothing is hit.
+ */
+int lua_rayCast( lua_State *L ) {
+    tw_broadphase_t *bp;
+    float x1, y1, x2, y2, t, length;
+    int id;
+    bp = get_broadphase(L);
+    if( lua_gettop(L) < 4 ) {
+        push_error("Lua: Error while calling rayCast: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    x1 = lua_tonumber(L, 1);
+    y1 = lua_tonumber(L, 2);
+    x2 = lua_tonumber(L, 3);
+    y2 = lua_tonumber(L, 4);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    id = ray_cast(bp, x1, y1, x2, y2, &t);
+    if( id < 0 ) {
+        lua_pushnil(L);
+        return 1;
+    }
+    length = sqrtf((x2 - x1) * (x2 - x1) + (y2 - y1) * (y2 - y1));
+    if( length > 0 ) {
+        t /= length;
+    }
+    lua_pushnumber(L, id);
+    lua_pushnumber(L, x1 + (x2 - x1) * t);
+    lua_pushnumber(L, y1 + (y2 - y1) * t);
+    return 3;
+}
+
+/*
+ * Lua callback to set the grid cell size whenever GLOBALS.cellSize is changed.
+ * Rebuilds the grid.
+ */
+int lua_setCellSize( lua_State *L ) {
+    tw_broadphase_t *bp;
+    unsigned int i;
+    bp = get_broadphase(L);
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while setting cellSize: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    if( !(lua_tonumber(L, -1) >= 1) ) { /* also rejects NaN */
+        push_warning("Lua: Invalid cellSize, keeping the current cell size!");
+        lua_pop(L, 1);
+        return 0;
+    }
+    for( i = 0; i < bp->body_list_size; i++ ) {
+        if( bp->body_list[i].active ) {
+            body_unlink(bp, i);
+        }
+    }
+    bp->cell_size = lua_tonumber(L, -1);
+    for( i = 0; i < bp->body_list_size; i++ ) {
+        if( bp->body_list[i].active && body_link(bp, i) ) {
+            push_error("Lua: Error while setting cellSize: Out of memory!");
+        }
+    }
+    lua_pop(L, 1);
+    return 0;
+}
+
+/*
+ * Sets up a broadphase in the given Lua state and registers its Lua functions
+ * in it. The GLOBALS of the state must have been set up before.
+ */
+int broadphase_open( lua_State *L ) {
+    tw_broadphase_t *bp;
+    int i;
+    bp = (tw_broadphase_t*)new_lua_context(L, TW_BROADPHASE, sizeof(tw_broadphase_t),
+        release_broadphase);
+    bp->cell_size = TW_BROADPHASE_CELL_SIZE;
+    for( i = 0; i < TW_BROADPHASE_BUCKETS; i++ ) {
+        bp->buckets[i] = -1;
+    }
+    bp->free_entries = -1;
+    bp->rect_result_ref = LUA_NOREF;
+    bp->body_result_ref = LUA_NOREF;
+    bp->pair_result_ref = LUA_NOREF;
+    if( add_lua_function_in(L, "addBody", lua_addBody) ||
+        add_lua_function_in(L, "moveBody", lua_moveBody) ||
+        add_lua_function_in(L, "removeBody", lua_removeBody) ||
+        add_lua_function_in(L, "queryRect", lua_queryRect) ||
+        add_lua_function_in(L, "queryBody", lua_queryBody) ||
+        add_lua_function_in(L, "queryPairs", lua_queryPairs) ||
+        add_lua_function_in(L, "rayCast", lua_rayCast) ||
+        add_lua_global_n_in(L, "cellSize", TW_BROADPHASE_CELL_SIZE, lua_setCellSize) ) {
+        push_error("Failed to add broadphase functions!");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Initializes the broadphase of the main Lua state.
+ */
+int broadphase_init() {
+    if( initialized ) {
+        push_warning("Broadphase already initialized!");
+        return 0;
+    }
+    if( broadphase_open(lua_main_state()) ) {
+        return -1;
+    }
+    initialized = 1;
+    return 0;
+}
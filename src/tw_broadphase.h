@@ -0,0 +1,18 @@
+/*
+ * tw_broadphase.h
+ */
+
+#ifndef TWBROADPHASE
+#define TWBROADPHASE
+
+#include "tw_lua.h"
+
+/*
+ * Sets up a broadphase in the given Lua state and registers its Lua functions
+ * in it. The GLOBALS of the state must have been set up before.
+ */
+int broadphase_open( lua_State *L );
+
+int broadphase_init();
+
+#endif
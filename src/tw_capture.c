@@ -0,0 +1,516 @@
+/*
+ * tw_capture.c
+ *
+ * This file contains the source code pertaining to capturing the output of the
+ * ToyWrench application, as PNG screenshots or as a video stream. Capturing a
+ * frame only copies the logical screen into one of a few recycled buffers and
+ * queues it; a background thread converts the queued frames and writes them to
+ * disk. If the thread falls behind and no buffer is free, the frame is dropped
+ * instead of stalling the main loop. Fast replays are the exception: there is
+ * no frame rate to keep up there, so they wait for a buffer and never drop.
+ *
+ * Videos are written as YUV4MPEG2 (with full resolution chroma) when the file
+ * name ends in ".y4m", and as raw 24 bit RGB frames otherwise. Either can be
+ * fed to common encoders, and a headless replay with capturing turned on gives
+ * a frame-exact record of a run for comparing against earlier ones.
+ *
+ * The frame is copied right before the screen is flipped rather than after,
+ * since the screen surface is the stale back buffer after a double buffered
+ * flip.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#include "tw_capture.h"
+#include "tw_error.h"
+#include "tw_graphics.h"
+#include "tw_lua.h"
+#include "tw_replay.h"
+#include "tw_trace.h"
+
+#define TW_CAPTURE_BUFFERS 4 /* must be a power of two */
+#define TW_CAPTURE_WAIT 1
+
+#define TW_JOB_SCREENSHOT 0
+#define TW_JOB_FRAME 1
+#define TW_JOB_END 2
+
+typedef struct {
+    int kind;
+    Uint8 *pixels;
+    size_t capacity;
+    int width;
+    int height;
+    Uint8 r_shift;
+    Uint8 g_shift;
+    Uint8 b_shift;
+    char *path; /* screenshots only */
+    FILE *video; /* video frames and ends */
+    int y4m;
+} tw_capture_job_t;
+
+static int initialized = 0;
+static tw_capture_job_t job_list[TW_CAPTURE_BUFFERS];
+static volatile unsigned int job_head = 0; /* written by the main thread */
+static volatile unsigned int job_tail = 0; /* written by the capture thread */
+static SDL_sem *job_ready = NULL;
+static SDL_Thread *capture_thread = NULL;
+static volatile int running = 0;
+static char *screenshot_path = NULL;
+static FILE *video_file = NULL;
+static int video_y4m = 0;
+static int video_width = 0;
+static int video_height = 0;
+static unsigned int video_every = 1;
+static unsigned long video_frames = 0;
+static unsigned long video_dropped = 0;
+static unsigned long video_skipped = 0;
+
+/*
+ * Converts a row of captured pixels to 24 bit RGB.
+ */
+static void row_to_rgb( tw_capture_job_t *job, const Uint32 *src, Uint8 *dst ) {
+    int x;
+    for( x = 0; x < job->width; x++ ) {
+        dst[x * 3] = (Uint8)(src[x] >> job->r_shift);
+        dst[x * 3 + 1] = (Uint8)(src[x] >> job->g_shift);
+        dst[x * 3 + 2] = (Uint8)(src[x] >> job->b_shift);
+    }
+}
+
+/*
+ * Writes the given job out as a PNG file.
+ */
+static int write_png( tw_capture_job_t *job, Uint8 *row ) {
+    FILE *fp;
+    png_structp png;
+    png_infop info;
+    int y;
+    fp = fopen(job->path, "wb");
+    if( fp == NULL ) {
+        push_error("write_png failed: Failed to open screenshot file!");
+        return -1;
+    }
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png != NULL ? png_create_info_struct(png) : NULL;
+    if( info == NULL ) {
+        png_destroy_write_struct(&png, NULL);
+        fclose(fp);
+        push_error("write_png failed: Out of memory!");
+        return -1;
+    }
+    if( setjmp(png_jmpbuf(png)) ) {
+        png_destroy_write_struct(&png, &info);
+        fclose(fp);
+        push_error("write_png failed: Failed to encode screenshot!");
+        return -1;
+    }
+    png_init_io(png, fp);
+    png_set_compression_level(png, 3); /* the thread has other frames to get to */
+    png_set_IHDR(png, info, job->width, job->height, 8, PNG_COLOR_TYPE_RGB,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for( y = 0; y < job->height; y++ ) {
+        row_to_rgb(job, (Uint32*)(job->pixels + y * job->width * 4), row);
+        png_write_row(png, row);
+    }
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    return fclose(fp) ? -1 : 0;
+}
+
+/*
+ * Appends the given job to its video as a frame. YUV4MPEG2 frames are converted
+ * with the BT.601 coefficients and written as full Y, Cb and Cr planes.
+ */
+static int write_frame( tw_capture_job_t *job, Uint8 *row ) {
+    Uint8 *planes, *p;
+    size_t plane_size, i;
+    int x, y, c, r, g, b;
+    if( !job->y4m ) {
+        for( y = 0; y < job->height; y++ ) {
+            row_to_rgb(job, (Uint32*)(job->pixels + y * job->width * 4), row);
+            if( fwrite(row, 3, job->width, job->video) != (size_t)job->width ) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    /* the RGB pixels are no longer needed, the planes replace them in place */
+    plane_size = (size_t)job->width * job->height;
+    planes = job->pixels;
+    for( i = 0; i < plane_size; i++ ) {
+        p = planes + i * 4;
+        r = (Uint8)(*(Uint32*)p >> job->r_shift);
+        g = (Uint8)(*(Uint32*)p >> job->g_shift);
+        b = (Uint8)(*(Uint32*)p >> job->b_shift);
+        p[0] = (Uint8)((66 * r + 129 * g + 25 * b + 128) / 256 + 16);
+        p[1] = (Uint8)((-38 * r - 74 * g + 112 * b + 128) / 256 + 128);
+        p[2] = (Uint8)((112 * r - 94 * g - 18 * b + 128) / 256 + 128);
+    }
+    if( fputs("FRAME\n", job->video) == EOF ) {
+        return -1;
+    }
+    for( c = 0; c < 3; c++ ) {
+        for( y = 0; y < job->height; y++ ) {
+            p = planes + (size_t)y * job->width * 4 + c;
+            for( x = 0; x < job->width; x++ ) {
+                row[x] = p[x * 4];
+            }
+            if( fwrite(row, 1, job->width, job->video) != (size_t)job->width ) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Background thread writing out queued jobs in order until capturing is shut
+ * down and the queue is empty.
+ */
+static int capture_run( void *data ) {
+    tw_capture_job_t *job;
+    Uint8 *row;
+    size_t row_size;
+    (void)data;
+    row = NULL;
+    row_size = 0;
+    trace_thread("capture");
+    for( ;; ) {
+        SDL_SemWait(job_ready);
+        if( job_tail == job_head ) {
+            if( !running ) {
+                break;
+            }
+            continue;
+        }
+        __sync_synchronize(); /* job filled in before it is read */
+        job = &job_list[job_tail & (TW_CAPTURE_BUFFERS - 1)];
+        if( job->kind != TW_JOB_END && row_size < (size_t)job->width * 3 ) {
+            free(row);
+            row_size = job->width * 3;
+            row = (Uint8*)malloc(row_size);
+            if( row == NULL ) {
+                row_size = 0;
+            }
+        }
+        if( job->kind == TW_JOB_SCREENSHOT ) {
+            trace_begin("write_png");
+            if( row == NULL || write_png(job, row) ) {
+                push_error("Failed to write screenshot!");
+            }
+            trace_end("write_png");
+            free(job->path);
+            job->path = NULL;
+        }
+        else if( job->kind == TW_JOB_FRAME ) {
+            trace_begin("write_frame");
+            if( row == NULL || write_frame(job, row) ) {
+                push_error("Failed to write video frame!");
+            }
+            trace_end("write_frame");
+        }
+        else if( fclose(job->video) ) {
+            push_error("Failed to finish video file!");
+        }
+        __sync_synchronize(); /* done with the job before releasing it */
+        job_tail++;
+    }
+    free(row);
+    return 0;
+}
+
+/*
+ * Returns a free job to fill in, or NULL if all of them are queued. Waits for a
+ * job to be freed instead if wait is set.
+ */
+static tw_capture_job_t * claim_job( int wait ) {
+    while( job_head - job_tail >= TW_CAPTURE_BUFFERS ) {
+        if( !wait ) {
+            return NULL;
+        }
+        SDL_Delay(TW_CAPTURE_WAIT);
+    }
+    __sync_synchronize(); /* the thread is done with the job */
+    return &job_list[job_head & (TW_CAPTURE_BUFFERS - 1)];
+}
+
+/*
+ * Queues the job claimed last.
+ */
+static void queue_job() {
+    __sync_synchronize(); /* job filled in before it is published */
+    job_head++;
+    SDL_SemPost(job_ready);
+}
+
+/*
+ * Copies the given surface into the given job. Returns -1 if no buffer could be
+ * allocated for it.
+ */
+static int copy_surface( tw_capture_job_t *job, SDL_Surface *surface ) {
+    size_t size;
+    int y;
+    size = (size_t)surface->w * surface->h * 4;
+    if( job->capacity < size ) {
+        free(job->pixels);
+        job->pixels = (Uint8*)malloc(size);
+        job->capacity = job->pixels != NULL ? size : 0;
+        if( job->pixels == NULL ) {
+            return -1;
+        }
+    }
+    if( SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) ) {
+        return -1;
+    }
+    for( y = 0; y < surface->h; y++ ) {
+        memcpy(job->pixels + (size_t)y * surface->w * 4,
+            (Uint8*)surface->pixels + y * surface->pitch, surface->w * 4);
+    }
+    if( SDL_MUSTLOCK(surface) ) {
+        SDL_UnlockSurface(surface);
+    }
+    job->width = surface->w;
+    job->height = surface->h;
+    job->r_shift = surface->format->Rshift;
+    job->g_shift = surface->format->Gshift;
+    job->b_shift = surface->format->Bshift;
+    return 0;
+}
+
+/*
+ * Captures the given frame, if a screenshot was requested or a video is being
+ * captured. The surface must be 32 bits per pixel.
+ */
+int capture_frame( SDL_Surface *surface ) {
+    tw_capture_job_t *job;
+    if( !initialized || capture_thread == NULL ) {
+        return 0;
+    }
+    if( screenshot_path != NULL ) {
+        job = claim_job(replay_fast());
+        if( job == NULL || copy_surface(job, surface) ) {
+            push_warning("Capture falling behind, screenshot dropped!");
+            free(screenshot_path);
+        }
+        else {
+            job->kind = TW_JOB_SCREENSHOT;
+            job->path = screenshot_path;
+            queue_job();
+        }
+        screenshot_path = NULL;
+    }
+    if( video_file != NULL && video_frames++ % video_every == 0 ) {
+        if( video_width == 0 ) { /* first frame, the video takes its size */
+            video_width = surface->w;
+            video_height = surface->h;
+            if( video_y4m ) {
+                fprintf(video_file, "YUV4MPEG2 W%d H%d F%u:%u Ip A1:1 C444\n",
+                    video_width, video_height, FPS, video_every);
+            }
+        }
+        if( surface->w != video_width || surface->h != video_height ) {
+            video_skipped++;
+            return 0;
+        }
+        job = claim_job(replay_fast());
+        if( job == NULL || copy_surface(job, surface) ) {
+            video_dropped++;
+            return 0;
+        }
+        job->kind = TW_JOB_FRAME;
+        job->video = video_file;
+        job->y4m = video_y4m;
+        queue_job();
+    }
+    return 0;
+}
+
+/*
+ * Takes a screenshot of the next frame shown and writes it to the given PNG
+ * file.
+ */
+static int take_screenshot( const char *file ) {
+    char *path;
+    if( !initialized || capture_thread == NULL ) {
+        push_error("take_screenshot failed: Capture not initialized!");
+        return -1;
+    }
+    path = (char*)malloc(strlen(file) + 1);
+    if( path == NULL ) {
+        push_error("take_screenshot failed: Out of memory!");
+        return -1;
+    }
+    strcpy(path, file);
+    free(screenshot_path);
+    screenshot_path = path;
+    return 0;
+}
+
+/*
+ * Finishes the video being captured, if any.
+ */
+static void stop_capture() {
+    tw_capture_job_t *job;
+    char message[128];
+    if( video_file == NULL ) {
+        return;
+    }
+    job = claim_job(1); /* the end of a video can not be dropped */
+    job->kind = TW_JOB_END;
+    job->video = video_file;
+    queue_job();
+    video_file = NULL;
+    if( video_dropped || video_skipped ) {
+        sprintf(message, "Capture dropped %lu frames, and skipped %lu after a resolution change.",
+            video_dropped, video_skipped);
+        push_warning(message);
+    }
+}
+
+/*
+ * Starts capturing every given number of frames to the given video file, at the
+ * size of the first frame captured. Any video already being captured is
+ * finished.
+ */
+static int start_capture( const char *file, unsigned int every ) {
+    size_t length;
+    if( !initialized || capture_thread == NULL ) {
+        push_error("start_capture failed: Capture not initialized!");
+        return -1;
+    }
+    stop_capture();
+    video_file = fopen(file, "wb");
+    if( video_file == NULL ) {
+        push_error("start_capture failed: Failed to open video file!");
+        return -1;
+    }
+    length = strlen(file);
+    video_y4m = length >= 4 && !strcmp(file + length - 4, ".y4m");
+    video_every = every > 0 ? every : 1;
+    video_width = 0;
+    video_height = 0;
+    video_frames = 0;
+    video_dropped = 0;
+    video_skipped = 0;
+    return 0;
+}
+
+/*
+ * Lua hook to the function
+ * take_screenshot( const char *file )
+ */
+int lua_screenshot( lua_State *L ) {
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while calling screenshot: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    if( take_screenshot(lua_tostring(L, 1)) ) {
+        push_error("Lua: Error while calling screenshot!");
+        lua_pushstring(L, "Error while taking screenshot.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to the function
+ * start_capture( const char *file, unsigned int every )
+ * capturing every frame unless told otherwise.
+ */
+int lua_startCapture( lua_State *L ) {
+    unsigned int every;
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while calling startCapture: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    every = lua_isnoneornil(L, 2) ? 1 : (unsigned int)lua_tonumber(L, 2);
+    if( start_capture(lua_tostring(L, 1), every) ) {
+        push_error("Lua: Error while calling startCapture!");
+        lua_pushstring(L, "Error while starting capture.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to finish the video being captured.
+ */
+int lua_stopCapture( lua_State *L ) {
+    stop_capture();
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Initializes capturing and starts the capture thread. If a video file is
+ * given, every frame is captured to it from the start.
+ */
+int capture_init( const char *file ) {
+    if( initialized ) {
+        push_warning("Capture already initialized!");
+        return 0;
+    }
+    if( add_lua_function("screenshot", lua_screenshot) ||
+        add_lua_function("startCapture", lua_startCapture) ||
+        add_lua_function("stopCapture", lua_stopCapture) ) {
+        push_error("Failed to add capture functions!");
+        return -1;
+    }
+    job_ready = SDL_CreateSemaphore(0);
+    if( job_ready == NULL ) {
+        push_error("capture_init failed: Failed to create semaphore!");
+        return -1;
+    }
+    running = 1;
+    capture_thread = SDL_CreateThread(capture_run, NULL);
+    if( capture_thread == NULL ) {
+        running = 0;
+        push_warning("Failed to start capture thread, capturing disabled!");
+    }
+    initialized = 1;
+    if( file != NULL && start_capture(file, 1) ) {
+        push_error("capture_init failed: Failed to start capture!");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Finishes the video being captured and waits for all queued frames to be
+ * written.
+ */
+void capture_shutdown() {
+    int i;
+    if( !initialized ) {
+        return;
+    }
+    if( capture_thread != NULL ) {
+        stop_capture();
+        free(screenshot_path);
+        screenshot_path = NULL;
+        running = 0;
+        SDL_SemPost(job_ready);
+        SDL_WaitThread(capture_thread, NULL);
+        capture_thread = NULL;
+    }
+    for( i = 0; i < TW_CAPTURE_BUFFERS; i++ ) {
+        free(job_list[i].pixels);
+        job_list[i].pixels = NULL;
+        job_list[i].capacity = 0;
+    }
+    SDL_DestroySemaphore(job_ready);
+    job_ready = NULL;
+    initialized = 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * tw_capture.h
+ */
+
+#ifndef TWCAPTURE
+#define TWCAPTURE
+
+#include "SDL.h"
+
+/*
+ * Captures the given frame, if a screenshot was requested or a video is being
+ * captured. The surface must be 32 bits per pixel.
+ */
+int capture_frame( SDL_Surface *surface );
+
+/*
+ * Initializes capturing. If a video file is given, every frame is captured to
+ * it from the start.
+ */
+int capture_init( const char *file );
+
+/*
+ * Finishes the video being captured and waits for all queued frames to be
+ * written.
+ */
+void capture_shutdown();
+
+#endif
@@ -0,0 +1,644 @@
+/*
+ * tw_entity.c
+ *
+ * This file contains the source code pertaining to the entity store of the
+ * ToyWrench application. Games with many simple objects can create them as
+ * entities instead of Lua tables. An entity is an id with any of a fixed set
+ * of components attached: a position (transform), a velocity, a sprite, an
+ * animation and a lifetime. The engine moves all entities by their velocity,
+ * advances their animations and removes those whose lifetime ran out once per
+ * frame, and drawEntities() draws all entities with a sprite or animation, so
+ * the per-object work of a frame happens in C loops instead of in Lua.
+ * Entities are drawn on layer 0 unless moved to another layer, see tw_scene.c.
+ *
+ * Components are stored as a structure of arrays, one array per field, packed
+ * so that the live entities occupy the first entity_count slots. Destroying an
+ * entity moves the last entity into its slot. Every entity has all fields, and
+ * the fields of components it does not have are kept neutral (e.g. a velocity
+ * of 0), so the systems can run over all slots without checking components.
+ *
+ * Entity ids combine the index of the entity with a generation number that is
+ * bumped whenever the index is reused, so a stale id of a destroyed entity
+ * never refers to a newer entity.
+ *
+ * Each Lua state set up with entity_open() has its own store, so batch
+ * instances keep their entities apart.
+ */
+
+#include <stdlib.h>
+#include "tw_alloc.h"
+#include "tw_animation.h"
+#include "tw_entity.h"
+#include "tw_error.h"
+#include "tw_graphics.h"
+#include "tw_lua.h"
+#include "tw_scene.h"
+
+#define TW_ENTITY_STORE "tw_entity_store"
+#define TW_MAX_ENTITIES 65536 /* ids have 16 bits of index */
+#define TW_MAX_FRAME_TIME 0.25f
+
+#define TW_COMPONENT_TRANSFORM 1
+#define TW_COMPONENT_VELOCITY 2
+#define TW_COMPONENT_SPRITE 4
+#define TW_COMPONENT_LIFETIME 8
+#define TW_COMPONENT_ANIMATION 16
+
+typedef struct {
+    float *x;
+    float *y;
+    float *vx;
+    float *vy;
+    float *life;
+    int *sprite;
+    int *clip;
+    float *clip_time;
+    float *clip_speed;
+    int *layer;
+    unsigned int *components;
+    unsigned int *index; /* index of the entity in each slot */
+    unsigned int entity_count;
+    unsigned int *slot_of;
+    unsigned short *generation;
+    unsigned int *free_indices;
+    unsigned int free_indices_size;
+    unsigned int last_ticks;
+    int stepped;
+} tw_entity_store_t;
+
+static int initialized = 0;
+
+/*
+ * Returns the entity store of the given Lua state.
+ */
+static tw_entity_store_t * get_store( lua_State *L ) {
+    return (tw_entity_store_t*)lua_context(L, TW_ENTITY_STORE);
+}
+
+/*
+ * Frees the arrays of an entity store when its Lua state is closed.
+ */
+static void release_store( void *context ) {
+    tw_entity_store_t *store;
+    store = (tw_entity_store_t*)context;
+    free(store->x);
+    free(store->y);
+    free(store->vx);
+    free(store->vy);
+    free(store->life);
+    free(store->sprite);
+    free(store->clip);
+    free(store->clip_time);
+    free(store->clip_speed);
+    free(store->layer);
+    free(store->components);
+    free(store->index);
+    free(store->slot_of);
+    free(store->generation);
+    free(store->free_indices);
+}
+
+/*
+ * Returns the id of the entity with the given index.
+ */
+static unsigned int entity_id( tw_entity_store_t *store, unsigned int index ) {
+    return ((unsigned int)store->generation[index] << 16) | index;
+}
+
+/*
+ * Returns the slot of the entity with the given id, or -1 if the id does not
+ * refer to a live entity.
+ */
+static int entity_slot( tw_entity_store_t *store, lua_Number id_number ) {
+    unsigned int id, index;
+    if( !(id_number >= 0 && id_number < 4294967296.0) ) { /* also rejects NaN */
+        return -1;
+    }
+    id = (unsigned int)id_number;
+    index = id & 0xffff;
+    if( store->slot_of[index] >= store->entity_count ||
+        store->index[store->slot_of[index]] != index || store->generation[index] != id >> 16 ) {
+        return -1;
+    }
+    return store->slot_of[index];
+}
+
+/*
+ * Creates an entity at the given position, returning its slot or -1 if there is
+ * no room left.
+ */
+static int create_entity( tw_entity_store_t *store, float x, float y ) {
+    unsigned int index, slot;
+    if( store->free_indices_size == 0 ) {
+        push_error("create_entity failed: Too many entities!");
+        return -1;
+    }
+    index = store->free_indices[--store->free_indices_size];
+    slot = store->entity_count++;
+    store->slot_of[index] = slot;
+    store->index[slot] = index;
+    store->x[slot] = x;
+    store->y[slot] = y;
+    store->vx[slot] = 0;
+    store->vy[slot] = 0;
+    store->life[slot] = 0;
+    store->sprite[slot] = -1;
+    store->clip[slot] = -1;
+    store->clip_time[slot] = 0;
+    store->clip_speed[slot] = 0;
+    store->layer[slot] = 0;
+    store->components[slot] = TW_COMPONENT_TRANSFORM;
+    return slot;
+}
+
+/*
+ * Destroys the entity in the given slot, moving the last entity into the slot.
+ */
+static void destroy_entity( tw_entity_store_t *store, unsigned int slot ) {
+    unsigned int index, last;
+    index = store->index[slot];
+    store->generation[index]++;
+    store->free_indices[store->free_indices_size++] = index;
+    last = --store->entity_count;
+    if( slot != last ) {
+        store->x[slot] = store->x[last];
+        store->y[slot] = store->y[last];
+        store->vx[slot] = store->vx[last];
+        store->vy[slot] = store->vy[last];
+        store->life[slot] = store->life[last];
+        store->sprite[slot] = store->sprite[last];
+        store->clip[slot] = store->clip[last];
+        store->clip_time[slot] = store->clip_time[last];
+        store->clip_speed[slot] = store->clip_speed[last];
+        store->layer[slot] = store->layer[last];
+        store->components[slot] = store->components[last];
+        store->index[slot] = store->index[last];
+        store->slot_of[store->index[slot]] = slot;
+    }
+}
+
+/*
+ * Returns a pointer to the given field (TW_ENTITY_X etc.) of the entity with
+ * the given id in the given Lua state, or NULL if the id does not refer to a
+ * live entity. The pointer is only valid until the next entity is destroyed.
+ */
+float * entity_field( lua_State *L, double id, int field ) {
+    tw_entity_store_t *store;
+    int slot;
+    store = get_store(L);
+    slot = store == NULL ? -1 : entity_slot(store, id);
+    if( slot < 0 ) {
+        return NULL;
+    }
+    switch( field ) {
+        case TW_ENTITY_X:
+            return &store->x[slot];
+        case TW_ENTITY_Y:
+            return &store->y[slot];
+        case TW_ENTITY_VX:
+            return &store->vx[slot];
+        case TW_ENTITY_VY:
+            return &store->vy[slot];
+        case TW_ENTITY_ANIMATION_SPEED:
+            return &store->clip_speed[slot];
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * Runs the built-in entity systems of the given Lua state for the frame
+ * starting at the given tick count: moves entities by their velocity, advances
+ * their animations and expires entities whose lifetime ran out.
+ */
+int entity_step( lua_State *L, unsigned int ticks ) {
+    tw_entity_store_t *store;
+    float dt;
+    unsigned int i;
+    store = get_store(L);
+    if( store == NULL ) {
+        push_error("entity_step failed: Entity store not initialized!");
+        return -1;
+    }
+    dt = store->stepped ? (ticks - store->last_ticks) / 1000.0f : 0;
+    if( dt > TW_MAX_FRAME_TIME ) { /* don't tunnel through walls after a hitch */
+        dt = TW_MAX_FRAME_TIME;
+    }
+    store->last_ticks = ticks;
+    store->stepped = 1;
+    for( i = 0; i < store->entity_count; i++ ) {
+        store->x[i] += store->vx[i] * dt;
+        store->y[i] += store->vy[i] * dt;
+        store->clip_time[i] += store->clip_speed[i] * dt;
+    }
+    /* walk backwards so that destroying only moves already visited entities */
+    for( i = store->entity_count; i-- > 0; ) {
+        if( store->components[i] & TW_COMPONENT_LIFETIME ) {
+            store->life[i] -= dt;
+            if( store->life[i] <= 0 ) {
+                destroy_entity(store, i);
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Draws the entity in the given slot. Animations take precedence over sprites.
+ */
+static int draw_entity( tw_entity_store_t *store, unsigned int slot ) {
+    SDL_Rect src;
+    int texture, x, y;
+    scene_to_screen(store->layer[slot], store->x[slot], store->y[slot], &x, &y);
+    if( store->clip[slot] >= 0 ) {
+        if( animation_frame(store->clip[slot], store->clip_time[slot], &texture, &src) < 0 ) {
+            return -1;
+        }
+        return draw_sprite_region(texture, &src, x, y);
+    }
+    if( store->sprite[slot] >= 0 ) {
+        return draw_sprite(store->sprite[slot], x, y);
+    }
+    return 0;
+}
+
+/*
+ * Draws every entity with a sprite or animation, layer by layer from back to
+ * front. The entities are bucketed by layer first, so every layer only visits
+ * its own entities.
+ */
+static int draw_entities( tw_entity_store_t *store ) {
+    unsigned int *sorted, start[TW_MAX_LAYERS + 1], i, j;
+    int order[TW_MAX_LAYERS], layers, l, status;
+    if( store->entity_count == 0 ) {
+        return 0;
+    }
+    sorted = (unsigned int*)frame_alloc(sizeof(unsigned int) * store->entity_count);
+    if( sorted == NULL ) {
+        push_error("draw_entities failed: Out of memory!");
+        return -1;
+    }
+    /* counting sort by layer, keeping the order within a layer */
+    for( l = 0; l <= TW_MAX_LAYERS; l++ ) {
+        start[l] = 0;
+    }
+    for( i = 0; i < store->entity_count; i++ ) {
+        start[store->layer[i] + 1]++;
+    }
+    for( l = 0; l < TW_MAX_LAYERS; l++ ) {
+        start[l + 1] += start[l];
+    }
+    for( i = 0; i < store->entity_count; i++ ) {
+        sorted[start[store->layer[i]]++] = i;
+    }
+    /* start[l] is now where layer l + 1 begins */
+    status = 0;
+    layers = scene_layer_order(order);
+    for( l = 0; l < layers; l++ ) {
+        for( j = order[l] ? start[order[l] - 1] : 0; j < start[order[l]]; j++ ) {
+            if( draw_entity(store, sorted[j]) ) {
+                status = -1;
+            }
+        }
+    }
+    return status;
+}
+
+/*
+ * Reads the entity id argument at index 1, raising a Lua error if it does not
+ * refer to a live entity.
+ */
+static int check_entity( lua_State *L, tw_entity_store_t *store, const char *fn_name ) {
+    int slot;
+    if( lua_gettop(L) == 0 ) {
+        push_error(fn_name);
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    slot = entity_slot(store, lua_tonumber(L, 1));
+    if( slot < 0 ) {
+        push_error(fn_name);
+        lua_pushstring(L, "Invalid entity.");
+        lua_error(L);
+        return -1;
+    }
+    return slot;
+}
+
+/*
+ * Lua hook to the function
+ * create_entity( float x, float y )
+ * returning the id of the new entity.
+ */
+int lua_createEntity( lua_State *L ) {
+    tw_entity_store_t *store;
+    int slot;
+    store = get_store(L);
+    slot = create_entity(store, lua_tonumber(L, 1), lua_tonumber(L, 2));
+    if( slot < 0 ) {
+        push_error("Lua: Error while calling createEntity!");
+        lua_pushstring(L, "Error while creating entity.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, entity_id(store, store->index[slot]));
+    return 1;
+}
+
+/*
+ * Lua hook to the function
+ * destroy_entity( unsigned int slot )
+ * taking an entity id.
+ */
+int lua_destroyEntity( lua_State *L ) {
+    tw_entity_store_t *store;
+    store = get_store(L);
+    destroy_entity(store, check_entity(L, store,
+        "Lua: Error while calling destroyEntity: Invalid entity!"));
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook returning whether the given entity id refers to a live entity.
+ */
+int lua_isEntity( lua_State *L ) {
+    tw_entity_store_t *store;
+    int alive;
+    store = get_store(L);
+    alive = entity_slot(store, lua_tonumber(L, 1)) >= 0;
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushboolean(L, alive);
+    return 1;
+}
+
+/*
+ * Lua hook to set the position of the given entity.
+ */
+int lua_setPosition( lua_State *L ) {
+    tw_entity_store_t *store;
+    int slot;
+    store = get_store(L);
+    slot = check_entity(L, store, "Lua: Error while calling setPosition: Invalid entity!");
+    store->x[slot] = lua_tonumber(L, 2);
+    store->y[slot] = lua_tonumber(L, 3);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook returning the position of the given entity.
+ */
+int lua_getPosition( lua_State *L ) {
+    tw_entity_store_t *store;
+    int slot;
+    store = get_store(L);
+    slot = check_entity(L, store, "Lua: Error while calling getPosition: Invalid entity!");
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, store->x[slot]);
+    lua_pushnumber(L, store->y[slot]);
+    return 2;
+}
+
+/*
+ * Lua hook to set the velocity of the given entity in pixels per second. A
+ * velocity of nil removes the velocity component.
+ */
+int lua_setVelocity( lua_State *L ) {
+    tw_entity_store_t *store;
+    int slot;
+    store = get_store(L);
+    slot = check_entity(L, store, "Lua: Error while calling setVelocity: Invalid entity!");
+    if( lua_isnoneornil(L, 2) ) {
+        store->vx[slot] = 0;
+        store->vy[slot] = 0;
+        store->components[slot] &= ~TW_COMPONENT_VELOCITY;
+    }
+    else {
+        store->vx[slot] = lua_tonumber(L, 2);
+        store->vy[slot] = lua_tonumber(L, 3);
+        store->components[slot] |= TW_COMPONENT_VELOCITY;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook returning the velocity of the given entity.
+ */
+int lua_getVelocity( lua_State *L ) {
+    tw_entity_store_t *store;
+    int slot;
+    store = get_store(L);
+    slot = check_entity(L, store, "Lua: Error while calling getVelocity: Invalid entity!");
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, store->vx[slot]);
+    lua_pushnumber(L, store->vy[slot]);
+    return 2;
+}
+
+/*
+ * Lua hook to set the texture drawn for the given entity. A texture of nil
+ * removes the sprite component.
+ */
+int lua_setSprite( lua_State *L ) {
+    tw_entity_store_t *store;
+    int slot;
+    store = get_store(L);
+    slot = check_entity(L, store, "Lua: Error while calling setSprite: Invalid entity!");
+    if( lua_isnoneornil(L, 2) ) {
+        store->sprite[slot] = -1;
+        store->components[slot] &= ~TW_COMPONENT_SPRITE;
+    }
+    else {
+        store->sprite[slot] = (int)lua_tonumber(L, 2);
+        store->components[slot] |= TW_COMPONENT_SPRITE;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to play the given clip on the given entity from the start, at the
+ * given speed (1 by default). A clip of nil removes the animation component.
+ */
+int lua_setAnimation( lua_State *L ) {
+    tw_entity_store_t *store;
+    int slot;
+    store = get_store(L);
+    slot = check_entity(L, store, "Lua: Error while calling setAnimation: Invalid entity!");
+    store->clip_time[slot] = 0;
+    if( lua_isnoneornil(L, 2) ) {
+        store->clip[slot] = -1;
+        store->clip_speed[slot] = 0;
+        store->components[slot] &= ~TW_COMPONENT_ANIMATION;
+    }
+    else {
+        store->clip[slot] = (int)lua_tonumber(L, 2);
+        store->clip_speed[slot] = lua_isnoneornil(L, 3) ? 1 : lua_tonumber(L, 3);
+        store->components[slot] |= TW_COMPONENT_ANIMATION;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook returning whether the animation of the given entity has ended. Only
+ * clips that play once ever end.
+ */
+int lua_animationEnded( lua_State *L ) {
+    tw_entity_store_t *store;
+    SDL_Rect src;
+    int slot, texture, ended;
+    store = get_store(L);
+    slot = check_entity(L, store, "Lua: Error while calling animationEnded: Invalid entity!");
+    ended = store->clip[slot] >= 0 &&
+        animation_frame(store->clip[slot], store->clip_time[slot], &texture, &src) == 1;
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushboolean(L, ended);
+    return 1;
+}
+
+/*
+ * Lua hook to move the given entity to the given layer.
+ */
+int lua_setEntityLayer( lua_State *L ) {
+    tw_entity_store_t *store;
+    int slot, layer;
+    store = get_store(L);
+    slot = check_entity(L, store, "Lua: Error while calling setEntityLayer: Invalid entity!");
+    layer = (int)lua_tonumber(L, 2);
+    if( (unsigned int)layer >= TW_MAX_LAYERS ) {
+        push_error("Lua: Error while calling setEntityLayer: Invalid layer!");
+        lua_pushstring(L, "Invalid layer.");
+        lua_error(L);
+        return -1;
+    }
+    store->layer[slot] = layer;
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to set the number of seconds after which the given entity is
+ * destroyed. A lifetime of nil removes the lifetime component.
+ */
+int lua_setLifetime( lua_State *L ) {
+    tw_entity_store_t *store;
+    int slot;
+    store = get_store(L);
+    slot = check_entity(L, store, "Lua: Error while calling setLifetime: Invalid entity!");
+    if( lua_isnoneornil(L, 2) ) {
+        store->life[slot] = 0;
+        store->components[slot] &= ~TW_COMPONENT_LIFETIME;
+    }
+    else {
+        store->life[slot] = lua_tonumber(L, 2);
+        store->components[slot] |= TW_COMPONENT_LIFETIME;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to draw all entities with a sprite. Meant to be called from
+ * tw_display.
+ */
+int lua_drawEntities( lua_State *L ) {
+    tw_entity_store_t *store;
+    store = get_store(L);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    if( draw_entities(store) ) {
+        push_error("Lua: Error while calling drawEntities!");
+        lua_pushstring(L, "Error while drawing entities.");
+        lua_error(L);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Lua hook returning the number of live entities.
+ */
+int lua_entityCount( lua_State *L ) {
+    tw_entity_store_t *store;
+    store = get_store(L);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, store->entity_count);
+    return 1;
+}
+
+/*
+ * Sets up an entity store in the given Lua state and registers the entity
+ * functions in it.
+ */
+int entity_open( lua_State *L ) {
+    tw_entity_store_t *store;
+    unsigned int i;
+    store = (tw_entity_store_t*)new_lua_context(L, TW_ENTITY_STORE, sizeof(tw_entity_store_t),
+        release_store);
+    store->x = (float*)malloc(sizeof(float) * TW_MAX_ENTITIES);
+    store->y = (float*)malloc(sizeof(float) * TW_MAX_ENTITIES);
+    store->vx = (float*)malloc(sizeof(float) * TW_MAX_ENTITIES);
+    store->vy = (float*)malloc(sizeof(float) * TW_MAX_ENTITIES);
+    store->life = (float*)malloc(sizeof(float) * TW_MAX_ENTITIES);
+    store->sprite = (int*)malloc(sizeof(int) * TW_MAX_ENTITIES);
+    store->clip = (int*)malloc(sizeof(int) * TW_MAX_ENTITIES);
+    store->clip_time = (float*)malloc(sizeof(float) * TW_MAX_ENTITIES);
+    store->clip_speed = (float*)malloc(sizeof(float) * TW_MAX_ENTITIES);
+    store->layer = (int*)malloc(sizeof(int) * TW_MAX_ENTITIES);
+    store->components = (unsigned int*)malloc(sizeof(unsigned int) * TW_MAX_ENTITIES);
+    store->index = (unsigned int*)malloc(sizeof(unsigned int) * TW_MAX_ENTITIES);
+    store->slot_of = (unsigned int*)malloc(sizeof(unsigned int) * TW_MAX_ENTITIES);
+    store->generation = (unsigned short*)calloc(TW_MAX_ENTITIES, sizeof(unsigned short));
+    store->free_indices = (unsigned int*)malloc(sizeof(unsigned int) * TW_MAX_ENTITIES);
+    if( store->x == NULL || store->y == NULL || store->vx == NULL || store->vy == NULL ||
+        store->life == NULL || store->sprite == NULL || store->clip == NULL ||
+        store->clip_time == NULL || store->clip_speed == NULL || store->layer == NULL ||
+        store->components == NULL || store->index == NULL || store->slot_of == NULL ||
+        store->generation == NULL || store->free_indices == NULL ) {
+        push_error("entity_open failed: Out of memory!");
+        return -1;
+    }
+    /* hand out low indices first */
+    for( i = 0; i < TW_MAX_ENTITIES; i++ ) {
+        store->free_indices[i] = TW_MAX_ENTITIES - 1 - i;
+        store->slot_of[i] = TW_MAX_ENTITIES;
+    }
+    store->free_indices_size = TW_MAX_ENTITIES;
+    if( add_lua_function_in(L, "createEntity", lua_createEntity) ||
+        add_lua_function_in(L, "destroyEntity", lua_destroyEntity) ||
+        add_lua_function_in(L, "isEntity", lua_isEntity) ||
+        add_lua_function_in(L, "setPosition", lua_setPosition) ||
+        add_lua_function_in(L, "getPosition", lua_getPosition) ||
+        add_lua_function_in(L, "setVelocity", lua_setVelocity) ||
+        add_lua_function_in(L, "getVelocity", lua_getVelocity) ||
+        add_lua_function_in(L, "setSprite", lua_setSprite) ||
+        add_lua_function_in(L, "setAnimation", lua_setAnimation) ||
+        add_lua_function_in(L, "animationEnded", lua_animationEnded) ||
+        add_lua_function_in(L, "setEntityLayer", lua_setEntityLayer) ||
+        add_lua_function_in(L, "setLifetime", lua_setLifetime) ||
+        add_lua_function_in(L, "drawEntities", lua_drawEntities) ||
+        add_lua_function_in(L, "entityCount", lua_entityCount) ) {
+        push_error("Failed to add entity functions!");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Initializes the entity store of the main Lua state.
+ */
+int entity_init() {
+    if( initialized ) {
+        push_warning("Entity store already initialized!");
+        return 0;
+    }
+    if( entity_open(lua_main_state()) ) {
+        return -1;
+    }
+    initialized = 1;
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * tw_entity.h
+ */
+
+#ifndef TWENTITY
+#define TWENTITY
+
+#include "tw_lua.h"
+
+#define TW_ENTITY_X 0
+#define TW_ENTITY_Y 1
+#define TW_ENTITY_VX 2
+#define TW_ENTITY_VY 3
+#define TW_ENTITY_ANIMATION_SPEED 4
+
+/*
+ * Returns a pointer to the given field (TW_ENTITY_X etc.) of the entity with
+ * the given id in the given Lua state, or NULL if the id does not refer to a
+ * live entity. The pointer is only valid until the next entity is destroyed.
+ */
+float * entity_field( lua_State *L, double id, int field );
+
+/*
+ * Runs the built-in entity systems of the given Lua state for the frame
+ * starting at the given tick count: moves entities by their velocity and
+ * expires entities whose lifetime ran out.
+ */
+int entity_step( lua_State *L, unsigned int ticks );
+
+/*
+ * Sets up an entity store in the given Lua state and registers the entity
+ * functions in it.
+ */
+int entity_open( lua_State *L );
+
+int entity_init();
+
+#endif
@@ -7,88 +7,305 @@
  * found in this file to alert the engine that an error has occurred. It is
  * strongly encouraged that every function have the return type "int", and
  * return 0 if no errors have occurred and some other value if errors did occur.
+ *
+ * Errors and warnings are recorded in a log, which is a preallocated ring
+ * buffer of fixed size messages. Any thread may add messages to the log without
+ * taking a lock or allocating memory. A background thread periodically writes
+ * the messages out to stderr or to a log file, and dump_stack_trace() writes
+ * out whatever is still pending right away.
+ *
+ * Every message is stamped with the time and frame number it was logged at. A
+ * message that is logged more than TW_LOG_BURST times within a second is
+ * suppressed for the rest of that second, and the number of suppressed copies
+ * is reported with its next occurrence. This keeps a script that errors every
+ * frame from flooding the log. If the ring buffer fills up faster than it is
+ * written out, new messages are dropped and counted instead. Errors are never
+ * dropped, logging one into a full buffer writes the buffer out on the spot.
  */
 
-#include "tw_error.h"
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "SDL.h"
+#include "tw_error.h"
+
+#define TW_LOG_ENTRIES 256 /* must be a power of two */
+#define TW_LOG_MESSAGE_SIZE 240
+#define TW_LOG_RECENT 32
+#define TW_LOG_BURST 3
+#define TW_LOG_FLUSH_INTERVAL 50
+
+typedef struct {
+    volatile unsigned long seq;
+    int level;
+    unsigned int repeats;
+    unsigned long frame;
+    unsigned long time_ms;
+    char value[TW_LOG_MESSAGE_SIZE];
+} tw_log_entry_t;
+
+typedef struct {
+    volatile unsigned int hash;
+    volatile unsigned long window;
+    volatile unsigned int count;
+    volatile unsigned int suppressed;
+} tw_log_recent_t;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
 
-static tw_error_t *error_stack = NULL;
-static tw_error_t *last_error = NULL;
+static tw_log_entry_t ring[TW_LOG_ENTRIES];
+static tw_log_recent_t recent[TW_LOG_RECENT];
+static volatile unsigned long ring_head = 0;
+static unsigned long ring_tail = 0;
+static volatile unsigned int dropped = 0;
+static volatile unsigned long current_frame = 0;
+static struct timespec start_time;
+static FILE *log_file = NULL;
+static SDL_mutex *flush_lock = NULL;
+static SDL_Thread *flush_thread = NULL;
+static volatile int running = 0;
+static int initialized = 0;
 
 /*
- * Returns the length of the given string.
+ * Prepares the ring buffer slots. Safe to call more than once before anything
+ * has been logged.
  */
-static int tw_strlen( const char *s ) {
-    int l;
-    l = 0;
-    if( s == NULL ) {
-        return 0;
+static void ring_init() {
+    static int ring_ready = 0;
+    unsigned long i;
+    if( !ring_ready ) {
+        for( i = 0; i < TW_LOG_ENTRIES; i++ ) {
+            ring[i].seq = i;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        ring_ready = 1;
     }
-    while( s[l++] );
-    return l;
 }
 
 /*
- * Returns a string that is a copy of the given string.
+ * Returns the number of milliseconds since logging started.
  */
-static char * tw_strcpy( const char *s ) {
-    int i;
-    int len;
-    char *cpy;
-    len = tw_strlen(s);
-    cpy = (char*)malloc(sizeof(char) * len);
-    for( i = 0; i < len; i++ ) {
-        cpy[i] = s[i];
-    }
-    return cpy;
+static unsigned long log_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_time.tv_sec) * 1000 +
+        (now.tv_nsec - start_time.tv_nsec) / 1000000;
 }
 
 /*
- * Prints the given warning messge to stderr.
+ * Returns the FNV-1a hash of the given string.
  */
-void push_warning( const char *s ) {
-    fprintf(stderr, "WARNING: ");
-    fprintf(stderr, "%s", s);
-    fprintf(stderr, "\n");
+static unsigned int log_hash( const char *s ) {
+    unsigned int h;
+    h = 2166136261u;
+    while( *s ) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
 }
 
 /*
- * Pushes the given error string onto the error stack.
+ * Returns whether the given message should be suppressed because it was
+ * logged too often recently. Otherwise stores the number of copies suppressed
+ * since it was last let through in repeats.
  */
-void push_error( const char *s ) {
-    tw_error_t *error;
-    char *cpy;
+static int rate_limited( unsigned int hash, unsigned long time_ms, unsigned int *repeats ) {
+    tw_log_recent_t *r;
+    unsigned long window;
+    r = &recent[hash % TW_LOG_RECENT];
+    window = time_ms / 1000;
+    *repeats = 0;
+    if( r->hash != hash || r->window != window ) {
+        if( r->hash == hash ) {
+            *repeats = __sync_lock_test_and_set(&r->suppressed, 0);
+        }
+        else {
+            r->suppressed = 0;
+        }
+        r->hash = hash;
+        r->window = window;
+        r->count = 0;
+    }
+    if( __sync_add_and_fetch(&r->count, 1) > TW_LOG_BURST ) {
+        __sync_fetch_and_add(&r->suppressed, 1);
+        return 1;
+    }
+    return 0;
+}
+
+static void log_flush();
+
+/*
+ * Records the given message with the given severity level in the log.
+ */
+void log_message( int level, const char *s ) {
+    tw_log_entry_t *entry;
+    unsigned long pos, time_ms;
+    unsigned int repeats;
+    int flushed;
+    long diff;
     if( s == NULL ) {
         return;
     }
-    cpy = tw_strcpy(s);
-    error = (tw_error_t*)malloc(sizeof(tw_error_t));
-    error->value = cpy;
-    error->next = NULL;
-    if( error_stack == NULL ) {
-        error_stack = error;
-        last_error = error;
+    ring_init();
+    time_ms = log_time();
+    if( rate_limited(log_hash(s), time_ms, &repeats) ) {
+        return;
+    }
+    flushed = 0;
+    for( ;; ) {
+        pos = ring_head;
+        entry = &ring[pos & (TW_LOG_ENTRIES - 1)];
+        diff = (long)(entry->seq - pos);
+        if( diff == 0 ) {
+            if( __sync_bool_compare_and_swap(&ring_head, pos, pos + 1) ) {
+                break;
+            }
+        }
+        else if( diff < 0 ) { /* full */
+            if( level < TW_LOG_ERROR || flushed ) {
+                __sync_fetch_and_add(&dropped, 1);
+                return;
+            }
+            log_flush(); /* errors are too important to drop */
+            flushed = 1;
+        }
+    }
+    entry->level = level;
+    entry->repeats = repeats;
+    entry->frame = current_frame;
+    entry->time_ms = time_ms;
+    strncpy(entry->value, s, TW_LOG_MESSAGE_SIZE - 1);
+    entry->value[TW_LOG_MESSAGE_SIZE - 1] = '\0';
+    __sync_synchronize();
+    entry->seq = pos + 1; /* publish */
+}
+
+/*
+ * Sets the frame number recorded with subsequent log messages.
+ */
+void log_set_frame( unsigned long frame ) {
+    current_frame = frame;
+}
+
+/*
+ * Writes all published messages out. Only one thread may flush at a time.
+ */
+static void log_flush() {
+    tw_log_entry_t *entry;
+    FILE *out;
+    unsigned int lost;
+    if( flush_lock != NULL ) {
+        SDL_mutexP(flush_lock);
+    }
+    ring_init();
+    out = log_file != NULL ? log_file : stderr;
+    for( ;; ) {
+        entry = &ring[ring_tail & (TW_LOG_ENTRIES - 1)];
+        if( entry->seq != ring_tail + 1 ) {
+            break;
+        }
+        __sync_synchronize();
+        fprintf(out, "[%lu.%03lu f%lu] %s: %s", entry->time_ms / 1000,
+            entry->time_ms % 1000, entry->frame, level_names[entry->level & 3],
+            entry->value);
+        if( entry->repeats ) {
+            fprintf(out, " (suppressed %u repeats)", entry->repeats);
+        }
+        fputc('\n', out);
+        __sync_synchronize();
+        entry->seq = ring_tail + TW_LOG_ENTRIES; /* release the slot */
+        ring_tail++;
+    }
+    lost = __sync_lock_test_and_set(&dropped, 0);
+    if( lost ) {
+        fprintf(out, "WARNING: %u log messages dropped!\n", lost);
     }
-    else {
-        last_error->next = (void*)error;
-        last_error = error;
+    fflush(out);
+    if( flush_lock != NULL ) {
+        SDL_mutexV(flush_lock);
     }
 }
 
+/*
+ * Records the given warning message in the log.
+ */
+void push_warning( const char *s ) {
+    log_message(TW_LOG_WARNING, s);
+}
+
+/*
+ * Pushes the given error string onto the error stack.
+ */
+void push_error( const char *s ) {
+    log_message(TW_LOG_ERROR, s);
+}
+
 /*
  * Clears the error stack, printing out all of the errors in the order that they
  * were pushed onto the stack.
  */
 void dump_stack_trace() {
-    tw_error_t *e;
-    while( error_stack != NULL ) {
-        fprintf(stderr, "ERROR: ");
-        fprintf(stderr, "%s", error_stack->value);
-        fprintf(stderr, "\n");
-        free(error_stack->value);
-        e = error_stack;
-        error_stack = (tw_error_t*)(error_stack->next);
-        free(e);
+    log_flush();
+}
+
+/*
+ * Background thread writing the log out every TW_LOG_FLUSH_INTERVAL ms.
+ */
+static int log_thread( void *data ) {
+    (void)data;
+    while( running ) {
+        SDL_Delay(TW_LOG_FLUSH_INTERVAL);
+        log_flush();
+    }
+    return 0;
+}
+
+/*
+ * Initializes the logging subsystem, writing to the given file, or to stderr
+ * if the file is NULL. Messages logged before this are kept and written out
+ * once the flush thread starts.
+ */
+int log_init( const char *file ) {
+    if( initialized ) {
+        push_warning("Logging already initialized!");
+        return 0;
+    }
+    ring_init();
+    if( file != NULL ) {
+        log_file = fopen(file, "a");
+        if( log_file == NULL ) {
+            push_warning("Failed to open log file, logging to stderr!");
+        }
+    }
+    flush_lock = SDL_CreateMutex();
+    if( flush_lock == NULL ) {
+        push_error("Failed to create log mutex!");
+        return -1;
+    }
+    running = 1;
+    flush_thread = SDL_CreateThread(log_thread, NULL);
+    if( flush_thread == NULL ) {
+        running = 0;
+        push_warning("Failed to start log thread, log is only written on errors!");
+    }
+    initialized = 1;
+    return 0;
+}
+
+/*
+ * Stops the log flushing thread, writing out any remaining messages.
+ */
+void log_shutdown() {
+    if( flush_thread != NULL ) {
+        running = 0;
+        SDL_WaitThread(flush_thread, NULL);
+        flush_thread = NULL;
+    }
+    log_flush();
+    if( log_file != NULL ) {
+        fclose(log_file);
+        log_file = NULL;
     }
 }
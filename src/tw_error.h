@@ -5,10 +5,20 @@
 #ifndef TWERROR
 #define TWERROR
 
-typedef struct {
-    char *value;
-    void *next;
-} tw_error_t;
+#define TW_LOG_DEBUG 0
+#define TW_LOG_INFO 1
+#define TW_LOG_WARNING 2
+#define TW_LOG_ERROR 3
+
+/*
+ * Records the given message with the given severity level in the log.
+ */
+void log_message( int level, const char *s );
+
+/*
+ * Sets the frame number recorded with subsequent log messages.
+ */
+void log_set_frame( unsigned long frame );
 
 void push_warning( const char *s );
 
@@ -23,4 +33,15 @@ void push_error( const char *s );
  */
 void dump_stack_trace();
 
+/*
+ * Initializes the logging subsystem, writing to the given file, or to stderr
+ * if the file is NULL.
+ */
+int log_init( const char *file );
+
+/*
+ * Stops the log flushing thread, writing out any remaining messages.
+ */
+void log_shutdown();
+
 #endif
@@ -4,61 +4,149 @@
  * This file contains the source code pertaining to the graphics handling
  * functions used in the ToyWrench application. The main purpose of this file is
  * to draw and update the display.
+ *
+ * Games draw onto a logical screen whose resolution is set at runtime with
+ * setResolution(). The window (or fullscreen mode) is an integer multiple of
+ * the logical resolution, and the logical screen is scaled up to it with
+ * nearest neighbour scaling once per frame, so a game can draw at a low
+ * resolution and only pay for the pixels it actually draws. At a scale of 1 the
+ * game draws directly onto the window.
+ *
+ * Instead of the screen, drawing can be directed at a canvas with setTarget().
+ * Canvases are offscreen surfaces that can be drawn like any other texture, so
+ * content that rarely changes can be drawn onto a canvas once and then drawn
+ * with a single blit every frame. Opaque canvases are cleared to black, while
+ * transparent canvases are color keyed, and are cleared to the key color.
+ * Since SDL blits do not blend alpha into a destination's alpha channel, the
+ * semi-transparent edges of sprites drawn onto a transparent canvas are
+ * blended against the key color.
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <png.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "SDL.h"
 #include "SDL_image.h"
 #include "tw_graphics.h"
+#include "tw_capture.h"
 #include "tw_lua.h"
 #include "tw_error.h"
+#include "tw_scene.h"
+#include "tw_texcache.h"
+#include "tw_trace.h"
+#include "tw_watch.h"
+
+#define TW_MAX_SCALE 8
 
-#define TW_SCREEN_WIDTH 1024
-#define TW_SCREEN_HEIGHT 640
+#define TW_CANVAS_KEY_R 0xFF
+#define TW_CANVAS_KEY_G 0x00
+#define TW_CANVAS_KEY_B 0xFF
 
 #define TW_MAX_SPRITES 64
 
+#define TW_TEXCACHE_DIR ".twcache"
+
 typedef struct {
     SDL_Surface *src;
     unsigned int width;
     unsigned int height;
+    char *path;
+    tw_texcache_map_t cache;
+    int canvas;
 } tw_sprite_t;
 
 static int initialized = 0;
 static SDL_Surface *screen;
+static SDL_Surface *logical; /* logical screen, the same as screen at scale 1 */
+static SDL_Surface *target; /* logical screen, or the canvas being drawn on */
+static int screen_scale = 1;
+static int fullscreen = 1;
+static SDL_PixelFormat alpha_format;
 static tw_sprite_t texture_list[TW_MAX_SPRITES];
 static unsigned int texture_list_size = 0;
 
+/*
+ * Returns an optimized surface for the given image file. The texture cache is
+ * consulted first, and freshly decoded sprites are added to it.
+ */
+static SDL_Surface * decode_sprite( const char *img_file, tw_texcache_map_t *cache ) {
+    SDL_Surface *image, *optimized;
+    optimized = texcache_load(img_file, &alpha_format, cache);
+    if( optimized != NULL ) {
+        return optimized;
+    }
+    image = IMG_Load(img_file);
+    if( image == NULL ) {
+        push_error("decode_sprite failed: Failed to load given image file!");
+        return NULL;
+    }
+    optimized = SDL_DisplayFormatAlpha(image);
+    if( optimized == NULL ) {
+        push_warning("Failed to create optimized sprite! This may affect performance!");
+        return image;
+    }
+    SDL_FreeSurface(image);
+    texcache_store(img_file, optimized);
+    return optimized;
+}
+
+/*
+ * Reloads the given texture from its image file, replacing its surface in
+ * place so that the texture keeps its index.
+ */
+static int reload_sprite( int texture ) {
+    tw_sprite_t *sprite;
+    tw_texcache_map_t cache;
+    SDL_Surface *image;
+    if( (unsigned int)texture >= texture_list_size ) {
+        push_error("reload_sprite failed: Invalid texture!");
+        return -1;
+    }
+    sprite = &texture_list[texture];
+    image = decode_sprite(sprite->path, &cache);
+    if( image == NULL ) {
+        push_error("reload_sprite failed: Failed to decode changed image file!");
+        return -1;
+    }
+    SDL_FreeSurface(sprite->src);
+    texcache_unmap(&sprite->cache);
+    sprite->src = image;
+    sprite->cache = cache;
+    sprite->width = image->w;
+    sprite->height = image->h;
+    return 0;
+}
+
 /*
  * Loads the given image file and stores it into the texture list
  */
 static int load_sprite(const char *img_file) {
-    SDL_Surface *image;
+    tw_sprite_t *sprite;
     if( initialized ) {
         if( texture_list_size < TW_MAX_SPRITES ) {
-            image = IMG_Load(img_file);
-            if( image ) { /* Create optimized sprite */
-                texture_list[texture_list_size].src = SDL_DisplayFormatAlpha(image);
-                if( texture_list[texture_list_size].src ) {
-                    SDL_FreeSurface(image);
-                }
-                else {
-                    push_warning("Failed to create optimized sprite! This may affect performance!");
-                    texture_list[texture_list_size].src = image;
-                }
-                texture_list[texture_list_size].width = texture_list[texture_list_size].src->w;
-                texture_list[texture_list_size].height = texture_list[texture_list_size].src->h;
-                if( texture_list[texture_list_size].src->format->palette ) {
-                    push_warning("Sprite has palette!");
-                }
-                texture_list_size++;
-                return 0;
-            }
-            else {
+            sprite = &texture_list[texture_list_size];
+            trace_begin("load_sprite");
+            sprite->src = decode_sprite(img_file, &sprite->cache);
+            trace_end("load_sprite");
+            if( sprite->src == NULL ) {
                 push_error("load_sprite failed: Failed to load given image file!");
                 return -1;
             }
+            sprite->width = sprite->src->w;
+            sprite->height = sprite->src->h;
+            if( sprite->src->format->palette ) {
+                push_warning("Sprite has palette!");
+            }
+            sprite->path = (char*)malloc(strlen(img_file) + 1);
+            if( sprite->path != NULL ) {
+                strcpy(sprite->path, img_file);
+                watch_file(sprite->path, reload_sprite, texture_list_size);
+            }
+            texture_list_size++;
+            return 0;
         }
         else {
             push_error("load_sprite failed: Too many sprites loaded!");
@@ -71,6 +159,28 @@ static int load_sprite(const char *img_file) {
     }
 }
 
+/*
+ * Records the pixel format SDL_DisplayFormatAlpha converts sprites to, which is
+ * the format texture cache entries are validated against.
+ */
+static int probe_alpha_format() {
+    SDL_Surface *probe, *converted;
+    probe = SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 32,
+        0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    if( probe == NULL ) {
+        return -1;
+    }
+    converted = SDL_DisplayFormatAlpha(probe);
+    SDL_FreeSurface(probe);
+    if( converted == NULL ) {
+        return -1;
+    }
+    alpha_format = *converted->format;
+    alpha_format.palette = NULL;
+    SDL_FreeSurface(converted);
+    return 0;
+}
+
 /*
  * Takes the given RGB values and returns a Uint32 of the corresponding color.
  */
@@ -91,17 +201,24 @@ static Uint32 get_rgba_color( unsigned int r, unsigned int g, unsigned int b, un
  */
 static int draw_line( unsigned int x0, unsigned int y0,
     unsigned int x1, unsigned int y1, Uint32 color ) {
-    unsigned int x, y, x_end, y_end;
+    Uint32 *pixels;
+    unsigned int x, y, x_end, y_end, stride;
     int delta_x, delta_y, error, steep, y_step;
     if( !initialized ) {
         push_error("draw_line failed: Graphics interface not initialized!");
         return -1;
     }
-    if( x0 >= TW_SCREEN_WIDTH || x1 >= TW_SCREEN_WIDTH ||
-        y0 >= TW_SCREEN_HEIGHT || y1 >= TW_SCREEN_HEIGHT ) {
+    if( x0 >= (unsigned int)target->w || x1 >= (unsigned int)target->w ||
+        y0 >= (unsigned int)target->h || y1 >= (unsigned int)target->h ) {
         push_error("draw_line failed: Out of bounds.");
         return -1;
     }
+    if( SDL_MUSTLOCK(target) && SDL_LockSurface(target) ) {
+        push_error("draw_line failed: Failed to lock screen!");
+        return -1;
+    }
+    pixels = (Uint32*)target->pixels;
+    stride = target->pitch / 4;
     if( x0 == x1 ) { /* vertical line */
         x = x0;
         if( y0 < y1 ) {
@@ -113,7 +230,7 @@ static int draw_line( unsigned int x0, unsigned int y0,
             y_end = y0;
         }
         for( ; y <= y_end; y++ ) {
-            ((Uint32*)(screen->pixels))[TW_SCREEN_WIDTH * y + x] = color;
+            pixels[stride * y + x] = color;
         }
     }
     else if( y0 == y1 ) { /* horizontal line */
@@ -127,7 +244,7 @@ static int draw_line( unsigned int x0, unsigned int y0,
             x_end = x0;
         }
         for( ; x <= x_end; x++ ) {
-            ((Uint32*)(screen->pixels))[TW_SCREEN_WIDTH * y + x] = color;
+            pixels[stride * y + x] = color;
         }
     }
     else { /* diagonal */
@@ -168,10 +285,10 @@ static int draw_line( unsigned int x0, unsigned int y0,
         }
         for( ; x <= x_end; x++ ) {
             if( steep ) {
-                ((Uint32*)(screen->pixels))[TW_SCREEN_WIDTH * x + y] = color;
+                pixels[stride * x + y] = color;
             }
             else {
-                ((Uint32*)(screen->pixels))[TW_SCREEN_WIDTH * y + x] = color;
+                pixels[stride * y + x] = color;
             }
             error -= delta_y;
             if( error < 0 ) {
@@ -180,21 +297,40 @@ static int draw_line( unsigned int x0, unsigned int y0,
             }
         }
     }
+    if( SDL_MUSTLOCK(target) ) {
+        SDL_UnlockSurface(target);
+    }
     return 0;
 }
 
 /*
- * Draws all necessary sprites
+ * Returns whether a rectangle of the given size at the given position lies
+ * completely outside of the screen.
  */
-static int draw_sprite( int texture, int x, int y ) {
+static int off_screen( int x, int y, int w, int h ) {
+    return x >= target->w || y >= target->h || x + w <= 0 || y + h <= 0;
+}
+
+/*
+ * Draws the given texture with its top left corner at the given position.
+ * Textures outside of the screen are skipped.
+ */
+int draw_sprite( int texture, int x, int y ) {
     SDL_Rect dest;
     if( initialized ) {
         if( (unsigned int)texture < texture_list_size ) {
+            if( off_screen(x, y, texture_list[texture].width, texture_list[texture].height) ) {
+                return 0;
+            }
+            if( texture_list[texture].src == target ) {
+                push_error("draw_sprite failed: Canvas drawn onto itself!");
+                return -1;
+            }
             dest.x = x;
             dest.y = y;
             dest.w = 0; /* width and height are ignored */
             dest.h = 0;
-            SDL_BlitSurface(texture_list[texture].src, NULL, screen, &dest);
+            SDL_BlitSurface(texture_list[texture].src, NULL, target, &dest);
             return 0;
         }
         else {
@@ -208,17 +344,257 @@ static int draw_sprite( int texture, int x, int y ) {
     }
 }
 
+/*
+ * Draws the given rectangle of the given texture with its top left corner at
+ * the given position. Rectangles outside of the screen are skipped.
+ */
+int draw_sprite_region( int texture, SDL_Rect *src, int x, int y ) {
+    SDL_Rect dest;
+    if( !initialized ) {
+        push_error("draw_sprite_region failed: Graphics interface not initialized!");
+        return -1;
+    }
+    if( (unsigned int)texture >= texture_list_size ) {
+        push_error("draw_sprite_region failed: Invalid texture!");
+        return -1;
+    }
+    if( off_screen(x, y, src->w, src->h) ) {
+        return 0;
+    }
+    if( texture_list[texture].src == target ) {
+        push_error("draw_sprite_region failed: Canvas drawn onto itself!");
+        return -1;
+    }
+    dest.x = x;
+    dest.y = y;
+    dest.w = 0; /* width and height are ignored */
+    dest.h = 0;
+    SDL_BlitSurface(texture_list[texture].src, src, target, &dest);
+    return 0;
+}
+
+/*
+ * Clears the given surface, to the color key for transparent canvases and to
+ * black otherwise.
+ */
+static void clear_surface( SDL_Surface *surface ) {
+    SDL_FillRect(surface, NULL,
+        surface->flags & SDL_SRCCOLORKEY ? surface->format->colorkey : 0);
+}
+
+/*
+ * Creates a canvas of the given size and adds it to the texture list. Returns
+ * the new texture, or -1 on errors.
+ */
+static int create_canvas( int width, int height, int transparent ) {
+    tw_sprite_t *sprite;
+    SDL_Surface *surface;
+    if( !initialized ) {
+        push_error("create_canvas failed: Graphics interface not initialized!");
+        return -1;
+    }
+    if( texture_list_size >= TW_MAX_SPRITES ) {
+        push_error("create_canvas failed: Too many sprites loaded!");
+        return -1;
+    }
+    if( width <= 0 || height <= 0 ) {
+        push_error("create_canvas failed: Invalid canvas size!");
+        return -1;
+    }
+    surface = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32,
+        screen->format->Rmask, screen->format->Gmask, screen->format->Bmask, 0);
+    if( surface == NULL ) {
+        push_error(SDL_GetError());
+        push_error("create_canvas failed: Failed to create surface!");
+        return -1;
+    }
+    if( transparent ) {
+        SDL_SetColorKey(surface, SDL_SRCCOLORKEY, SDL_MapRGB(surface->format,
+            TW_CANVAS_KEY_R, TW_CANVAS_KEY_G, TW_CANVAS_KEY_B));
+    }
+    clear_surface(surface);
+    sprite = &texture_list[texture_list_size];
+    memset(sprite, 0, sizeof(tw_sprite_t));
+    sprite->src = surface;
+    sprite->width = width;
+    sprite->height = height;
+    sprite->path = NULL; /* not backed by a file, never reloaded */
+    sprite->canvas = 1;
+    return texture_list_size++;
+}
+
+/*
+ * Stores the size of the given texture in width and height.
+ */
+int texture_size( int texture, unsigned int *width, unsigned int *height ) {
+    if( (unsigned int)texture >= texture_list_size ) {
+        push_error("texture_size failed: Invalid texture!");
+        return -1;
+    }
+    *width = texture_list[texture].width;
+    *height = texture_list[texture].height;
+    return 0;
+}
+
+/*
+ * Returns the surface of the given texture, or NULL for invalid textures. The
+ * surface of a texture is replaced when its image file is reloaded, so it must
+ * not be kept around.
+ */
+SDL_Surface * texture_surface( int texture ) {
+    if( (unsigned int)texture >= texture_list_size ) {
+        return NULL;
+    }
+    return texture_list[texture].src;
+}
+
+/*
+ * Converts the given window position, e.g. of a mouse event, to a position on
+ * the logical screen that scripts draw to.
+ */
+void graphics_window_to_logical( int *x, int *y ) {
+    *x /= screen_scale;
+    *y /= screen_scale;
+}
+
+/*
+ * Scales the given row of pixels up by the given factor.
+ */
+static void upscale_row( const Uint32 *src, Uint32 *dst, int width, int scale ) {
+#ifdef __SSE2__
+    __m128i v;
+#endif
+    int x, i;
+    x = 0;
+#ifdef __SSE2__
+    switch( scale ) {
+        case 2:
+            for( ; x + 4 <= width; x += 4, dst += 8 ) {
+                v = _mm_loadu_si128((const __m128i*)(src + x));
+                _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi32(v, v));
+                _mm_storeu_si128((__m128i*)(dst + 4), _mm_unpackhi_epi32(v, v));
+            }
+            break;
+        case 3:
+            for( ; x + 4 <= width; x += 4, dst += 12 ) {
+                v = _mm_loadu_si128((const __m128i*)(src + x));
+                _mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+                _mm_storeu_si128((__m128i*)(dst + 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+                _mm_storeu_si128((__m128i*)(dst + 8), _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+            }
+            break;
+        case 4:
+            for( ; x + 4 <= width; x += 4, dst += 16 ) {
+                v = _mm_loadu_si128((const __m128i*)(src + x));
+                _mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi32(v, 0x00));
+                _mm_storeu_si128((__m128i*)(dst + 4), _mm_shuffle_epi32(v, 0x55));
+                _mm_storeu_si128((__m128i*)(dst + 8), _mm_shuffle_epi32(v, 0xAA));
+                _mm_storeu_si128((__m128i*)(dst + 12), _mm_shuffle_epi32(v, 0xFF));
+            }
+            break;
+        default:
+            break;
+    }
+#endif
+    for( ; x < width; x++ ) {
+        for( i = 0; i < scale; i++ ) {
+            *dst++ = src[x];
+        }
+    }
+}
+
+/*
+ * Scales the logical screen up onto the window. Every logical row is scaled
+ * once, and then copied for the remaining window rows it covers.
+ */
+static int present() {
+    Uint8 *src, *dst;
+    int y, i, row_bytes;
+    if( SDL_MUSTLOCK(screen) && SDL_LockSurface(screen) ) {
+        push_error("present failed: Failed to lock screen!");
+        return -1;
+    }
+    src = (Uint8*)logical->pixels;
+    dst = (Uint8*)screen->pixels;
+    row_bytes = logical->w * screen_scale * 4;
+    for( y = 0; y < logical->h; y++ ) {
+        upscale_row((Uint32*)src, (Uint32*)dst, logical->w, screen_scale);
+        for( i = 1; i < screen_scale; i++ ) {
+            memcpy(dst + i * screen->pitch, dst, row_bytes);
+        }
+        src += logical->pitch;
+        dst += screen->pitch * screen_scale;
+    }
+    if( SDL_MUSTLOCK(screen) ) {
+        SDL_UnlockSurface(screen);
+    }
+    return 0;
+}
+
+/*
+ * Sets the logical resolution of the screen and the integer factor it is scaled
+ * up by in the window, or in fullscreen mode. Drawing is directed back at the
+ * screen.
+ */
+static int set_resolution( int width, int height, int scale, int full ) {
+    SDL_Surface *new_screen, *new_logical;
+    if( width <= 0 || height <= 0 || scale < 1 || scale > TW_MAX_SCALE ) {
+        push_error("set_resolution failed: Invalid resolution!");
+        return -1;
+    }
+    new_screen = SDL_SetVideoMode(width * scale, height * scale, 32,
+        full ? SDL_FULLSCREEN|SDL_HWSURFACE|SDL_DOUBLEBUF : SDL_SWSURFACE);
+    if( new_screen == NULL ) {
+        push_error(SDL_GetError());
+        push_error("set_resolution failed: SDL failed to set video mode!");
+        return -1;
+    }
+    if( logical != NULL && logical != screen ) {
+        SDL_FreeSurface(logical);
+    }
+    screen = new_screen;
+    logical = screen;
+    if( scale > 1 ) {
+        new_logical = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32,
+            screen->format->Rmask, screen->format->Gmask, screen->format->Bmask, 0);
+        if( new_logical == NULL ) {
+            push_warning("Failed to create logical screen, drawing without scaling!");
+            scale = 1;
+        }
+        else {
+            logical = new_logical;
+        }
+    }
+    target = logical;
+    screen_scale = scale;
+    fullscreen = full;
+    set_lua_global_n("screenWidth", logical->w);
+    set_lua_global_n("screenHeight", logical->h);
+    return 0;
+}
+
 /*
  * Redraws the screen.
  */
 int display() {
     if( initialized ) {
-        SDL_FillRect(screen, NULL, 0);
+        target = logical;
+        SDL_FillRect(logical, NULL, 0);
+        trace_begin("tw_display");
         if( run_lua_function("tw_display") ) {
             push_error("Call to Lua function display failed!");
             return -1;
         }
+        trace_end("tw_display");
+        target = logical; /* in case the script left a canvas as the target */
+        trace_begin("present");
+        if( logical != screen && present() ) {
+            push_error("display failed: Failed to present the screen!");
+            return -1;
+        }
+        capture_frame(logical);
         SDL_Flip(screen);
+        trace_end("present");
         return 0;
     }
     else {
@@ -339,9 +715,12 @@ int lua_drawLine( lua_State *L ) {
 /*
  * Lua hook to the function
  * draw_sprite( int texture, int x, int y )
+ * taking screen coordinates, or world coordinates on the given layer if a
+ * layer is given. Nothing is drawn on hidden layers. Layer depth does not order
+ * these draws, only those of drawEntities().
  */
 int lua_drawTexture( lua_State *L ) {
-    int texture;
+    int texture, hidden;
     int x, y;
     switch( lua_gettop(L) ) {
         case 0:
@@ -355,9 +734,19 @@ int lua_drawTexture( lua_State *L ) {
             texture = lua_tonumber(L, 1);
             x = lua_tonumber(L, 2);
             y = lua_tonumber(L, 3);
+            hidden = !lua_isnoneornil(L, 4) && !scene_layer_visible(lua_tonumber(L, 4));
+            if( !lua_isnoneornil(L, 4) &&
+                scene_to_screen(lua_tonumber(L, 4), lua_tonumber(L, 2), lua_tonumber(L, 3), &x, &y) ) {
+                push_error("Lua: Error while calling drawTexture: Invalid layer!");
+                lua_pushstring(L, "Invalid layer.");
+                lua_error(L);
+                return -1;
+            }
     }
     if( (unsigned int)texture < texture_list_size ) {
-        draw_sprite(texture, x, y);
+        if( !hidden ) {
+            draw_sprite(texture, x, y);
+        }
         lua_pop(L, lua_gettop(L)); /* clear stack */
         return 0;
     }
@@ -369,6 +758,88 @@ int lua_drawTexture( lua_State *L ) {
     }
 }
 
+/*
+ * Lua hook to the function
+ * set_resolution( int width, int height, int scale, int full )
+ * keeping the current scale and window mode unless given.
+ */
+int lua_setResolution( lua_State *L ) {
+    int scale, full;
+    if( lua_gettop(L) < 2 ) {
+        push_error("Lua: Error while calling setResolution: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    scale = lua_isnoneornil(L, 3) ? screen_scale : (int)lua_tonumber(L, 3);
+    full = lua_isnoneornil(L, 4) ? fullscreen : lua_toboolean(L, 4);
+    if( set_resolution((int)lua_tonumber(L, 1), (int)lua_tonumber(L, 2), scale, full) ) {
+        push_error("Lua: Error while calling setResolution!");
+        lua_pushstring(L, "Error while setting resolution.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to the function
+ * create_canvas( int width, int height, int transparent )
+ * returning the texture of the new canvas.
+ */
+int lua_createCanvas( lua_State *L ) {
+    int texture;
+    if( lua_gettop(L) < 2 ) {
+        push_error("Lua: Error while calling createCanvas: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    texture = create_canvas((int)lua_tonumber(L, 1), (int)lua_tonumber(L, 2), lua_toboolean(L, 3));
+    if( texture < 0 ) {
+        push_error("Lua: Error while calling createCanvas!");
+        lua_pushstring(L, "Error while creating canvas.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, texture);
+    return 1;
+}
+
+/*
+ * Lua hook to direct drawing at the given canvas, or back at the screen if no
+ * canvas is given.
+ */
+int lua_setTarget( lua_State *L ) {
+    int texture;
+    if( lua_isnoneornil(L, 1) ) {
+        target = logical;
+    }
+    else {
+        texture = (int)lua_tonumber(L, 1);
+        if( (unsigned int)texture >= texture_list_size || !texture_list[texture].canvas ) {
+            push_error("Lua: Error while calling setTarget: Invalid canvas!");
+            lua_pushstring(L, "Invalid canvas.");
+            lua_error(L);
+            return -1;
+        }
+        target = texture_list[texture].src;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to clear the current target.
+ */
+int lua_clearTarget( lua_State *L ) {
+    clear_surface(target);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
 /*
  * Lua callback to set the caption whenever GLOBALS.gameName is changed.
  */
@@ -417,20 +888,29 @@ int graphics_init() {
             return -1;
         }
         else {
-            screen = SDL_SetVideoMode(TW_SCREEN_WIDTH, TW_SCREEN_HEIGHT, 32, SDL_FULLSCREEN|SDL_HWSURFACE|SDL_DOUBLEBUF); /*SDL_SWSURFACE);*/
-            if( screen == NULL ) {
-                push_error(SDL_GetError());
+            add_lua_global_n("screenWidth", TW_DEFAULT_WIDTH, NULL);
+            add_lua_global_n("screenHeight", TW_DEFAULT_HEIGHT, NULL);
+            if( set_resolution(TW_DEFAULT_WIDTH, TW_DEFAULT_HEIGHT, 1,
+                getenv("TW_WINDOWED") == NULL) ) {
                 push_error("SDL failed to set video mode!");
                 return -1;
             }
-            FPS = 40;
+            if( probe_alpha_format() ) {
+                push_warning("Failed to determine sprite format, texture cache disabled!");
+            }
+            else {
+                texcache_init(TW_TEXCACHE_DIR);
+            }
+            FPS = TW_DEFAULT_FPS;
             add_lua_function("loadTexture", lua_loadTexture);
             add_lua_function("drawTexture", lua_drawTexture);
             add_lua_function("drawLine", lua_drawLine);
+            add_lua_function("setResolution", lua_setResolution);
+            add_lua_function("createCanvas", lua_createCanvas);
+            add_lua_function("setTarget", lua_setTarget);
+            add_lua_function("clearTarget", lua_clearTarget);
             add_lua_global_s("gameName", "Untitled", lua_setCaption);
-            add_lua_global_n("fpsCap", 40, lua_setFpsCap);
-            add_lua_global_n("screenWidth", TW_SCREEN_WIDTH, NULL);
-            add_lua_global_n("screenHeight", TW_SCREEN_HEIGHT, NULL);
+            add_lua_global_n("fpsCap", TW_DEFAULT_FPS, lua_setFpsCap);
             SDL_WM_SetCaption("Untitled", "Untitled");
             initialized = 1;
             return 0;
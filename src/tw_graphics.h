@@ -5,8 +5,43 @@
 #ifndef TWGRAPHICS
 #define TWGRAPHICS
 
+#include "SDL.h"
+
+#define TW_DEFAULT_WIDTH 1024
+#define TW_DEFAULT_HEIGHT 640
+#define TW_DEFAULT_FPS 40
+
 unsigned int FPS;
 
+/*
+ * Draws the given texture with its top left corner at the given position.
+ */
+int draw_sprite( int texture, int x, int y );
+
+/*
+ * Draws the given rectangle of the given texture with its top left corner at
+ * the given position.
+ */
+int draw_sprite_region( int texture, SDL_Rect *src, int x, int y );
+
+/*
+ * Stores the size of the given texture in width and height.
+ */
+int texture_size( int texture, unsigned int *width, unsigned int *height );
+
+/*
+ * Returns the surface of the given texture, or NULL for invalid textures. The
+ * surface of a texture is replaced when its image file is reloaded, so it must
+ * not be kept around.
+ */
+SDL_Surface * texture_surface( int texture );
+
+/*
+ * Converts the given window position, e.g. of a mouse event, to a position on
+ * the logical screen that scripts draw to.
+ */
+void graphics_window_to_logical( int *x, int *y );
+
 /*
  * Redraws the screen.
  */
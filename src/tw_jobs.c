@@ -0,0 +1,472 @@
+/*
+ * tw_jobs.c
+ *
+ * This file contains the source code pertaining to the job system of the
+ * ToyWrench application, which lets scripts run CPU heavy work such as AI
+ * planning or procedural generation on the other cores. A job names a function
+ * in a game module as "module.function", and is run by one of a pool of worker
+ * threads, each owning its own Lua state with the standard libraries and
+ * require() for the game's modules. A module is loaded into a worker the first
+ * time one of its jobs needs it, and stays loaded. Workers share nothing with
+ * the main state, so a job function can only see its arguments and what its
+ * module sets up, and none of the engine functions.
+ *
+ *   submitJob("terrain.generate", onTerrain, seed, 256, 256)
+ *
+ * Arguments and results are copied between states in the format of saveState()
+ * (see tw_savestate.c), so they may be nil, booleans, numbers, strings, and
+ * tables of those, but no functions or userdata. When a job is done its
+ * callback is called on the main thread at the start of a later frame, like
+ * pcall: with true and the results of the job function, or with false and the
+ * error message. Jobs may finish in any order. When recording a replay the jobs
+ * delivered in every frame are recorded, and a replay waits for those jobs and
+ * delivers them in the same frames and order, however long they take.
+ *
+ * The worker threads are only started when the first job is submitted.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tw_jobs.h"
+#include "tw_error.h"
+#include "tw_loader.h"
+#include "tw_lua.h"
+#include "tw_replay.h"
+#include "tw_savestate.h"
+#include "tw_trace.h"
+
+#define TW_MAX_JOB_WORKERS 8
+
+typedef struct tw_job_t {
+    unsigned long id;
+    char *name;
+    char *args; /* serialized arguments */
+    size_t args_size;
+    char *results; /* serialized results, or the error message */
+    size_t results_size;
+    int ok;
+    int callback; /* registry reference in the main state */
+    struct tw_job_t *next;
+} tw_job_t;
+
+typedef struct {
+    lua_State *L;
+    SDL_Thread *thread;
+} tw_worker_t;
+
+static int initialized = 0;
+static int started = 0;
+static volatile int running = 0;
+static tw_worker_t worker_list[TW_MAX_JOB_WORKERS];
+static int worker_count = 0;
+static SDL_mutex *queue_lock = NULL;
+static SDL_cond *queue_ready = NULL;
+static SDL_cond *job_finished = NULL;
+static tw_job_t *pending_head = NULL; /* oldest first */
+static tw_job_t *pending_tail = NULL;
+static tw_job_t *done_list = NULL; /* newest first */
+static unsigned long next_id = 1;
+static unsigned int outstanding = 0;
+static unsigned int busy = 0; /* jobs being run by a worker */
+
+/*
+ * Stores the error message on top of the stack of the given Lua state as the
+ * result of the given job.
+ */
+static void fail_job( lua_State *L, tw_job_t *job, const char *message ) {
+    size_t length;
+    const char *s;
+    s = message != NULL ? message : lua_tolstring(L, -1, &length);
+    if( s == NULL ) {
+        s = "Job failed.";
+    }
+    length = strlen(s);
+    job->results = (char*)malloc(length + 1);
+    if( job->results != NULL ) {
+        memcpy(job->results, s, length + 1);
+        job->results_size = length;
+    }
+    job->ok = 0;
+}
+
+/*
+ * Runs the given job in the given worker state, storing its serialized results
+ * or error message in the job.
+ */
+static void run_job( lua_State *L, tw_job_t *job ) {
+    tw_savestate_t results;
+    char *dot;
+    int nargs;
+    lua_settop(L, 0);
+    dot = strrchr(job->name, '.');
+    if( dot == NULL ) {
+        fail_job(L, job, "Job name not in the form \"module.function\".");
+        return;
+    }
+    lua_getglobal(L, "require");
+    lua_pushlstring(L, job->name, dot - job->name);
+    if( lua_pcall(L, 1, 1, 0) ) {
+        fail_job(L, job, NULL);
+        return;
+    }
+    if( !lua_istable(L, 1) ) {
+        fail_job(L, job, "Job module did not return a table.");
+        return;
+    }
+    lua_getfield(L, 1, dot + 1);
+    if( !lua_isfunction(L, 2) ) {
+        fail_job(L, job, "Job function not found in its module.");
+        return;
+    }
+    nargs = savestate_read(L, job->args, job->args_size);
+    if( nargs < 0 || lua_pcall(L, nargs, LUA_MULTRET, 0) ) {
+        fail_job(L, job, NULL);
+        return;
+    }
+    memset(&results, 0, sizeof(results));
+    if( savestate_write(L, 2, lua_gettop(L) - 1, &results) ) { /* above the module */
+        free(results.data);
+        fail_job(L, job, "Job returned a value that can not be passed back.");
+        return;
+    }
+    job->results = results.data;
+    job->results_size = results.size;
+    job->ok = 1;
+}
+
+/*
+ * Worker thread running pending jobs until the job system is shut down.
+ */
+static int job_worker( void *data ) {
+    tw_worker_t *worker;
+    tw_job_t *job;
+    const char *span;
+    worker = (tw_worker_t*)data;
+    trace_thread("job worker");
+    for( ;; ) {
+        SDL_mutexP(queue_lock);
+        while( pending_head == NULL && running ) {
+            SDL_CondWait(queue_ready, queue_lock);
+        }
+        job = pending_head;
+        if( job == NULL ) { /* shut down */
+            SDL_mutexV(queue_lock);
+            break;
+        }
+        pending_head = job->next;
+        if( pending_head == NULL ) {
+            pending_tail = NULL;
+        }
+        busy++;
+        SDL_mutexV(queue_lock);
+        span = trace_enabled() ? trace_intern(job->name) : NULL;
+        trace_begin(span);
+        run_job(worker->L, job);
+        trace_end(span);
+        lua_settop(worker->L, 0);
+        SDL_mutexP(queue_lock);
+        job->next = done_list;
+        done_list = job;
+        busy--;
+        SDL_CondBroadcast(job_finished);
+        SDL_mutexV(queue_lock);
+    }
+    return 0;
+}
+
+/*
+ * Creates the worker states and starts the worker threads, one for every core
+ * but the one of the main thread.
+ */
+static int start_workers() {
+    long cores;
+    int i;
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = cores > 1 ? (int)cores - 1 : 1;
+    if( worker_count > TW_MAX_JOB_WORKERS ) {
+        worker_count = TW_MAX_JOB_WORKERS;
+    }
+    running = 1;
+    for( i = 0; i < worker_count; i++ ) {
+        worker_list[i].L = luaL_newstate();
+        if( worker_list[i].L == NULL ) {
+            push_error("start_workers failed: Failed to create worker state!");
+            break;
+        }
+        luaL_openlibs(worker_list[i].L);
+        if( loader_install(worker_list[i].L) ) {
+            lua_close(worker_list[i].L);
+            push_error("start_workers failed: Failed to install module loader!");
+            break;
+        }
+        worker_list[i].thread = SDL_CreateThread(job_worker, &worker_list[i]);
+        if( worker_list[i].thread == NULL ) {
+            lua_close(worker_list[i].L);
+            push_error("start_workers failed: Failed to start worker thread!");
+            break;
+        }
+    }
+    worker_count = i;
+    started = 1;
+    set_lua_global_n("jobWorkers", worker_count);
+    return worker_count > 0 ? 0 : -1;
+}
+
+/*
+ * Frees the given job, releasing its callback in the given Lua state.
+ */
+static void free_job( lua_State *L, tw_job_t *job ) {
+    if( L != NULL ) {
+        luaL_unref(L, LUA_REGISTRYINDEX, job->callback);
+    }
+    free(job->name);
+    free(job->args);
+    free(job->results);
+    free(job);
+}
+
+/*
+ * Calls the callback of the given finished job, unless an earlier callback
+ * failed as given by the status, and frees the job. Returns the status, or -1
+ * if the callback failed.
+ */
+static int finish_job( lua_State *L, tw_job_t *job, int status ) {
+    int nresults;
+    outstanding--;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, job->callback);
+    if( !lua_isfunction(L, -1) || status ) {
+        lua_pop(L, 1);
+        free_job(L, job);
+        return status;
+    }
+    lua_pushboolean(L, job->ok);
+    nresults = 1;
+    if( job->ok ) {
+        nresults = savestate_read(L, job->results, job->results_size);
+        if( nresults < 0 ) {
+            push_error(lua_tostring(L, -1));
+            lua_pop(L, 3);
+            push_error("jobs_step failed: Failed to read job results!");
+            free_job(L, job);
+            return -1;
+        }
+    }
+    else {
+        lua_pushlstring(L, job->results != NULL ? job->results : "Out of memory.",
+            job->results != NULL ? job->results_size : 14);
+    }
+    if( lua_pcall(L, nresults, 0, 0) ) {
+        push_error(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        push_error("jobs_step failed: Error in job callback!");
+        status = -1;
+    }
+    free_job(L, job);
+    return status;
+}
+
+/*
+ * Takes the job with the given id off the finished jobs, waiting for it if it
+ * is still pending or running. Returns NULL if no such job is outstanding.
+ */
+static tw_job_t * wait_for_job( unsigned long id ) {
+    tw_job_t **link, *job;
+    if( !started ) {
+        return NULL;
+    }
+    SDL_mutexP(queue_lock);
+    for( ;; ) {
+        link = &done_list;
+        while( *link != NULL && (*link)->id != id ) {
+            link = &(*link)->next;
+        }
+        if( *link != NULL || (pending_head == NULL && busy == 0) ) {
+            break;
+        }
+        SDL_CondWait(job_finished, queue_lock);
+    }
+    job = *link;
+    if( job != NULL ) {
+        *link = job->next;
+    }
+    SDL_mutexV(queue_lock);
+    return job;
+}
+
+/*
+ * Calls the callbacks of all finished jobs in the order they finished, and
+ * records their ids. When replaying, calls the callbacks of the jobs recorded
+ * for the frame instead, in the recorded order, waiting for them to finish.
+ */
+int jobs_step() {
+    lua_State *L;
+    tw_job_t *list, *job, *next;
+    unsigned long id;
+    int status;
+    L = lua_main_state();
+    status = 0;
+    if( replay_playing() ) {
+        while( replay_next_job(&id) ) {
+            job = wait_for_job(id);
+            if( job == NULL ) {
+                push_error("jobs_step failed: Replay delivers a job that is not outstanding!");
+                return -1;
+            }
+            status = finish_job(L, job, status);
+        }
+        if( started ) {
+            set_lua_global_n("jobsPending", outstanding);
+        }
+        return status;
+    }
+    if( !started ) {
+        return 0;
+    }
+    SDL_mutexP(queue_lock);
+    list = done_list;
+    done_list = NULL;
+    SDL_mutexV(queue_lock);
+    job = NULL;
+    while( list != NULL ) { /* reverse into the order they finished in */
+        next = list->next;
+        list->next = job;
+        job = list;
+        list = next;
+    }
+    for( ; job != NULL; job = next ) {
+        next = job->next;
+        replay_record_job(job->id);
+        status = finish_job(L, job, status);
+    }
+    set_lua_global_n("jobsPending", outstanding);
+    return status;
+}
+
+/*
+ * Lua hook submitting a job calling the given "module.function" with the
+ * arguments following the callback, returning the id of the job.
+ */
+int lua_submitJob( lua_State *L ) {
+    tw_job_t *job;
+    tw_savestate_t args;
+    const char *name;
+    if( lua_gettop(L) < 2 ) {
+        push_error("Lua: Error while calling submitJob: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    name = lua_tostring(L, 1);
+    if( name == NULL || !(lua_isfunction(L, 2) || lua_isnil(L, 2)) ) {
+        push_error("Lua: Error while calling submitJob: Expected a job name and a callback!");
+        lua_pushstring(L, "Expected a job name and a callback.");
+        lua_error(L);
+        return -1;
+    }
+    if( !started && start_workers() ) {
+        push_error("Lua: Error while calling submitJob: Failed to start workers!");
+        lua_pushstring(L, "Failed to start job workers.");
+        lua_error(L);
+        return -1;
+    }
+    memset(&args, 0, sizeof(args));
+    if( savestate_write(L, 3, lua_gettop(L) - 2, &args) ) {
+        free(args.data);
+        push_error("Lua: Error while calling submitJob: Argument can not be passed to a job!");
+        lua_pushstring(L, "Argument can not be passed to a job.");
+        lua_error(L);
+        return -1;
+    }
+    job = (tw_job_t*)calloc(1, sizeof(tw_job_t));
+    if( job != NULL ) {
+        job->name = (char*)malloc(strlen(name) + 1);
+    }
+    if( job == NULL || job->name == NULL ) {
+        free(job);
+        free(args.data);
+        push_error("Lua: Error while calling submitJob: Out of memory!");
+        lua_pushstring(L, "Out of memory.");
+        lua_error(L);
+        return -1;
+    }
+    strcpy(job->name, name);
+    job->args = args.data;
+    job->args_size = args.size;
+    job->id = next_id++;
+    lua_pushvalue(L, 2);
+    job->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+    SDL_mutexP(queue_lock);
+    if( pending_tail != NULL ) {
+        pending_tail->next = job;
+    }
+    else {
+        pending_head = job;
+    }
+    pending_tail = job;
+    SDL_CondSignal(queue_ready);
+    SDL_mutexV(queue_lock);
+    outstanding++;
+    set_lua_global_n("jobsPending", outstanding);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, job->id);
+    return 1;
+}
+
+/*
+ * Initializes the job system and registers its Lua functions.
+ */
+int jobs_init() {
+    if( initialized ) {
+        push_warning("Job system already initialized!");
+        return 0;
+    }
+    queue_lock = SDL_CreateMutex();
+    queue_ready = SDL_CreateCond();
+    job_finished = SDL_CreateCond();
+    if( queue_lock == NULL || queue_ready == NULL || job_finished == NULL ) {
+        push_error("jobs_init failed: Failed to create job queue!");
+        return -1;
+    }
+    if( add_lua_function("submitJob", lua_submitJob) ||
+        add_lua_global_n("jobWorkers", 0, NULL) ||
+        add_lua_global_n("jobsPending", 0, NULL) ) {
+        push_error("Failed to add job functions!");
+        return -1;
+    }
+    initialized = 1;
+    return 0;
+}
+
+/*
+ * Stops the worker threads once they finish the jobs they are running, and
+ * drops all other jobs.
+ */
+void jobs_shutdown() {
+    tw_job_t *job;
+    int i;
+    if( !started ) {
+        return;
+    }
+    SDL_mutexP(queue_lock);
+    running = 0;
+    while( pending_head != NULL ) {
+        job = pending_head;
+        pending_head = job->next;
+        free_job(NULL, job);
+    }
+    pending_tail = NULL;
+    SDL_CondBroadcast(queue_ready);
+    SDL_mutexV(queue_lock);
+    for( i = 0; i < worker_count; i++ ) {
+        SDL_WaitThread(worker_list[i].thread, NULL);
+        lua_close(worker_list[i].L);
+    }
+    while( done_list != NULL ) {
+        job = done_list;
+        done_list = job->next;
+        free_job(NULL, job);
+    }
+    worker_count = 0;
+    started = 0;
+}
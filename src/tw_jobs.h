@@ -0,0 +1,23 @@
+/*
+ * tw_jobs.h
+ */
+
+#ifndef TWJOBS
+#define TWJOBS
+
+/*
+ * Calls the callbacks of all finished jobs in the order they finished, and
+ * records their ids. When replaying, calls the callbacks of the jobs recorded
+ * for the frame instead, in the recorded order, waiting for them to finish.
+ */
+int jobs_step();
+
+int jobs_init();
+
+/*
+ * Stops the worker threads once they finish the jobs they are running, and
+ * drops all other jobs.
+ */
+void jobs_shutdown();
+
+#endif
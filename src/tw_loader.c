@@ -0,0 +1,435 @@
+/*
+ * tw_loader.c
+ *
+ * This file contains the source code pertaining to loading the Lua files that
+ * make up a game. Compiling Lua source is a significant part of the startup
+ * time of larger games, so every source file loaded through here is compiled
+ * once and its bytecode is kept in a cache directory, tagged with a hash of the
+ * source it was compiled from. A cache entry is only used while the hash still
+ * matches, so editing a source file transparently invalidates its entry.
+ *
+ * Games may also ship precompiled ".luac" files (see the "bytecode" target in
+ * the Makefile), which are used whenever the matching source file is absent.
+ *
+ * The loader also installs a searcher into package.loaders so that a game can
+ * require() its own modules relative to the directory of its game file. Modules
+ * found this way are registered with the watch interface, and when hot
+ * reloading is enabled a changed module is re-run and its new fields are copied
+ * into the table already stored in package.loaded, so that code holding on to
+ * the module table picks up the new functions while game state is preserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <lauxlib.h>
+#include "tw_loader.h"
+#include "tw_error.h"
+#include "tw_trace.h"
+#include "tw_watch.h"
+
+#define TW_BYTECODE_DIR ".twcache"
+#define TW_BYTECODE_MAGIC "TWBC"
+#define TW_LOADER_PATH_MAX 1024
+
+typedef struct {
+    char magic[4];
+    unsigned int hash;
+    unsigned int source_size;
+} tw_bytecode_header_t;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} tw_buffer_t;
+
+typedef struct {
+    char *name;
+    char *path;
+} tw_module_t;
+
+static lua_State *loader_state;
+static tw_module_t *module_list = NULL;
+static unsigned int module_list_size = 0;
+static char game_dir[TW_LOADER_PATH_MAX];
+static int cache_enabled = 0;
+static int initialized = 0;
+
+/*
+ * Returns the 32-bit FNV-1a hash of the given buffer.
+ */
+static unsigned int loader_hash( const char *data, size_t size ) {
+    unsigned int h;
+    size_t i;
+    h = 2166136261u;
+    for( i = 0; i < size; i++ ) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Reads the entire given file into a newly allocated buffer. Returns NULL if
+ * the file could not be read.
+ */
+static char * read_file( const char *path, size_t *size ) {
+    FILE *fp;
+    char *data;
+    long len;
+    fp = fopen(path, "rb");
+    if( fp == NULL ) {
+        return NULL;
+    }
+    if( fseek(fp, 0, SEEK_END) || (len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) ) {
+        fclose(fp);
+        return NULL;
+    }
+    data = (char*)malloc(len > 0 ? len : 1);
+    if( data != NULL && fread(data, 1, len, fp) != (size_t)len ) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *size = len;
+    return data;
+}
+
+/*
+ * Writes the path of the bytecode cache entry for the given source file into
+ * entry.
+ */
+static int cache_entry_path( const char *path, char *entry, size_t size ) {
+    int len;
+    len = snprintf(entry, size, "%s/%08x.twbc", TW_BYTECODE_DIR,
+        loader_hash(path, strlen(path)));
+    if( len < 0 || (size_t)len >= size ) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * lua_Writer that appends dumped bytecode to a tw_buffer_t.
+ */
+static int buffer_writer( lua_State *L, const void *p, size_t sz, void *ud ) {
+    tw_buffer_t *buf;
+    char *data;
+    (void)L;
+    buf = (tw_buffer_t*)ud;
+    if( buf->size + sz > buf->capacity ) {
+        buf->capacity = (buf->size + sz) * 2;
+        data = (char*)realloc(buf->data, buf->capacity);
+        if( data == NULL ) {
+            return 1;
+        }
+        buf->data = data;
+    }
+    memcpy(buf->data + buf->size, p, sz);
+    buf->size += sz;
+    return 0;
+}
+
+/*
+ * Dumps the function on top of the stack of the given Lua state into the cache
+ * entry for the given source. Failing to write the cache is not an error.
+ */
+static void cache_store( lua_State *L, const char *entry, unsigned int hash,
+    size_t source_size ) {
+    tw_bytecode_header_t header;
+    tw_buffer_t buf;
+    FILE *fp;
+    char tmp[TW_LOADER_PATH_MAX + 24];
+    int status;
+    buf.data = NULL;
+    buf.size = 0;
+    buf.capacity = 0;
+    if( lua_dump(L, buffer_writer, &buf) || buf.data == NULL ) {
+        free(buf.data);
+        return;
+    }
+    memcpy(header.magic, TW_BYTECODE_MAGIC, 4);
+    header.hash = hash;
+    header.source_size = source_size;
+    snprintf(tmp, sizeof(tmp), "%s.%lx", entry, (unsigned long)L); /* unique per state */
+    fp = fopen(tmp, "wb");
+    if( fp != NULL ) {
+        status = fwrite(&header, sizeof(header), 1, fp) != 1 ||
+            fwrite(buf.data, 1, buf.size, fp) != buf.size;
+        if( fclose(fp) || status || rename(tmp, entry) ) {
+            remove(tmp);
+            push_warning("Failed to write bytecode cache entry!");
+        }
+    }
+    free(buf.data);
+}
+
+/*
+ * Loads the given Lua file as a chunk onto the stack of the given Lua state,
+ * using the bytecode cache when possible. Returns 0 on success, or a Lua error
+ * code with the error message on the stack.
+ */
+static int load_file( lua_State *L, const char *path ) {
+    char entry[TW_LOADER_PATH_MAX];
+    char chunkname[TW_LOADER_PATH_MAX + 1];
+    tw_bytecode_header_t *header;
+    char *source, *cached;
+    size_t source_size, cached_size, i;
+    unsigned int hash;
+    int status;
+    source = read_file(path, &source_size);
+    if( source == NULL || source_size == 0 || source[0] == '\033' ) {
+        /* missing, empty or precompiled files need no caching */
+        free(source);
+        return luaL_loadfile(L, path);
+    }
+    snprintf(chunkname, sizeof(chunkname), "@%s", path);
+    if( source[0] == '#' ) { /* blank out a leading #! line like luaL_loadfile */
+        for( i = 0; i < source_size && source[i] != '\n'; i++ ) {
+            source[i] = ' ';
+        }
+    }
+    hash = loader_hash(source, source_size);
+    if( cache_enabled && !cache_entry_path(path, entry, sizeof(entry)) ) {
+        cached = read_file(entry, &cached_size);
+        if( cached != NULL ) {
+            header = (tw_bytecode_header_t*)cached;
+            if( cached_size > sizeof(tw_bytecode_header_t) &&
+                !memcmp(header->magic, TW_BYTECODE_MAGIC, 4) &&
+                header->hash == hash && header->source_size == source_size ) {
+                status = luaL_loadbuffer(L, cached + sizeof(tw_bytecode_header_t),
+                    cached_size - sizeof(tw_bytecode_header_t), chunkname);
+                if( !status ) {
+                    free(cached);
+                    free(source);
+                    return 0;
+                }
+                lua_pop(L, 1); /* stale or incompatible bytecode, recompile */
+            }
+            free(cached);
+        }
+    }
+    else {
+        entry[0] = '\0';
+    }
+    status = luaL_loadbuffer(L, source, source_size, chunkname);
+    if( !status && entry[0] ) {
+        cache_store(L, entry, hash, source_size);
+    }
+    free(source);
+    return status;
+}
+
+/*
+ * Loads the given Lua file like load_file(), recording the load as a trace
+ * span.
+ */
+int loader_load_file( lua_State *L, const char *path ) {
+    int status;
+    trace_begin("load_script");
+    status = load_file(L, path);
+    trace_end("load_script");
+    return status;
+}
+
+/*
+ * Returns whether the given file exists.
+ */
+static int file_exists( const char *path ) {
+    struct stat st;
+    return !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+/*
+ * Re-runs the given game module, merging the fields of its new module table
+ * into the table stored in package.loaded.
+ */
+static int reload_module( int id ) {
+    lua_State *L;
+    int top;
+    L = loader_state;
+    if( (unsigned int)id >= module_list_size ) {
+        push_error("reload_module failed: Invalid module!");
+        return -1;
+    }
+    if( loader_load_file(L, module_list[id].path) ) {
+        push_error(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return -1;
+    }
+    lua_pushstring(L, module_list[id].name);
+    if( lua_pcall(L, 1, 1, 0) ) {
+        push_error(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return -1;
+    }
+    top = lua_gettop(L); /* new module value */
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    lua_getfield(L, -1, module_list[id].name); /* new package loaded old */
+    if( lua_istable(L, top) && lua_istable(L, -1) ) {
+        lua_pushnil(L);
+        while( lua_next(L, top) ) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, top + 3);
+        }
+    }
+    else if( !lua_isnil(L, top) ) {
+        lua_pushvalue(L, top);
+        lua_setfield(L, top + 2, module_list[id].name);
+    }
+    lua_settop(L, top - 1);
+    return 0;
+}
+
+/*
+ * Registers the given game module so it is reloaded when its file changes.
+ */
+static void register_module( const char *name, const char *path ) {
+    tw_module_t *list;
+    char *name_cpy, *path_cpy;
+    list = (tw_module_t*)realloc(module_list, sizeof(tw_module_t) * (module_list_size + 1));
+    if( list == NULL ) {
+        return;
+    }
+    module_list = list;
+    name_cpy = (char*)malloc(strlen(name) + 1);
+    path_cpy = (char*)malloc(strlen(path) + 1);
+    if( name_cpy == NULL || path_cpy == NULL ) {
+        free(name_cpy);
+        free(path_cpy);
+        return;
+    }
+    strcpy(name_cpy, name);
+    strcpy(path_cpy, path);
+    module_list[module_list_size].name = name_cpy;
+    module_list[module_list_size].path = path_cpy;
+    watch_file(path_cpy, reload_module, module_list_size);
+    module_list_size++;
+}
+
+/*
+ * Lua searcher for package.loaders. Looks for the given module name in the
+ * game directory, first as Lua source and then as precompiled bytecode. Modules
+ * are registered for reloading if upvalue 1 is true.
+ */
+static int lua_searchGame( lua_State *L ) {
+    char path[TW_LOADER_PATH_MAX];
+    char module[TW_LOADER_PATH_MAX];
+    const char *name;
+    size_t i;
+    int len;
+    name = luaL_checkstring(L, 1);
+    for( i = 0; name[i] && i < sizeof(module) - 1; i++ ) {
+        module[i] = name[i] == '.' ? '/' : name[i];
+    }
+    module[i] = '\0';
+    len = snprintf(path, sizeof(path), "%s%s.lua", game_dir, module);
+    if( len < 0 || (size_t)len >= sizeof(path) - 1 ) {
+        lua_pushfstring(L, "\n\tmodule name too long: '%s'", name);
+        return 1;
+    }
+    if( !file_exists(path) ) {
+        path[len] = 'c';
+        path[len + 1] = '\0';
+        if( !file_exists(path) ) {
+            lua_pushfstring(L, "\n\tno file '%s%s.lua'\n\tno file '%s'",
+                game_dir, module, path);
+            return 1;
+        }
+    }
+    if( loader_load_file(L, path) ) {
+        return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+            name, path, lua_tostring(L, -1));
+    }
+    if( lua_toboolean(L, lua_upvalueindex(1)) ) {
+        register_module(name, path);
+    }
+    return 1;
+}
+
+/*
+ * Installs the game directory searcher into package.loaders of the given Lua
+ * state, right after the preload searcher.
+ */
+static int install_searcher( lua_State *L, int reload ) {
+    int i;
+    lua_getglobal(L, "package");
+    if( !lua_istable(L, -1) ) {
+        lua_pop(L, 1);
+        push_error("install_searcher failed: Lua package library not loaded!");
+        return -1;
+    }
+    lua_getfield(L, -1, "loaders");
+    if( !lua_istable(L, -1) ) {
+        lua_pop(L, 2);
+        push_error("install_searcher failed: package.loaders missing!");
+        return -1;
+    }
+    for( i = lua_objlen(L, -1); i >= 2; i-- ) { /* shift to make room at 2 */
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushboolean(L, reload);
+    lua_pushcclosure(L, lua_searchGame, 1);
+    lua_rawseti(L, -2, 2);
+    lua_pop(L, 2);
+    return 0;
+}
+
+/*
+ * Lets the given Lua state other than the main one require() game modules.
+ * Modules loaded into it are not reloaded when their files change. May be
+ * called from any thread once the loader is initialized.
+ */
+int loader_install( lua_State *L ) {
+    if( !initialized ) {
+        push_error("loader_install failed: Module loader not initialized!");
+        return -1;
+    }
+    return install_searcher(L, 0);
+}
+
+/*
+ * Initializes the game module loader for the given game file, installing the
+ * game directory searcher into package.loaders of the given main Lua state
+ * right after the preload searcher. Without a main state, only states set up
+ * with loader_install() can load game modules.
+ */
+int loader_init( lua_State *L, const char *game_file ) {
+    const char *slash;
+    struct stat dir_stat;
+    size_t len;
+    if( initialized ) {
+        push_warning("Module loader already initialized!");
+        return 0;
+    }
+    slash = strrchr(game_file, '/');
+    len = slash == NULL ? 0 : (size_t)(slash - game_file) + 1;
+    if( len >= sizeof(game_dir) ) {
+        push_error("loader_init failed: Game directory name too long!");
+        return -1;
+    }
+    loader_state = L;
+    memcpy(game_dir, game_file, len);
+    game_dir[len] = '\0';
+    if( !stat(TW_BYTECODE_DIR, &dir_stat) ) {
+        cache_enabled = S_ISDIR(dir_stat.st_mode);
+    }
+    else {
+        cache_enabled = !mkdir(TW_BYTECODE_DIR, 0755);
+    }
+    if( !cache_enabled ) {
+        push_warning("Bytecode cache directory unavailable, cache disabled!");
+    }
+    if( L != NULL && install_searcher(L, 1) ) {
+        push_error("loader_init failed: Failed to install searcher!");
+        return -1;
+    }
+    initialized = 1;
+    return 0;
+}
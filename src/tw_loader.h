@@ -0,0 +1,30 @@
+/*
+ * tw_loader.h
+ */
+
+#ifndef TWLOADER
+#define TWLOADER
+
+#include <lua.h>
+
+/*
+ * Loads the given Lua file as a chunk onto the stack of the given Lua state,
+ * using the bytecode cache when possible. Returns 0 on success, or a Lua error
+ * code with the error message on the stack.
+ */
+int loader_load_file( lua_State *L, const char *path );
+
+/*
+ * Lets the given Lua state other than the main one require() game modules.
+ * Modules loaded into it are not reloaded when their files change.
+ */
+int loader_install( lua_State *L );
+
+/*
+ * Initializes the game module loader for the given game file, installing the
+ * game directory searcher into package.loaders of the given main Lua state,
+ * which may be NULL when only loader_install() is used.
+ */
+int loader_init( lua_State *L, const char *game_file );
+
+#endif
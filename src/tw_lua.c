@@ -8,17 +8,365 @@
  * state should be done through one of the Lua handler functions.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "tw_lua.h"
+#include "tw_alloc.h"
 #include "tw_error.h"
 #include "tw_keyboard.h"
+#include "tw_loader.h"
 #include "tw_mouse.h"
+#include "tw_trace.h"
 
 #define GLOBALS "GLOBALS"
+#define TW_EVENTS "tw_events"
+#define TW_GLOBALS_CONTEXT "tw_globals"
+#define TW_SCHEDULER "tw_scheduler"
+
+#define TW_WAIT_FRAMES 1
+#define TW_WAIT_TICKS 2
+#define TW_WAIT_EVENT 3
+
+#define TW_GC_BUDGET 2
+
+#define TW_GLOBALS_START 256 /* must be a multiple of 32 and a power of two */
+
+#define TW_GLOBAL_NIL 0
+#define TW_GLOBAL_NUMBER 1
+#define TW_GLOBAL_BOOLEAN 2
+#define TW_GLOBAL_REF 3 /* any other value, kept in the registry */
+
+/*
+ * A property of GLOBALS. Numbers and booleans are stored unboxed, anything else
+ * is referenced from the Lua registry.
+ */
+typedef struct {
+    char *name;
+    unsigned int hash;
+    int type;
+    lua_Number number;
+    int ref;
+    lua_CFunction fn;
+} tw_global_t;
+
+/*
+ * The properties of the GLOBALS of one Lua state.
+ */
+typedef struct {
+    tw_global_t *list;
+    unsigned int size;
+    unsigned int capacity;
+    int *buckets; /* twice the capacity of list */
+    unsigned int bucket_count;
+    unsigned int *changed;
+    int keys_ref;
+} tw_globals_t;
 
 static lua_State *state;
+static tw_pool_t lua_pool;
 static int initialized = 0;
 static int sticky_keys = 0;
 
+static tw_globals_t *main_globals = NULL;
+
+/*
+ * __gc metamethod of subsystem contexts, calling the function in upvalue 1
+ * with the context.
+ */
+static int context_gc( lua_State *L ) {
+    ((void (*)( void * ))lua_touserdata(L, lua_upvalueindex(1)))(lua_touserdata(L, 1));
+    return 0;
+}
+
+/*
+ * Creates the zeroed context of the subsystem with the given name in the given
+ * Lua state, keeping it in the registry until the state is closed, when the
+ * given function (if any) is called to release what the context holds. Every
+ * state has its own contexts, so batch instances share no subsystem state.
+ */
+void * new_lua_context( lua_State *L, const char *name, size_t size, void (*release)( void * ) ) {
+    void *context;
+    context = lua_newuserdata(L, size);
+    memset(context, 0, size);
+    if( release != NULL ) {
+        lua_newtable(L);
+        lua_pushlightuserdata(L, (void*)release);
+        lua_pushcclosure(L, context_gc, 1);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, name);
+    return context;
+}
+
+/*
+ * Returns the context of the subsystem with the given name in the given Lua
+ * state, or NULL if the subsystem was not set up in it.
+ */
+void * lua_context( lua_State *L, const char *name ) {
+    void *context;
+    lua_getfield(L, LUA_REGISTRYINDEX, name);
+    context = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return context;
+}
+
+/*
+ * Returns the FNV-1a hash of the given global name.
+ */
+static unsigned int global_hash( const char *name ) {
+    unsigned int h;
+    h = 2166136261u;
+    while( *name ) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Returns the slot of the global with the given name, or -1 if there is none.
+ */
+static int find_global( tw_globals_t *globals, const char *name ) {
+    unsigned int h, i;
+    int slot;
+    if( globals == NULL || globals->buckets == NULL ) {
+        return -1;
+    }
+    h = global_hash(name);
+    for( i = h & (globals->bucket_count - 1); (slot = globals->buckets[i]) >= 0;
+         i = (i + 1) & (globals->bucket_count - 1) ) {
+        if( globals->list[slot].hash == h && !strcmp(globals->list[slot].name, name) ) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Adds the global in the given slot to the hash table.
+ */
+static void bucket_global( tw_globals_t *globals, int slot ) {
+    unsigned int i;
+    for( i = globals->list[slot].hash & (globals->bucket_count - 1); globals->buckets[i] >= 0;
+         i = (i + 1) & (globals->bucket_count - 1) ) {
+    }
+    globals->buckets[i] = slot;
+}
+
+/*
+ * Doubles the room for globals, rebuilding the hash table. Slots stay the same.
+ */
+static int grow_globals( tw_globals_t *globals ) {
+    tw_global_t *list;
+    unsigned int *changed, capacity, i;
+    int *buckets;
+    capacity = globals->capacity ? globals->capacity * 2 : TW_GLOBALS_START;
+    list = (tw_global_t*)realloc(globals->list, sizeof(tw_global_t) * capacity);
+    if( list == NULL ) {
+        return -1;
+    }
+    globals->list = list;
+    changed = (unsigned int*)realloc(globals->changed, sizeof(unsigned int) * (capacity / 32));
+    if( changed == NULL ) {
+        return -1;
+    }
+    memset(changed + globals->capacity / 32, 0,
+        sizeof(unsigned int) * ((capacity - globals->capacity) / 32));
+    globals->changed = changed;
+    buckets = (int*)malloc(sizeof(int) * capacity * 2);
+    if( buckets == NULL ) {
+        return -1;
+    }
+    free(globals->buckets);
+    globals->buckets = buckets;
+    globals->bucket_count = capacity * 2;
+    for( i = 0; i < globals->bucket_count; i++ ) {
+        globals->buckets[i] = -1;
+    }
+    for( i = 0; i < globals->size; i++ ) {
+        bucket_global(globals, i);
+    }
+    globals->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Frees the properties of a GLOBALS context when its Lua state is closed.
+ */
+static void release_globals( void *context ) {
+    tw_globals_t *globals;
+    unsigned int i;
+    globals = (tw_globals_t*)context;
+    for( i = 0; i < globals->size; i++ ) {
+        free(globals->list[i].name);
+    }
+    free(globals->list);
+    free(globals->buckets);
+    free(globals->changed);
+}
+
+/*
+ * Returns the slot of the global with the given name, creating the global if it
+ * does not exist yet. Returns -1 if there is no room for another global.
+ */
+static int get_global( lua_State *L, tw_globals_t *globals, const char *name ) {
+    tw_global_t *global;
+    int slot;
+    slot = find_global(globals, name);
+    if( slot >= 0 ) {
+        return slot;
+    }
+    if( globals->size == globals->capacity && grow_globals(globals) ) {
+        push_error("get_global failed: Out of memory!");
+        return -1;
+    }
+    slot = globals->size;
+    global = &globals->list[slot];
+    global->name = (char*)malloc(strlen(name) + 1);
+    if( global->name == NULL ) {
+        push_error("get_global failed: Out of memory!");
+        return -1;
+    }
+    strcpy(global->name, name);
+    global->hash = global_hash(name);
+    global->type = TW_GLOBAL_NIL;
+    global->number = 0;
+    global->ref = LUA_NOREF;
+    global->fn = NULL;
+    globals->size++;
+    bucket_global(globals, slot);
+    /* let Lua find the slot by the interned key string */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, globals->keys_ref);
+    lua_pushstring(L, name);
+    lua_pushnumber(L, slot);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return slot;
+}
+
+/*
+ * Stores the Lua value at the given stack index in the given global.
+ */
+static void store_global( lua_State *L, tw_global_t *global, int index ) {
+    if( global->type == TW_GLOBAL_REF ) {
+        luaL_unref(L, LUA_REGISTRYINDEX, global->ref);
+        global->ref = LUA_NOREF;
+    }
+    switch( lua_type(L, index) ) {
+        case LUA_TNIL:
+            global->type = TW_GLOBAL_NIL;
+            break;
+        case LUA_TNUMBER:
+            global->type = TW_GLOBAL_NUMBER;
+            global->number = lua_tonumber(L, index);
+            break;
+        case LUA_TBOOLEAN:
+            global->type = TW_GLOBAL_BOOLEAN;
+            global->number = lua_toboolean(L, index);
+            break;
+        default:
+            global->type = TW_GLOBAL_REF;
+            lua_pushvalue(L, index);
+            global->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            break;
+    }
+}
+
+/*
+ * __index metamethod of GLOBALS. The table of global slots by key is the first
+ * upvalue, the GLOBALS context the second.
+ */
+static int globals_index( lua_State *L ) {
+    tw_globals_t *globals;
+    tw_global_t *global;
+    lua_rawget(L, lua_upvalueindex(1));
+    if( !lua_isnumber(L, -1) ) {
+        lua_pushnil(L);
+        return 1;
+    }
+    globals = (tw_globals_t*)lua_touserdata(L, lua_upvalueindex(2));
+    global = &globals->list[(int)lua_tonumber(L, -1)];
+    switch( global->type ) {
+        case TW_GLOBAL_NUMBER:
+            lua_pushnumber(L, global->number);
+            break;
+        case TW_GLOBAL_BOOLEAN:
+            lua_pushboolean(L, (int)global->number);
+            break;
+        case TW_GLOBAL_REF:
+            lua_rawgeti(L, LUA_REGISTRYINDEX, global->ref);
+            break;
+        default:
+            lua_pushnil(L);
+            break;
+    }
+    return 1;
+}
+
+/*
+ * __newindex metamethod of GLOBALS. Stores the value, marks the global as
+ * changed, and calls its callback with the new value on top of the stack.
+ */
+static int globals_newindex( lua_State *L ) {
+    tw_globals_t *globals;
+    tw_global_t *global;
+    int slot;
+    globals = (tw_globals_t*)lua_touserdata(L, lua_upvalueindex(2));
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    if( lua_isnumber(L, -1) ) {
+        slot = (int)lua_tonumber(L, -1);
+    }
+    else if( lua_type(L, 2) == LUA_TSTRING ) {
+        slot = get_global(L, globals, lua_tostring(L, 2));
+    }
+    else {
+        push_error("Lua: Error while setting GLOBALS: Key is not a string!");
+        lua_pushstring(L, "GLOBALS keys must be strings.");
+        lua_error(L);
+        return -1;
+    }
+    if( slot < 0 ) {
+        lua_pushstring(L, "Out of memory for GLOBALS.");
+        lua_error(L);
+        return -1;
+    }
+    lua_settop(L, 3);
+    global = &globals->list[slot];
+    store_global(L, global, 3);
+    globals->changed[slot / 32] |= 1u << (slot % 32);
+    if( global->fn != NULL ) {
+        lua_pushvalue(L, 3);
+        global->fn(L);
+    }
+    return 0;
+}
+
+/*
+ * Adds the given string to the GLOBALS of the given Lua state, which must have
+ * been set up with setup_lua_globals(). This value may later be modified. An
+ * optional pointer to a Lua-C function can be passed that will act as a
+ * callback whenever the value is modified.
+ */
+int add_lua_global_s_in( lua_State *L, const char *name, const char *value, lua_CFunction fn ) {
+    tw_globals_t *globals;
+    int slot;
+    globals = (tw_globals_t*)lua_context(L, TW_GLOBALS_CONTEXT);
+    slot = globals == NULL ? -1 : get_global(L, globals, name);
+    if( slot < 0 ) {
+        push_error("add_lua_global_s failed: Could not add global!");
+        return -1;
+    }
+    lua_pushstring(L, value);
+    store_global(L, &globals->list[slot], -1);
+    lua_pop(L, 1);
+    if( fn != NULL ) {
+        globals->list[slot].fn = fn;
+    }
+    return 0;
+}
+
 /*
  * Adds the given string to the GLOBALS Lua table. This value may later be modified.
  * An optional pointer to a Lua-C function can be passed that will act as a
@@ -26,23 +374,7 @@ static int sticky_keys = 0;
  */
 int add_lua_global_s( const char *name, const char *value, lua_CFunction fn ) {
     if( initialized ) {
-        lua_getglobal(state, GLOBALS);
-        lua_pushstring(state, "_values");
-        lua_rawget(state, -2);
-        lua_pushstring(state, name);
-        lua_pushstring(state, value);
-        lua_rawset(state, -3);
-        lua_pop(state, 1);
-        if( fn != NULL ) {
-            lua_pushstring(state, "_fns");
-            lua_rawget(state, -2);
-            lua_pushstring(state, name);
-            lua_pushcfunction(state, fn);
-            lua_rawset(state, -3);
-            lua_pop(state, 1);
-        }
-        lua_pop(state, 1);
-        return 0;
+        return add_lua_global_s_in(state, name, value, fn);
     }
     else {
         push_error("add_lua_global_s failed: Lua interface not initialized!");
@@ -56,20 +388,36 @@ int add_lua_global_s( const char *name, const char *value, lua_CFunction fn ) {
  * add a new value, use add_lua_global_s instead.
  */
 int set_lua_global_s( const char *name, const char *value ) {
-    if( initialized ) {
-        lua_getglobal(state, GLOBALS);
-        lua_pushstring(state, "_values");
-        lua_rawget(state, -2);
-        lua_pushstring(state, name);
-        lua_pushstring(state, value);
-        lua_rawset(state, -3);
-        lua_pop(state, 2);
-        return 0;
-    }
-    else {
-        push_error("set_lua_global_n failed: Lua interface not initialized!");
+    return add_lua_global_s(name, value, NULL);
+}
+
+/*
+ * Adds the given number to the GLOBALS of the given Lua state, which must have
+ * been set up with setup_lua_globals(). This value may later be modified. An
+ * optional pointer to a Lua-C function can be passed that will act as a
+ * callback whenever the value is modified.
+ */
+int add_lua_global_n_in( lua_State *L, const char *name, int value, lua_CFunction fn ) {
+    tw_globals_t *globals;
+    tw_global_t *global;
+    int slot;
+    globals = (tw_globals_t*)lua_context(L, TW_GLOBALS_CONTEXT);
+    slot = globals == NULL ? -1 : get_global(L, globals, name);
+    if( slot < 0 ) {
+        push_error("add_lua_global_n failed: Could not add global!");
         return -1;
     }
+    global = &globals->list[slot];
+    if( global->type == TW_GLOBAL_REF ) {
+        luaL_unref(L, LUA_REGISTRYINDEX, global->ref);
+        global->ref = LUA_NOREF;
+    }
+    global->type = TW_GLOBAL_NUMBER;
+    global->number = value;
+    if( fn != NULL ) {
+        global->fn = fn;
+    }
+    return 0;
 }
 
 /*
@@ -79,23 +427,7 @@ int set_lua_global_s( const char *name, const char *value ) {
  */
 int add_lua_global_n( const char *name, int value, lua_CFunction fn ) {
     if( initialized ) {
-        lua_getglobal(state, GLOBALS);
-        lua_pushstring(state, "_values");
-        lua_rawget(state, -2);
-        lua_pushstring(state, name);
-        lua_pushnumber(state, value);
-        lua_rawset(state, -3);
-        lua_pop(state, 1);
-        if( fn != NULL ) {
-            lua_pushstring(state, "_fns");
-            lua_rawget(state, -2);
-            lua_pushstring(state, name);
-            lua_pushcfunction(state, fn);
-            lua_rawset(state, -3);
-            lua_pop(state, 1);
-        }
-        lua_pop(state, 1);
-        return 0;
+        return add_lua_global_n_in(state, name, value, fn);
     }
     else {
         push_error("add_lua_global_n failed: Lua interface not initialized!");
@@ -109,32 +441,86 @@ int add_lua_global_n( const char *name, int value, lua_CFunction fn ) {
  * add a new value, use add_lua_global_n instead.
  */
 int set_lua_global_n( const char *name, int value ) {
-    if( initialized ) {
-        lua_getglobal(state, GLOBALS);
-        lua_pushstring(state, "_values");
-        lua_rawget(state, -2);
-        lua_pushstring(state, name);
-        lua_pushnumber(state, value);
-        lua_rawset(state, -3);
-        lua_pop(state, 2);
+    return add_lua_global_n(name, value, NULL);
+}
+
+/*
+ * Sets the given number in the GLOBALS of the given Lua state. To add a new
+ * value, use add_lua_global_n_in instead.
+ */
+int set_lua_global_n_in( lua_State *L, const char *name, int value ) {
+    return add_lua_global_n_in(L, name, value, NULL);
+}
+
+/*
+ * Returns the slot of the given global of the main Lua state, for use with
+ * lua_global_changed(), or -1 if there is no such global.
+ */
+int lua_global_slot( const char *name ) {
+    return find_global(main_globals, name);
+}
+
+/*
+ * Returns whether the global in the given slot was set from Lua since the last
+ * call, and clears its changed flag.
+ */
+int lua_global_changed( int slot ) {
+    unsigned int bit;
+    if( main_globals == NULL || (unsigned int)slot >= main_globals->size ) {
         return 0;
     }
-    else {
-        push_error("set_lua_global_n failed: Lua interface not initialized!");
-        return -1;
+    bit = 1u << (slot % 32);
+    if( main_globals->changed[slot / 32] & bit ) {
+        main_globals->changed[slot / 32] &= ~bit;
+        return 1;
     }
+    return 0;
+}
+
+/*
+ * Calls the C function in upvalue 1 inside a trace span named by upvalue 2.
+ */
+static int traced_function( lua_State *L ) {
+    const char *name;
+    int results;
+    name = (const char*)lua_touserdata(L, lua_upvalueindex(2));
+    trace_begin(name);
+    results = ((lua_CFunction)lua_touserdata(L, lua_upvalueindex(1)))(L);
+    trace_end(name);
+    return results;
 }
 
 /*
  * Binds the given properly formatted C function to a Lua function of the given
- * name. Consult the Lua documentation for information on how to properly format
- * a C function so that it may be bound in such a way.
+ * name in the given Lua state. Consult the Lua documentation for information on
+ * how to properly format a C function so that it may be bound in such a way.
+ * When tracing bindings, every call of the function is recorded as a span.
+ */
+int add_lua_function_in( lua_State *L, const char *name, lua_CFunction fn ) {
+    const char *span;
+    span = NULL;
+    if( trace_bindings() && fn != lua_traceBegin && fn != lua_traceEnd ) {
+        span = trace_intern(name);
+    }
+    if( span != NULL ) {
+        lua_pushlightuserdata(L, (void*)fn);
+        lua_pushlightuserdata(L, (void*)span);
+        lua_pushcclosure(L, traced_function, 2);
+    }
+    else {
+        lua_pushcfunction(L, fn);
+    }
+    lua_setglobal(L, name);
+    return 0;
+}
+
+/*
+ * Binds the given C function to a Lua function of the given name in the main
+ * Lua state, as add_lua_function_in() does.
  */
 int add_lua_function( const char *name, lua_CFunction fn ) {
     if( initialized ) {
-        lua_pushcfunction(state, fn);
-        lua_setglobal(state, name);
-        return 0;
+        return add_lua_function_in(state, name, fn);
     }
     else {
         push_error("add_lua_function failed: Lua interface not initialized!");
@@ -142,6 +528,14 @@ int add_lua_function( const char *name, lua_CFunction fn ) {
     }
 }
 
+/*
+ * Returns the main Lua state, for subsystems that call into scripts outside of
+ * Lua hooks.
+ */
+lua_State * lua_main_state() {
+    return state;
+}
+
 /*
  * Runs the given Lua function name.
  */
@@ -329,6 +723,542 @@ int lua_signalQuit( lua_State *L ) {
     return 0;
 }
 
+/*
+ * The coroutine scheduler. Coroutines started with spawn() suspend themselves
+ * with waitFrames(), waitSeconds() or waitEvent(), and are kept in one of two
+ * min-heaps (keyed by frame number or by SDL ticks) or in the waiter list of an
+ * event until they are due. Each frame only the coroutines at the top of the
+ * heaps that are due get resumed, so sleeping coroutines cost nothing.
+ *
+ * A coroutine that yields with coroutine.yield() is resumed on the next frame,
+ * whatever values it yields. The wait functions tell their yields apart from
+ * those by yielding the address of wait_sentinel first.
+ *
+ * The heaps and clocks of a Lua state are kept in its scheduler context, and
+ * the waiter lists in its TW_EVENTS registry table, so every batch instance
+ * schedules its own coroutines.
+ */
+
+typedef struct {
+    unsigned long key;
+    unsigned long seq;
+    lua_State *co;
+    int ref;
+} tw_sleeper_t;
+
+typedef struct {
+    tw_sleeper_t *items;
+    unsigned int size;
+    unsigned int capacity;
+} tw_heap_t;
+
+typedef struct {
+    tw_heap_t frame_heap;
+    tw_heap_t tick_heap;
+    unsigned long sleeper_seq;
+    unsigned long frame;
+    unsigned int ticks;
+} tw_scheduler_t;
+
+static char wait_sentinel;
+
+/*
+ * Returns the scheduler of the given Lua state.
+ */
+static tw_scheduler_t * get_scheduler( lua_State *L ) {
+    return (tw_scheduler_t*)lua_context(L, TW_SCHEDULER);
+}
+
+/*
+ * Frees the heaps of a scheduler when its Lua state is closed. The coroutines
+ * in them go with the state.
+ */
+static void release_scheduler( void *context ) {
+    tw_scheduler_t *sched;
+    sched = (tw_scheduler_t*)context;
+    free(sched->frame_heap.items);
+    free(sched->tick_heap.items);
+}
+
+/*
+ * Returns whether sleeper a is due before sleeper b. Sleepers that are due at
+ * the same time are resumed in the order they went to sleep.
+ */
+static int sleeper_before( tw_sleeper_t *a, tw_sleeper_t *b ) {
+    return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+/*
+ * Adds the given coroutine to the given heap of the given scheduler, to be
+ * resumed once the heap's clock reaches key. If that fails the coroutine is
+ * released.
+ */
+static int heap_push( tw_scheduler_t *sched, tw_heap_t *heap, unsigned long key,
+    lua_State *co, int ref ) {
+    tw_sleeper_t *items, item;
+    unsigned int i, capacity;
+    if( heap->size == heap->capacity ) {
+        capacity = heap->capacity ? heap->capacity * 2 : 64;
+        items = (tw_sleeper_t*)realloc(heap->items, sizeof(tw_sleeper_t) * capacity);
+        if( items == NULL ) {
+            push_error("heap_push failed: Out of memory!");
+            luaL_unref(co, LUA_REGISTRYINDEX, ref);
+            return -1;
+        }
+        heap->items = items;
+        heap->capacity = capacity;
+    }
+    item.key = key;
+    item.seq = sched->sleeper_seq++;
+    item.co = co;
+    item.ref = ref;
+    for( i = heap->size++; i > 0 && sleeper_before(&item, &heap->items[(i - 1) / 2]); i = (i - 1) / 2 ) {
+        heap->items[i] = heap->items[(i - 1) / 2];
+    }
+    heap->items[i] = item;
+    return 0;
+}
+
+/*
+ * Removes the first due sleeper from the given heap.
+ */
+static tw_sleeper_t heap_pop( tw_heap_t *heap ) {
+    tw_sleeper_t top, last;
+    unsigned int i, child;
+    top = heap->items[0];
+    last = heap->items[--heap->size];
+    for( i = 0; (child = 2 * i + 1) < heap->size; i = child ) {
+        if( child + 1 < heap->size && sleeper_before(&heap->items[child + 1], &heap->items[child]) ) {
+            child++;
+        }
+        if( !sleeper_before(&heap->items[child], &last) ) {
+            break;
+        }
+        heap->items[i] = heap->items[child];
+    }
+    heap->items[i] = last;
+    return top;
+}
+
+/*
+ * Adds the given coroutine to the waiter list of the given event.
+ */
+static int event_wait( lua_State *L, const char *name, int ref ) {
+    lua_getfield(L, LUA_REGISTRYINDEX, TW_EVENTS);
+    lua_getfield(L, -1, name);
+    if( lua_isnil(L, -1) ) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, name);
+    }
+    lua_pushnumber(L, ref);
+    lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+    lua_pop(L, 2);
+    return 0;
+}
+
+/*
+ * Resumes the given coroutine with the given number of arguments on its stack
+ * and schedules it on the given scheduler according to what it yielded.
+ * Finished coroutines are released.
+ */
+static int resume_coroutine( tw_scheduler_t *sched, lua_State *co, int ref, int nargs ) {
+    int status, kind;
+    lua_Number amount;
+    status = lua_resume(co, nargs);
+    if( status == LUA_YIELD ) {
+        kind = TW_WAIT_FRAMES;
+        amount = 1;
+        if( lua_gettop(co) == 3 && lua_touserdata(co, 1) == &wait_sentinel ) {
+            kind = (int)lua_tonumber(co, 2);
+            amount = lua_tonumber(co, 3);
+        }
+        switch( kind ) {
+            case TW_WAIT_TICKS:
+                status = heap_push(sched, &sched->tick_heap,
+                    sched->ticks + (amount < 1 ? 1 : (unsigned long)amount), co, ref);
+                break;
+            case TW_WAIT_EVENT:
+                status = event_wait(co, lua_tostring(co, 3), ref);
+                break;
+            default:
+                status = heap_push(sched, &sched->frame_heap,
+                    sched->frame + (amount < 1 ? 1 : (unsigned long)amount), co, ref);
+                break;
+        }
+        lua_settop(co, 0);
+        return status;
+    }
+    else if( status == 0 ) {
+        luaL_unref(co, LUA_REGISTRYINDEX, ref);
+        return 0;
+    }
+    else {
+        push_error(lua_tostring(co, -1));
+        luaL_unref(co, LUA_REGISTRYINDEX, ref);
+        return -1;
+    }
+}
+
+/*
+ * Resumes all coroutines of the given Lua state that are due at the given frame
+ * and tick count.
+ */
+int scheduler_step( lua_State *L, unsigned long frame, unsigned int ticks ) {
+    tw_scheduler_t *sched;
+    tw_sleeper_t sleeper;
+    sched = get_scheduler(L);
+    sched->frame = frame;
+    sched->ticks = ticks;
+    while( sched->frame_heap.size > 0 && sched->frame_heap.items[0].key <= frame ) {
+        sleeper = heap_pop(&sched->frame_heap);
+        if( resume_coroutine(sched, sleeper.co, sleeper.ref, 0) ) {
+            push_error("scheduler_step failed: Error in coroutine!");
+            return -1;
+        }
+    }
+    while( sched->tick_heap.size > 0 && sched->tick_heap.items[0].key <= ticks ) {
+        sleeper = heap_pop(&sched->tick_heap);
+        if( resume_coroutine(sched, sleeper.co, sleeper.ref, 0) ) {
+            push_error("scheduler_step failed: Error in coroutine!");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Lua hook to start a new coroutine running the given function with the given
+ * arguments. The coroutine runs right away until it first waits.
+ */
+int lua_spawn( lua_State *L ) {
+    lua_State *co;
+    int nargs, ref;
+    if( lua_gettop(L) < 1 || !lua_isfunction(L, 1) ) {
+        push_error("Lua: Error while calling spawn: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    nargs = lua_gettop(L) - 1;
+    co = lua_newthread(L);
+    lua_pushvalue(L, -1);
+    ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_insert(L, 1); /* thread fn args... */
+    lua_xmove(L, co, nargs + 1);
+    if( resume_coroutine(get_scheduler(L), co, ref, nargs) ) {
+        push_error("Lua: Error while calling spawn!");
+        lua_pushstring(L, "Error in spawned coroutine.");
+        lua_error(L);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Lua hook to suspend the running coroutine for the given number of frames.
+ */
+int lua_waitFrames( lua_State *L ) {
+    lua_Number frames;
+    frames = lua_gettop(L) < 1 ? 1 : lua_tonumber(L, 1);
+    lua_settop(L, 0);
+    lua_pushlightuserdata(L, &wait_sentinel);
+    lua_pushnumber(L, TW_WAIT_FRAMES);
+    lua_pushnumber(L, frames);
+    return lua_yield(L, 3);
+}
+
+/*
+ * Lua hook to suspend the running coroutine for the given number of seconds.
+ */
+int lua_waitSeconds( lua_State *L ) {
+    lua_Number seconds;
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while calling waitSeconds: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    seconds = lua_tonumber(L, 1);
+    lua_settop(L, 0);
+    lua_pushlightuserdata(L, &wait_sentinel);
+    lua_pushnumber(L, TW_WAIT_TICKS);
+    lua_pushnumber(L, seconds * 1000);
+    return lua_yield(L, 3);
+}
+
+/*
+ * Lua hook to suspend the running coroutine until the given event is signalled
+ * with signalEvent().
+ */
+int lua_waitEvent( lua_State *L ) {
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while calling waitEvent: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    if( lua_type(L, 1) != LUA_TSTRING ) {
+        push_error("Lua: Error while calling waitEvent: Event name is not a string!");
+        lua_pushstring(L, "Event name is not a string.");
+        lua_error(L);
+        return -1;
+    }
+    lua_settop(L, 1);
+    lua_pushnumber(L, TW_WAIT_EVENT);
+    lua_insert(L, 1);
+    lua_pushlightuserdata(L, &wait_sentinel);
+    lua_insert(L, 1);
+    return lua_yield(L, 3);
+}
+
+/*
+ * Lua hook to wake all coroutines waiting on the given event. The woken
+ * coroutines are resumed on the next frame. Returns the number of coroutines
+ * woken.
+ */
+int lua_signalEvent( lua_State *L ) {
+    tw_scheduler_t *sched;
+    int i, n, ref;
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while calling signalEvent: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    if( lua_type(L, 1) != LUA_TSTRING ) {
+        push_error("Lua: Error while calling signalEvent: Event name is not a string!");
+        lua_pushstring(L, "Event name is not a string.");
+        lua_error(L);
+        return -1;
+    }
+    sched = get_scheduler(L);
+    lua_settop(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, TW_EVENTS);
+    lua_getfield(L, -1, lua_tostring(L, 1));
+    n = lua_istable(L, -1) ? (int)lua_objlen(L, -1) : 0;
+    for( i = 1; i <= n; i++ ) {
+        lua_rawgeti(L, -1, i);
+        ref = (int)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+        heap_push(sched, &sched->frame_heap, sched->frame + 1, lua_tothread(L, -1), ref);
+        lua_pop(L, 1);
+    }
+    lua_pushnil(L);
+    lua_setfield(L, 2, lua_tostring(L, 1));
+    lua_settop(L, 0);
+    lua_pushnumber(L, n);
+    return 1;
+}
+
+/*
+ * Sets up a coroutine scheduler in the given Lua state and registers the
+ * spawn and wait functions in it.
+ */
+int scheduler_open( lua_State *L ) {
+    new_lua_context(L, TW_SCHEDULER, sizeof(tw_scheduler_t), release_scheduler);
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, TW_EVENTS);
+    add_lua_function_in(L, "spawn", lua_spawn);
+    add_lua_function_in(L, "waitFrames", lua_waitFrames);
+    add_lua_function_in(L, "waitSeconds", lua_waitSeconds);
+    add_lua_function_in(L, "waitEvent", lua_waitEvent);
+    add_lua_function_in(L, "signalEvent", lua_signalEvent);
+    return 0;
+}
+
+/*
+ * The garbage collector policy. The collector is kept stopped, and instead is
+ * stepped by gc_step() in the time left over at the end of each frame, so that
+ * collection work is spread over many small slices instead of landing in
+ * whichever frame happens to cross the allocation threshold.
+ *
+ * A new cycle is only started once the heap has grown to pause percent of its
+ * size after the last cycle. The amount of work done per step (the step
+ * multiplier) is derived from the observed allocation rate, so that a cycle is
+ * expected to finish before the heap grows past that point. If the idle time
+ * is not enough and the heap grows past twice that, steps are forced even
+ * without idle time left, and the pause is raised to trade memory for fewer
+ * forced steps.
+ */
+
+typedef struct {
+    unsigned int memory_kb;
+    unsigned int live_kb;
+    unsigned int alloc_rate_kb;
+    unsigned int steps;
+    unsigned int time_ms;
+    unsigned int forced_steps;
+    unsigned long cycles;
+    int pause;
+    int stepmul;
+    int collecting;
+} tw_gc_stats_t;
+
+static tw_gc_stats_t gc_stats = { 0, 0, 0, 0, 0, 0, 0, 200, 200, 0 };
+static unsigned int gc_budget = TW_GC_BUDGET;
+static double gc_steps_per_ms = 0;
+static unsigned int gc_last_kb = 0;
+
+/*
+ * Retunes the step multiplier from the observed allocation rate and the number
+ * of steps that fit in a frame.
+ */
+static void gc_tune( unsigned int steps_per_frame ) {
+    double frames_left, needed;
+    if( gc_stats.alloc_rate_kb == 0 || steps_per_frame == 0 ) {
+        return;
+    }
+    /* frames until the heap reaches the point where a cycle should be done */
+    frames_left = (double)gc_stats.live_kb * gc_stats.pause / 100.0 / gc_stats.alloc_rate_kb;
+    if( frames_left < 1 ) {
+        frames_left = 1;
+    }
+    /* each step does roughly stepmul/100 KB of work */
+    needed = (double)gc_stats.memory_kb * 100.0 / (steps_per_frame * frames_left);
+    gc_stats.stepmul = needed < 100 ? 100 : needed > 1000 ? 1000 : (int)needed;
+    lua_gc(state, LUA_GCSETSTEPMUL, gc_stats.stepmul);
+}
+
+/*
+ * Performs incremental garbage collection until the given tick deadline, or
+ * until the per-frame GC budget is spent.
+ */
+int gc_step( unsigned int deadline ) {
+    unsigned int start, now, kb, steps;
+    int done;
+    if( !initialized ) {
+        push_error("gc_step failed: Lua interface not initialized!");
+        return -1;
+    }
+    start = SDL_GetTicks();
+    if( deadline > start + gc_budget ) {
+        deadline = start + gc_budget;
+    }
+    kb = lua_gc(state, LUA_GCCOUNT, 0);
+    if( kb > gc_last_kb ) {
+        gc_stats.alloc_rate_kb = (gc_stats.alloc_rate_kb * 7 + (kb - gc_last_kb)) / 8;
+    }
+    if( !gc_stats.collecting && kb * 100 >= gc_stats.live_kb * gc_stats.pause ) {
+        gc_stats.collecting = 1;
+    }
+    steps = 0;
+    now = start;
+    while( gc_stats.collecting && now < deadline ) {
+        done = lua_gc(state, LUA_GCSTEP, 0);
+        steps++;
+        if( done ) {
+            gc_stats.cycles++;
+            gc_stats.collecting = 0;
+            gc_stats.live_kb = lua_gc(state, LUA_GCCOUNT, 0);
+            if( gc_stats.pause > 200 ) { /* idle time kept up, relax the pause */
+                gc_stats.pause -= 10;
+            }
+        }
+        now = SDL_GetTicks();
+    }
+    gc_stats.forced_steps = 0;
+    if( gc_stats.collecting && kb * 100 >= gc_stats.live_kb * 2 * gc_stats.pause ) {
+        /* falling behind: catch up with the allocations of one frame */
+        if( lua_gc(state, LUA_GCSTEP, gc_stats.alloc_rate_kb) ) {
+            gc_stats.cycles++;
+            gc_stats.collecting = 0;
+            gc_stats.live_kb = lua_gc(state, LUA_GCCOUNT, 0);
+        }
+        gc_stats.forced_steps = 1;
+        if( gc_stats.pause < 400 ) {
+            gc_stats.pause += 20;
+        }
+        now = SDL_GetTicks();
+    }
+    lua_gc(state, LUA_GCSTOP, 0); /* stepping restarts the automatic collector */
+    if( steps > 0 && now > start ) {
+        gc_steps_per_ms = (gc_steps_per_ms * 7 + (double)steps / (now - start)) / 8;
+    }
+    gc_tune((unsigned int)(gc_steps_per_ms * gc_budget));
+    gc_stats.steps = steps;
+    gc_stats.time_ms = now - start;
+    gc_stats.memory_kb = gc_last_kb = lua_gc(state, LUA_GCCOUNT, 0);
+    return 0;
+}
+
+/*
+ * Lua hook returning a table of garbage collector statistics.
+ */
+int lua_gcStats( lua_State *L ) {
+    lua_settop(L, 0);
+    lua_newtable(L);
+    lua_pushnumber(L, gc_stats.memory_kb);
+    lua_setfield(L, -2, "memoryKB");
+    lua_pushnumber(L, gc_stats.live_kb);
+    lua_setfield(L, -2, "liveKB");
+    lua_pushnumber(L, gc_stats.alloc_rate_kb);
+    lua_setfield(L, -2, "allocRateKB");
+    lua_pushnumber(L, gc_stats.steps);
+    lua_setfield(L, -2, "steps");
+    lua_pushnumber(L, gc_stats.time_ms);
+    lua_setfield(L, -2, "timeMs");
+    lua_pushnumber(L, gc_stats.forced_steps);
+    lua_setfield(L, -2, "forcedSteps");
+    lua_pushnumber(L, gc_stats.cycles);
+    lua_setfield(L, -2, "cycles");
+    lua_pushnumber(L, gc_stats.pause);
+    lua_setfield(L, -2, "pause");
+    lua_pushnumber(L, gc_stats.stepmul);
+    lua_setfield(L, -2, "stepmul");
+    return 1;
+}
+
+/*
+ * Lua callback to set the per-frame GC budget whenever GLOBALS.gcBudget is
+ * changed.
+ */
+int lua_setGcBudget( lua_State *L ) {
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while setting gcBudget: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    gc_budget = (unsigned int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return 0;
+}
+
+/*
+ * Lua hook returning a table of allocator statistics for the Lua state.
+ */
+int lua_allocStats( lua_State *L ) {
+    lua_settop(L, 0);
+    lua_newtable(L);
+    lua_pushnumber(L, lua_pool.bytes_in_use);
+    lua_setfield(L, -2, "bytesInUse");
+    lua_pushnumber(L, lua_pool.bytes_reserved);
+    lua_setfield(L, -2, "poolBytesReserved");
+    lua_pushnumber(L, lua_pool.large_bytes);
+    lua_setfield(L, -2, "largeBytes");
+    lua_pushnumber(L, lua_pool.allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_pushnumber(L, lua_pool.frees);
+    lua_setfield(L, -2, "frees");
+    lua_pushnumber(L, lua_pool.large_allocs);
+    lua_setfield(L, -2, "largeAllocs");
+    return 1;
+}
+
+/*
+ * Panic function for the Lua state, called on errors outside of any protected
+ * call. Dumps the error stack before Lua aborts the application.
+ */
+static int lua_panic( lua_State *L ) {
+    push_error(lua_tostring(L, -1));
+    push_error("Unprotected error in call to Lua API!");
+    dump_stack_trace();
+    return 0;
+}
+
 /*
  * Initializes the Lua table "eventList".
  */
@@ -339,12 +1269,18 @@ int eventlist_init() {
 }
 
 /*
- * Initializes the game logic, opening and running the given game file.
+ * Initializes the game logic, opening and running the given game file. The
+ * game file is loaded through the module loader so that its bytecode is cached
+ * and it can require() other modules from its own directory.
  */
 int gamelogic_init( const char *file ) {
     int status;
     add_lua_global_n("stickyKeys", 0, lua_setStickyKeys);
-    status = luaL_dofile(state, file);
+    add_lua_global_n("gcBudget", TW_GC_BUDGET, lua_setGcBudget);
+    if( loader_init(state, file) ) {
+        return -1;
+    }
+    status = loader_load_file(state, file) || lua_pcall(state, 0, LUA_MULTRET, 0);
     if( status ) {
         push_error(lua_tostring(state, -1));
     }
@@ -352,52 +1288,71 @@ int gamelogic_init( const char *file ) {
 }
 
 /*
- * Initializes the GLOBALS meta table, as well as initializing the setMain and
- * setDisplay Lua functions.
+ * Creates GLOBALS in the given Lua state as a userdata whose properties live in
+ * the GLOBALS context of that state. Lua finds the slot of a property through a
+ * table keyed by the (interned) property name, which is the first upvalue of
+ * both metamethods, and C finds it through a hash table. The property list and
+ * the hash table grow as properties are added.
  */
-static int setup_lua_globals() {
+int setup_lua_globals( lua_State *L ) {
+    tw_globals_t *globals;
+    globals = (tw_globals_t*)new_lua_context(L, TW_GLOBALS_CONTEXT, sizeof(tw_globals_t),
+        release_globals);
+    if( grow_globals(globals) ) {
+        push_error("setup_lua_globals failed: Out of memory!");
+        return -1;
+    }
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    globals->keys_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_newuserdata(L, 1);
+    luaL_newmetatable(L, GLOBALS);
+    lua_pushvalue(L, -3);
+    lua_pushlightuserdata(L, globals);
+    lua_pushcclosure(L, globals_index, 2);
+    lua_setfield(L, -2, "__index");
+    lua_pushvalue(L, -3);
+    lua_pushlightuserdata(L, globals);
+    lua_pushcclosure(L, globals_newindex, 2);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable"); /* keep scripts from replacing it */
+    lua_setmetatable(L, -2);
+    lua_setglobal(L, GLOBALS);
+    lua_pop(L, 1);
+    return 0;
+}
+
+/*
+ * Initializes the setMain and setDisplay Lua functions in the given Lua state.
+ * Batch instances share this setup (see tw_batch.c).
+ */
+int setup_lua_main( lua_State *L ) {
     int status;
-    status = luaL_dostring(state,
-        "globals_meta = {\n"
-        "    __newindex = function(t, k, v)\n"
-        "        t._values[k] = v\n"
-        "        if(t._fns[k] ~= nil) then\n"
-        "            t._fns[k](v)\n"
-        "        end\n"
-        "    end,\n"
-        "    __index = function(t, k)\n"
-        "        return rawget(t, '_values')[k]\n"
-        "    end\n"
-        "}");
+    status = luaL_dostring(L,
+        "tw_main = function()\n"
+        "    print(\"Main not set!\")\n"
+        "end");
     if( !status ) {
-        status = luaL_dostring(state, "setmetatable(GLOBALS, globals_meta)");
+        status = luaL_dostring(L,
+            "setMain = function(fn)\n"
+            "    tw_main = fn\n"
+            "end");
         if( !status ) {
-            status = luaL_dostring(state,
-                "tw_main = function()\n"
-                "    print(\"Main not set!\")\n"
+            status = luaL_dostring(L,
+                "tw_display = function()\n"
+                "    print(\"Display not set!\")\n"
                 "end");
             if( !status ) {
-                status = luaL_dostring(state,
-                    "setMain = function(fn)\n"
-                    "    tw_main = fn\n"
+                status = luaL_dostring(L,
+                    "setDisplay = function(fn)\n"
+                    "    tw_display = fn\n"
                     "end");
-                if( !status ) {
-                    status = luaL_dostring(state,
-                        "tw_display = function()\n"
-                        "    print(\"Display not set!\")\n"
-                        "end");
-                    if( !status ) {
-                        status = luaL_dostring(state,
-                            "setDisplay = function(fn)\n"
-                            "    tw_display = fn\n"
-                            "end");
-                    }
-                }
             }
         }
     }
     if( status ) {
-        push_error(lua_tostring(state, -1));
+        push_error(lua_tostring(L, -1));
     }
     return status;
 }
@@ -411,29 +1366,33 @@ int lua_init() {
         return 0;
     }
     else {
-        state = lua_open();
+        pool_init(&lua_pool);
+        state = lua_newstate(pool_lua_alloc, &lua_pool);
         if( state == NULL ) {
             push_error("Failed to create Lua state!");
             return 1;
         }
+        lua_atpanic(state, lua_panic);
         luaL_openlibs(state);
-        lua_newtable(state);
-        lua_setglobal(state, GLOBALS);
-        lua_getglobal(state, GLOBALS);
-        lua_pushstring(state, "_values");
-        lua_newtable(state);
-        lua_rawset(state, -3);
-        lua_pushstring(state, "_fns");
-        lua_newtable(state);
-        lua_rawset(state, -3);
-        lua_pop(state, 1);
-        setup_lua_globals();
+        if( setup_lua_globals(state) ) {
+            push_error("Failed to create GLOBALS during Lua initialization!");
+            return 1;
+        }
+        main_globals = (tw_globals_t*)lua_context(state, TW_GLOBALS_CONTEXT);
+        setup_lua_main(state);
         initialized = 1;
         if( add_lua_function("quit", lua_signalQuit) ) {
             push_error("Failed to add quit function during Lua initialization!");
             initialized = 0;
             return 1;
         }
+        scheduler_open(state);
+        add_lua_function("gcStats", lua_gcStats);
+        add_lua_function("allocStats", lua_allocStats);
+        add_lua_function("traceBegin", lua_traceBegin);
+        add_lua_function("traceEnd", lua_traceEnd);
+        gc_stats.live_kb = lua_gc(state, LUA_GCCOUNT, 0);
+        lua_gc(state, LUA_GCSTOP, 0); /* collection is driven by gc_step */
         return 0;
     }
 }
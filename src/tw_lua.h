@@ -10,24 +10,105 @@
 #include <lauxlib.h>
 #include "SDL.h"
 
+/*
+ * Creates the zeroed context of the subsystem with the given name in the given
+ * Lua state, keeping it in the registry until the state is closed, when the
+ * given function (if any) is called to release what the context holds. Every
+ * state has its own contexts, so batch instances share no subsystem state.
+ */
+void * new_lua_context( lua_State *L, const char *name, size_t size, void (*release)( void * ) );
+
+/*
+ * Returns the context of the subsystem with the given name in the given Lua
+ * state, or NULL if the subsystem was not set up in it.
+ */
+void * lua_context( lua_State *L, const char *name );
+
 int add_lua_global_s( const char *name, const char *value, lua_CFunction fn );
 
+/*
+ * Adds the given string to the GLOBALS of the given Lua state, which must have
+ * been set up with setup_lua_globals().
+ */
+int add_lua_global_s_in( lua_State *L, const char *name, const char *value, lua_CFunction fn );
+
 int set_lua_global_s( const char *name, const char *value );
 
 int add_lua_global_n( const char *name, int value, lua_CFunction fn );
 
 int set_lua_global_n( const char *name, int value );
 
-int add_lua_function( const char *name, lua_CFunction fn );
+/*
+ * Adds the given number to the GLOBALS of the given Lua state, which must have
+ * been set up with setup_lua_globals().
+ */
+int add_lua_global_n_in( lua_State *L, const char *name, int value, lua_CFunction fn );
+
+/*
+ * Sets the given number in the GLOBALS of the given Lua state.
+ */
+int set_lua_global_n_in( lua_State *L, const char *name, int value );
+
+/*
+ * Returns the slot of the given global of the main Lua state, for use with
+ * lua_global_changed(), or -1 if there is no such global.
+ */
+int lua_global_slot( const char *name );
+
+/*
+ * Returns whether the global in the given slot was set from Lua since the last
+ * call, and clears its changed flag.
+ */
+int lua_global_changed( int slot );
 
 int add_lua_function( const char *name, lua_CFunction fn );
 
+/*
+ * Binds the given C function to a Lua function of the given name in the given
+ * Lua state.
+ */
+int add_lua_function_in( lua_State *L, const char *name, lua_CFunction fn );
+
+/*
+ * Returns the main Lua state, for subsystems that call into scripts outside of
+ * Lua hooks.
+ */
+lua_State * lua_main_state();
+
+/*
+ * Creates GLOBALS in the given Lua state.
+ */
+int setup_lua_globals( lua_State *L );
+
+/*
+ * Initializes the setMain and setDisplay Lua functions in the given Lua state.
+ */
+int setup_lua_main( lua_State *L );
+
 int run_lua_function( const char *name );
 
 int lua_keyboard( SDL_Event *event );
 
 int lua_mouse( unsigned int down, unsigned int button, int x, int y );
 
+/*
+ * Resumes all coroutines of the given Lua state that are due at the given frame
+ * and tick count.
+ */
+int scheduler_step( lua_State *L, unsigned long frame, unsigned int ticks );
+
+/*
+ * Sets up a coroutine scheduler in the given Lua state and registers the
+ * spawn and wait functions in it.
+ */
+int scheduler_open( lua_State *L );
+
+/*
+ * Performs incremental garbage collection until the given tick deadline, or
+ * until the per-frame GC budget is spent.
+ */
+int gc_step( unsigned int deadline );
+
 int eventlist_reset();
 
 int eventlist_init();
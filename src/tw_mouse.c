@@ -8,15 +8,20 @@
  */
 
 #include "tw_error.h"
+#include "tw_graphics.h"
 #include "tw_lua.h"
 #include "tw_mouse.h"
 
 int handle_mouse( SDL_Event *event ) {
+    int x, y;
+    x = event->button.x;
+    y = event->button.y;
+    graphics_window_to_logical(&x, &y); /* scripts work in logical pixels */
     if( event->type == SDL_MOUSEBUTTONDOWN && event->button.state == SDL_PRESSED ) {
-        return lua_mouse(1, event->button.button, event->button.x, event->button.y);
+        return lua_mouse(1, event->button.button, x, y);
     }
     else if( event->type == SDL_MOUSEBUTTONUP && event->button.state == SDL_RELEASED ) {
-        return lua_mouse(0, event->button.button, event->button.x, event->button.y);
+        return lua_mouse(0, event->button.button, x, y);
     }
     else {
         push_error("Event passed to handle_mouse that is not a mouse button event!");
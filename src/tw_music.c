@@ -0,0 +1,580 @@
+/*
+ * tw_music.c
+ *
+ * This file contains the source code pertaining to music playback in the
+ * ToyWrench application. Music tracks are long, so instead of being loaded
+ * into memory like sounds they are streamed: a background thread decodes each
+ * playing track a chunk at a time into a small ring buffer, and the audio
+ * callback mixes from that ring buffer. A track therefore only ever occupies
+ * TW_MUSIC_RING frames of memory, and no decoding happens on the main thread
+ * or in the audio callback.
+ *
+ * Looping tracks are rewound by the decoding thread as soon as it reaches their
+ * end, so the start of the track follows its end in the ring buffer without a
+ * gap. Starting a track while another one plays crossfades between the two.
+ *
+ * Each stream slot moves through its states in a fixed order, and each state
+ * change is made by only one thread: the main thread starts a free slot
+ * playing, the audio callback marks a finished slot as done, and the decoding
+ * thread closes a done slot and frees it again. The ring buffer of a slot has
+ * a single writer (the decoding thread) and a single reader (the callback).
+ *
+ * WAV files are always supported. Ogg Vorbis files are supported when built
+ * with TW_VORBIS defined and linked against libvorbisfile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef TW_VORBIS
+#include <vorbis/vorbisfile.h>
+#endif
+#include "tw_music.h"
+#include "tw_error.h"
+#include "tw_lua.h"
+#include "tw_trace.h"
+
+#define TW_MUSIC_STREAMS 3
+#define TW_MUSIC_RING 16384 /* frames, must be a power of two */
+#define TW_MUSIC_CHUNK 2048 /* frames */
+#define TW_MUSIC_DELAY 10
+
+#define TW_STREAM_FREE 0
+#define TW_STREAM_PLAYING 1
+#define TW_STREAM_DONE 2
+
+typedef struct {
+    void *handle;
+    int freq;
+    int channels;
+    /* returns the number of frames read, 0 at the end, or -1 on errors */
+    int (*read)( void *handle, Sint16 *buf, int frames );
+    int (*rewind)( void *handle );
+    void (*close)( void *handle );
+} tw_decoder_t;
+
+typedef struct {
+    FILE *fp;
+    long data_start;
+    Uint32 data_size;
+    Uint32 data_left;
+    int bits;
+    int channels;
+} tw_wav_t;
+
+typedef struct {
+    volatile int state;
+    tw_decoder_t decoder;
+    int loop;
+    int eof;
+    volatile int ended; /* eof, and all decoded frames are in the ring */
+    /* decoded source frames, owned by the decoding thread */
+    Sint16 src[TW_MUSIC_CHUNK * 2];
+    int src_len;
+    int src_pos;
+    /* resampler state, owned by the decoding thread */
+    Uint32 step;
+    Uint32 frac;
+    Sint16 prev[2];
+    Sint16 next[2];
+    int primed;
+    /* ring buffer */
+    Sint16 ring[TW_MUSIC_RING * 2];
+    volatile unsigned int write_pos;
+    volatile unsigned int read_pos;
+    /* fading, owned by the audio callback except for fade_request */
+    volatile int fade_request; /* frames, negative to fade out */
+    float gain;
+    float gain_step;
+} tw_stream_t;
+
+static int initialized = 0;
+static int output_freq = 0;
+static tw_stream_t *streams = NULL;
+static int current_stream = -1;
+static volatile Sint16 music_volume = 256;
+static SDL_Thread *decode_thread = NULL;
+
+/*
+ * Reads up to the given number of frames of 16-bit samples from a WAV file.
+ */
+static int wav_read( void *handle, Sint16 *buf, int frames ) {
+    tw_wav_t *wav;
+    Uint8 *bytes;
+    size_t want, got, i;
+    wav = (tw_wav_t*)handle;
+    want = (size_t)frames * wav->channels * (wav->bits / 8);
+    if( want > wav->data_left ) {
+        want = wav->data_left;
+    }
+    if( want == 0 ) {
+        return 0;
+    }
+    got = fread(buf, 1, want, wav->fp);
+    if( got == 0 ) {
+        return ferror(wav->fp) ? -1 : 0;
+    }
+    wav->data_left -= got;
+    if( wav->bits == 8 ) { /* unsigned 8-bit, widen in place from the back */
+        bytes = (Uint8*)buf;
+        for( i = got; i-- > 0; ) {
+            buf[i] = (Sint16)((bytes[i] - 128) << 8);
+        }
+        return (int)(got / wav->channels);
+    }
+#if SDL_BYTEORDER != SDL_LIL_ENDIAN
+    for( i = 0; i < got / 2; i++ ) {
+        buf[i] = (Sint16)(((Uint16)buf[i] >> 8) | ((Uint16)buf[i] << 8));
+    }
+#endif
+    return (int)(got / (2 * wav->channels));
+}
+
+static int wav_rewind( void *handle ) {
+    tw_wav_t *wav;
+    wav = (tw_wav_t*)handle;
+    wav->data_left = wav->data_size;
+    return fseek(wav->fp, wav->data_start, SEEK_SET);
+}
+
+static void wav_close( void *handle ) {
+    fclose(((tw_wav_t*)handle)->fp);
+    free(handle);
+}
+
+/*
+ * Returns the little endian number stored in the given bytes.
+ */
+static Uint32 le32( const Uint8 *b ) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((Uint32)b[3] << 24);
+}
+
+static Uint16 le16( const Uint8 *b ) {
+    return (Uint16)(b[0] | (b[1] << 8));
+}
+
+/*
+ * Opens a streaming decoder for the given PCM WAV file.
+ */
+static int wav_open( const char *file, tw_decoder_t *decoder ) {
+    tw_wav_t *wav;
+    Uint8 header[12], chunk[8], fmt[16];
+    Uint32 size;
+    int have_fmt;
+    wav = (tw_wav_t*)malloc(sizeof(tw_wav_t));
+    if( wav == NULL ) {
+        return -1;
+    }
+    wav->fp = fopen(file, "rb");
+    if( wav->fp == NULL ) {
+        free(wav);
+        return -1;
+    }
+    have_fmt = 0;
+    if( fread(header, 1, 12, wav->fp) != 12 || memcmp(header, "RIFF", 4) ||
+        memcmp(header + 8, "WAVE", 4) ) {
+        wav_close(wav);
+        return -1;
+    }
+    while( fread(chunk, 1, 8, wav->fp) == 8 ) {
+        size = le32(chunk + 4);
+        if( !memcmp(chunk, "fmt ", 4) && size >= 16 ) {
+            if( fread(fmt, 1, 16, wav->fp) != 16 ) {
+                break;
+            }
+            wav->channels = le16(fmt + 2);
+            decoder->freq = le32(fmt + 4);
+            wav->bits = le16(fmt + 14);
+            have_fmt = le16(fmt) == 1 && (wav->channels == 1 || wav->channels == 2) &&
+                (wav->bits == 8 || wav->bits == 16) && decoder->freq > 0;
+            size -= 16;
+        }
+        else if( !memcmp(chunk, "data", 4) && have_fmt ) {
+            wav->data_start = ftell(wav->fp);
+            wav->data_size = size;
+            wav->data_left = size;
+            decoder->handle = wav;
+            decoder->channels = wav->channels;
+            decoder->read = wav_read;
+            decoder->rewind = wav_rewind;
+            decoder->close = wav_close;
+            return 0;
+        }
+        if( fseek(wav->fp, size + (size & 1), SEEK_CUR) ) {
+            break;
+        }
+    }
+    wav_close(wav);
+    return -1;
+}
+
+#ifdef TW_VORBIS
+static int vorbis_read( void *handle, Sint16 *buf, int frames ) {
+    OggVorbis_File *vf;
+    vorbis_info *info;
+    long got;
+    int section;
+    vf = (OggVorbis_File*)handle;
+    info = ov_info(vf, -1);
+    got = ov_read(vf, (char*)buf, frames * info->channels * 2,
+        SDL_BYTEORDER != SDL_LIL_ENDIAN, 2, 1, &section);
+    if( got < 0 ) {
+        return -1;
+    }
+    return (int)(got / (2 * info->channels));
+}
+
+static int vorbis_rewind( void *handle ) {
+    return ov_pcm_seek((OggVorbis_File*)handle, 0);
+}
+
+static void vorbis_close( void *handle ) {
+    ov_clear((OggVorbis_File*)handle);
+    free(handle);
+}
+
+/*
+ * Opens a streaming decoder for the given Ogg Vorbis file.
+ */
+static int vorbis_open( const char *file, tw_decoder_t *decoder ) {
+    OggVorbis_File *vf;
+    vorbis_info *info;
+    vf = (OggVorbis_File*)malloc(sizeof(OggVorbis_File));
+    if( vf == NULL ) {
+        return -1;
+    }
+    if( ov_fopen(file, vf) ) {
+        free(vf);
+        return -1;
+    }
+    info = ov_info(vf, -1);
+    if( info == NULL || info->channels < 1 || info->channels > 2 ) {
+        vorbis_close(vf);
+        return -1;
+    }
+    decoder->handle = vf;
+    decoder->freq = info->rate;
+    decoder->channels = info->channels;
+    decoder->read = vorbis_read;
+    decoder->rewind = vorbis_rewind;
+    decoder->close = vorbis_close;
+    return 0;
+}
+#endif
+
+/*
+ * Opens a streaming decoder for the given file, picking the decoder by the
+ * file's extension.
+ */
+static int decoder_open( const char *file, tw_decoder_t *decoder ) {
+    const char *ext;
+    ext = strrchr(file, '.');
+    if( ext != NULL && !strcmp(ext, ".ogg") ) {
+#ifdef TW_VORBIS
+        return vorbis_open(file, decoder);
+#else
+        push_error("decoder_open failed: Built without Ogg Vorbis support!");
+        return -1;
+#endif
+    }
+    return wav_open(file, decoder);
+}
+
+/*
+ * Reads the next source frame of the given stream as stereo into frame,
+ * rewinding looping streams at their end. Returns 0 at the end of the stream.
+ */
+static int stream_next_frame( tw_stream_t *stream, Sint16 *frame ) {
+    int n;
+    if( stream->src_pos >= stream->src_len ) {
+        stream->src_pos = 0;
+        stream->src_len = 0;
+        n = stream->decoder.read(stream->decoder.handle, stream->src, TW_MUSIC_CHUNK);
+        if( n == 0 && stream->loop && !stream->decoder.rewind(stream->decoder.handle) ) {
+            n = stream->decoder.read(stream->decoder.handle, stream->src, TW_MUSIC_CHUNK);
+        }
+        if( n <= 0 ) {
+            return 0;
+        }
+        stream->src_len = n;
+    }
+    if( stream->decoder.channels == 1 ) {
+        frame[0] = frame[1] = stream->src[stream->src_pos];
+    }
+    else {
+        frame[0] = stream->src[stream->src_pos * 2];
+        frame[1] = stream->src[stream->src_pos * 2 + 1];
+    }
+    stream->src_pos++;
+    return 1;
+}
+
+/*
+ * Decodes up to the given number of output frames of the given stream into
+ * out, resampling from the source rate to the output rate with linear
+ * interpolation. Returns the number of frames decoded.
+ */
+static int stream_decode( tw_stream_t *stream, Sint16 *out, int frames ) {
+    int i;
+    if( !stream->primed ) {
+        if( !stream_next_frame(stream, stream->prev) ) {
+            return 0;
+        }
+        if( !stream_next_frame(stream, stream->next) ) {
+            stream->next[0] = stream->prev[0];
+            stream->next[1] = stream->prev[1];
+        }
+        stream->primed = 1;
+    }
+    for( i = 0; i < frames && !stream->eof; i++ ) {
+        out[i * 2] = (Sint16)(stream->prev[0] +
+            (((stream->next[0] - stream->prev[0]) * (Sint32)(stream->frac >> 1)) >> 15));
+        out[i * 2 + 1] = (Sint16)(stream->prev[1] +
+            (((stream->next[1] - stream->prev[1]) * (Sint32)(stream->frac >> 1)) >> 15));
+        stream->frac += stream->step;
+        while( stream->frac >= 0x10000 ) {
+            stream->frac -= 0x10000;
+            stream->prev[0] = stream->next[0];
+            stream->prev[1] = stream->next[1];
+            if( !stream_next_frame(stream, stream->next) ) {
+                stream->eof = 1;
+                break;
+            }
+        }
+    }
+    return i;
+}
+
+/*
+ * Background thread keeping the ring buffers of all playing streams filled,
+ * and closing streams that are done.
+ */
+static int music_thread( void *data ) {
+    static Sint16 chunk[TW_MUSIC_CHUNK * 2];
+    tw_stream_t *stream;
+    unsigned int space, pos, first;
+    int i, n;
+    (void)data;
+    trace_thread("music");
+    for( ;; ) {
+        for( i = 0; i < TW_MUSIC_STREAMS; i++ ) {
+            stream = &streams[i];
+            if( stream->state == TW_STREAM_PLAYING ) {
+                space = TW_MUSIC_RING - (stream->write_pos - stream->read_pos);
+                while( !stream->eof && space >= TW_MUSIC_CHUNK ) {
+                    trace_begin("decode");
+                    n = stream_decode(stream, chunk, TW_MUSIC_CHUNK);
+                    trace_end("decode");
+                    if( n <= 0 ) {
+                        stream->eof = 1;
+                        break;
+                    }
+                    pos = stream->write_pos & (TW_MUSIC_RING - 1);
+                    first = TW_MUSIC_RING - pos < (unsigned int)n ? TW_MUSIC_RING - pos : (unsigned int)n;
+                    memcpy(stream->ring + pos * 2, chunk, first * 4);
+                    memcpy(stream->ring, chunk + first * 2, (n - first) * 4);
+                    __sync_synchronize(); /* samples before the new position */
+                    stream->write_pos += n;
+                    space -= n;
+                }
+                if( stream->eof && !stream->ended ) {
+                    __sync_synchronize(); /* last frames before the flag */
+                    stream->ended = 1;
+                }
+            }
+            else if( stream->state == TW_STREAM_DONE ) {
+                stream->decoder.close(stream->decoder.handle);
+                __sync_synchronize();
+                stream->state = TW_STREAM_FREE;
+            }
+        }
+        SDL_Delay(TW_MUSIC_DELAY);
+    }
+    return 0;
+}
+
+/*
+ * Adds the currently playing music streams to the given mix buffer at the given
+ * 8.8 fixed point master volume. Called from the audio callback.
+ */
+void music_mix( Sint32 *out, int frames, Sint16 master_volume ) {
+    tw_stream_t *stream;
+    unsigned int avail, pos;
+    float volume;
+    int i, j, n, request, faded;
+    if( streams == NULL ) {
+        return;
+    }
+    volume = music_volume * master_volume / 65536.0f;
+    for( i = 0; i < TW_MUSIC_STREAMS; i++ ) {
+        stream = &streams[i];
+        if( stream->state != TW_STREAM_PLAYING ) {
+            continue;
+        }
+        request = stream->fade_request;
+        if( request && __sync_bool_compare_and_swap(&stream->fade_request, request, 0) ) {
+            stream->gain_step = request > 0 ? (1.0f - stream->gain) / request :
+                -stream->gain / -request;
+        }
+        avail = stream->write_pos - stream->read_pos;
+        __sync_synchronize();
+        n = avail < (unsigned int)frames ? (int)avail : frames;
+        pos = stream->read_pos;
+        faded = 0;
+        for( j = 0; j < n; j++, pos++ ) {
+            stream->gain += stream->gain_step;
+            if( stream->gain >= 1.0f ) {
+                stream->gain = 1.0f;
+                stream->gain_step = 0;
+            }
+            else if( stream->gain <= 0.0f ) {
+                stream->gain = 0.0f;
+                if( stream->gain_step < 0 ) {
+                    faded = 1;
+                    break;
+                }
+            }
+            out[j * 2] += (Sint32)(stream->ring[(pos & (TW_MUSIC_RING - 1)) * 2] * stream->gain * volume);
+            out[j * 2 + 1] += (Sint32)(stream->ring[(pos & (TW_MUSIC_RING - 1)) * 2 + 1] * stream->gain * volume);
+        }
+        __sync_synchronize(); /* done reading before releasing the space */
+        stream->read_pos = pos;
+        if( faded || (stream->ended && stream->read_pos == stream->write_pos) ) {
+            stream->state = TW_STREAM_DONE;
+        }
+    }
+}
+
+/*
+ * Starts playing the given music file, crossfading from the current music over
+ * the given number of frames.
+ */
+static int play_music( const char *file, int fade, int loop ) {
+    tw_stream_t *stream;
+    int i;
+    if( !initialized ) {
+        push_error("play_music failed: Music interface not initialized!");
+        return -1;
+    }
+    if( output_freq == 0 ) {
+        return 0; /* no audio device */
+    }
+    for( i = 0; i < TW_MUSIC_STREAMS && streams[i].state != TW_STREAM_FREE; i++ );
+    if( i == TW_MUSIC_STREAMS ) {
+        push_error("play_music failed: Too many music streams fading!");
+        return -1;
+    }
+    stream = &streams[i];
+    if( decoder_open(file, &stream->decoder) ) {
+        push_error("play_music failed: Failed to open given music file!");
+        return -1;
+    }
+    stream->loop = loop;
+    stream->eof = 0;
+    stream->ended = 0;
+    stream->src_len = 0;
+    stream->src_pos = 0;
+    stream->step = (Uint32)(((Uint64)stream->decoder.freq << 16) / output_freq);
+    stream->frac = 0;
+    stream->primed = 0;
+    stream->write_pos = 0;
+    stream->read_pos = 0;
+    stream->fade_request = fade > 0 ? fade : 0;
+    stream->gain = fade > 0 ? 0.0f : 1.0f;
+    stream->gain_step = 0;
+    if( current_stream >= 0 && streams[current_stream].state == TW_STREAM_PLAYING ) {
+        streams[current_stream].fade_request = -(fade > 0 ? fade : 1);
+    }
+    __sync_synchronize(); /* stream set up before the callback sees it */
+    stream->state = TW_STREAM_PLAYING;
+    current_stream = i;
+    return 0;
+}
+
+/*
+ * Lua hook to the function
+ * play_music( const char *file, int fade, int loop )
+ * taking the fade time in seconds, and looping unless told otherwise.
+ */
+int lua_playMusic( lua_State *L ) {
+    int fade, loop;
+    if( lua_gettop(L) == 0 ) {
+        push_error("Lua: Error while calling playMusic: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    fade = (int)(lua_tonumber(L, 2) * output_freq);
+    loop = lua_isnoneornil(L, 3) ? 1 : lua_toboolean(L, 3);
+    if( play_music(lua_tostring(L, 1), fade, loop) ) {
+        push_error("Lua: Error while calling playMusic!");
+        lua_pushstring(L, "Error while playing music.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to fade out the current music over the given number of seconds.
+ */
+int lua_stopMusic( lua_State *L ) {
+    int fade;
+    fade = (int)(lua_tonumber(L, 1) * output_freq);
+    if( current_stream >= 0 && streams[current_stream].state == TW_STREAM_PLAYING ) {
+        streams[current_stream].fade_request = -(fade > 0 ? fade : 1);
+    }
+    current_stream = -1;
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua callback to set the music volume whenever GLOBALS.musicVolume is
+ * changed.
+ */
+int lua_setMusicVolume( lua_State *L ) {
+    lua_Number volume;
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while setting musicVolume: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    volume = lua_tonumber(L, -1);
+    music_volume = (Sint16)((volume < 0 ? 0 : volume > 4 ? 4 : volume) * 256);
+    lua_pop(L, 1);
+    return 0;
+}
+
+/*
+ * Initializes music playback for the given output rate. A rate of 0 means there
+ * is no audio device, in which case music functions do nothing.
+ */
+int music_init( int freq ) {
+    if( initialized ) {
+        push_warning("Music interface already initialized!");
+        return 0;
+    }
+    output_freq = freq;
+    if( freq > 0 ) {
+        streams = (tw_stream_t*)calloc(TW_MUSIC_STREAMS, sizeof(tw_stream_t));
+        if( streams == NULL ) {
+            push_error("music_init failed: Out of memory!");
+            return -1;
+        }
+        decode_thread = SDL_CreateThread(music_thread, NULL);
+        if( decode_thread == NULL ) {
+            free(streams);
+            streams = NULL;
+            push_error("music_init failed: Failed to start decoding thread!");
+            return -1;
+        }
+    }
+    add_lua_function("playMusic", lua_playMusic);
+    add_lua_function("stopMusic", lua_stopMusic);
+    add_lua_global_n("musicVolume", 1, lua_setMusicVolume);
+    initialized = 1;
+    return 0;
+}
@@ -0,0 +1,18 @@
+/*
+ * tw_music.h
+ */
+
+#ifndef TWMUSIC
+#define TWMUSIC
+
+#include "SDL.h"
+
+/*
+ * Adds the currently playing music streams to the given mix buffer at the given
+ * 8.8 fixed point master volume. Called from the audio callback.
+ */
+void music_mix( Sint32 *out, int frames, Sint16 master_volume );
+
+int music_init( int freq );
+
+#endif
@@ -0,0 +1,926 @@
+/*
+ * tw_path.c
+ *
+ * This file contains the source code pertaining to pathfinding in the
+ * ToyWrench application. Scripts describe the walkable space of a level as a
+ * grid of cells, each with the cost of entering it from 1 to 255, or 0 where it
+ * is blocked, and ask for paths across it:
+ *
+ *   grid = createGrid(w, h, [diagonal], [cost])
+ *   grid:size()                             width and height of the grid
+ *   grid:get(x, y)                          cost of one cell
+ *   grid:set(x, y, cost)                    sets the cost of one cell
+ *   grid:fill(x, y, w, h, cost)             sets the cost of a rectangle
+ *   grid:findPath(sx, sy, gx, gy)           path and its cost, or nil
+ *   grid:flowField(gx, gy)                  flow field towards the goal
+ *   grid:requestPath(sx, sy, gx, gy, fn)    findPath over the next frames
+ *   grid:requestFlowField(gx, gy, fn)       flowField over the next frames
+ *
+ * Cells are addressed from 0. Paths are found with A* and returned as a table
+ * of the cells along them, start and goal included, in the form
+ * {x1, y1, x2, y2, ...}. Moves on diagonal grids may go diagonally, but never
+ * cut the corner of a blocked cell. Costs are counted in orthogonal moves onto
+ * a cell of cost 1; a diagonal move costs 1.4 times as much.
+ *
+ * Many agents heading for the same goal are better served by a flow field,
+ * which holds the best next move and the remaining cost for every cell of the
+ * grid, computed by one search outwards from the goal:
+ *
+ *   field:size()                            width and height of the field
+ *   field:direction(x, y)                   dx, dy of the best next move
+ *   field:distance(x, y)                    remaining cost, or nil
+ *
+ * A field keeps the state of the grid at the time it was computed. The
+ * direction is 0, 0 at the goal and in cells that can not reach it.
+ *
+ * Searches over large grids can take longer than a frame. The request methods
+ * queue them instead, and path_step() advances the queue at the start of each
+ * frame by up to GLOBALS.pathBudget expanded cells, one request after another.
+ * When a request finishes, its callback is called with what findPath() or
+ * flowField() would have returned. A request sees changes made to its grid
+ * while it runs.
+ *
+ * The searches share their scratch memory, so finding a path allocates nothing
+ * but the result once the scratch memory has grown to the largest grid. Each
+ * Lua state set up with path_open() has its own scratch memory and request
+ * queue, so batch instances search side by side.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "tw_path.h"
+#include "tw_error.h"
+#include "tw_lua.h"
+
+#define TW_GRID "TWGrid"
+#define TW_FLOW_FIELD "TWFlowField"
+#define TW_PATHFINDER "tw_pathfinder"
+#define TW_PATH_BUDGET 4096
+#define TW_PATH_MAX_CELLS (1 << 20)
+#define TW_PATH_UNREACHED UINT_MAX
+#define TW_DIRECTION_NONE 8
+
+typedef struct {
+    int w, h;
+    int diagonal;
+    unsigned char *cost; /* of entering each cell, 0 if blocked */
+} tw_grid_t;
+
+typedef struct {
+    int w, h;
+    unsigned int *distance;
+    unsigned char *direction;
+} tw_flow_field_t;
+
+typedef struct {
+    unsigned int f; /* cost so far plus estimate of the remaining cost */
+    unsigned int g; /* cost so far */
+    int cell;
+} tw_open_t;
+
+typedef struct {
+    unsigned int *g;
+    unsigned char *from; /* direction to the previous cell on the best route */
+    unsigned int *stamp; /* search that last reached each cell */
+    unsigned int cells;
+    unsigned int current;
+    tw_open_t *open; /* binary heap of cells to expand */
+    unsigned int open_size;
+    unsigned int open_capacity;
+    tw_grid_t *grid;
+    int goal;
+    int flow; /* searching outwards from the goal for a flow field */
+    int found;
+} tw_search_t;
+
+typedef struct {
+    int grid; /* references in the Lua registry */
+    int callback;
+    int field; /* LUA_NOREF for path requests */
+    int start;
+    int goal;
+} tw_path_request_t;
+
+/*
+ * The pathfinding state of one Lua state.
+ */
+typedef struct {
+    unsigned int path_budget;
+    tw_search_t immediate_search; /* for findPath and flowField */
+    tw_search_t queued_search; /* for the request at the head of the queue */
+    tw_path_request_t *request_list;
+    unsigned int request_list_size;
+    unsigned int request_list_capacity;
+    unsigned int request_head;
+    int request_running;
+} tw_pathfinder_t;
+
+static int initialized = 0;
+
+/* the first four directions are orthogonal, the last one is no move at all */
+static const int direction_x[9] = { 1, 0, -1, 0, 1, -1, -1, 1, 0 };
+static const int direction_y[9] = { 0, 1, 0, -1, 1, 1, -1, -1, 0 };
+static const unsigned char direction_back[9] = { 2, 3, 0, 1, 6, 7, 4, 5, 8 };
+
+/*
+ * Returns the pathfinder of the given Lua state.
+ */
+static tw_pathfinder_t * get_pathfinder( lua_State *L ) {
+    return (tw_pathfinder_t*)lua_context(L, TW_PATHFINDER);
+}
+
+/*
+ * Frees the scratch memory of the given search.
+ */
+static void search_release( tw_search_t *s ) {
+    free(s->g);
+    free(s->from);
+    free(s->stamp);
+    free(s->open);
+}
+
+/*
+ * Frees the searches and the request queue of a pathfinder when its Lua state
+ * is closed.
+ */
+static void release_pathfinder( void *context ) {
+    tw_pathfinder_t *finder;
+    finder = (tw_pathfinder_t*)context;
+    search_release(&finder->immediate_search);
+    search_release(&finder->queued_search);
+    free(finder->request_list);
+}
+
+/*
+ * Grows the scratch memory of the given search to hold the given number of
+ * cells.
+ */
+static int search_reserve( tw_search_t *s, unsigned int cells ) {
+    unsigned int *new_g, *new_stamp;
+    unsigned char *new_from;
+    if( cells <= s->cells ) {
+        return 0;
+    }
+    new_g = (unsigned int*)realloc(s->g, sizeof(unsigned int) * cells);
+    if( new_g != NULL ) {
+        s->g = new_g;
+    }
+    new_from = new_g == NULL ? NULL : (unsigned char*)realloc(s->from, cells);
+    if( new_from != NULL ) {
+        s->from = new_from;
+    }
+    new_stamp = new_from == NULL ? NULL : (unsigned int*)realloc(s->stamp,
+        sizeof(unsigned int) * cells);
+    if( new_stamp == NULL ) {
+        push_error("search_reserve failed: Out of memory!");
+        return -1;
+    }
+    s->stamp = new_stamp;
+    memset(s->stamp, 0, sizeof(unsigned int) * cells);
+    s->current = 0;
+    s->cells = cells;
+    return 0;
+}
+
+/*
+ * Returns whether the first open list entry should be expanded before the
+ * second. Among equal estimates, the one further along is preferred.
+ */
+static int open_before( const tw_open_t *a, const tw_open_t *b ) {
+    return a->f < b->f || (a->f == b->f && a->g > b->g);
+}
+
+/*
+ * Adds a cell to the open list of the given search.
+ */
+static int open_push( tw_search_t *s, int cell, unsigned int g, unsigned int f ) {
+    tw_open_t *new_open, entry;
+    unsigned int i, parent;
+    if( s->open_size == s->open_capacity ) {
+        new_open = (tw_open_t*)realloc(s->open,
+            sizeof(tw_open_t) * (s->open_capacity ? s->open_capacity * 2 : 256));
+        if( new_open == NULL ) {
+            push_error("open_push failed: Out of memory!");
+            return -1;
+        }
+        s->open = new_open;
+        s->open_capacity = s->open_capacity ? s->open_capacity * 2 : 256;
+    }
+    entry.f = f;
+    entry.g = g;
+    entry.cell = cell;
+    i = s->open_size++;
+    while( i > 0 ) {
+        parent = (i - 1) / 2;
+        if( !open_before(&entry, &s->open[parent]) ) {
+            break;
+        }
+        s->open[i] = s->open[parent];
+        i = parent;
+    }
+    s->open[i] = entry;
+    return 0;
+}
+
+/*
+ * Removes and returns the first entry of the open list of the given search,
+ * which must not be empty.
+ */
+static tw_open_t open_pop( tw_search_t *s ) {
+    tw_open_t top, last;
+    unsigned int i, child;
+    top = s->open[0];
+    last = s->open[--s->open_size];
+    i = 0;
+    while( (child = 2 * i + 1) < s->open_size ) {
+        if( child + 1 < s->open_size && open_before(&s->open[child + 1], &s->open[child]) ) {
+            child++;
+        }
+        if( !open_before(&s->open[child], &last) ) {
+            break;
+        }
+        s->open[i] = s->open[child];
+        i = child;
+    }
+    s->open[i] = last;
+    return top;
+}
+
+/*
+ * Returns a lower bound of the cost from the given cell to the goal of the
+ * given search.
+ */
+static unsigned int search_estimate( tw_search_t *s, int cell ) {
+    unsigned int dx, dy;
+    if( s->flow ) {
+        return 0;
+    }
+    dx = abs(cell % s->grid->w - s->goal % s->grid->w);
+    dy = abs(cell / s->grid->w - s->goal / s->grid->w);
+    if( s->grid->diagonal ) {
+        return 10 * (dx + dy) - 6 * (dx < dy ? dx : dy);
+    }
+    return 10 * (dx + dy);
+}
+
+/*
+ * Records that the given search reached the given cell at the given cost,
+ * coming from the given direction, unless it was reached more cheaply before.
+ */
+static int search_reach( tw_search_t *s, int cell, unsigned int g, unsigned char from ) {
+    if( s->stamp[cell] == s->current && s->g[cell] <= g ) {
+        return 0;
+    }
+    s->stamp[cell] = s->current;
+    s->g[cell] = g;
+    s->from[cell] = from;
+    return open_push(s, cell, g, g + search_estimate(s, cell));
+}
+
+/*
+ * Starts a search on the given grid: for a path from the start to the goal
+ * cell, or for a flow field towards the goal cell.
+ */
+static int search_start( tw_search_t *s, tw_grid_t *grid, int start, int goal, int flow ) {
+    if( search_reserve(s, grid->w * grid->h) ) {
+        return -1;
+    }
+    if( ++s->current == 0 ) { /* stamps wrapped around */
+        memset(s->stamp, 0, sizeof(unsigned int) * s->cells);
+        s->current = 1;
+    }
+    s->grid = grid;
+    s->goal = goal;
+    s->flow = flow;
+    s->found = 0;
+    s->open_size = 0;
+    if( goal < 0 || grid->cost[goal] == 0 ) {
+        return 0;
+    }
+    return search_reach(s, flow ? goal : start, 0, TW_DIRECTION_NONE);
+}
+
+/*
+ * Expands cells of the given search until it is done or the given budget of
+ * cells is spent. Returns 1 when done, 0 when out of budget, or -1 on errors.
+ */
+static int search_run( tw_search_t *s, unsigned int *budget ) {
+    tw_grid_t *grid;
+    tw_open_t top;
+    unsigned int step;
+    int x, y, nx, ny, d, directions, next;
+    grid = s->grid;
+    directions = grid->diagonal ? 8 : 4;
+    while( s->open_size > 0 ) {
+        if( *budget == 0 ) {
+            return 0;
+        }
+        top = open_pop(s);
+        if( top.g > s->g[top.cell] ) { /* reached more cheaply since */
+            continue;
+        }
+        (*budget)--;
+        if( !s->flow && top.cell == s->goal ) {
+            s->found = 1;
+            return 1;
+        }
+        x = top.cell % grid->w;
+        y = top.cell / grid->w;
+        for( d = 0; d < directions; d++ ) {
+            nx = x + direction_x[d];
+            ny = y + direction_y[d];
+            if( nx < 0 || ny < 0 || nx >= grid->w || ny >= grid->h ) {
+                continue;
+            }
+            next = ny * grid->w + nx;
+            if( grid->cost[next] == 0 ) {
+                continue;
+            }
+            if( d >= 4 && (grid->cost[y * grid->w + nx] == 0 || grid->cost[ny * grid->w + x] == 0) ) {
+                continue; /* cuts a corner */
+            }
+            /* flow fields are searched backwards, moving into the expanded cell */
+            step = (d >= 4 ? 14 : 10) * grid->cost[s->flow ? top.cell : next];
+            if( search_reach(s, next, top.g + step, direction_back[d]) ) {
+                return -1;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Pushes the path found by the given search and its cost, or nil if there is
+ * none, returning the number of values pushed.
+ */
+static int push_path( lua_State *L, tw_search_t *s ) {
+    int cell, length, i, w;
+    if( !s->found ) {
+        lua_pushnil(L);
+        return 1;
+    }
+    w = s->grid->w;
+    length = 1;
+    for( cell = s->goal; s->from[cell] != TW_DIRECTION_NONE; length++ ) {
+        cell += direction_y[s->from[cell]] * w + direction_x[s->from[cell]];
+    }
+    lua_createtable(L, length * 2, 0);
+    cell = s->goal;
+    for( i = length; i > 0; i-- ) {
+        lua_pushnumber(L, cell % w);
+        lua_rawseti(L, -2, i * 2 - 1);
+        lua_pushnumber(L, cell / w);
+        lua_rawseti(L, -2, i * 2);
+        cell += direction_y[s->from[cell]] * w + direction_x[s->from[cell]];
+    }
+    lua_pushnumber(L, s->g[s->goal] / 10.0);
+    return 2;
+}
+
+/*
+ * Pushes a new flow field of the given size with all cells unreached.
+ */
+static tw_flow_field_t * push_flow_field( lua_State *L, int w, int h ) {
+    tw_flow_field_t *field;
+    int i;
+    field = (tw_flow_field_t*)lua_newuserdata(L, sizeof(tw_flow_field_t) +
+        (sizeof(unsigned int) + 1) * w * h);
+    field->w = w;
+    field->h = h;
+    field->distance = (unsigned int*)(field + 1);
+    field->direction = (unsigned char*)(field->distance + w * h);
+    for( i = 0; i < w * h; i++ ) {
+        field->distance[i] = TW_PATH_UNREACHED;
+    }
+    memset(field->direction, TW_DIRECTION_NONE, w * h);
+    luaL_getmetatable(L, TW_FLOW_FIELD);
+    lua_setmetatable(L, -2);
+    return field;
+}
+
+/*
+ * Copies the result of the given flow field search into the given field.
+ */
+static void fill_flow_field( tw_search_t *s, tw_flow_field_t *field ) {
+    int i;
+    for( i = 0; i < field->w * field->h; i++ ) {
+        if( s->stamp[i] == s->current ) {
+            field->distance[i] = s->g[i];
+            field->direction[i] = s->from[i];
+        }
+    }
+}
+
+/*
+ * Checks that the given number of arguments was passed to the method with the
+ * given name, and returns the object of the given type at index 1. Raises a
+ * Lua error otherwise.
+ */
+static void * check_object( lua_State *L, int arguments, const char *type, const char *fn_name ) {
+    void *object;
+    int valid;
+    if( lua_gettop(L) < arguments ) {
+        push_error("Lua: Error while calling path method: Not enough arguments!");
+        push_error(fn_name);
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return NULL;
+    }
+    object = lua_touserdata(L, 1);
+    valid = 0;
+    if( object != NULL && lua_getmetatable(L, 1) ) {
+        luaL_getmetatable(L, type);
+        valid = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+    if( !valid ) {
+        push_error("Lua: Error while calling path method: Wrong object type!");
+        push_error(fn_name);
+        lua_pushstring(L, "Wrong object type.");
+        lua_error(L);
+        return NULL;
+    }
+    return object;
+}
+
+/*
+ * Returns the cell of the grid at the given coordinates, or -1 if they lie
+ * outside of it.
+ */
+static int grid_cell( tw_grid_t *grid, lua_Number x, lua_Number y ) {
+    if( x < 0 || y < 0 || x >= grid->w || y >= grid->h ) {
+        return -1;
+    }
+    return (int)y * grid->w + (int)x;
+}
+
+/*
+ * Returns the given number as a cell cost.
+ */
+static unsigned char to_cost( lua_Number cost ) {
+    return cost <= 0 ? 0 : cost >= 255 ? 255 : (unsigned char)cost;
+}
+
+/*
+ * Queues a request on the grid at index 1 with the callback at the given
+ * index.
+ */
+static int queue_request( lua_State *L, int callback, int start, int goal, int flow ) {
+    tw_pathfinder_t *finder;
+    tw_path_request_t *new_list, *request;
+    tw_grid_t *grid;
+    finder = get_pathfinder(L);
+    if( finder->request_list_size == finder->request_list_capacity ) {
+        new_list = (tw_path_request_t*)realloc(finder->request_list,
+            sizeof(tw_path_request_t) *
+            (finder->request_list_capacity ? finder->request_list_capacity * 2 : 16));
+        if( new_list == NULL ) {
+            push_error("queue_request failed: Out of memory!");
+            return -1;
+        }
+        finder->request_list = new_list;
+        finder->request_list_capacity = finder->request_list_capacity ?
+            finder->request_list_capacity * 2 : 16;
+    }
+    grid = (tw_grid_t*)lua_touserdata(L, 1);
+    request = &finder->request_list[finder->request_list_size++];
+    request->start = start;
+    request->goal = goal;
+    request->field = LUA_NOREF;
+    if( flow ) {
+        push_flow_field(L, grid->w, grid->h);
+        request->field = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_pushvalue(L, callback);
+    request->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 1);
+    request->grid = luaL_ref(L, LUA_REGISTRYINDEX);
+    set_lua_global_n_in(L, "pathsPending", finder->request_list_size - finder->request_head);
+    return 0;
+}
+
+/*
+ * Advances the queued path and flow field requests of the given Lua state by
+ * up to GLOBALS.pathBudget expanded cells, calling the callbacks of those that
+ * finish.
+ */
+int path_step( lua_State *L ) {
+    tw_pathfinder_t *finder;
+    tw_path_request_t request;
+    tw_grid_t *grid;
+    unsigned int budget;
+    int status, done, nresults;
+    finder = get_pathfinder(L);
+    budget = finder->path_budget;
+    status = 0;
+    while( finder->request_head < finder->request_list_size && budget > 0 && status == 0 ) {
+        request = finder->request_list[finder->request_head];
+        if( !finder->request_running ) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, request.grid);
+            grid = (tw_grid_t*)lua_touserdata(L, -1);
+            lua_pop(L, 1);
+            if( search_start(&finder->queued_search, grid, request.start, request.goal,
+                request.field != LUA_NOREF) ) {
+                push_error("path_step failed: Failed to start search!");
+                return -1;
+            }
+            finder->request_running = 1;
+        }
+        done = search_run(&finder->queued_search, &budget);
+        if( done < 0 ) {
+            push_error("path_step failed: Error while searching!");
+            return -1;
+        }
+        if( !done ) {
+            break;
+        }
+        finder->request_running = 0;
+        finder->request_head++; /* the callback may queue more requests */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, request.callback);
+        if( request.field != LUA_NOREF ) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, request.field);
+            fill_flow_field(&finder->queued_search, (tw_flow_field_t*)lua_touserdata(L, -1));
+            nresults = 1;
+        }
+        else {
+            nresults = push_path(L, &finder->queued_search);
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, request.grid);
+        luaL_unref(L, LUA_REGISTRYINDEX, request.callback);
+        luaL_unref(L, LUA_REGISTRYINDEX, request.field);
+        if( lua_pcall(L, nresults, 0, 0) ) {
+            push_error(lua_tostring(L, -1));
+            lua_pop(L, 1);
+            push_error("path_step failed: Error in path callback!");
+            status = -1;
+        }
+    }
+    if( finder->request_head == finder->request_list_size ) {
+        finder->request_head = 0;
+        finder->request_list_size = 0;
+    }
+    set_lua_global_n_in(L, "pathsPending", finder->request_list_size - finder->request_head);
+    return status;
+}
+
+/*
+ * Lua hook returning the width and height of the grid.
+ */
+int lua_gridSize( lua_State *L ) {
+    tw_grid_t *grid;
+    grid = (tw_grid_t*)check_object(L, 1, TW_GRID, "Lua: Error while calling size!");
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, grid->w);
+    lua_pushnumber(L, grid->h);
+    return 2;
+}
+
+/*
+ * Lua hook returning the cost of the cell at the given position, or nothing
+ * outside of the grid.
+ */
+int lua_gridGet( lua_State *L ) {
+    tw_grid_t *grid;
+    int cell;
+    grid = (tw_grid_t*)check_object(L, 3, TW_GRID, "Lua: Error while calling get!");
+    cell = grid_cell(grid, lua_tonumber(L, 2), lua_tonumber(L, 3));
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    if( cell < 0 ) {
+        return 0;
+    }
+    lua_pushnumber(L, grid->cost[cell]);
+    return 1;
+}
+
+/*
+ * Lua hook to set the cost of the cell at the given position. Cells outside of
+ * the grid are ignored.
+ */
+int lua_gridSet( lua_State *L ) {
+    tw_grid_t *grid;
+    int cell;
+    grid = (tw_grid_t*)check_object(L, 4, TW_GRID, "Lua: Error while calling set!");
+    cell = grid_cell(grid, lua_tonumber(L, 2), lua_tonumber(L, 3));
+    if( cell >= 0 ) {
+        grid->cost[cell] = to_cost(lua_tonumber(L, 4));
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to set the cost of all cells in the given rectangle, clipped to the
+ * grid.
+ */
+int lua_gridFill( lua_State *L ) {
+    tw_grid_t *grid;
+    int x0, y0, x1, y1, y;
+    unsigned char cost;
+    grid = (tw_grid_t*)check_object(L, 6, TW_GRID, "Lua: Error while calling fill!");
+    x0 = (int)lua_tonumber(L, 2);
+    y0 = (int)lua_tonumber(L, 3);
+    x1 = x0 + (int)lua_tonumber(L, 4);
+    y1 = y0 + (int)lua_tonumber(L, 5);
+    cost = to_cost(lua_tonumber(L, 6));
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > grid->w ? grid->w : x1;
+    y1 = y1 > grid->h ? grid->h : y1;
+    for( y = y0; y < y1 && x0 < x1; y++ ) {
+        memset(&grid->cost[y * grid->w + x0], cost, x1 - x0);
+    }
+    return 0;
+}
+
+/*
+ * Lua hook returning the path from the start to the goal cell and its cost, or
+ * nil if there is none.
+ */
+int lua_gridFindPath( lua_State *L ) {
+    tw_pathfinder_t *finder;
+    tw_grid_t *grid;
+    unsigned int budget;
+    int start, goal;
+    grid = (tw_grid_t*)check_object(L, 5, TW_GRID, "Lua: Error while calling findPath!");
+    start = grid_cell(grid, lua_tonumber(L, 2), lua_tonumber(L, 3));
+    goal = grid_cell(grid, lua_tonumber(L, 4), lua_tonumber(L, 5));
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    if( start < 0 ) {
+        lua_pushnil(L);
+        return 1;
+    }
+    finder = get_pathfinder(L);
+    budget = UINT_MAX;
+    if( search_start(&finder->immediate_search, grid, start, goal, 0) ||
+        search_run(&finder->immediate_search, &budget) < 0 ) {
+        push_error("Lua: Error while calling findPath: Out of memory!");
+        lua_pushstring(L, "Out of memory.");
+        lua_error(L);
+        return -1;
+    }
+    return push_path(L, &finder->immediate_search);
+}
+
+/*
+ * Lua hook returning the flow field towards the goal cell.
+ */
+int lua_gridFlowField( lua_State *L ) {
+    tw_pathfinder_t *finder;
+    tw_grid_t *grid;
+    tw_flow_field_t *field;
+    unsigned int budget;
+    int goal;
+    grid = (tw_grid_t*)check_object(L, 3, TW_GRID, "Lua: Error while calling flowField!");
+    goal = grid_cell(grid, lua_tonumber(L, 2), lua_tonumber(L, 3));
+    lua_pop(L, 2);
+    field = push_flow_field(L, grid->w, grid->h);
+    finder = get_pathfinder(L);
+    budget = UINT_MAX;
+    if( search_start(&finder->immediate_search, grid, goal, goal, 1) ||
+        search_run(&finder->immediate_search, &budget) < 0 ) {
+        push_error("Lua: Error while calling flowField: Out of memory!");
+        lua_pushstring(L, "Out of memory.");
+        lua_error(L);
+        return -1;
+    }
+    fill_flow_field(&finder->immediate_search, field);
+    return 1;
+}
+
+/*
+ * Lua hook queueing a search for the path from the start to the goal cell, whose
+ * result is passed to the given callback once it is found.
+ */
+int lua_gridRequestPath( lua_State *L ) {
+    tw_grid_t *grid;
+    int start, goal;
+    grid = (tw_grid_t*)check_object(L, 6, TW_GRID, "Lua: Error while calling requestPath!");
+    if( !lua_isfunction(L, 6) ) {
+        push_error("Lua: Error while calling requestPath: Callback is not a function!");
+        lua_pushstring(L, "Callback is not a function.");
+        lua_error(L);
+        return -1;
+    }
+    start = grid_cell(grid, lua_tonumber(L, 2), lua_tonumber(L, 3));
+    goal = grid_cell(grid, lua_tonumber(L, 4), lua_tonumber(L, 5));
+    if( queue_request(L, 6, start, start < 0 ? -1 : goal, 0) ) {
+        push_error("Lua: Error while calling requestPath: Out of memory!");
+        lua_pushstring(L, "Out of memory.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook queueing the computation of the flow field towards the goal cell,
+ * which is passed to the given callback once it is done.
+ */
+int lua_gridRequestFlowField( lua_State *L ) {
+    tw_grid_t *grid;
+    int goal;
+    grid = (tw_grid_t*)check_object(L, 4, TW_GRID, "Lua: Error while calling requestFlowField!");
+    if( !lua_isfunction(L, 4) ) {
+        push_error("Lua: Error while calling requestFlowField: Callback is not a function!");
+        lua_pushstring(L, "Callback is not a function.");
+        lua_error(L);
+        return -1;
+    }
+    goal = grid_cell(grid, lua_tonumber(L, 2), lua_tonumber(L, 3));
+    if( queue_request(L, 4, goal, goal, 1) ) {
+        push_error("Lua: Error while calling requestFlowField: Out of memory!");
+        lua_pushstring(L, "Out of memory.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook returning the width and height of the flow field.
+ */
+int lua_flowFieldSize( lua_State *L ) {
+    tw_flow_field_t *field;
+    field = (tw_flow_field_t*)check_object(L, 1, TW_FLOW_FIELD, "Lua: Error while calling size!");
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, field->w);
+    lua_pushnumber(L, field->h);
+    return 2;
+}
+
+/*
+ * Lua hook returning the best move from the cell at the given position towards
+ * the goal, as the offset to the next cell.
+ */
+int lua_flowFieldDirection( lua_State *L ) {
+    tw_flow_field_t *field;
+    int x, y, direction;
+    field = (tw_flow_field_t*)check_object(L, 3, TW_FLOW_FIELD,
+        "Lua: Error while calling direction!");
+    x = (int)lua_tonumber(L, 2);
+    y = (int)lua_tonumber(L, 3);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    direction = TW_DIRECTION_NONE;
+    if( x >= 0 && y >= 0 && x < field->w && y < field->h ) {
+        direction = field->direction[y * field->w + x];
+    }
+    lua_pushnumber(L, direction_x[direction]);
+    lua_pushnumber(L, direction_y[direction]);
+    return 2;
+}
+
+/*
+ * Lua hook returning the cost of reaching the goal from the cell at the given
+ * position, or nil if it can not be reached.
+ */
+int lua_flowFieldDistance( lua_State *L ) {
+    tw_flow_field_t *field;
+    unsigned int distance;
+    int x, y;
+    field = (tw_flow_field_t*)check_object(L, 3, TW_FLOW_FIELD,
+        "Lua: Error while calling distance!");
+    x = (int)lua_tonumber(L, 2);
+    y = (int)lua_tonumber(L, 3);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    distance = TW_PATH_UNREACHED;
+    if( x >= 0 && y >= 0 && x < field->w && y < field->h ) {
+        distance = field->distance[y * field->w + x];
+    }
+    if( distance == TW_PATH_UNREACHED ) {
+        lua_pushnil(L);
+    }
+    else {
+        lua_pushnumber(L, distance / 10.0);
+    }
+    return 1;
+}
+
+/*
+ * Lua hook returning a new grid of the given size, all of whose cells have the
+ * given cost (1 by default). Paths on diagonal grids may move diagonally.
+ */
+int lua_createGrid( lua_State *L ) {
+    tw_grid_t *grid;
+    int w, h, diagonal;
+    unsigned char cost;
+    if( lua_gettop(L) < 2 ) {
+        push_error("Lua: Error while calling createGrid: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    w = (int)lua_tonumber(L, 1);
+    h = (int)lua_tonumber(L, 2);
+    if( w < 1 || h < 1 || w > TW_PATH_MAX_CELLS / h ) {
+        push_error("Lua: Error while calling createGrid: Invalid grid size!");
+        lua_pushstring(L, "Invalid grid size.");
+        lua_error(L);
+        return -1;
+    }
+    diagonal = lua_toboolean(L, 3);
+    cost = lua_isnumber(L, 4) ? to_cost(lua_tonumber(L, 4)) : 1;
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    grid = (tw_grid_t*)lua_newuserdata(L, sizeof(tw_grid_t) + w * h);
+    grid->w = w;
+    grid->h = h;
+    grid->diagonal = diagonal;
+    grid->cost = (unsigned char*)(grid + 1);
+    memset(grid->cost, cost, w * h);
+    luaL_getmetatable(L, TW_GRID);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/*
+ * Lua callback to set the number of cells requests may expand per frame
+ * whenever GLOBALS.pathBudget is changed.
+ */
+int lua_setPathBudget( lua_State *L ) {
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while setting pathBudget: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    if( lua_tonumber(L, -1) < 1 ) {
+        push_warning("Lua: Invalid pathBudget, keeping the current budget!");
+        lua_pop(L, 1);
+        return 0;
+    }
+    get_pathfinder(L)->path_budget = (unsigned int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return 0;
+}
+
+/*
+ * Creates the metatable of the given type with the given methods in the given
+ * Lua state.
+ */
+static void add_methods( lua_State *L, const char *type, const luaL_Reg *methods ) {
+    luaL_newmetatable(L, type);
+    lua_newtable(L);
+    for( ; methods->name != NULL; methods++ ) {
+        lua_pushcfunction(L, methods->func);
+        lua_setfield(L, -2, methods->name);
+    }
+    lua_setfield(L, -2, "__index");
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+}
+
+/*
+ * Sets up pathfinding in the given Lua state and registers its Lua functions
+ * in it. The GLOBALS of the state must have been set up before.
+ */
+int path_open( lua_State *L ) {
+    static const luaL_Reg grid_methods[] = {
+        { "size", lua_gridSize },
+        { "get", lua_gridGet },
+        { "set", lua_gridSet },
+        { "fill", lua_gridFill },
+        { "findPath", lua_gridFindPath },
+        { "flowField", lua_gridFlowField },
+        { "requestPath", lua_gridRequestPath },
+        { "requestFlowField", lua_gridRequestFlowField },
+        { NULL, NULL }
+    };
+    static const luaL_Reg flow_field_methods[] = {
+        { "size", lua_flowFieldSize },
+        { "direction", lua_flowFieldDirection },
+        { "distance", lua_flowFieldDistance },
+        { NULL, NULL }
+    };
+    tw_pathfinder_t *finder;
+    finder = (tw_pathfinder_t*)new_lua_context(L, TW_PATHFINDER, sizeof(tw_pathfinder_t),
+        release_pathfinder);
+    finder->path_budget = TW_PATH_BUDGET;
+    if( add_lua_function_in(L, "createGrid", lua_createGrid) ||
+        add_lua_global_n_in(L, "pathBudget", TW_PATH_BUDGET, lua_setPathBudget) ||
+        add_lua_global_n_in(L, "pathsPending", 0, NULL) ) {
+        push_error("Failed to add pathfinding functions!");
+        return -1;
+    }
+    add_methods(L, TW_GRID, grid_methods);
+    add_methods(L, TW_FLOW_FIELD, flow_field_methods);
+    return 0;
+}
+
+/*
+ * Initializes pathfinding in the main Lua state.
+ */
+int path_init() {
+    if( initialized ) {
+        push_warning("Pathfinding already initialized!");
+        return 0;
+    }
+    if( path_open(lua_main_state()) ) {
+        return -1;
+    }
+    initialized = 1;
+    return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * tw_path.h
+ */
+
+#ifndef TWPATH
+#define TWPATH
+
+#include "tw_lua.h"
+
+/*
+ * Advances the queued path and flow field requests of the given Lua state by
+ * up to GLOBALS.pathBudget expanded cells, calling the callbacks of those that
+ * finish.
+ */
+int path_step( lua_State *L );
+
+/*
+ * Sets up pathfinding in the given Lua state and registers its Lua functions
+ * in it. The GLOBALS of the state must have been set up before.
+ */
+int path_open( lua_State *L );
+
+int path_init();
+
+#endif
@@ -0,0 +1,557 @@
+/*
+ * tw_pixels.c
+ *
+ * This file contains the source code pertaining to direct pixel access in the
+ * ToyWrench application. getPixels() returns a pixel buffer over the surface of
+ * a texture or canvas, whose methods work on many pixels at once so that the
+ * per-pixel loops of procedural effects run in C instead of Lua:
+ *
+ *   buffer:size()                      width and height of the buffer
+ *   buffer:get(x, y)                   r, g, b, a of one pixel
+ *   buffer:set(x, y, color)            sets one pixel
+ *   buffer:fill(x, y, length, color)   fills a horizontal span
+ *   buffer:write(colors, [x, y, w])    copies an array of colors, row by row
+ *   buffer:map(lut, [lut_g, lut_b])    passes every channel through a table
+ *   buffer:palette(colors)             recolors pixels by their brightness
+ *   buffer:blur(radius)                box blurs the buffer
+ *   buffer:colorMatrix(matrix)         transforms every color by a 3x4 matrix
+ *
+ * Colors are either tables of RGB or RGBA values like everywhere else, or
+ * numbers in the form 0xRRGGBB, which are much cheaper in bulk. Lookup tables
+ * and palettes have up to 256 entries, indexed from 1. The alpha channel of a
+ * pixel is kept by all operations except set, fill and write.
+ *
+ * The buffer refers to its texture by index rather than holding on to the
+ * surface, so it stays valid when the texture is reloaded, and locks the
+ * surface only for the duration of each operation.
+ */
+
+#include "tw_pixels.h"
+#include "tw_alloc.h"
+#include "tw_error.h"
+#include "tw_graphics.h"
+#include "tw_lua.h"
+
+#define TW_PIXELS "TWPixels"
+#define TW_MAX_BLUR_RADIUS 64
+
+typedef struct {
+    int texture;
+} tw_pixels_t;
+
+static int initialized = 0;
+
+/*
+ * Returns a pixel in the format of the given surface with the given channels.
+ */
+static Uint32 pack_pixel( SDL_PixelFormat *format, Uint32 r, Uint32 g, Uint32 b, Uint32 a ) {
+    return r << format->Rshift | g << format->Gshift | b << format->Bshift |
+        ((a << format->Ashift) & format->Amask);
+}
+
+/*
+ * Reads the color at the given index, either a table of RGB(A) values or a
+ * number in the form 0xRRGGBB, as a pixel in the format of the given surface.
+ */
+static Uint32 read_color( lua_State *L, int index, SDL_PixelFormat *format ) {
+    Uint32 value, r, g, b, a;
+    if( lua_istable(L, index) ) {
+        lua_rawgeti(L, index, 1);
+        lua_rawgeti(L, index, 2);
+        lua_rawgeti(L, index, 3);
+        lua_rawgeti(L, index, 4);
+        r = (Uint32)lua_tonumber(L, -4) & 0xFF;
+        g = (Uint32)lua_tonumber(L, -3) & 0xFF;
+        b = (Uint32)lua_tonumber(L, -2) & 0xFF;
+        a = lua_isnil(L, -1) ? 0xFF : (Uint32)lua_tonumber(L, -1) & 0xFF;
+        lua_pop(L, 4);
+        return pack_pixel(format, r, g, b, a);
+    }
+    value = (Uint32)lua_tonumber(L, index);
+    return pack_pixel(format, (value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF, 0xFF);
+}
+
+/*
+ * Reads a table of up to 256 numbers at the given index into a lookup table,
+ * clamping them to 0-255. Entries past the end of the table map to themselves.
+ */
+static void read_lut( lua_State *L, int index, Uint8 *lut ) {
+    int i;
+    lua_Number value;
+    for( i = 0; i < 256; i++ ) {
+        lua_rawgeti(L, index, i + 1);
+        if( lua_isnumber(L, -1) ) {
+            value = lua_tonumber(L, -1);
+            lut[i] = value < 0 ? 0 : value > 255 ? 255 : (Uint8)value;
+        }
+        else {
+            lut[i] = (Uint8)i;
+        }
+        lua_pop(L, 1);
+    }
+}
+
+/*
+ * Checks that the given number of arguments was passed to the method with the
+ * given name, and returns the surface of the buffer at index 1. Raises a Lua
+ * error otherwise.
+ */
+static SDL_Surface * check_pixels( lua_State *L, int arguments, const char *fn_name ) {
+    tw_pixels_t *buffer;
+    SDL_Surface *surface;
+    int valid;
+    if( lua_gettop(L) < arguments ) {
+        push_error("Lua: Error while calling pixel buffer method: Not enough arguments!");
+        push_error(fn_name);
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return NULL;
+    }
+    buffer = (tw_pixels_t*)lua_touserdata(L, 1);
+    valid = 0;
+    if( buffer != NULL && lua_getmetatable(L, 1) ) {
+        luaL_getmetatable(L, TW_PIXELS);
+        valid = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+    }
+    if( !valid ) {
+        push_error("Lua: Error while calling pixel buffer method: Not a pixel buffer!");
+        push_error(fn_name);
+        lua_pushstring(L, "Not a pixel buffer.");
+        lua_error(L);
+        return NULL;
+    }
+    surface = texture_surface(buffer->texture);
+    if( surface == NULL || surface->format->BytesPerPixel != 4 ) {
+        push_error("Lua: Error while calling pixel buffer method: Unsupported pixel format!");
+        push_error(fn_name);
+        lua_pushstring(L, "Unsupported pixel format.");
+        lua_error(L);
+        return NULL;
+    }
+    return surface;
+}
+
+/*
+ * Locks the given surface if needed, raising a Lua error if that fails. No Lua
+ * errors may be raised until the surface is unlocked again.
+ */
+static void lock_pixels( lua_State *L, SDL_Surface *surface ) {
+    if( SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) ) {
+        push_error("Lua: Error while calling pixel buffer method: Failed to lock surface!");
+        lua_pushstring(L, "Failed to lock surface.");
+        lua_error(L);
+    }
+}
+
+/*
+ * Unlocks the given surface if it was locked.
+ */
+static void unlock_pixels( SDL_Surface *surface ) {
+    if( SDL_MUSTLOCK(surface) ) {
+        SDL_UnlockSurface(surface);
+    }
+}
+
+/*
+ * Returns a pointer to the pixel at the given position of the given surface.
+ */
+static Uint32 * pixel_at( SDL_Surface *surface, int x, int y ) {
+    return (Uint32*)((Uint8*)surface->pixels + y * surface->pitch) + x;
+}
+
+/*
+ * Box blurs count pixels that lie stride pixels apart, treating the four bytes
+ * of every pixel as separate channels. Pixels past either end repeat the edge
+ * pixel. line is scratch space for count pixels.
+ */
+static void blur_line( Uint32 *pixels, int count, int stride, int radius, Uint32 *line ) {
+    Uint32 sum[4], scale, pixel;
+    int i, c;
+    for( i = 0; i < count; i++ ) {
+        line[i] = pixels[i * stride];
+    }
+    scale = 65536 / (2 * radius + 1);
+    for( c = 0; c < 4; c++ ) {
+        sum[c] = ((line[0] >> (c * 8)) & 0xFF) * (radius + 1);
+        for( i = 1; i <= radius; i++ ) {
+            sum[c] += (line[i < count ? i : count - 1] >> (c * 8)) & 0xFF;
+        }
+    }
+    for( i = 0; i < count; i++ ) {
+        pixel = 0;
+        for( c = 0; c < 4; c++ ) {
+            pixel |= ((sum[c] * scale + 32768) >> 16) << (c * 8);
+            sum[c] += (line[i + radius + 1 < count ? i + radius + 1 : count - 1] >> (c * 8)) & 0xFF;
+            sum[c] -= (line[i - radius > 0 ? i - radius : 0] >> (c * 8)) & 0xFF;
+        }
+        pixels[i * stride] = pixel;
+    }
+}
+
+/*
+ * Lua hook returning the width and height of the buffer.
+ */
+int lua_pixelsSize( lua_State *L ) {
+    SDL_Surface *surface;
+    surface = check_pixels(L, 1, "Lua: Error while calling size!");
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, surface->w);
+    lua_pushnumber(L, surface->h);
+    return 2;
+}
+
+/*
+ * Lua hook returning the red, green, blue and alpha values of the pixel at the
+ * given position, or nothing outside of the buffer.
+ */
+int lua_pixelsGet( lua_State *L ) {
+    SDL_Surface *surface;
+    Uint8 r, g, b, a;
+    int x, y;
+    surface = check_pixels(L, 3, "Lua: Error while calling get!");
+    x = (int)lua_tonumber(L, 2);
+    y = (int)lua_tonumber(L, 3);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    if( x < 0 || y < 0 || x >= surface->w || y >= surface->h ) {
+        return 0;
+    }
+    lock_pixels(L, surface);
+    SDL_GetRGBA(*pixel_at(surface, x, y), surface->format, &r, &g, &b, &a);
+    unlock_pixels(surface);
+    lua_pushnumber(L, r);
+    lua_pushnumber(L, g);
+    lua_pushnumber(L, b);
+    lua_pushnumber(L, a);
+    return 4;
+}
+
+/*
+ * Lua hook to set the pixel at the given position to the given color. Pixels
+ * outside of the buffer are ignored.
+ */
+int lua_pixelsSet( lua_State *L ) {
+    SDL_Surface *surface;
+    Uint32 color;
+    int x, y;
+    surface = check_pixels(L, 4, "Lua: Error while calling set!");
+    x = (int)lua_tonumber(L, 2);
+    y = (int)lua_tonumber(L, 3);
+    color = read_color(L, 4, surface->format);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    if( x < 0 || y < 0 || x >= surface->w || y >= surface->h ) {
+        return 0;
+    }
+    lock_pixels(L, surface);
+    *pixel_at(surface, x, y) = color;
+    unlock_pixels(surface);
+    return 0;
+}
+
+/*
+ * Lua hook to fill the given number of pixels to the right of the given position
+ * with the given color, clipped to the buffer.
+ */
+int lua_pixelsFill( lua_State *L ) {
+    SDL_Surface *surface;
+    Uint32 *pixels, color;
+    int x, y, end, i;
+    surface = check_pixels(L, 5, "Lua: Error while calling fill!");
+    x = (int)lua_tonumber(L, 2);
+    y = (int)lua_tonumber(L, 3);
+    end = x + (int)lua_tonumber(L, 4);
+    color = read_color(L, 5, surface->format);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    if( x < 0 ) {
+        x = 0;
+    }
+    if( end > surface->w ) {
+        end = surface->w;
+    }
+    if( y < 0 || y >= surface->h || x >= end ) {
+        return 0;
+    }
+    lock_pixels(L, surface);
+    pixels = pixel_at(surface, 0, y);
+    for( i = x; i < end; i++ ) {
+        pixels[i] = color;
+    }
+    unlock_pixels(surface);
+    return 0;
+}
+
+/*
+ * Lua hook to copy a table of colors in the form 0xRRGGBB into the buffer, row
+ * by row from the given position (the top left corner by default) with rows of
+ * the given width (the rest of the buffer width by default). Pixels outside of
+ * the buffer are skipped.
+ */
+int lua_pixelsWrite( lua_State *L ) {
+    SDL_Surface *surface;
+    SDL_PixelFormat *format;
+    Uint32 *pixels, value;
+    int x, y, width, count, i, px, py;
+    surface = check_pixels(L, 2, "Lua: Error while calling write!");
+    if( !lua_istable(L, 2) ) {
+        push_error("Lua: Error while calling write: Given colors not a table!");
+        lua_pushstring(L, "Given parameter not a table.");
+        lua_error(L);
+        return -1;
+    }
+    x = (int)lua_tonumber(L, 3);
+    y = (int)lua_tonumber(L, 4);
+    width = lua_isnoneornil(L, 5) ? surface->w - x : (int)lua_tonumber(L, 5);
+    count = lua_objlen(L, 2);
+    if( width <= 0 ) {
+        lua_pop(L, lua_gettop(L)); /* clear stack */
+        return 0;
+    }
+    format = surface->format;
+    lock_pixels(L, surface);
+    for( i = 0; i < count; i++ ) {
+        px = x + i % width;
+        py = y + i / width;
+        if( py >= surface->h ) {
+            break;
+        }
+        if( px < 0 || py < 0 || px >= surface->w ) {
+            continue;
+        }
+        lua_rawgeti(L, 2, i + 1);
+        value = (Uint32)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        pixels = pixel_at(surface, px, py);
+        *pixels = pack_pixel(format, (value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF, 0xFF);
+    }
+    unlock_pixels(surface);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to pass the red, green and blue values of every pixel through the
+ * given lookup tables. A single table is used for all three channels.
+ */
+int lua_pixelsMap( lua_State *L ) {
+    SDL_Surface *surface;
+    SDL_PixelFormat *format;
+    Uint8 lut_r[256], lut_g[256], lut_b[256];
+    Uint32 *pixels, pixel;
+    int x, y;
+    surface = check_pixels(L, 2, "Lua: Error while calling map!");
+    if( !lua_istable(L, 2) ) {
+        push_error("Lua: Error while calling map: Given lookup table not a table!");
+        lua_pushstring(L, "Given parameter not a table.");
+        lua_error(L);
+        return -1;
+    }
+    read_lut(L, 2, lut_r);
+    read_lut(L, lua_istable(L, 3) ? 3 : 2, lut_g);
+    read_lut(L, lua_istable(L, 4) ? 4 : 2, lut_b);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    format = surface->format;
+    lock_pixels(L, surface);
+    for( y = 0; y < surface->h; y++ ) {
+        pixels = pixel_at(surface, 0, y);
+        for( x = 0; x < surface->w; x++ ) {
+            pixel = pixels[x];
+            pixels[x] = (pixel & format->Amask) |
+                (Uint32)lut_r[(pixel >> format->Rshift) & 0xFF] << format->Rshift |
+                (Uint32)lut_g[(pixel >> format->Gshift) & 0xFF] << format->Gshift |
+                (Uint32)lut_b[(pixel >> format->Bshift) & 0xFF] << format->Bshift;
+        }
+    }
+    unlock_pixels(surface);
+    return 0;
+}
+
+/*
+ * Lua hook to replace the color of every pixel by the entry of the given palette
+ * its brightness falls on, with dark pixels taking the first entry and bright
+ * ones the last. Drawing a grayscale intensity and then applying a palette is
+ * how fire and plasma effects get their colors.
+ */
+int lua_pixelsPalette( lua_State *L ) {
+    SDL_Surface *surface;
+    SDL_PixelFormat *format;
+    Uint32 palette[256], *pixels, pixel, luma;
+    int count, x, y, i;
+    surface = check_pixels(L, 2, "Lua: Error while calling palette!");
+    count = lua_istable(L, 2) ? lua_objlen(L, 2) : 0;
+    if( count == 0 ) {
+        push_error("Lua: Error while calling palette: Given palette not a table of colors!");
+        lua_pushstring(L, "Given parameter not a table.");
+        lua_error(L);
+        return -1;
+    }
+    if( count > 256 ) {
+        count = 256;
+    }
+    format = surface->format;
+    for( i = 0; i < count; i++ ) {
+        lua_rawgeti(L, 2, i + 1);
+        palette[i] = read_color(L, lua_gettop(L), format) & ~format->Amask;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lock_pixels(L, surface);
+    for( y = 0; y < surface->h; y++ ) {
+        pixels = pixel_at(surface, 0, y);
+        for( x = 0; x < surface->w; x++ ) {
+            pixel = pixels[x];
+            luma = ((pixel >> format->Rshift) & 0xFF) * 77 +
+                ((pixel >> format->Gshift) & 0xFF) * 150 +
+                ((pixel >> format->Bshift) & 0xFF) * 29;
+            pixels[x] = (pixel & format->Amask) | palette[(luma >> 8) * count >> 8];
+        }
+    }
+    unlock_pixels(surface);
+    return 0;
+}
+
+/*
+ * Lua hook to box blur the buffer with the given radius, horizontally and then
+ * vertically. Blurring twice with the same radius comes close to a gaussian.
+ */
+int lua_pixelsBlur( lua_State *L ) {
+    SDL_Surface *surface;
+    Uint32 *line;
+    int radius, x, y;
+    surface = check_pixels(L, 2, "Lua: Error while calling blur!");
+    radius = (int)lua_tonumber(L, 2);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    if( radius <= 0 ) {
+        return 0;
+    }
+    if( radius > TW_MAX_BLUR_RADIUS ) {
+        radius = TW_MAX_BLUR_RADIUS;
+    }
+    line = (Uint32*)frame_alloc(sizeof(Uint32) * (surface->w > surface->h ? surface->w : surface->h));
+    if( line == NULL ) {
+        push_error("Lua: Error while calling blur: Out of memory!");
+        lua_pushstring(L, "Out of memory.");
+        lua_error(L);
+        return -1;
+    }
+    lock_pixels(L, surface);
+    for( y = 0; y < surface->h; y++ ) {
+        blur_line(pixel_at(surface, 0, y), surface->w, 1, radius, line);
+    }
+    for( x = 0; x < surface->w; x++ ) {
+        blur_line(pixel_at(surface, x, 0), surface->h, surface->pitch / 4, radius, line);
+    }
+    unlock_pixels(surface);
+    return 0;
+}
+
+/*
+ * Lua hook to transform the color of every pixel by the given table of 12
+ * numbers, holding the rows of a 3x4 matrix that computes the new red, green and
+ * blue values from the old ones and a constant offset:
+ * { rr, rg, rb, ro,  gr, gg, gb, go,  br, bg, bb, bo }
+ */
+int lua_pixelsColorMatrix( lua_State *L ) {
+    SDL_Surface *surface;
+    SDL_PixelFormat *format;
+    Uint32 *pixels, pixel;
+    int matrix[12], r, g, b, out[3], x, y, i;
+    surface = check_pixels(L, 2, "Lua: Error while calling colorMatrix!");
+    if( !lua_istable(L, 2) || lua_objlen(L, 2) < 12 ) {
+        push_error("Lua: Error while calling colorMatrix: Given matrix not a table of 12 numbers!");
+        lua_pushstring(L, "Given parameter not a table of 12 numbers.");
+        lua_error(L);
+        return -1;
+    }
+    for( i = 0; i < 12; i++ ) {
+        lua_rawgeti(L, 2, i + 1);
+        matrix[i] = (int)(lua_tonumber(L, -1) * 256); /* 8 fractional bits */
+        lua_pop(L, 1);
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    format = surface->format;
+    lock_pixels(L, surface);
+    for( y = 0; y < surface->h; y++ ) {
+        pixels = pixel_at(surface, 0, y);
+        for( x = 0; x < surface->w; x++ ) {
+            pixel = pixels[x];
+            r = (pixel >> format->Rshift) & 0xFF;
+            g = (pixel >> format->Gshift) & 0xFF;
+            b = (pixel >> format->Bshift) & 0xFF;
+            for( i = 0; i < 3; i++ ) {
+                out[i] = (matrix[i * 4] * r + matrix[i * 4 + 1] * g + matrix[i * 4 + 2] * b +
+                    matrix[i * 4 + 3] + 128) >> 8;
+                out[i] = out[i] < 0 ? 0 : out[i] > 255 ? 255 : out[i];
+            }
+            pixels[x] = (pixel & format->Amask) | (Uint32)out[0] << format->Rshift |
+                (Uint32)out[1] << format->Gshift | (Uint32)out[2] << format->Bshift;
+        }
+    }
+    unlock_pixels(surface);
+    return 0;
+}
+
+/*
+ * Lua hook returning a pixel buffer over the given texture or canvas.
+ */
+int lua_getPixels( lua_State *L ) {
+    tw_pixels_t *buffer;
+    int texture;
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while calling getPixels: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    texture = (int)lua_tonumber(L, 1);
+    if( texture_surface(texture) == NULL ) {
+        push_error("Lua: Error while calling getPixels: Invalid texture!");
+        lua_pushstring(L, "Invalid texture.");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    buffer = (tw_pixels_t*)lua_newuserdata(L, sizeof(tw_pixels_t));
+    buffer->texture = texture;
+    if( luaL_newmetatable(L, TW_PIXELS) ) { /* first buffer, fill in the methods */
+        lua_newtable(L);
+        lua_pushcfunction(L, lua_pixelsSize);
+        lua_setfield(L, -2, "size");
+        lua_pushcfunction(L, lua_pixelsGet);
+        lua_setfield(L, -2, "get");
+        lua_pushcfunction(L, lua_pixelsSet);
+        lua_setfield(L, -2, "set");
+        lua_pushcfunction(L, lua_pixelsFill);
+        lua_setfield(L, -2, "fill");
+        lua_pushcfunction(L, lua_pixelsWrite);
+        lua_setfield(L, -2, "write");
+        lua_pushcfunction(L, lua_pixelsMap);
+        lua_setfield(L, -2, "map");
+        lua_pushcfunction(L, lua_pixelsPalette);
+        lua_setfield(L, -2, "palette");
+        lua_pushcfunction(L, lua_pixelsBlur);
+        lua_setfield(L, -2, "blur");
+        lua_pushcfunction(L, lua_pixelsColorMatrix);
+        lua_setfield(L, -2, "colorMatrix");
+        lua_setfield(L, -2, "__index");
+        lua_pushboolean(L, 0);
+        lua_setfield(L, -2, "__metatable");
+    }
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/*
+ * Initializes pixel access and registers its Lua functions.
+ */
+int pixels_init() {
+    if( initialized ) {
+        push_warning("Pixel access already initialized!");
+        return 0;
+    }
+    if( add_lua_function("getPixels", lua_getPixels) ) {
+        push_error("Failed to add pixel functions!");
+        return -1;
+    }
+    initialized = 1;
+    return 0;
+}
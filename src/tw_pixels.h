@@ -0,0 +1,10 @@
+/*
+ * tw_pixels.h
+ */
+
+#ifndef TWPIXELS
+#define TWPIXELS
+
+int pixels_init();
+
+#endif
@@ -0,0 +1,311 @@
+/*
+ * tw_replay.c
+ *
+ * This file contains the source code pertaining to recording and replaying
+ * input in the ToyWrench application. When recording, the frame clock and
+ * every input event handled by the main loop are written to a compact binary
+ * log. When replaying, the main loop is fed the recorded clock and events
+ * instead of the real ones, so a game run that showed a problem can be repeated
+ * exactly, as often as needed, for example while profiling it.
+ *
+ * The log starts with the magic "TWRP" and a version byte, followed by a stream
+ * of records, each starting with a tag byte. A frame record holds the tick
+ * count of the frame, and is followed by the records of the events polled in
+ * that frame, and then by the ids of the jobs whose results were delivered in
+ * it (see tw_jobs.c). Jobs run on other threads and finish whenever they do, so
+ * a replay waits for the recorded jobs of each frame instead. All numbers are
+ * stored little endian.
+ *
+ * A replay ends with a quit event when the log runs out. Real input is ignored
+ * during a replay, except for quitting. When replaying as fast as possible the
+ * frame rate limit is lifted, and the replay reports the mean and worst frame
+ * times once it ends.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "tw_replay.h"
+#include "tw_error.h"
+
+#define TW_REPLAY_VERSION 2
+
+#define TW_REC_FRAME 1
+#define TW_REC_KEYDOWN 2
+#define TW_REC_KEYUP 3
+#define TW_REC_MOUSEDOWN 4
+#define TW_REC_MOUSEUP 5
+#define TW_REC_QUIT 6
+#define TW_REC_JOB 7
+
+static int initialized = 0;
+static int mode = TW_REPLAY_OFF;
+static int fast = 0;
+static FILE *log_fp = NULL;
+static int next_tag = 0; /* tag of the next record when replaying, 0 at the end */
+static unsigned long frames = 0;
+static unsigned int last_ticks = 0;
+static unsigned int first_ticks = 0;
+static unsigned int worst_ms = 0;
+static unsigned long worst_frame = 0;
+
+/*
+ * Writes the given number as a little endian number of the given size.
+ */
+static void write_num( Uint32 value, int size ) {
+    while( size-- > 0 ) {
+        fputc(value & 0xff, log_fp);
+        value >>= 8;
+    }
+}
+
+/*
+ * Reads a little endian number of the given size.
+ */
+static Uint32 read_num( int size ) {
+    Uint32 value;
+    int i, c;
+    value = 0;
+    for( i = 0; i < size; i++ ) {
+        c = fgetc(log_fp);
+        value |= (Uint32)(c == EOF ? 0 : c) << (i * 8);
+    }
+    return value;
+}
+
+/*
+ * Reads the tag of the next record.
+ */
+static void read_tag() {
+    int c;
+    c = fgetc(log_fp);
+    next_tag = c == EOF ? 0 : c;
+}
+
+/*
+ * Appends the given event to the recording if it is an input event.
+ */
+static void record_event( SDL_Event *event ) {
+    switch( event->type ) {
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+            fputc(event->type == SDL_KEYDOWN ? TW_REC_KEYDOWN : TW_REC_KEYUP, log_fp);
+            write_num(event->key.keysym.sym, 2);
+            write_num(event->key.keysym.mod, 2);
+            break;
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:
+            fputc(event->type == SDL_MOUSEBUTTONDOWN ? TW_REC_MOUSEDOWN : TW_REC_MOUSEUP, log_fp);
+            write_num(event->button.button, 1);
+            write_num(event->button.x, 2);
+            write_num(event->button.y, 2);
+            break;
+        case SDL_QUIT:
+            fputc(TW_REC_QUIT, log_fp);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Fills in the given event from the next record of the replay. Returns 0 when
+ * the frame has no more events.
+ */
+static int replay_event( SDL_Event *event ) {
+    memset(event, 0, sizeof(SDL_Event));
+    switch( next_tag ) {
+        case TW_REC_KEYDOWN:
+        case TW_REC_KEYUP:
+            event->type = next_tag == TW_REC_KEYDOWN ? SDL_KEYDOWN : SDL_KEYUP;
+            event->key.type = event->type;
+            event->key.state = next_tag == TW_REC_KEYDOWN ? SDL_PRESSED : SDL_RELEASED;
+            event->key.keysym.sym = (SDLKey)read_num(2);
+            event->key.keysym.mod = (SDLMod)read_num(2);
+            break;
+        case TW_REC_MOUSEDOWN:
+        case TW_REC_MOUSEUP:
+            event->type = next_tag == TW_REC_MOUSEDOWN ? SDL_MOUSEBUTTONDOWN : SDL_MOUSEBUTTONUP;
+            event->button.type = event->type;
+            event->button.state = next_tag == TW_REC_MOUSEDOWN ? SDL_PRESSED : SDL_RELEASED;
+            event->button.button = (Uint8)read_num(1);
+            event->button.x = (Uint16)read_num(2);
+            event->button.y = (Uint16)read_num(2);
+            break;
+        case TW_REC_QUIT:
+        case 0: /* out of input, end the replay */
+            event->type = SDL_QUIT;
+            break;
+        default:
+            return 0;
+    }
+    if( next_tag != 0 ) {
+        read_tag();
+    }
+    return 1;
+}
+
+/*
+ * Starts a new frame at the given real tick count, returning the tick count
+ * the game should see for the frame.
+ */
+unsigned int replay_frame( unsigned int ticks ) {
+    SDL_Event skipped;
+    unsigned int frame_ms;
+    if( frames > 0 ) {
+        frame_ms = ticks - last_ticks;
+        if( frame_ms > worst_ms ) {
+            worst_ms = frame_ms;
+            worst_frame = frames;
+        }
+    }
+    else {
+        first_ticks = ticks;
+    }
+    last_ticks = ticks;
+    frames++;
+    if( mode == TW_REPLAY_RECORD ) {
+        fputc(TW_REC_FRAME, log_fp);
+        write_num(ticks, 4);
+    }
+    else if( mode == TW_REPLAY_PLAY ) {
+        while( next_tag != TW_REC_FRAME && next_tag != 0 ) {
+            if( next_tag == TW_REC_JOB ) {
+                push_warning("Skipping recorded job the replay did not deliver!");
+                read_num(4);
+                read_tag();
+                continue;
+            }
+            push_warning("Skipping replay event recorded outside of a frame!");
+            if( !replay_event(&skipped) ) {
+                push_error("Replay file is corrupt, ending replay!");
+                next_tag = 0;
+            }
+        }
+        if( next_tag == TW_REC_FRAME ) {
+            ticks = read_num(4);
+            read_tag();
+        }
+    }
+    return ticks;
+}
+
+/*
+ * Replacement for SDL_PollEvent() that records the polled input events, or
+ * returns the recorded input events of the current frame when replaying.
+ */
+int replay_poll_event( SDL_Event *event ) {
+    if( mode == TW_REPLAY_PLAY ) {
+        while( SDL_PollEvent(event) ) {
+            if( event->type == SDL_QUIT ) {
+                return 1;
+            }
+        }
+        return next_tag == TW_REC_FRAME ? 0 : replay_event(event);
+    }
+    if( !SDL_PollEvent(event) ) {
+        return 0;
+    }
+    if( mode == TW_REPLAY_RECORD ) {
+        record_event(event);
+    }
+    return 1;
+}
+
+/*
+ * Appends the delivery of the job with the given id in the current frame to the
+ * recording, if recording.
+ */
+void replay_record_job( unsigned long id ) {
+    if( mode == TW_REPLAY_RECORD ) {
+        fputc(TW_REC_JOB, log_fp);
+        write_num((Uint32)id, 4);
+    }
+}
+
+/*
+ * Returns whether a recording is being replayed.
+ */
+int replay_playing() {
+    return mode == TW_REPLAY_PLAY;
+}
+
+/*
+ * Stores the id of the next job delivered in the current frame of the replay in
+ * the given id and returns 1, or returns 0 if the frame delivers no more jobs.
+ * Must be called after all events of the frame were polled.
+ */
+int replay_next_job( unsigned long *id ) {
+    if( mode != TW_REPLAY_PLAY || next_tag != TW_REC_JOB ) {
+        return 0;
+    }
+    *id = read_num(4);
+    read_tag();
+    return 1;
+}
+
+/*
+ * Returns whether frames should be run as fast as possible instead of being
+ * limited to the frame rate.
+ */
+int replay_fast() {
+    return fast;
+}
+
+/*
+ * Initializes recording to or replaying from the given file. Replaying as fast
+ * as possible is only allowed when replaying.
+ */
+int replay_init( int new_mode, const char *file, int new_fast ) {
+    char magic[4];
+    if( initialized ) {
+        push_warning("Replay interface already initialized!");
+        return 0;
+    }
+    mode = new_mode;
+    fast = mode == TW_REPLAY_PLAY && new_fast;
+    if( mode == TW_REPLAY_RECORD ) {
+        log_fp = fopen(file, "wb");
+        if( log_fp == NULL ) {
+            push_error("replay_init failed: Could not create recording file!");
+            return -1;
+        }
+        fwrite("TWRP", 1, 4, log_fp);
+        fputc(TW_REPLAY_VERSION, log_fp);
+    }
+    else if( mode == TW_REPLAY_PLAY ) {
+        log_fp = fopen(file, "rb");
+        if( log_fp == NULL ) {
+            push_error("replay_init failed: Could not open replay file!");
+            return -1;
+        }
+        if( fread(magic, 1, 4, log_fp) != 4 || memcmp(magic, "TWRP", 4) ||
+            fgetc(log_fp) != TW_REPLAY_VERSION ) {
+            push_error("replay_init failed: Not a replay file, or wrong version!");
+            fclose(log_fp);
+            log_fp = NULL;
+            return -1;
+        }
+        read_tag();
+    }
+    initialized = 1;
+    return 0;
+}
+
+/*
+ * Finishes the recording, or reports the frame times of the replay.
+ */
+void replay_shutdown() {
+    char summary[160];
+    if( log_fp == NULL ) {
+        return;
+    }
+    if( mode == TW_REPLAY_PLAY && frames > 1 ) {
+        snprintf(summary, sizeof(summary),
+            "Replayed %lu frames in %u ms: mean %.2f ms, worst %u ms at frame %lu.",
+            frames, last_ticks - first_ticks,
+            (double)(last_ticks - first_ticks) / (frames - 1), worst_ms, worst_frame);
+        log_message(TW_LOG_INFO, summary);
+    }
+    fclose(log_fp);
+    log_fp = NULL;
+}
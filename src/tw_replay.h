@@ -0,0 +1,59 @@
+/*
+ * tw_replay.h
+ */
+
+#ifndef TWREPLAY
+#define TWREPLAY
+
+#include "SDL.h"
+
+#define TW_REPLAY_OFF 0
+#define TW_REPLAY_RECORD 1
+#define TW_REPLAY_PLAY 2
+
+/*
+ * Starts a new frame at the given real tick count, returning the tick count
+ * the game should see for the frame.
+ */
+unsigned int replay_frame( unsigned int ticks );
+
+/*
+ * Replacement for SDL_PollEvent() that records the polled input events, or
+ * returns the recorded input events of the current frame when replaying.
+ */
+int replay_poll_event( SDL_Event *event );
+
+/*
+ * Appends the delivery of the job with the given id in the current frame to the
+ * recording, if recording.
+ */
+void replay_record_job( unsigned long id );
+
+/*
+ * Returns whether a recording is being replayed.
+ */
+int replay_playing();
+
+/*
+ * Stores the id of the next job delivered in the current frame of the replay in
+ * the given id and returns 1, or returns 0 if the frame delivers no more jobs.
+ */
+int replay_next_job( unsigned long *id );
+
+/*
+ * Returns whether frames should be run as fast as possible instead of being
+ * limited to the frame rate.
+ */
+int replay_fast();
+
+/*
+ * Initializes recording to or replaying from the given file.
+ */
+int replay_init( int mode, const char *file, int fast );
+
+/*
+ * Finishes the recording, or reports the frame times of the replay.
+ */
+void replay_shutdown();
+
+#endif
@@ -0,0 +1,546 @@
+/*
+ * tw_savestate.c
+ *
+ * This file contains the source code pertaining to saving game state in the
+ * ToyWrench application. saveState(...) serializes its arguments into a string
+ * in a compact binary format, and loadState(data) returns copies of them. The
+ * values may be nil, booleans, numbers, strings, and tables of those, with
+ * tables shared between several places or containing themselves kept intact.
+ * Metatables are not saved, and functions, userdata and coroutines can not be.
+ *
+ *   local data = saveState(world, player)
+ *   world, player = loadState(data)
+ *
+ * The strings can be written to files with the io library for save games, or
+ * kept in memory as snapshots to rewind to. The job system passes arguments
+ * and results between Lua states in the same format.
+ *
+ * The data starts with a header and the number of values, followed by the
+ * values, each a tag byte and its payload:
+ *
+ *   tag 0, 1, 2           nil, false, true
+ *   tag 3, varint         integer, zigzag encoded
+ *   tag 4, 8 bytes        any other number, IEEE 754 little endian
+ *   tag 5, varint, bytes  string of the given length
+ *   tag 6, varint, ...    table: the given number of array items, then key
+ *                         value pairs up to tag 8
+ *   tag 7, varint         the string or table with the given reference
+ *   tag 16 - 255          integer 0 - 239
+ *
+ * Every string and table is given the next reference number the first time it
+ * is written, starting at 0, and written as a reference after that. So repeated
+ * strings like field names are only stored once, and cycles end.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "tw_savestate.h"
+#include "tw_error.h"
+
+#define TW_SAVESTATE_HEADER "TWS\1"
+#define TW_SAVESTATE_MAX_DEPTH 200
+
+#define TW_SAVESTATE_NIL 0
+#define TW_SAVESTATE_FALSE 1
+#define TW_SAVESTATE_TRUE 2
+#define TW_SAVESTATE_INTEGER 3
+#define TW_SAVESTATE_NUMBER 4
+#define TW_SAVESTATE_STRING 5
+#define TW_SAVESTATE_TABLE 6
+#define TW_SAVESTATE_REFERENCE 7
+#define TW_SAVESTATE_END 8
+#define TW_SAVESTATE_SMALL 16
+
+typedef struct {
+    lua_State *L;
+    tw_savestate_t *state;
+    int seen; /* stack index of the table of reference numbers by value */
+    lua_Number next_reference;
+    int depth;
+    const char *error;
+    int bad_type; /* type of the value that can not be saved, or -1 */
+} tw_writer_t;
+
+typedef struct {
+    lua_State *L;
+    const unsigned char *p;
+    const unsigned char *end;
+    int references; /* stack index of the table of values by reference number */
+    int next_reference;
+    int depth;
+    const char *error;
+} tw_reader_t;
+
+static int initialized = 0;
+static __thread tw_savestate_t save_buffer; /* reused by saveState */
+
+/*
+ * Appends the given bytes to the output of the given writer.
+ */
+static int put_bytes( tw_writer_t *w, const void *data, size_t size ) {
+    tw_savestate_t *state;
+    char *grown;
+    size_t capacity;
+    state = w->state;
+    if( state->size + size > state->capacity ) {
+        capacity = state->capacity ? state->capacity * 2 : 256;
+        while( capacity < state->size + size ) {
+            capacity *= 2;
+        }
+        grown = (char*)realloc(state->data, capacity);
+        if( grown == NULL ) {
+            w->error = "Out of memory.";
+            return -1;
+        }
+        state->data = grown;
+        state->capacity = capacity;
+    }
+    memcpy(state->data + state->size, data, size);
+    state->size += size;
+    return 0;
+}
+
+/*
+ * Appends the given tag byte and, unless the tag is negative, the given number
+ * as a varint to the output of the given writer.
+ */
+static int put_varint( tw_writer_t *w, int tag, unsigned long long value ) {
+    unsigned char bytes[11];
+    int size;
+    size = 0;
+    if( tag >= 0 ) {
+        bytes[size++] = (unsigned char)tag;
+    }
+    while( value >= 0x80 ) {
+        bytes[size++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[size++] = (unsigned char)value;
+    return put_bytes(w, bytes, size);
+}
+
+/*
+ * Appends the given number to the output of the given writer.
+ */
+static int put_number( tw_writer_t *w, lua_Number n ) {
+    unsigned char bytes[9];
+    unsigned long long bits;
+    double d;
+    int i;
+    if( n == floor(n) && fabs(n) < 9007199254740992.0 && !(n == 0 && signbit(n)) ) {
+        if( n >= 0 && n < 256 - TW_SAVESTATE_SMALL ) {
+            bytes[0] = (unsigned char)(TW_SAVESTATE_SMALL + n);
+            return put_bytes(w, bytes, 1);
+        }
+        return put_varint(w, TW_SAVESTATE_INTEGER, n >= 0 ? (unsigned long long)n * 2 :
+            (unsigned long long)(-n - 1) * 2 + 1);
+    }
+    d = n;
+    memcpy(&bits, &d, sizeof(bits));
+    bytes[0] = TW_SAVESTATE_NUMBER;
+    for( i = 0; i < 8; i++ ) {
+        bytes[i + 1] = (unsigned char)(bits >> (i * 8));
+    }
+    return put_bytes(w, bytes, 9);
+}
+
+/*
+ * Looks up the string or table at the given index in the values written so far.
+ * Appends a reference to it and returns 1 if it was written before, otherwise
+ * gives it the next reference number and returns 0.
+ */
+static int put_reference( tw_writer_t *w, int index ) {
+    lua_State *L;
+    lua_Number reference;
+    L = w->L;
+    lua_pushvalue(L, index);
+    lua_rawget(L, w->seen);
+    if( !lua_isnil(L, -1) ) {
+        reference = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        return put_varint(w, TW_SAVESTATE_REFERENCE, (unsigned long long)reference) ? -1 : 1;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, index);
+    lua_pushnumber(L, w->next_reference++);
+    lua_rawset(L, w->seen);
+    return 0;
+}
+
+/*
+ * Appends the value at the given index to the output of the given writer.
+ */
+static int put_value( tw_writer_t *w, int index ) {
+    lua_State *L;
+    unsigned char tag;
+    const char *s;
+    size_t length, count, i;
+    lua_Number key;
+    int status;
+    L = w->L;
+    if( index < 0 ) {
+        index = lua_gettop(L) + index + 1;
+    }
+    switch( lua_type(L, index) ) {
+        case LUA_TNIL:
+            tag = TW_SAVESTATE_NIL;
+            return put_bytes(w, &tag, 1);
+        case LUA_TBOOLEAN:
+            tag = lua_toboolean(L, index) ? TW_SAVESTATE_TRUE : TW_SAVESTATE_FALSE;
+            return put_bytes(w, &tag, 1);
+        case LUA_TNUMBER:
+            return put_number(w, lua_tonumber(L, index));
+        case LUA_TSTRING:
+            status = put_reference(w, index);
+            if( status ) {
+                return status < 0 ? -1 : 0;
+            }
+            s = lua_tolstring(L, index, &length);
+            return put_varint(w, TW_SAVESTATE_STRING, length) || put_bytes(w, s, length) ? -1 : 0;
+        case LUA_TTABLE:
+            if( w->depth >= TW_SAVESTATE_MAX_DEPTH || !lua_checkstack(L, 8) ) {
+                w->error = "Tables nested too deeply.";
+                return -1;
+            }
+            status = put_reference(w, index);
+            if( status ) {
+                return status < 0 ? -1 : 0;
+            }
+            count = lua_objlen(L, index);
+            if( put_varint(w, TW_SAVESTATE_TABLE, count) ) {
+                return -1;
+            }
+            w->depth++;
+            for( i = 1; i <= count; i++ ) {
+                lua_rawgeti(L, index, i);
+                status = put_value(w, -1);
+                lua_pop(L, 1);
+                if( status ) {
+                    return -1;
+                }
+            }
+            lua_pushnil(L);
+            while( lua_next(L, index) ) {
+                if( lua_type(L, -2) == LUA_TNUMBER ) { /* skip the array items */
+                    key = lua_tonumber(L, -2);
+                    if( key >= 1 && key <= count && key == floor(key) ) {
+                        lua_pop(L, 1);
+                        continue;
+                    }
+                }
+                if( put_value(w, -2) || put_value(w, -1) ) {
+                    lua_pop(L, 2);
+                    return -1;
+                }
+                lua_pop(L, 1);
+            }
+            w->depth--;
+            tag = TW_SAVESTATE_END;
+            return put_bytes(w, &tag, 1);
+        default:
+            w->bad_type = lua_type(L, index);
+            return -1;
+    }
+}
+
+/*
+ * Serializes the given number of values from the given index of the given Lua
+ * state into the given buffer, replacing what it held before. Returns 0, or -1
+ * with the error message pushed.
+ */
+int savestate_write( lua_State *L, int first, int count, tw_savestate_t *state ) {
+    tw_writer_t w;
+    int top, i, status;
+    top = lua_gettop(L);
+    if( first < 0 ) {
+        first = top + first + 1;
+    }
+    w.L = L;
+    w.state = state;
+    w.next_reference = 0;
+    w.depth = 0;
+    w.error = NULL;
+    w.bad_type = -1;
+    state->size = 0;
+    lua_newtable(L);
+    w.seen = lua_gettop(L);
+    status = put_bytes(&w, TW_SAVESTATE_HEADER, 4) || put_varint(&w, -1, count);
+    for( i = 0; i < count && !status; i++ ) {
+        status = put_value(&w, first + i);
+    }
+    lua_settop(L, top);
+    if( status && w.bad_type >= 0 ) {
+        lua_pushfstring(L, "Can not save a %s.", lua_typename(L, w.bad_type));
+    }
+    else if( status ) {
+        lua_pushstring(L, w.error != NULL ? w.error : "Out of memory.");
+    }
+    return status ? -1 : 0;
+}
+
+/*
+ * Reads the next byte of the input of the given reader.
+ */
+static int get_byte( tw_reader_t *r, unsigned char *byte ) {
+    if( r->p >= r->end ) {
+        r->error = "Data is truncated.";
+        return -1;
+    }
+    *byte = *r->p++;
+    return 0;
+}
+
+/*
+ * Reads the next varint of the input of the given reader.
+ */
+static int get_varint( tw_reader_t *r, unsigned long long *value ) {
+    unsigned char byte;
+    int shift;
+    *value = 0;
+    for( shift = 0; shift < 64; shift += 7 ) {
+        if( get_byte(r, &byte) ) {
+            return -1;
+        }
+        *value |= (unsigned long long)(byte & 0x7F) << shift;
+        if( !(byte & 0x80) ) {
+            return 0;
+        }
+    }
+    r->error = "Data is corrupt.";
+    return -1;
+}
+
+/*
+ * Returns whether the given reader has at least the given number of bytes of
+ * input left, setting an error otherwise.
+ */
+static int has_bytes( tw_reader_t *r, unsigned long long size ) {
+    if( size > (unsigned long long)(r->end - r->p) ) {
+        r->error = "Data is truncated.";
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Gives the value on top of the stack the next reference number.
+ */
+static void add_reference( tw_reader_t *r ) {
+    lua_pushvalue(r->L, -1);
+    lua_rawseti(r->L, r->references, r->next_reference++);
+}
+
+/*
+ * Reads the next value of the input of the given reader and pushes it.
+ */
+static int get_value( tw_reader_t *r ) {
+    lua_State *L;
+    unsigned long long value, bits;
+    unsigned char tag;
+    double d;
+    unsigned int i;
+    L = r->L;
+    if( get_byte(r, &tag) ) {
+        return -1;
+    }
+    if( tag >= TW_SAVESTATE_SMALL ) {
+        lua_pushnumber(L, tag - TW_SAVESTATE_SMALL);
+        return 0;
+    }
+    switch( tag ) {
+        case TW_SAVESTATE_NIL:
+            lua_pushnil(L);
+            return 0;
+        case TW_SAVESTATE_FALSE:
+        case TW_SAVESTATE_TRUE:
+            lua_pushboolean(L, tag == TW_SAVESTATE_TRUE);
+            return 0;
+        case TW_SAVESTATE_INTEGER:
+            if( get_varint(r, &value) ) {
+                return -1;
+            }
+            lua_pushnumber(L, value & 1 ? -(lua_Number)(value >> 1) - 1 : (lua_Number)(value >> 1));
+            return 0;
+        case TW_SAVESTATE_NUMBER:
+            if( !has_bytes(r, 8) ) {
+                return -1;
+            }
+            bits = 0;
+            for( i = 0; i < 8; i++ ) {
+                bits |= (unsigned long long)r->p[i] << (i * 8);
+            }
+            r->p += 8;
+            memcpy(&d, &bits, sizeof(d));
+            lua_pushnumber(L, d);
+            return 0;
+        case TW_SAVESTATE_STRING:
+            if( get_varint(r, &value) || !has_bytes(r, value) ) {
+                return -1;
+            }
+            lua_pushlstring(L, (const char*)r->p, (size_t)value);
+            r->p += value;
+            add_reference(r);
+            return 0;
+        case TW_SAVESTATE_REFERENCE:
+            if( get_varint(r, &value) ) {
+                return -1;
+            }
+            if( value >= (unsigned long long)r->next_reference ) {
+                r->error = "Data is corrupt.";
+                return -1;
+            }
+            lua_rawgeti(L, r->references, (int)value);
+            return 0;
+        case TW_SAVESTATE_TABLE:
+            if( r->depth >= TW_SAVESTATE_MAX_DEPTH || !lua_checkstack(L, 8) ) {
+                r->error = "Tables nested too deeply.";
+                return -1;
+            }
+            /* every item takes at least one byte */
+            if( get_varint(r, &value) || !has_bytes(r, value) ) {
+                return -1;
+            }
+            lua_createtable(L, (int)value, 0);
+            add_reference(r);
+            r->depth++;
+            for( i = 1; i <= value; i++ ) {
+                if( get_value(r) ) {
+                    return -1;
+                }
+                lua_rawseti(L, -2, i);
+            }
+            for( ;; ) {
+                if( !has_bytes(r, 1) ) {
+                    return -1;
+                }
+                if( *r->p == TW_SAVESTATE_END ) {
+                    r->p++;
+                    break;
+                }
+                if( get_value(r) ) {
+                    return -1;
+                }
+                if( lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER &&
+                    lua_tonumber(L, -1) != lua_tonumber(L, -1)) ) { /* not a valid key */
+                    r->error = "Data is corrupt.";
+                    return -1;
+                }
+                if( get_value(r) ) {
+                    return -1;
+                }
+                lua_rawset(L, -3);
+            }
+            r->depth--;
+            return 0;
+        default:
+            r->error = "Data is corrupt.";
+            return -1;
+    }
+}
+
+/*
+ * Pushes the values serialized into the given data onto the stack of the given
+ * Lua state, returning their number, or -1 with the error message pushed.
+ */
+int savestate_read( lua_State *L, const char *data, size_t size ) {
+    tw_reader_t r;
+    unsigned long long count, i;
+    int top;
+    top = lua_gettop(L);
+    r.L = L;
+    r.p = (const unsigned char*)data;
+    r.end = r.p + size;
+    r.next_reference = 0;
+    r.depth = 0;
+    r.error = NULL;
+    if( size < 4 || memcmp(data, TW_SAVESTATE_HEADER, 4) ) {
+        lua_pushstring(L, "Data is not a saved state.");
+        return -1;
+    }
+    r.p += 4;
+    lua_newtable(L);
+    r.references = lua_gettop(L);
+    if( get_varint(&r, &count) || !has_bytes(&r, count) ||
+        !lua_checkstack(L, (int)count + 8) ) {
+        i = 0;
+        count = 1;
+        if( r.error == NULL ) {
+            r.error = "Too many values.";
+        }
+    }
+    else {
+        for( i = 0; i < count; i++ ) {
+            if( get_value(&r) ) {
+                break;
+            }
+        }
+    }
+    if( i < count ) {
+        lua_settop(L, top);
+        lua_pushstring(L, r.error != NULL ? r.error : "Data is corrupt.");
+        return -1;
+    }
+    lua_remove(L, r.references);
+    return (int)count;
+}
+
+/*
+ * Lua hook returning a string holding all of its arguments serialized.
+ */
+int lua_saveState( lua_State *L ) {
+    if( savestate_write(L, 1, lua_gettop(L), &save_buffer) ) {
+        push_error("Lua: Error while calling saveState!");
+        lua_error(L);
+        return -1;
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushlstring(L, save_buffer.data, save_buffer.size);
+    return 1;
+}
+
+/*
+ * Lua hook returning the values serialized into the given string.
+ */
+int lua_loadState( lua_State *L ) {
+    const char *data;
+    size_t size;
+    int count;
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while calling loadState: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    data = lua_tolstring(L, 1, &size);
+    if( data == NULL ) {
+        push_error("Lua: Error while calling loadState: Expected a string!");
+        lua_pushstring(L, "Expected a string.");
+        lua_error(L);
+        return -1;
+    }
+    count = savestate_read(L, data, size);
+    if( count < 0 ) {
+        push_error("Lua: Error while calling loadState!");
+        lua_error(L);
+        return -1;
+    }
+    return count;
+}
+
+/*
+ * Initializes saving game state and registers its Lua functions.
+ */
+int savestate_init() {
+    if( initialized ) {
+        push_warning("Save states already initialized!");
+        return 0;
+    }
+    if( add_lua_function("saveState", lua_saveState) ||
+        add_lua_function("loadState", lua_loadState) ) {
+        push_error("Failed to add save state functions!");
+        return -1;
+    }
+    initialized = 1;
+    return 0;
+}
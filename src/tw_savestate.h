@@ -0,0 +1,41 @@
+/*
+ * tw_savestate.h
+ */
+
+#ifndef TWSAVESTATE
+#define TWSAVESTATE
+
+#include "tw_lua.h"
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} tw_savestate_t;
+
+/*
+ * Serializes the given number of values from the given index of the given Lua
+ * state into the given buffer, replacing what it held before. Returns 0, or -1
+ * with the error message pushed.
+ */
+int savestate_write( lua_State *L, int first, int count, tw_savestate_t *state );
+
+/*
+ * Pushes the values serialized into the given data onto the stack of the given
+ * Lua state, returning their number, or -1 with the error message pushed.
+ */
+int savestate_read( lua_State *L, const char *data, size_t size );
+
+/*
+ * Lua hook returning a string holding all of its arguments serialized.
+ */
+int lua_saveState( lua_State *L );
+
+/*
+ * Lua hook returning the values serialized into the given string.
+ */
+int lua_loadState( lua_State *L );
+
+int savestate_init();
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * tw_scene.c
+ *
+ * This file contains the source code pertaining to the camera and the drawing
+ * layers of the ToyWrench application. Things drawn on a layer are positioned
+ * in world coordinates, and are moved onto the screen by the camera position
+ * scaled by the parallax factor of the layer: a factor of 1 scrolls with the
+ * camera, a factor of 0 stays fixed on the screen (for user interfaces), and
+ * factors in between scroll slower (for backgrounds).
+ *
+ * Entities are assigned to layers with setEntityLayer(), and drawEntities()
+ * draws them layer by layer from back to front in the order of their depth.
+ * drawTexture() draws onto a layer when given one, placing the texture with the
+ * layer's parallax, but right away: its draws are ordered by when they are
+ * made, not by depth. Hidden layers are skipped by both.
+ * Everything drawn is culled against the screen before it is blitted, so
+ * objects outside of the view cost next to nothing.
+ */
+
+#include <math.h>
+#include "tw_scene.h"
+#include "tw_error.h"
+#include "tw_lua.h"
+
+typedef struct {
+    float parallax_x;
+    float parallax_y;
+    int depth;
+    int visible;
+} tw_layer_t;
+
+static int initialized = 0;
+static float camera_x = 0;
+static float camera_y = 0;
+static tw_layer_t layer_list[TW_MAX_LAYERS];
+
+/*
+ * Converts the given world position on the given layer to a screen position,
+ * applying the camera scrolled by the parallax factor of the layer.
+ */
+int scene_to_screen( int layer, float x, float y, int *screen_x, int *screen_y ) {
+    if( (unsigned int)layer >= TW_MAX_LAYERS ) {
+        push_error("scene_to_screen failed: Invalid layer!");
+        return -1;
+    }
+    *screen_x = (int)floorf(x - camera_x * layer_list[layer].parallax_x);
+    *screen_y = (int)floorf(y - camera_y * layer_list[layer].parallax_y);
+    return 0;
+}
+
+/*
+ * Returns whether the given layer is shown. Invalid layers are not.
+ */
+int scene_layer_visible( int layer ) {
+    return (unsigned int)layer < TW_MAX_LAYERS && layer_list[layer].visible;
+}
+
+/*
+ * Fills order with the visible layers from back to front, returning their
+ * number. Layers of equal depth are drawn in the order of their numbers.
+ */
+int scene_layer_order( int *order ) {
+    int count, i, j;
+    count = 0;
+    for( i = 0; i < TW_MAX_LAYERS; i++ ) {
+        if( !layer_list[i].visible ) {
+            continue;
+        }
+        /* insertion sort, there are only a few layers */
+        for( j = count; j > 0 && layer_list[order[j - 1]].depth > layer_list[i].depth; j-- ) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Reads the layer argument at index 1, raising a Lua error for invalid layers.
+ */
+static int check_layer( lua_State *L, const char *fn_name ) {
+    int layer;
+    if( lua_gettop(L) < 2 ) {
+        push_error(fn_name);
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    layer = (int)lua_tonumber(L, 1);
+    if( (unsigned int)layer >= TW_MAX_LAYERS ) {
+        push_error(fn_name);
+        lua_pushstring(L, "Invalid layer.");
+        lua_error(L);
+        return -1;
+    }
+    return layer;
+}
+
+/*
+ * Lua hook to move the camera to the given world position, which is shown at
+ * the top left corner of the screen.
+ */
+int lua_setCamera( lua_State *L ) {
+    if( lua_gettop(L) < 2 ) {
+        push_error("Lua: Error while calling setCamera: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    camera_x = lua_tonumber(L, 1);
+    camera_y = lua_tonumber(L, 2);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook returning the camera position.
+ */
+int lua_getCamera( lua_State *L ) {
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, camera_x);
+    lua_pushnumber(L, camera_y);
+    return 2;
+}
+
+/*
+ * Lua hook to set the parallax factors of the given layer. The vertical factor
+ * defaults to the horizontal one.
+ */
+int lua_setLayerParallax( lua_State *L ) {
+    int layer;
+    layer = check_layer(L, "Lua: Error while calling setLayerParallax: Invalid layer!");
+    layer_list[layer].parallax_x = lua_tonumber(L, 2);
+    layer_list[layer].parallax_y = lua_isnoneornil(L, 3) ? lua_tonumber(L, 2) : lua_tonumber(L, 3);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to set the depth of the given layer. Layers with a greater depth are
+ * drawn on top by drawEntities().
+ */
+int lua_setLayerDepth( lua_State *L ) {
+    int layer;
+    layer = check_layer(L, "Lua: Error while calling setLayerDepth: Invalid layer!");
+    layer_list[layer].depth = (int)lua_tonumber(L, 2);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to show or hide the given layer.
+ */
+int lua_setLayerVisible( lua_State *L ) {
+    int layer;
+    layer = check_layer(L, "Lua: Error while calling setLayerVisible: Invalid layer!");
+    layer_list[layer].visible = lua_toboolean(L, 2);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Initializes the camera and layers and registers their Lua functions. All
+ * layers start visible, scrolling with the camera, with their number as their
+ * depth.
+ */
+int scene_init() {
+    int i;
+    if( initialized ) {
+        push_warning("Scene already initialized!");
+        return 0;
+    }
+    for( i = 0; i < TW_MAX_LAYERS; i++ ) {
+        layer_list[i].parallax_x = 1;
+        layer_list[i].parallax_y = 1;
+        layer_list[i].depth = i;
+        layer_list[i].visible = 1;
+    }
+    if( add_lua_function("setCamera", lua_setCamera) ||
+        add_lua_function("getCamera", lua_getCamera) ||
+        add_lua_function("setLayerParallax", lua_setLayerParallax) ||
+        add_lua_function("setLayerDepth", lua_setLayerDepth) ||
+        add_lua_function("setLayerVisible", lua_setLayerVisible) ||
+        add_lua_global_n("maxLayers", TW_MAX_LAYERS, NULL) ) {
+        push_error("Failed to add scene functions!");
+        return -1;
+    }
+    initialized = 1;
+    return 0;
+}
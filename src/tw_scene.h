@@ -0,0 +1,29 @@
+/*
+ * tw_scene.h
+ */
+
+#ifndef TWSCENE
+#define TWSCENE
+
+#define TW_MAX_LAYERS 16
+
+/*
+ * Converts the given world position on the given layer to a screen position,
+ * applying the camera scrolled by the parallax factor of the layer.
+ */
+int scene_to_screen( int layer, float x, float y, int *screen_x, int *screen_y );
+
+/*
+ * Returns whether the given layer is shown.
+ */
+int scene_layer_visible( int layer );
+
+/*
+ * Fills order with the visible layers from back to front, returning their
+ * number.
+ */
+int scene_layer_order( int *order );
+
+int scene_init();
+
+#endif
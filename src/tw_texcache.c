@@ -0,0 +1,248 @@
+/*
+ * tw_texcache.c
+ *
+ * This file contains the source code pertaining to the texture cache used in
+ * the ToyWrench application. Decoding a PNG and converting it to the display
+ * format is by far the most expensive part of loading a sprite, so the result
+ * of that conversion is written to a cache directory the first time a sprite
+ * is loaded. On later runs the cached pixels are memory-mapped and handed to
+ * SDL directly, skipping the decoder entirely.
+ *
+ * A cache entry is keyed by the source path, and is only used if the source
+ * file's modification time and size, as well as the requested pixel format,
+ * all match the values recorded when the entry was written.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "tw_texcache.h"
+#include "tw_error.h"
+
+#define TW_TEXCACHE_MAGIC "TWTC"
+#define TW_TEXCACHE_VERSION 1
+#define TW_TEXCACHE_PATH_MAX 1024
+
+typedef struct {
+    char magic[4];
+    Uint32 version;
+    Sint64 mtime;
+    Sint64 source_size;
+    Uint32 width;
+    Uint32 height;
+    Uint32 pitch;
+    Uint32 bpp;
+    Uint32 rmask;
+    Uint32 gmask;
+    Uint32 bmask;
+    Uint32 amask;
+    Uint32 path_length;
+    Uint32 data_offset;
+} tw_texcache_header_t;
+
+static char cache_dir[TW_TEXCACHE_PATH_MAX];
+static int initialized = 0;
+
+/*
+ * Returns the 64-bit FNV-1a hash of the given string.
+ */
+static Uint64 texcache_hash( const char *s ) {
+    Uint64 h;
+    h = 14695981039346656037ULL;
+    while( *s ) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Writes the path of the cache entry for the given image file into entry.
+ */
+static int texcache_entry_path( const char *img_file, char *entry, size_t size ) {
+    int len;
+    len = snprintf(entry, size, "%s/%016llx.twc", cache_dir,
+        (unsigned long long)texcache_hash(img_file));
+    if( len < 0 || (size_t)len >= size ) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the offset of the pixel data within a cache entry for a source path
+ * of the given length. Pixel data is kept 16-byte aligned.
+ */
+static Uint32 texcache_data_offset( Uint32 path_length ) {
+    return (sizeof(tw_texcache_header_t) + path_length + 15) & ~15u;
+}
+
+/*
+ * Returns a surface wrapping the cached pixel data for the given image file, or
+ * NULL if no valid cache entry exists for the file in the given pixel format.
+ * Misses are not errors, the caller is expected to decode the image instead.
+ */
+SDL_Surface * texcache_load( const char *img_file, SDL_PixelFormat *format,
+    tw_texcache_map_t *map ) {
+    char entry[TW_TEXCACHE_PATH_MAX];
+    struct stat src_stat, entry_stat;
+    tw_texcache_header_t *header;
+    SDL_Surface *surface;
+    void *data;
+    int fd;
+    map->data = NULL;
+    map->size = 0;
+    if( !initialized || img_file == NULL ) {
+        return NULL;
+    }
+    if( stat(img_file, &src_stat) || texcache_entry_path(img_file, entry, sizeof(entry)) ) {
+        return NULL;
+    }
+    fd = open(entry, O_RDONLY);
+    if( fd < 0 ) {
+        return NULL;
+    }
+    if( fstat(fd, &entry_stat) || (size_t)entry_stat.st_size < sizeof(tw_texcache_header_t) ) {
+        close(fd);
+        return NULL;
+    }
+    /* Private writable mapping, so surfaces may be modified copy-on-write */
+    data = mmap(NULL, entry_stat.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( data == MAP_FAILED ) {
+        return NULL;
+    }
+    header = (tw_texcache_header_t*)data;
+    if( memcmp(header->magic, TW_TEXCACHE_MAGIC, 4) ||
+        header->version != TW_TEXCACHE_VERSION ||
+        header->mtime != (Sint64)src_stat.st_mtime ||
+        header->source_size != (Sint64)src_stat.st_size ||
+        header->bpp != format->BitsPerPixel ||
+        header->rmask != format->Rmask || header->gmask != format->Gmask ||
+        header->bmask != format->Bmask || header->amask != format->Amask ||
+        header->path_length != strlen(img_file) ||
+        header->data_offset != texcache_data_offset(header->path_length) ||
+        (size_t)entry_stat.st_size < (size_t)header->data_offset + (size_t)header->pitch * header->height ||
+        memcmp((char*)data + sizeof(tw_texcache_header_t), img_file, header->path_length) ) {
+        munmap(data, entry_stat.st_size);
+        return NULL;
+    }
+    surface = SDL_CreateRGBSurfaceFrom((char*)data + header->data_offset,
+        header->width, header->height, header->bpp, header->pitch,
+        header->rmask, header->gmask, header->bmask, header->amask);
+    if( surface == NULL ) {
+        munmap(data, entry_stat.st_size);
+        return NULL;
+    }
+    if( header->amask ) {
+        SDL_SetAlpha(surface, SDL_SRCALPHA, SDL_ALPHA_OPAQUE);
+    }
+    map->data = data;
+    map->size = entry_stat.st_size;
+    return surface;
+}
+
+/*
+ * Writes the pixel data of the given surface to the cache entry for the given
+ * image file. The entry is written to a temporary file first and then renamed
+ * into place, so a partially written entry is never picked up.
+ */
+int texcache_store( const char *img_file, SDL_Surface *surface ) {
+    char entry[TW_TEXCACHE_PATH_MAX];
+    char tmp[TW_TEXCACHE_PATH_MAX + 8];
+    char padding[16];
+    struct stat src_stat;
+    tw_texcache_header_t header;
+    FILE *fp;
+    int y, status;
+    if( !initialized ) {
+        return 0;
+    }
+    if( surface->format->palette || SDL_MUSTLOCK(surface) ) {
+        return 0; /* only plain software surfaces are cached */
+    }
+    if( stat(img_file, &src_stat) || texcache_entry_path(img_file, entry, sizeof(entry)) ) {
+        push_warning("texcache_store: Failed to locate cache entry!");
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", entry);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TW_TEXCACHE_MAGIC, 4);
+    header.version = TW_TEXCACHE_VERSION;
+    header.mtime = src_stat.st_mtime;
+    header.source_size = src_stat.st_size;
+    header.width = surface->w;
+    header.height = surface->h;
+    header.pitch = surface->pitch;
+    header.bpp = surface->format->BitsPerPixel;
+    header.rmask = surface->format->Rmask;
+    header.gmask = surface->format->Gmask;
+    header.bmask = surface->format->Bmask;
+    header.amask = surface->format->Amask;
+    header.path_length = strlen(img_file);
+    header.data_offset = texcache_data_offset(header.path_length);
+    fp = fopen(tmp, "wb");
+    if( fp == NULL ) {
+        push_warning("texcache_store: Failed to open cache entry for writing!");
+        return -1;
+    }
+    memset(padding, 0, sizeof(padding));
+    status = fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(img_file, 1, header.path_length, fp) != header.path_length ||
+        fwrite(padding, 1, header.data_offset - sizeof(header) - header.path_length, fp) !=
+            header.data_offset - sizeof(header) - header.path_length;
+    for( y = 0; !status && y < surface->h; y++ ) {
+        status = fwrite((char*)surface->pixels + y * surface->pitch, 1, surface->pitch, fp) != surface->pitch;
+    }
+    if( fclose(fp) || status || rename(tmp, entry) ) {
+        unlink(tmp);
+        push_warning("texcache_store: Failed to write cache entry!");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Releases a mapping returned by texcache_load. Any surface created from the
+ * mapping must already have been freed.
+ */
+void texcache_unmap( tw_texcache_map_t *map ) {
+    if( map->data != NULL ) {
+        munmap(map->data, map->size);
+        map->data = NULL;
+        map->size = 0;
+    }
+}
+
+/*
+ * Initializes the texture cache, creating the given cache directory if it does
+ * not exist yet. Failing to do so disables the cache but is not an error.
+ */
+int texcache_init( const char *dir ) {
+    struct stat dir_stat;
+    if( initialized ) {
+        push_warning("Texture cache already initialized!");
+        return 0;
+    }
+    if( strlen(dir) >= sizeof(cache_dir) - 32 ) {
+        push_warning("Texture cache directory name too long, cache disabled!");
+        return 0;
+    }
+    if( stat(dir, &dir_stat) ) {
+        if( mkdir(dir, 0755) ) {
+            push_warning("Failed to create texture cache directory, cache disabled!");
+            return 0;
+        }
+    }
+    else if( !S_ISDIR(dir_stat.st_mode) ) {
+        push_warning("Texture cache path is not a directory, cache disabled!");
+        return 0;
+    }
+    strcpy(cache_dir, dir);
+    initialized = 1;
+    return 0;
+}
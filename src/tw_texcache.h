@@ -0,0 +1,37 @@
+/*
+ * tw_texcache.h
+ */
+
+#ifndef TWTEXCACHE
+#define TWTEXCACHE
+
+#include <stddef.h>
+#include "SDL.h"
+
+typedef struct {
+    void *data;
+    size_t size;
+} tw_texcache_map_t;
+
+/*
+ * Returns a surface wrapping the cached pixel data for the given image file, or
+ * NULL if no valid cache entry exists for the file in the given pixel format.
+ * The mapping backing the surface is stored in map and must outlive it.
+ */
+SDL_Surface * texcache_load( const char *img_file, SDL_PixelFormat *format,
+    tw_texcache_map_t *map );
+
+/*
+ * Writes the pixel data of the given surface to the cache entry for the given
+ * image file.
+ */
+int texcache_store( const char *img_file, SDL_Surface *surface );
+
+/*
+ * Releases a mapping returned by texcache_load.
+ */
+void texcache_unmap( tw_texcache_map_t *map );
+
+int texcache_init( const char *dir );
+
+#endif
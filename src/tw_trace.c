@@ -0,0 +1,355 @@
+/*
+ * tw_trace.c
+ *
+ * This file contains the source code pertaining to tracing in the ToyWrench
+ * application. When a trace file is given with "--trace <file>", the engine
+ * records the begin and end of spans of work: the phases of every frame, asset
+ * loads, the work of the background threads, and zones declared by scripts with
+ * traceBegin() and traceEnd(). With "--trace-bindings" every call into a C
+ * function bound to Lua is recorded as well, which is detailed but fills the
+ * buffers quickly. At exit the spans are written out in the Chrome trace event
+ * format, which can be loaded into chrome://tracing or Perfetto to see a
+ * timeline of all threads.
+ *
+ * Every thread records into its own buffer, claimed the first time it records
+ * a span, so recording takes no locks. A buffer is a ring of TW_TRACE_EVENTS
+ * events; once it is full the oldest events of its thread are overwritten, so a
+ * long run keeps its last stretch. Ends whose begin was overwritten are left
+ * out when the trace is written.
+ *
+ * Span names are not copied when recorded. C code passes string literals, and
+ * names coming from Lua are interned into a table that lives until exit. A
+ * span left open by a Lua error simply ends with the trace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tw_trace.h"
+#include "tw_error.h"
+
+#define TW_TRACE_THREADS 32
+#define TW_TRACE_EVENTS (1 << 20) /* must be a power of two */
+#define TW_TRACE_NAMES 1024 /* must be a power of two */
+
+typedef struct {
+    const char *name;
+    unsigned long long time_us;
+    char phase;
+} tw_trace_event_t;
+
+typedef struct {
+    const char *thread_name;
+    tw_trace_event_t *events;
+    volatile unsigned long count; /* events ever recorded */
+} tw_trace_buffer_t;
+
+static int initialized = 0;
+static int enabled = 0;
+static int bindings = 0;
+static char *trace_path = NULL;
+static struct timespec start_time;
+static tw_trace_buffer_t buffer_list[TW_TRACE_THREADS];
+static volatile unsigned int buffer_count = 0;
+static const char * volatile name_table[TW_TRACE_NAMES];
+static __thread tw_trace_buffer_t *thread_buffer = NULL;
+static __thread int thread_claimed = 0;
+
+/*
+ * Returns the microseconds since tracing started.
+ */
+static unsigned long long trace_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)(now.tv_sec - start_time.tv_sec) * 1000000 +
+        (now.tv_nsec - start_time.tv_nsec) / 1000;
+}
+
+/*
+ * Returns the buffer of the calling thread, claiming one the first time, or
+ * NULL if all buffers are taken.
+ */
+static tw_trace_buffer_t * trace_buffer() {
+    unsigned int index;
+    tw_trace_buffer_t *buffer;
+    if( !thread_claimed ) {
+        thread_claimed = 1;
+        index = __sync_fetch_and_add(&buffer_count, 1);
+        if( index >= TW_TRACE_THREADS ) {
+            return NULL;
+        }
+        buffer = &buffer_list[index];
+        buffer->events = (tw_trace_event_t*)malloc(sizeof(tw_trace_event_t) * TW_TRACE_EVENTS);
+        if( buffer->events == NULL ) {
+            push_warning("Failed to allocate trace buffer, thread not traced!");
+        }
+        __sync_synchronize(); /* buffer set up before it is written out */
+        thread_buffer = buffer;
+    }
+    return thread_buffer;
+}
+
+/*
+ * Records an event of the given phase for the calling thread.
+ */
+static void trace_event( const char *name, char phase ) {
+    tw_trace_buffer_t *buffer;
+    tw_trace_event_t *event;
+    if( name == NULL ) { /* name table full */
+        return;
+    }
+    buffer = trace_buffer();
+    if( buffer == NULL || buffer->events == NULL ) {
+        return;
+    }
+    event = &buffer->events[buffer->count & (TW_TRACE_EVENTS - 1)];
+    event->name = name;
+    event->time_us = trace_time();
+    event->phase = phase;
+    __sync_synchronize(); /* event written before it is counted */
+    buffer->count++;
+}
+
+/*
+ * Returns whether spans are being recorded.
+ */
+int trace_enabled() {
+    return enabled;
+}
+
+/*
+ * Returns whether calls into C functions bound to Lua are recorded as spans.
+ */
+int trace_bindings() {
+    return enabled && bindings;
+}
+
+/*
+ * Begins a span with the given name on the calling thread. The name must stay
+ * valid until exit.
+ */
+void trace_begin( const char *name ) {
+    if( enabled ) {
+        trace_event(name, 'B');
+    }
+}
+
+/*
+ * Ends the span with the given name on the calling thread.
+ */
+void trace_end( const char *name ) {
+    if( enabled ) {
+        trace_event(name, 'E');
+    }
+}
+
+/*
+ * Names the calling thread in the trace.
+ */
+void trace_thread( const char *name ) {
+    tw_trace_buffer_t *buffer;
+    if( enabled ) {
+        buffer = trace_buffer();
+        if( buffer != NULL ) {
+            buffer->thread_name = name;
+        }
+    }
+}
+
+/*
+ * Returns an interned copy of the given name that stays valid until exit, or
+ * NULL if the name table is full. Any thread may intern names.
+ */
+const char * trace_intern( const char *name ) {
+    unsigned int hash, i;
+    const char *p, *found;
+    char *copy;
+    hash = 2166136261u;
+    for( p = name; *p; p++ ) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    copy = NULL;
+    for( i = 0; i < TW_TRACE_NAMES; i++ ) {
+        found = name_table[(hash + i) & (TW_TRACE_NAMES - 1)];
+        if( found == NULL ) {
+            if( copy == NULL ) {
+                copy = (char*)malloc(strlen(name) + 1);
+                if( copy == NULL ) {
+                    return NULL;
+                }
+                strcpy(copy, name);
+            }
+            found = __sync_val_compare_and_swap(&name_table[(hash + i) & (TW_TRACE_NAMES - 1)],
+                NULL, copy);
+            if( found == NULL ) {
+                return copy;
+            }
+        }
+        if( !strcmp(found, name) ) { /* interned before, or by another thread just now */
+            free(copy);
+            return found;
+        }
+    }
+    free(copy);
+    return NULL;
+}
+
+/*
+ * Writes the given string to the given file as a JSON string.
+ */
+static void write_json_string( FILE *fp, const char *s ) {
+    fputc('"', fp);
+    for( ; *s; s++ ) {
+        if( *s == '"' || *s == '\\' ) {
+            fputc('\\', fp);
+            fputc(*s, fp);
+        }
+        else if( (unsigned char)*s < 0x20 ) {
+            fprintf(fp, "\\u%04x", (unsigned char)*s);
+        }
+        else {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/*
+ * Writes all recorded events out to the trace file.
+ */
+static int write_trace() {
+    FILE *fp;
+    tw_trace_buffer_t *buffer;
+    tw_trace_event_t *event;
+    unsigned int threads, i, depth;
+    unsigned long j, count, dropped;
+    int first;
+    char message[96];
+    fp = fopen(trace_path, "w");
+    if( fp == NULL ) {
+        push_error("write_trace failed: Failed to open trace file!");
+        return -1;
+    }
+    threads = buffer_count < TW_TRACE_THREADS ? buffer_count : TW_TRACE_THREADS;
+    dropped = 0;
+    first = 1;
+    fputs("{\"traceEvents\":[\n", fp);
+    for( i = 0; i < threads; i++ ) {
+        buffer = &buffer_list[i];
+        count = buffer->count;
+        __sync_synchronize(); /* events counted before they are read */
+        if( buffer->thread_name != NULL ) {
+            fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                first ? "" : ",\n", i + 1);
+            write_json_string(fp, buffer->thread_name);
+            fputs("}}", fp);
+            first = 0;
+        }
+        j = 0;
+        if( count > TW_TRACE_EVENTS ) { /* oldest events overwritten */
+            j = count - TW_TRACE_EVENTS;
+            dropped += j;
+        }
+        for( depth = 0; j < count; j++ ) {
+            event = &buffer->events[j & (TW_TRACE_EVENTS - 1)];
+            if( event->phase == 'E' ) {
+                if( depth == 0 ) { /* begin was overwritten */
+                    continue;
+                }
+                depth--;
+            }
+            else {
+                depth++;
+            }
+            fprintf(fp, "%s{\"name\":", first ? "" : ",\n");
+            write_json_string(fp, event->name);
+            fprintf(fp, ",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%u}",
+                event->phase, event->time_us, i + 1);
+            first = 0;
+        }
+    }
+    fputs("\n]}\n", fp);
+    if( dropped ) {
+        sprintf(message, "Trace buffers full, %lu oldest events overwritten!", dropped);
+        push_warning(message);
+    }
+    return fclose(fp) ? -1 : 0;
+}
+
+/*
+ * Lua hook to begin a span with the given name.
+ */
+int lua_traceBegin( lua_State *L ) {
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while calling traceBegin: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    if( enabled && lua_isstring(L, 1) ) {
+        trace_begin(trace_intern(lua_tostring(L, 1)));
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Lua hook to end the span with the given name.
+ */
+int lua_traceEnd( lua_State *L ) {
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while calling traceEnd: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    if( enabled && lua_isstring(L, 1) ) {
+        trace_end(trace_intern(lua_tostring(L, 1)));
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    return 0;
+}
+
+/*
+ * Initializes tracing, recording spans to write to the given file at exit. No
+ * spans are recorded if the file is NULL. Calls into C functions bound to Lua
+ * are only recorded if the given flag is set. Called before any other
+ * subsystem, so that all of their threads and bindings are traced.
+ */
+int trace_init( const char *file, int record_bindings ) {
+    if( initialized ) {
+        push_warning("Tracing already initialized!");
+        return 0;
+    }
+    initialized = 1;
+    if( file == NULL ) {
+        return 0;
+    }
+    trace_path = (char*)malloc(strlen(file) + 1);
+    if( trace_path == NULL ) {
+        push_error("trace_init failed: Out of memory!");
+        return -1;
+    }
+    strcpy(trace_path, file);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    enabled = 1;
+    bindings = record_bindings;
+    trace_thread("main");
+    return 0;
+}
+
+/*
+ * Stops recording spans and writes them out.
+ */
+void trace_shutdown() {
+    if( !enabled ) {
+        return;
+    }
+    enabled = 0;
+    if( write_trace() ) {
+        push_error("Failed to write trace file!");
+    }
+    free(trace_path);
+    trace_path = NULL;
+}
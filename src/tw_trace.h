@@ -0,0 +1,58 @@
+/*
+ * tw_trace.h
+ */
+
+#ifndef TWTRACE
+#define TWTRACE
+
+#include <lua.h>
+
+/*
+ * Returns whether spans are being recorded.
+ */
+int trace_enabled();
+
+/*
+ * Returns whether calls into C functions bound to Lua are recorded as spans.
+ */
+int trace_bindings();
+
+/*
+ * Begins a span with the given name on the calling thread. The name must stay
+ * valid until exit.
+ */
+void trace_begin( const char *name );
+
+/*
+ * Ends the span with the given name on the calling thread.
+ */
+void trace_end( const char *name );
+
+/*
+ * Names the calling thread in the trace.
+ */
+void trace_thread( const char *name );
+
+/*
+ * Returns an interned copy of the given name that stays valid until exit, or
+ * NULL if the name table is full.
+ */
+const char * trace_intern( const char *name );
+
+int lua_traceBegin( lua_State *L );
+
+int lua_traceEnd( lua_State *L );
+
+/*
+ * Initializes tracing, recording spans to write to the given file at exit. No
+ * spans are recorded if the file is NULL. Calls into C functions bound to Lua
+ * are only recorded if the given flag is set.
+ */
+int trace_init( const char *file, int record_bindings );
+
+/*
+ * Stops recording spans and writes them out.
+ */
+void trace_shutdown();
+
+#endif
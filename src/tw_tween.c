@@ -0,0 +1,535 @@
+/*
+ * tw_tween.c
+ *
+ * This file contains the source code pertaining to tweening in the ToyWrench
+ * application. A tween moves one number from a start to an end value over a
+ * number of seconds along an easing curve, which covers most motion in menus
+ * and effects without scripts updating values by hand every frame:
+ *
+ *   tween(target, key, from, to, seconds, [easing], [callback])
+ *
+ * The target is either an entity id, whose "x", "y", "vx", "vy" or
+ * "animationSpeed" is set, or a table or userdata such as GLOBALS, whose field
+ * key is set. A from value of nil starts
+ * at the current value. Easings are named "linear" (the default), "quadIn",
+ * "quadOut", "quadInOut", "cubicIn", "cubicOut", "cubicInOut", "sineIn",
+ * "sineOut", "sineInOut", "backIn", "backOut", "elasticOut" and "bounceOut".
+ * tween() returns the id of the tween, which stopTween() takes to stop it where
+ * it is. A new tween of a value that is already being tweened replaces the old
+ * one.
+ *
+ * The tweens of a Lua state are kept in one packed array in its tweener and
+ * advanced by tween_step() once per frame, after the entity systems ran and
+ * before tw_main. A value is only written when it changed, through the usual
+ * table access so that tables like GLOBALS see the update. When a tween reaches
+ * its end value, its callback is called with its id. Tweens of destroyed
+ * entities are dropped silently.
+ *
+ * Writing a field may run a metamethod that starts or stops tweens. While the
+ * tweens are being stepped, stopped tweens are only marked as removed and the
+ * array is compacted afterwards, and tweens started meanwhile are first
+ * advanced in the next frame.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "tw_tween.h"
+#include "tw_alloc.h"
+#include "tw_entity.h"
+#include "tw_error.h"
+#include "tw_lua.h"
+
+#define TW_TWEENER "tw_tweener"
+#define TW_MAX_FRAME_TIME 0.25f
+#define TW_PI 3.14159265f
+
+enum {
+    TW_EASE_LINEAR,
+    TW_EASE_QUAD_IN,
+    TW_EASE_QUAD_OUT,
+    TW_EASE_QUAD_IN_OUT,
+    TW_EASE_CUBIC_IN,
+    TW_EASE_CUBIC_OUT,
+    TW_EASE_CUBIC_IN_OUT,
+    TW_EASE_SINE_IN,
+    TW_EASE_SINE_OUT,
+    TW_EASE_SINE_IN_OUT,
+    TW_EASE_BACK_IN,
+    TW_EASE_BACK_OUT,
+    TW_EASE_ELASTIC_OUT,
+    TW_EASE_BOUNCE_OUT,
+    TW_EASE_COUNT
+};
+
+typedef struct {
+    unsigned int id;
+    lua_Number entity; /* target entity, if table is LUA_NOREF */
+    int field; /* of the entity */
+    int table; /* references in the Lua registry */
+    const void *table_pointer; /* to tell targets apart without the registry */
+    int key;
+    int callback;
+    float from;
+    float to;
+    float time;
+    float duration;
+    float last; /* value last written */
+    int written;
+    int easing;
+    int removed; /* while stepping */
+} tw_tween_t;
+
+/*
+ * The tweens of one Lua state.
+ */
+typedef struct {
+    tw_tween_t *tween_list;
+    unsigned int tween_list_size;
+    unsigned int tween_list_capacity;
+    unsigned int next_id;
+    unsigned int last_ticks;
+    int stepped;
+    int stepping;
+    int write_ref; /* function setting a field, called protected */
+} tw_tweener_t;
+
+static int initialized = 0;
+
+static const char *easing_names[TW_EASE_COUNT] = {
+    "linear", "quadIn", "quadOut", "quadInOut", "cubicIn", "cubicOut", "cubicInOut",
+    "sineIn", "sineOut", "sineInOut", "backIn", "backOut", "elasticOut", "bounceOut"
+};
+
+static const char *field_names[] = { "x", "y", "vx", "vy", "animationSpeed", NULL };
+
+/*
+ * Returns the tweener of the given Lua state.
+ */
+static tw_tweener_t * get_tweener( lua_State *L ) {
+    return (tw_tweener_t*)lua_context(L, TW_TWEENER);
+}
+
+/*
+ * Frees the tweens of a tweener when its Lua state is closed.
+ */
+static void release_tweener( void *context ) {
+    free(((tw_tweener_t*)context)->tween_list);
+}
+
+/*
+ * Returns the given easing curve at the given point between 0 and 1.
+ */
+static float ease( int easing, float t ) {
+    float u;
+    switch( easing ) {
+        case TW_EASE_QUAD_IN:
+            return t * t;
+        case TW_EASE_QUAD_OUT:
+            return t * (2 - t);
+        case TW_EASE_QUAD_IN_OUT:
+            return t < 0.5f ? 2 * t * t : -1 + (4 - 2 * t) * t;
+        case TW_EASE_CUBIC_IN:
+            return t * t * t;
+        case TW_EASE_CUBIC_OUT:
+            u = t - 1;
+            return u * u * u + 1;
+        case TW_EASE_CUBIC_IN_OUT:
+            u = 2 * t - 2;
+            return t < 0.5f ? 4 * t * t * t : 0.5f * u * u * u + 1;
+        case TW_EASE_SINE_IN:
+            return 1 - cosf(t * TW_PI / 2);
+        case TW_EASE_SINE_OUT:
+            return sinf(t * TW_PI / 2);
+        case TW_EASE_SINE_IN_OUT:
+            return 0.5f - 0.5f * cosf(t * TW_PI);
+        case TW_EASE_BACK_IN:
+            return t * t * (2.70158f * t - 1.70158f);
+        case TW_EASE_BACK_OUT:
+            u = t - 1;
+            return u * u * (2.70158f * u + 1.70158f) + 1;
+        case TW_EASE_ELASTIC_OUT:
+            if( t <= 0 || t >= 1 ) {
+                return t;
+            }
+            return powf(2, -10 * t) * sinf((t * 10 - 0.75f) * 2 * TW_PI / 3) + 1;
+        case TW_EASE_BOUNCE_OUT:
+            if( t < 1 / 2.75f ) {
+                return 7.5625f * t * t;
+            }
+            else if( t < 2 / 2.75f ) {
+                t -= 1.5f / 2.75f;
+                return 7.5625f * t * t + 0.75f;
+            }
+            else if( t < 2.5f / 2.75f ) {
+                t -= 2.25f / 2.75f;
+                return 7.5625f * t * t + 0.9375f;
+            }
+            t -= 2.625f / 2.75f;
+            return 7.5625f * t * t + 0.984375f;
+        default:
+            return t;
+    }
+}
+
+/*
+ * Lua function setting the field of the table at index 1 with the key at index
+ * 2 to the value at index 3. Called protected by tween_step.
+ */
+static int lua_writeField( lua_State *L ) {
+    lua_settable(L, 1);
+    return 0;
+}
+
+/*
+ * Releases the references of the tween in the given slot and moves the last
+ * tween into it, or only marks it as removed while stepping.
+ */
+static void remove_tween( lua_State *L, tw_tweener_t *tweener, unsigned int slot, int keep_callback ) {
+    luaL_unref(L, LUA_REGISTRYINDEX, tweener->tween_list[slot].table);
+    luaL_unref(L, LUA_REGISTRYINDEX, tweener->tween_list[slot].key);
+    if( !keep_callback ) {
+        luaL_unref(L, LUA_REGISTRYINDEX, tweener->tween_list[slot].callback);
+    }
+    if( tweener->stepping ) { /* tween_step still walks the array */
+        tweener->tween_list[slot].removed = 1;
+    }
+    else {
+        tweener->tween_list[slot] = tweener->tween_list[--tweener->tween_list_size];
+    }
+}
+
+/*
+ * Drops the tweens marked as removed, keeping the order of the others.
+ */
+static void compact_tweens( tw_tweener_t *tweener ) {
+    unsigned int i, j;
+    j = 0;
+    for( i = 0; i < tweener->tween_list_size; i++ ) {
+        if( !tweener->tween_list[i].removed ) {
+            tweener->tween_list[j++] = tweener->tween_list[i];
+        }
+    }
+    tweener->tween_list_size = j;
+}
+
+/*
+ * Writes the given value to the target of the given tween. Returns 1 if the
+ * target is gone, or -1 on errors.
+ */
+static int write_tween( lua_State *L, tw_tweener_t *tweener, tw_tween_t *tween, float value ) {
+    float *field;
+    if( tween->written && tween->last == value ) {
+        return 0;
+    }
+    tween->last = value;
+    tween->written = 1;
+    if( tween->table == LUA_NOREF ) {
+        field = entity_field(L, tween->entity, tween->field);
+        if( field == NULL ) {
+            return 1;
+        }
+        *field = value;
+        return 0;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, tweener->write_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, tween->table);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, tween->key);
+    lua_pushnumber(L, value);
+    if( lua_pcall(L, 3, 0, 0) ) {
+        push_error(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Advances all tweens of the given Lua state to the frame starting at the given
+ * tick count, writes their values and calls the callbacks of those that
+ * finished.
+ */
+int tween_step( lua_State *L, unsigned int ticks ) {
+    tw_tweener_t *tweener;
+    tw_tween_t *tween;
+    unsigned int i, count, done_count, *done_ids;
+    int *done_callbacks, status, gone;
+    float dt, t;
+    tweener = get_tweener(L);
+    dt = tweener->stepped ? (ticks - tweener->last_ticks) / 1000.0f : 0;
+    if( dt > TW_MAX_FRAME_TIME ) {
+        dt = TW_MAX_FRAME_TIME;
+    }
+    tweener->last_ticks = ticks;
+    tweener->stepped = 1;
+    if( tweener->tween_list_size == 0 ) {
+        return 0;
+    }
+    count = tweener->tween_list_size; /* tweens started by writes wait for the next frame */
+    done_ids = (unsigned int*)frame_alloc(sizeof(unsigned int) * count);
+    done_callbacks = (int*)frame_alloc(sizeof(int) * count);
+    if( done_ids == NULL || done_callbacks == NULL ) {
+        push_error("tween_step failed: Out of memory!");
+        return -1;
+    }
+    done_count = 0;
+    status = 0;
+    tweener->stepping = 1;
+    for( i = 0; i < count; i++ ) {
+        tween = &tweener->tween_list[i];
+        if( tween->removed ) {
+            continue;
+        }
+        tween->time += dt;
+        t = tween->time < tween->duration ? tween->time / tween->duration : 1;
+        gone = write_tween(L, tweener, tween, t >= 1 ? tween->to :
+            tween->from + (tween->to - tween->from) * ease(tween->easing, t));
+        tween = &tweener->tween_list[i]; /* the write may have moved the array */
+        if( gone < 0 ) {
+            push_error("tween_step failed: Error while writing tween!");
+            status = -1;
+        }
+        if( tween->removed ) { /* stopped or replaced by the write */
+            continue;
+        }
+        if( gone ) {
+            remove_tween(L, tweener, i, 0);
+        }
+        else if( t >= 1 ) {
+            done_ids[done_count] = tween->id;
+            done_callbacks[done_count++] = tween->callback;
+            remove_tween(L, tweener, i, 1);
+        }
+    }
+    tweener->stepping = 0;
+    compact_tweens(tweener);
+    /* only call back once all tweens are consistent again */
+    for( i = 0; i < done_count; i++ ) {
+        if( done_callbacks[i] == LUA_NOREF ) {
+            continue;
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, done_callbacks[i]);
+        luaL_unref(L, LUA_REGISTRYINDEX, done_callbacks[i]);
+        if( status ) {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_pushnumber(L, done_ids[i]);
+        if( lua_pcall(L, 1, 0, 0) ) {
+            push_error(lua_tostring(L, -1));
+            lua_pop(L, 1);
+            push_error("tween_step failed: Error in tween callback!");
+            status = -1;
+        }
+    }
+    return status;
+}
+
+/*
+ * Lua hook starting a tween of the given target field from the given to the
+ * given value over the given number of seconds, returning its id.
+ */
+int lua_tween( lua_State *L ) {
+    tw_tweener_t *tweener;
+    tw_tween_t *new_list, *tween;
+    const char *easing;
+    float *field;
+    unsigned int i;
+    int entity_field_index, easing_index, same;
+    tweener = get_tweener(L);
+    if( lua_gettop(L) < 5 ) {
+        push_error("Lua: Error while calling tween: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    lua_settop(L, 7);
+    entity_field_index = -1;
+    field = NULL;
+    if( lua_type(L, 1) == LUA_TNUMBER ) {
+        for( i = 0; field_names[i] != NULL; i++ ) {
+            if( lua_isstring(L, 2) && !strcmp(lua_tostring(L, 2), field_names[i]) ) {
+                entity_field_index = i;
+            }
+        }
+        if( entity_field_index < 0 ) {
+            push_error("Lua: Error while calling tween: Invalid entity field!");
+            lua_pushstring(L, "Invalid entity field.");
+            lua_error(L);
+            return -1;
+        }
+        field = entity_field(L, lua_tonumber(L, 1), entity_field_index);
+        if( field == NULL ) {
+            push_error("Lua: Error while calling tween: Invalid entity!");
+            lua_pushstring(L, "Invalid entity.");
+            lua_error(L);
+            return -1;
+        }
+    }
+    else if( !lua_istable(L, 1) && !lua_isuserdata(L, 1) ) {
+        push_error("Lua: Error while calling tween: Invalid target!");
+        lua_pushstring(L, "Invalid target.");
+        lua_error(L);
+        return -1;
+    }
+    else if( lua_isnil(L, 2) ) {
+        push_error("Lua: Error while calling tween: Key is nil!");
+        lua_pushstring(L, "Key is nil.");
+        lua_error(L);
+        return -1;
+    }
+    easing_index = TW_EASE_LINEAR;
+    if( !lua_isnil(L, 6) ) {
+        easing = lua_tostring(L, 6);
+        for( easing_index = 0; easing_index < TW_EASE_COUNT; easing_index++ ) {
+            if( easing != NULL && !strcmp(easing, easing_names[easing_index]) ) {
+                break;
+            }
+        }
+        if( easing_index == TW_EASE_COUNT ) {
+            push_error("Lua: Error while calling tween: Unknown easing!");
+            lua_pushstring(L, "Unknown easing.");
+            lua_error(L);
+            return -1;
+        }
+    }
+    if( lua_isnil(L, 3) ) { /* start at the current value */
+        if( field != NULL ) {
+            lua_pushnumber(L, *field);
+        }
+        else {
+            lua_pushvalue(L, 2);
+            lua_gettable(L, 1);
+        }
+        lua_replace(L, 3);
+    }
+    /* replace any tween of the same target */
+    for( i = 0; i < tweener->tween_list_size; i++ ) {
+        tween = &tweener->tween_list[i];
+        same = 0;
+        if( tween->removed ) {
+            continue;
+        }
+        if( field != NULL ) {
+            same = tween->table == LUA_NOREF && tween->entity == lua_tonumber(L, 1) &&
+                tween->field == entity_field_index;
+        }
+        else if( tween->table_pointer == lua_topointer(L, 1) ) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, tween->key);
+            same = lua_rawequal(L, -1, 2);
+            lua_pop(L, 1);
+        }
+        if( same ) {
+            remove_tween(L, tweener, i, 0);
+            break;
+        }
+    }
+    if( tweener->tween_list_size == tweener->tween_list_capacity ) {
+        new_list = (tw_tween_t*)realloc(tweener->tween_list,
+            sizeof(tw_tween_t) * (tweener->tween_list_capacity ? tweener->tween_list_capacity * 2 : 64));
+        if( new_list == NULL ) {
+            push_error("Lua: Error while calling tween: Out of memory!");
+            lua_pushstring(L, "Out of memory.");
+            lua_error(L);
+            return -1;
+        }
+        tweener->tween_list = new_list;
+        tweener->tween_list_capacity = tweener->tween_list_capacity ?
+            tweener->tween_list_capacity * 2 : 64;
+    }
+    tween = &tweener->tween_list[tweener->tween_list_size++];
+    tween->id = tweener->next_id++;
+    tween->from = lua_tonumber(L, 3);
+    tween->to = lua_tonumber(L, 4);
+    tween->time = 0;
+    tween->duration = lua_tonumber(L, 5);
+    tween->written = 0;
+    tween->easing = easing_index;
+    tween->removed = 0;
+    tween->entity = 0;
+    tween->field = entity_field_index;
+    tween->table = LUA_NOREF;
+    tween->table_pointer = NULL;
+    tween->key = LUA_NOREF;
+    tween->callback = LUA_NOREF;
+    if( field != NULL ) {
+        tween->entity = lua_tonumber(L, 1);
+    }
+    else {
+        tween->table_pointer = lua_topointer(L, 1);
+        lua_pushvalue(L, 1);
+        tween->table = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_pushvalue(L, 2);
+        tween->key = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    if( lua_isfunction(L, 7) ) {
+        lua_pushvalue(L, 7);
+        tween->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    lua_pushnumber(L, tween->id);
+    return 1;
+}
+
+/*
+ * Lua hook stopping the tween with the given id where it is, without calling
+ * its callback. Returns whether the tween was still running.
+ */
+int lua_stopTween( lua_State *L ) {
+    tw_tweener_t *tweener;
+    unsigned int i, id;
+    int found;
+    tweener = get_tweener(L);
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while calling stopTween: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    id = (unsigned int)lua_tonumber(L, 1);
+    lua_pop(L, lua_gettop(L)); /* clear stack */
+    found = 0;
+    for( i = 0; i < tweener->tween_list_size; i++ ) {
+        if( tweener->tween_list[i].id == id && !tweener->tween_list[i].removed ) {
+            remove_tween(L, tweener, i, 0);
+            found = 1;
+            break;
+        }
+    }
+    lua_pushboolean(L, found);
+    return 1;
+}
+
+/*
+ * Sets up a tweener in the given Lua state and registers the tween functions
+ * in it.
+ */
+int tween_open( lua_State *L ) {
+    tw_tweener_t *tweener;
+    tweener = (tw_tweener_t*)new_lua_context(L, TW_TWEENER, sizeof(tw_tweener_t),
+        release_tweener);
+    tweener->next_id = 1;
+    if( add_lua_function_in(L, "tween", lua_tween) ||
+        add_lua_function_in(L, "stopTween", lua_stopTween) ) {
+        push_error("Failed to add tween functions!");
+        return -1;
+    }
+    lua_pushcfunction(L, lua_writeField);
+    tweener->write_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 0;
+}
+
+/*
+ * Initializes tweening in the main Lua state.
+ */
+int tween_init() {
+    if( initialized ) {
+        push_warning("Tweening already initialized!");
+        return 0;
+    }
+    if( tween_open(lua_main_state()) ) {
+        return -1;
+    }
+    initialized = 1;
+    return 0;
+}
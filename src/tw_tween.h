@@ -0,0 +1,25 @@
+/*
+ * tw_tween.h
+ */
+
+#ifndef TWTWEEN
+#define TWTWEEN
+
+#include "tw_lua.h"
+
+/*
+ * Advances all tweens of the given Lua state to the frame starting at the given
+ * tick count, writes their values and calls the callbacks of those that
+ * finished.
+ */
+int tween_step( lua_State *L, unsigned int ticks );
+
+/*
+ * Sets up a tweener in the given Lua state and registers the tween functions
+ * in it.
+ */
+int tween_open( lua_State *L );
+
+int tween_init();
+
+#endif
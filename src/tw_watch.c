@@ -0,0 +1,218 @@
+/*
+ * tw_watch.c
+ *
+ * This file contains the source code pertaining to the file watching functions
+ * used in the ToyWrench application. Subsystems that load files from disk
+ * register them here together with a callback, and while hot reloading is
+ * enabled (by setting GLOBALS.hotReload) the callback is invoked once per frame
+ * for every file that was modified, so that only the changed assets have to be
+ * reloaded.
+ *
+ * The directories containing watched files are watched rather than the files
+ * themselves, since most editors save by writing a new file and renaming it
+ * over the old one, which would silently end a watch on the file.
+ *
+ * NOTE: File watching is currently only implemented on Linux using inotify. On
+ * other platforms enabling hot reloading only produces a warning.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "tw_watch.h"
+#include "tw_error.h"
+#include "tw_lua.h"
+
+typedef struct {
+    char *dir;
+    char *name;
+    int wd;
+    int dirty;
+    tw_watch_fn fn;
+    int id;
+} tw_watch_t;
+
+static tw_watch_t *watch_list = NULL;
+static unsigned int watch_list_size = 0;
+static unsigned int watch_list_capacity = 0;
+static int watch_fd = -1;
+static int enabled = 0;
+static int initialized = 0;
+
+/*
+ * Starts watching the directory of the given entry, reusing the watch of an
+ * earlier entry in the same directory if there is one.
+ */
+static int watch_entry( tw_watch_t *entry ) {
+#ifdef __linux__
+    entry->wd = inotify_add_watch(watch_fd, entry->dir,
+        IN_CLOSE_WRITE|IN_MOVED_TO); /* files written in place or renamed over */
+    if( entry->wd < 0 ) {
+        push_warning("Failed to watch directory for changes!");
+        return -1;
+    }
+    return 0;
+#else
+    (void)entry;
+    return -1;
+#endif
+}
+
+/*
+ * Registers the given file to be watched for changes while hot reloading is
+ * enabled. When the file changes, the given callback is invoked with the given
+ * id.
+ */
+int watch_file( const char *path, tw_watch_fn fn, int id ) {
+    tw_watch_t *entry;
+    const char *slash;
+    size_t dir_len;
+    if( !initialized ) {
+        push_error("watch_file failed: Watch interface not initialized!");
+        return -1;
+    }
+    if( watch_list_size == watch_list_capacity ) {
+        watch_list_capacity = watch_list_capacity ? watch_list_capacity * 2 : 16;
+        entry = (tw_watch_t*)realloc(watch_list, sizeof(tw_watch_t) * watch_list_capacity);
+        if( entry == NULL ) {
+            push_error("watch_file failed: Out of memory!");
+            return -1;
+        }
+        watch_list = entry;
+    }
+    entry = &watch_list[watch_list_size];
+    slash = strrchr(path, '/');
+    dir_len = slash == NULL ? 1 : (size_t)(slash - path);
+    entry->dir = (char*)malloc(dir_len + 1);
+    entry->name = (char*)malloc(strlen(slash == NULL ? path : slash + 1) + 1);
+    if( entry->dir == NULL || entry->name == NULL ) {
+        free(entry->dir);
+        free(entry->name);
+        push_error("watch_file failed: Out of memory!");
+        return -1;
+    }
+    if( slash == NULL ) {
+        strcpy(entry->dir, ".");
+        strcpy(entry->name, path);
+    }
+    else {
+        memcpy(entry->dir, path, dir_len);
+        entry->dir[dir_len] = '\0';
+        strcpy(entry->name, slash + 1);
+    }
+    entry->wd = -1;
+    entry->dirty = 0;
+    entry->fn = fn;
+    entry->id = id;
+    watch_list_size++;
+    if( enabled ) {
+        watch_entry(entry);
+    }
+    return 0;
+}
+
+/*
+ * Marks all watched files matching the given directory watch and file name as
+ * changed.
+ */
+static void mark_dirty( int wd, const char *name ) {
+    unsigned int i;
+    for( i = 0; i < watch_list_size; i++ ) {
+        if( watch_list[i].wd == wd && !strcmp(watch_list[i].name, name) ) {
+            watch_list[i].dirty = 1;
+        }
+    }
+}
+
+/*
+ * Dispatches callbacks for all watched files that changed since the last call.
+ * Several writes to the same file within a frame result in a single callback.
+ * Failed reloads are reported as warnings, keeping the previously loaded
+ * version of the asset.
+ */
+int watch_poll() {
+#ifdef __linux__
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    ssize_t len;
+    char *p;
+    unsigned int i;
+    if( !enabled ) {
+        return 0;
+    }
+    while( (len = read(watch_fd, buf, sizeof(buf))) > 0 ) {
+        for( p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len ) {
+            event = (struct inotify_event*)p;
+            if( event->len ) {
+                mark_dirty(event->wd, event->name);
+            }
+        }
+    }
+    for( i = 0; i < watch_list_size; i++ ) {
+        if( watch_list[i].dirty ) {
+            watch_list[i].dirty = 0;
+            if( watch_list[i].fn(watch_list[i].id) ) {
+                push_warning("Hot reload failed, keeping previous version!");
+                dump_stack_trace();
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Lua callback to enable or disable hot reloading whenever GLOBALS.hotReload
+ * is changed.
+ */
+int lua_setHotReload( lua_State *L ) {
+    unsigned int i;
+    if( lua_gettop(L) < 1 ) {
+        push_error("Lua: Error while setting hotReload: Not enough arguments!");
+        lua_pushstring(L, "Too few arguments.");
+        lua_error(L);
+        return -1;
+    }
+    if( lua_toboolean(L, -1) && !enabled ) {
+#ifdef __linux__
+        watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+        if( watch_fd < 0 ) {
+            push_warning("Failed to initialize inotify, hot reloading disabled!");
+        }
+        else {
+            enabled = 1;
+            for( i = 0; i < watch_list_size; i++ ) {
+                watch_entry(&watch_list[i]);
+            }
+        }
+#else
+        push_warning("Hot reloading is not supported on this platform!");
+#endif
+    }
+    else if( !lua_toboolean(L, -1) && enabled ) {
+        close(watch_fd); /* also removes all watches */
+        watch_fd = -1;
+        enabled = 0;
+        for( i = 0; i < watch_list_size; i++ ) {
+            watch_list[i].wd = -1;
+            watch_list[i].dirty = 0;
+        }
+    }
+    lua_pop(L, 1);
+    return 0;
+}
+
+/*
+ * Initializes the watch interface. Hot reloading starts out disabled.
+ */
+int watch_init() {
+    if( initialized ) {
+        push_warning("Watch interface already initialized!");
+        return 0;
+    }
+    initialized = 1;
+    return add_lua_global_n("hotReload", 0, lua_setHotReload);
+}
@@ -0,0 +1,27 @@
+/*
+ * tw_watch.h
+ */
+
+#ifndef TWWATCH
+#define TWWATCH
+
+/*
+ * Callback invoked with the id given to watch_file when the watched file
+ * changes.
+ */
+typedef int (*tw_watch_fn)( int id );
+
+/*
+ * Registers the given file to be watched for changes while hot reloading is
+ * enabled.
+ */
+int watch_file( const char *path, tw_watch_fn fn, int id );
+
+/*
+ * Dispatches callbacks for all watched files that changed since the last call.
+ */
+int watch_poll();
+
+int watch_init();
+
+#endif